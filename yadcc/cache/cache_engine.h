@@ -44,7 +44,7 @@ class CacheEngine {
                    const flare::NoncontiguousBuffer& bytes) = 0;
 
   // Purge function. Return the keys purged.
-  virtual void Purge() = 0;
+  virtual std::vector<std::string> Purge() = 0;
 
   // Dumps internal about this cache engine.
   virtual Json::Value DumpInternals() const = 0;
@@ -30,6 +30,7 @@
 
 #include "yadcc/common/parse_size.h"
 #include "yadcc/common/token_verifier.h"
+#include "yadcc/common/xxhash.h"
 
 using namespace std::literals;
 
@@ -41,6 +42,15 @@ DEFINE_string(max_in_memory_cache_size, "4G",
               "This option control the max in-memory size we can use. `4G` is "
               "the default value.");
 
+DEFINE_int32(max_keys_per_batch_read, 32,
+             "Maximum number of keys a single `TryGetEntries` call may "
+             "carry.");
+
+DEFINE_int32(in_memory_cache_shards, 32,
+             "Number of shards the in-memory cache is split into. Each shard "
+             "has its own lock, and a proportional part of "
+             "`max_in_memory_cache_size`.");
+
 namespace yadcc::cache {
 
 namespace {
@@ -75,7 +85,10 @@ CacheServiceImpl::CacheServiceImpl()
   is_servant_verifier_ =
       MakeTokenVerifierFromFlag(FLAGS_acceptable_servant_tokens);
   cache_ = cache_engine_registry.New(FLAGS_cache_engine);
-  in_memory_cache_ = std::make_unique<InMemoryCache>(*max_size);
+  FLARE_CHECK_GT(FLAGS_in_memory_cache_shards, 0,
+                 "Flag in_memory_cache_shards is invalid.");
+  in_memory_cache_ = std::make_unique<InMemoryCache>(
+      *max_size, FLAGS_in_memory_cache_shards);
 }
 
 void CacheServiceImpl::FetchBloomFilter(
@@ -95,28 +108,45 @@ void CacheServiceImpl::FetchBloomFilter(
   }
 
   // We need to keep frequency of full update low, it's bandwidth-consuming.
-  //
-  // FIXME: If there are way too many newly populated keys during last 10
-  // minutes, returning a full bloom filter may be more bandwidth efficient. We
-  // might want to set a threshold and return the full Bloom Filter if there are
-  // too many new keys.
   response->set_incremental(
       request.seconds_since_last_full_fetch() <
       GetBloomFilterFullFetchIntervalFor(controller->GetRemotePeer()) / 1s);
   if (response->incremental()) {
     constexpr auto kNetworkDelayCompensation = 5s;
     // It's fresh enough, let it update its Bloom Filter incrementally.
-    for (auto&& e :
-         bf_gen_.GetNewlyPopulatedKeys(request.seconds_since_last_fetch() * 1s +
-                                       kNetworkDelayCompensation)) {
-      response->add_newly_populated_keys(e);
+    auto keys = bf_gen_.GetNewlyPopulatedKeys(
+        request.seconds_since_last_fetch() * 1s + kNetworkDelayCompensation);
+    std::size_t delta_size = 0;
+    if (request.accept_key_fingerprints()) {
+      delta_size = keys.size() * sizeof(std::uint64_t);
+    } else {
+      for (auto&& e : keys) {
+        delta_size += e.size();
+      }
+    }
+
+    // If there are way too many newly populated keys, returning the full bloom
+    // filter is more bandwidth efficient.
+    if (delta_size > full_bf_size_.load(std::memory_order_relaxed)) {
+      response->set_incremental(false);
+    } else if (request.accept_key_fingerprints()) {
+      for (auto&& e : keys) {
+        response->add_newly_populated_key_fingerprints(XxHash()(e));
+      }
+    } else {
+      for (auto&& e : keys) {
+        response->add_newly_populated_keys(e);
+      }
     }
-  } else {
+  }
+  if (!response->incremental()) {
     // Return the full Bloom Filter then.
     auto filter = bf_gen_.GetBloomFilter();
     auto compressed_bytes =
         flare::Compress(flare::MakeCompressor("zstd").get(), filter.GetBytes());
     FLARE_CHECK(compressed_bytes);  // How can compression fail?
+    full_bf_size_.store(compressed_bytes->ByteSize(),
+                        std::memory_order_relaxed);
     response->set_num_hashes(filter.GetIterationCount());
     controller->SetResponseAttachment(*compressed_bytes);
   }
@@ -132,19 +162,12 @@ void CacheServiceImpl::TryGetEntry(const TryGetEntryRequest& request,
     return;
   }
 
-  auto bytes = in_memory_cache_->TryGet(request.key());
-  if (!bytes) {
-    bytes = cache_->TryGet(request.key());  // Try L2 then.
-  }
+  auto bytes = TryGet(request.key());
   if (!bytes) {
-    cache_miss_.fetch_add(1, std::memory_order_relaxed);
     controller->SetFailed(STATUS_NOT_FOUND, "Cache miss.");
     return;
   }
-
-  cache_hits_.fetch_add(1, std::memory_order_relaxed);
-  in_memory_cache_->Put(request.key(), *bytes);
-  controller->SetResponseAttachment(*bytes);
+  controller->SetResponseAttachment(*std::move(bytes));
 }
 
 void CacheServiceImpl::PutEntry(const PutEntryRequest& request,
@@ -157,22 +180,74 @@ void CacheServiceImpl::PutEntry(const PutEntryRequest& request,
     return;
   }
 
-  auto&& key = request.key();
-  auto&& body = controller->GetRequestAttachment();
+  Put(request.key(), controller->GetRequestAttachment());
+}
 
-  // For better auditability.
-  FLARE_LOG_INFO("Filled cache entry [{}] with {} bytes.", key,
-                 body.ByteSize());
+void CacheServiceImpl::TryGetEntries(const TryGetEntriesRequest& request,
+                                     TryGetEntriesResponse* response,
+                                     flare::RpcServerController* controller) {
+  flare::AddLoggingItemToRpc(controller->GetRemotePeer().ToString());
 
-  cache_->Put(key, body);
-  in_memory_cache_->Put(key, body);
-  bf_gen_.Add(key);
+  if (!is_user_verifier_->Verify(request.token())) {
+    controller->SetFailed(STATUS_ACCESS_DENIED);
+    return;
+  }
+
+  if (request.keys().size() > FLAGS_max_keys_per_batch_read) {
+    controller->SetFailed(STATUS_INVALID_ARGUMENT);
+    return;
+  }
+
+  flare::NoncontiguousBuffer values;
+  for (auto&& e : request.keys()) {
+    auto location = response->add_values();
+    if (auto bytes = TryGet(e)) {
+      location->set_found(true);
+      location->set_offset(values.ByteSize());
+      location->set_size(bytes->ByteSize());
+      values.Append(*std::move(bytes));
+    }
+  }
+  controller->SetResponseAttachment(std::move(values));
+}
+
+void CacheServiceImpl::PutEntries(const PutEntriesRequest& request,
+                                  PutEntriesResponse* response,
+                                  flare::RpcServerController* controller) {
+  flare::AddLoggingItemToRpc(controller->GetRemotePeer().ToString());
+
+  if (!is_servant_verifier_->Verify(request.token())) {
+    controller->SetFailed(STATUS_ACCESS_DENIED);
+    return;
+  }
+
+  auto&& attachment = controller->GetRequestAttachment();
+  if (request.keys().size() != request.values().size()) {
+    controller->SetFailed(STATUS_INVALID_ARGUMENT);
+    return;
+  }
+  for (auto&& e : request.values()) {
+    if (e.offset() > attachment.ByteSize() ||
+        e.size() > attachment.ByteSize() - e.offset()) {
+      controller->SetFailed(STATUS_INVALID_ARGUMENT);
+      return;
+    }
+  }
+
+  for (int i = 0; i != request.keys().size(); ++i) {
+    auto&& location = request.values(i);
+    auto value = attachment;
+    value.Skip(location.offset());
+    Put(request.keys(i), value.Cut(location.size()));
+  }
 }
 
 void CacheServiceImpl::Start() {
   // They're heavy operation, so don't to it too frequently.
-  cache_purge_timer_ =
-      flare::fiber::SetTimer(1min, [this] { cache_->Purge(); });
+  cache_purge_timer_ = flare::fiber::SetTimer(1min, [this] {
+    // Entries purged from L2 are dropped from L1 as well.
+    in_memory_cache_->Remove(cache_->Purge());
+  });
   bf_rebuild_timer_ = flare::fiber::SetTimer(60s, [this] { OnRebuildTimer(); });
 
   // Make sure the Bloom Filter is ready before we start serving the clients.
@@ -188,6 +263,37 @@ void CacheServiceImpl::Join() {
   // NOTHING.
 }
 
+std::optional<flare::NoncontiguousBuffer> CacheServiceImpl::TryGet(
+    const std::string& key) {
+  // Hits in L1 are returned as is. The buffer shares its storage with L1, so
+  // no bytes are copied.
+  auto bytes = in_memory_cache_->TryGet(key);
+  if (!bytes) {
+    bytes = cache_->TryGet(key);  // Try L2 then.
+    if (bytes) {
+      // Promote it to L1, and respond with the buffer shared with L1.
+      bytes = in_memory_cache_->Promote(key, *bytes);
+    }
+  }
+  if (!bytes) {
+    cache_miss_.fetch_add(1, std::memory_order_relaxed);
+    return std::nullopt;
+  }
+  cache_hits_.fetch_add(1, std::memory_order_relaxed);
+  return bytes;
+}
+
+void CacheServiceImpl::Put(const std::string& key,
+                           const flare::NoncontiguousBuffer& bytes) {
+  // For better auditability.
+  FLARE_LOG_INFO("Filled cache entry [{}] with {} bytes.", key,
+                 bytes.ByteSize());
+
+  cache_->Put(key, bytes);
+  in_memory_cache_->Put(key, bytes);
+  bf_gen_.Add(key);
+}
+
 // Bloom filter can deal with the duplicate keys case. We can get the advantage
 // of fast insertions.
 std::vector<std::string> CacheServiceImpl::GetKeys() const {
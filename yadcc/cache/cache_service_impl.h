@@ -15,8 +15,10 @@
 #ifndef YADCC_CACHE_CACHE_SERVICE_IMPL_H_
 #define YADCC_CACHE_CACHE_SERVICE_IMPL_H_
 
+#include <limits>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -43,6 +45,12 @@ class CacheServiceImpl : public SyncCacheService {
                    flare::RpcServerController* controller) override;
   void PutEntry(const PutEntryRequest& request, PutEntryResponse* response,
                 flare::RpcServerController* controller) override;
+  void TryGetEntries(const TryGetEntriesRequest& request,
+                     TryGetEntriesResponse* response,
+                     flare::RpcServerController* controller) override;
+  void PutEntries(const PutEntriesRequest& request,
+                  PutEntriesResponse* response,
+                  flare::RpcServerController* controller) override;
 
   // Initialize the service. This must be called prior to starting the server.
   void Start();
@@ -52,6 +60,12 @@ class CacheServiceImpl : public SyncCacheService {
   void Join();
 
  private:
+  // Read from L1, and then L2. Entries found in L2 are promoted to L1.
+  std::optional<flare::NoncontiguousBuffer> TryGet(const std::string& key);
+
+  // Write to both L1 and L2.
+  void Put(const std::string& key, const flare::NoncontiguousBuffer& bytes);
+
   std::vector<std::string> GetKeys() const;
 
   void OnRebuildTimer();
@@ -74,6 +88,11 @@ class CacheServiceImpl : public SyncCacheService {
 
   std::mutex bf_lock_;
   BloomFilterGenerator bf_gen_;
+
+  // Size of the (compressed) bloom filter we returned last time. Incremental
+  // updates larger than this are replaced by the full bloom filter.
+  std::atomic<std::size_t> full_bf_size_{
+      std::numeric_limits<std::size_t>::max()};
   std::uint64_t bf_rebuild_timer_;
 
   flare::ExposedVarDynamic<Json::Value> internal_exposer_;
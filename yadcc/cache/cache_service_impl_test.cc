@@ -25,6 +25,7 @@
 #include "flare/testing/rpc_controller.h"
 
 #include "yadcc/api/cache.pb.h"
+#include "yadcc/common/xxhash.h"
 
 using namespace std::literals;
 
@@ -136,6 +137,133 @@ TEST(CacheServiceImpl, Ops) {
   });
 }
 
+TEST(CacheServiceImpl, BatchOps) {
+  flare::fiber::ExecutionContext::Create()->Execute([&] {
+    FLAGS_acceptable_user_tokens = "token1";
+    FLAGS_acceptable_servant_tokens = "token2";
+    CacheServiceImpl impl;
+
+    {
+      PutEntriesRequest req;
+      PutEntriesResponse resp;
+      flare::RpcServerController ctlr;
+      req.set_token("token2");
+      req.add_keys("batch key1");
+      req.add_keys("batch key2");
+      auto value = req.add_values();
+      value->set_offset(0);
+      value->set_size(5);
+      value = req.add_values();
+      value->set_offset(5);
+      value->set_size(6);
+      flare::testing::SetRpcServerRequestAttachment(
+          &ctlr, flare::CreateBufferSlow("body1body22"));
+      impl.PutEntries(req, &resp, &ctlr);
+      ASSERT_FALSE(ctlr.Failed());
+
+      // Out of range.
+      ctlr.Reset();
+      value->set_size(7);
+      flare::testing::SetRpcServerRequestAttachment(
+          &ctlr, flare::CreateBufferSlow("body1body22"));
+      impl.PutEntries(req, &resp, &ctlr);
+      EXPECT_EQ(STATUS_INVALID_ARGUMENT, ctlr.ErrorCode());
+    }
+
+    {
+      TryGetEntriesRequest req;
+      TryGetEntriesResponse resp;
+      flare::RpcServerController ctlr;
+      req.set_token("token1");
+      req.add_keys("batch key2");
+      req.add_keys("batch key3");
+      req.add_keys("batch key1");
+      impl.TryGetEntries(req, &resp, &ctlr);
+      ASSERT_FALSE(ctlr.Failed());
+
+      auto attachment = flare::FlattenSlow(ctlr.GetResponseAttachment());
+      ASSERT_EQ(3, resp.values().size());
+      EXPECT_TRUE(resp.values(0).found());
+      EXPECT_EQ("body22", attachment.substr(resp.values(0).offset(),
+                                            resp.values(0).size()));
+      EXPECT_FALSE(resp.values(1).found());
+      EXPECT_EQ(0, resp.values(1).size());
+      EXPECT_TRUE(resp.values(2).found());
+      EXPECT_EQ("body1", attachment.substr(resp.values(2).offset(),
+                                           resp.values(2).size()));
+    }
+
+    {
+      TryGetEntriesRequest req;
+      TryGetEntriesResponse resp;
+      flare::RpcServerController ctlr;
+      req.set_token("token1");
+      for (int i = 0; i != 1000; ++i) {
+        req.add_keys("batch key1");
+      }
+      impl.TryGetEntries(req, &resp, &ctlr);
+      EXPECT_EQ(STATUS_INVALID_ARGUMENT, ctlr.ErrorCode());
+    }
+  });
+}
+
+TEST(CacheServiceImpl, FetchBloomFilter) {
+  flare::fiber::ExecutionContext::Create()->Execute([&] {
+    FLAGS_acceptable_user_tokens = "token1";
+    FLAGS_acceptable_servant_tokens = "token2";
+    CacheServiceImpl impl;
+
+    {
+      PutEntryRequest req;
+      PutEntryResponse resp;
+      flare::RpcServerController ctlr;
+      req.set_token("token2");
+      req.set_key("bf key");
+      impl.PutEntry(req, &resp, &ctlr);
+      ASSERT_FALSE(ctlr.Failed());
+    }
+
+    FetchBloomFilterRequest req;
+    req.set_token("token1");
+    req.set_seconds_since_last_fetch(0x7fff'ffff);
+    req.set_seconds_since_last_full_fetch(0x7fff'ffff);
+
+    {
+      FetchBloomFilterResponse resp;
+      flare::RpcServerController ctlr;
+      impl.FetchBloomFilter(req, &resp, &ctlr);
+      ASSERT_FALSE(ctlr.Failed());
+      EXPECT_FALSE(resp.incremental());
+      EXPECT_NE(0, ctlr.GetResponseAttachment().ByteSize());
+    }
+
+    req.set_seconds_since_last_fetch(10);
+    req.set_seconds_since_last_full_fetch(10);
+    {
+      FetchBloomFilterResponse resp;
+      flare::RpcServerController ctlr;
+      impl.FetchBloomFilter(req, &resp, &ctlr);
+      ASSERT_FALSE(ctlr.Failed());
+      ASSERT_TRUE(resp.incremental());
+      ASSERT_EQ(1, resp.newly_populated_keys().size());
+      EXPECT_EQ("bf key", resp.newly_populated_keys(0));
+      EXPECT_EQ(0, resp.newly_populated_key_fingerprints().size());
+    }
+
+    req.set_accept_key_fingerprints(true);
+    {
+      FetchBloomFilterResponse resp;
+      flare::RpcServerController ctlr;
+      impl.FetchBloomFilter(req, &resp, &ctlr);
+      ASSERT_FALSE(ctlr.Failed());
+      ASSERT_TRUE(resp.incremental());
+      EXPECT_EQ(0, resp.newly_populated_keys().size());
+      ASSERT_EQ(1, resp.newly_populated_key_fingerprints().size());
+      EXPECT_EQ(XxHash()("bf key"), resp.newly_populated_key_fingerprints(0));
+    }
+  });
+}
+
 }  // namespace yadcc::cache
 
 FLARE_TEST_MAIN
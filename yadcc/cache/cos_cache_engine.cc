@@ -142,7 +142,7 @@ void CosCacheEngine::Put(const std::string& key,
   }
 }
 
-void CosCacheEngine::Purge() {
+std::vector<std::string> CosCacheEngine::Purge() {
   constexpr auto kBatchSize = 1000;  // Maximum allowed by COS.
   std::vector<std::string> keys;
   {
@@ -150,14 +150,15 @@ void CosCacheEngine::Purge() {
     keys.swap(pending_removal_);
   }
 
-  std::size_t purged = 0;
+  std::vector<std::string> purged;
   for (auto iter = keys.begin(); iter != keys.end();) {
+    auto batch_start = iter;
     flare::CosDeleteMultipleObjectsRequest req;
     while (iter != keys.end() && req.objects.size() < kBatchSize) {
       req.objects.emplace_back().key = MakeObjectKey(*iter++);
     }
     if (auto result = client_.Execute(req)) {
-      purged += req.objects.size();
+      purged.insert(purged.end(), batch_start, iter);
       FLARE_VLOG(10, "Purged {} entries.", req.objects.size());
     } else {
       FLARE_LOG_WARNING_EVERY_SECOND(
@@ -166,7 +167,8 @@ void CosCacheEngine::Purge() {
           result.error().ToString());
     }
   }
-  FLARE_VLOG(1, "Purged {} entries from COS cache.", purged);
+  FLARE_VLOG(1, "Purged {} entries from COS cache.", purged.size());
+  return purged;
 }
 
 Json::Value CosCacheEngine::DumpInternals() const {
@@ -40,7 +40,7 @@ class CosCacheEngine : public CacheEngine {
   void Put(const std::string& key,
            const flare::NoncontiguousBuffer& bytes) override;
 
-  void Purge() override;
+  std::vector<std::string> Purge() override;
 
   Json::Value DumpInternals() const override;
 
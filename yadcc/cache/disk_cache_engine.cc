@@ -58,7 +58,9 @@ void DiskCacheEngine::Put(const std::string& key,
   disk_cache_impl_.Put(key, bytes);
 }
 
-void DiskCacheEngine::Purge() { disk_cache_impl_.Purge(); }
+std::vector<std::string> DiskCacheEngine::Purge() {
+  return disk_cache_impl_.Purge();
+}
 
 Json::Value DiskCacheEngine::DumpInternals() const {
   Json::Value jsv;
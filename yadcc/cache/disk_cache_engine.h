@@ -56,7 +56,9 @@ class DiskCacheEngine : public CacheEngine {
   // to make space.
   //
   // It's slow, and may block `TryGet` / `Put`, so don't call it too often.
-  void Purge() override;
+  //
+  // Keys of the entries discarded are returned.
+  std::vector<std::string> Purge() override;
 
   // Dumps internals about the cache.
   Json::Value DumpInternals() const override;
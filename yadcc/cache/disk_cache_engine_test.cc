@@ -87,7 +87,7 @@ TEST(DiskCacheEngine, All) {
   }
 
   // Discard some entries to keep size under limit.
-  cache.Purge();
+  auto purged = cache.Purge();
 
   // They shouldn't be discarded.
   for (int i = 0; i != 100; ++i) {
@@ -112,6 +112,7 @@ TEST(DiskCacheEngine, All) {
 
   EXPECT_LE(now_used_bytes, 1048576);
   EXPECT_GT(keys_discarded, 0);
+  EXPECT_EQ(keys_discarded, purged.size());
 
   static constexpr auto kHealthyEntries = 10;
   auto not_touched = 0;
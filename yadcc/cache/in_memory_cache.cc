@@ -18,8 +18,11 @@
 #include <utility>
 #include <vector>
 
+#include "flare/base/logging.h"
 #include "flare/base/string.h"
 
+#include "yadcc/common/xxhash.h"
+
 namespace yadcc::cache {
 
 namespace {
@@ -39,302 +42,375 @@ flare::NoncontiguousBuffer CompactBuffer(
 
 }  // namespace
 
-InMemoryCache::InMemoryCache(std::size_t max_size)
-    : max_size_in_bytes_(max_size) {}
+InMemoryCache::InMemoryCache(std::size_t max_size, std::size_t shards) {
+  FLARE_CHECK_GT(shards, 0);
+  for (std::size_t i = 0; i != shards; ++i) {
+    shards_.push_back(std::make_unique<Shard>());
+    shards_.back()->max_size_in_bytes = max_size / shards;
+  }
+}
+
+InMemoryCache::~InMemoryCache() = default;
 
 bool InMemoryCache::Put(const std::string& key,
                         const flare::NoncontiguousBuffer& buffer) {
-  if (buffer.ByteSize() > max_size_in_bytes_) {
+  auto hash = XxHash()(key);
+  auto shard = GetShardOf(hash);
+  if (buffer.ByteSize() > shard->max_size_in_bytes) {
     return false;
   }
-  auto reshaped_buffer = CompactBuffer(buffer);
-
-  std::scoped_lock _(lock_);
-
-  // If the entry is already in our cache(means in t1 or t2), we replace the
-  // content of the entry simplely.
-  if (memory_buffer_mapper_.count(key)) {
-    UnsafeOverwrite(key, reshaped_buffer);
-    return true;
-  }
-
-  CacheEntry entry = {reshaped_buffer, nullptr};
+  PutCompacted(shard, hash, key, CompactBuffer(buffer));
+  return true;
+}
 
-  auto entry_in_phantom = phantom_entry_mapper_.find(key);
-  // The case the entry is in phantom list. We push it back into t1 or t2 cache
-  // list.
-  if (entry_in_phantom != phantom_entry_mapper_.end()) {
-    entry.entry_iter = entry_in_phantom->second.second;
-    if (entry_in_phantom->second.first == 1) {
-      entry.belonging_list = &list_hit_once_phantom_;
-    } else {
-      entry.belonging_list = &list_more_than_once_phantom_;
-    }
-    UnsafeCacheInPhantom(entry_in_phantom->second.first, key, &entry);
-  } else {
-    // The case the entry miss all the cache lists. We push it into t1 cache
-    // list.
-    UnsafeCacheIfMiss(key, &entry);
+flare::NoncontiguousBuffer InMemoryCache::Promote(
+    const std::string& key, const flare::NoncontiguousBuffer& buffer) {
+  auto hash = XxHash()(key);
+  auto shard = GetShardOf(hash);
+  if (buffer.ByteSize() > shard->max_size_in_bytes) {
+    return buffer;  // Not cacheable, nor is there a reason to compact it.
   }
-  EvictMemoryOverflow();
-  return true;
+  auto reshaped_buffer = CompactBuffer(buffer);
+  PutCompacted(shard, hash, key, reshaped_buffer);
+  return reshaped_buffer;
 }
 
 // If the entry hit the t1 or t2 cache, we can return the cache. Then we move
 // the entry to the top of t2 list.
 std::optional<flare::NoncontiguousBuffer> InMemoryCache::TryGet(
     const std::string& key) {
-  std::scoped_lock _(lock_);
-  if (memory_buffer_mapper_.count(key) == 0) {
-    misses_.fetch_add(1, std::memory_order_relaxed);
+  auto hash = XxHash()(key);
+  auto shard = GetShardOf(hash);
+  std::scoped_lock _(shard->lock);
+  auto iter = shard->entries.find(hash);
+  if (iter == shard->entries.end() || iter->second.key != key) {
+    ++shard->misses;
     return std::nullopt;
   }
 
-  UnsafePutEntryIntoList(key, &memory_buffer_mapper_.at(key),
-                         &list_more_than_once_);
-  hits_.fetch_add(1, std::memory_order_relaxed);
-  return memory_buffer_mapper_.at(key).buffer;
+  UnsafeMoveEntry(&iter->second, &shard->list_more_than_once);
+  ++shard->hits;
+  return iter->second.buffer;
 }
 
 void InMemoryCache::Remove(const std::vector<std::string>& keys) {
-  std::scoped_lock _(lock_);
-  for (const auto& key : keys) {
-    if (memory_buffer_mapper_.count(key) == 0) {
+  // Keys are grouped by shard so that each shard is locked only once.
+  std::vector<std::vector<std::pair<std::uint64_t, const std::string*>>>
+      keys_per_shard(shards_.size());
+  for (auto&& key : keys) {
+    auto hash = XxHash()(key);
+    keys_per_shard[GetShardIndexOf(hash)].emplace_back(hash, &key);
+  }
+
+  for (std::size_t i = 0; i != shards_.size(); ++i) {
+    if (keys_per_shard[i].empty()) {
       continue;
     }
-    auto iter = memory_buffer_mapper_.find(key);
-    FLARE_CHECK(iter != memory_buffer_mapper_.end());
-    iter->second.belonging_list->size -= iter->second.buffer.ByteSize();
-    iter->second.belonging_list->list.remove_if(
-        [&](const std::pair<std::string, std::size_t>& e) {
-          return e.first == key;
-        });
-    memory_buffer_mapper_.erase(key);
+    auto shard = shards_[i].get();
+    std::scoped_lock _(shard->lock);
+    for (auto&& [hash, key] : keys_per_shard[i]) {
+      UnsafeRemove(shard, hash, *key);
+    }
   }
 }
 
 std::vector<std::string> InMemoryCache::GetKeys() const {
   std::vector<std::string> keys;
-  std::scoped_lock _(lock_);
-  for (auto&& [k, _] : memory_buffer_mapper_) {
-    keys.emplace_back(k);
+  for (auto&& shard : shards_) {
+    std::scoped_lock _(shard->lock);
+    for (auto&& [_, e] : shard->entries) {
+      keys.emplace_back(e.key);
+    }
   }
   return keys;
 }
 
 Json::Value InMemoryCache::DumpInternals() const {
+  std::uint64_t actual_size = 0, actual_entries = 0, phantom_size = 0,
+                phantom_entries = 0, hits = 0, misses = 0;
+
+  for (auto&& shard : shards_) {
+    std::scoped_lock _(shard->lock);
+    actual_size +=
+        shard->list_hit_once.size + shard->list_more_than_once.size;
+    actual_entries += shard->entries.size();
+    phantom_size += shard->list_hit_once_phantom.size +
+                    shard->list_more_than_once_phantom.size;
+    phantom_entries += shard->phantom_entries.size();
+    hits += shard->hits;
+    misses += shard->misses;
+  }
+
   Json::Value jsv;
+  jsv["actual_size_in_bytes"] = static_cast<Json::UInt64>(actual_size);
+  jsv["actual_entries"] = static_cast<Json::UInt64>(actual_entries);
+  jsv["phantom_size_in_bytes"] = static_cast<Json::UInt64>(phantom_size);
+  jsv["phantom_entries"] = static_cast<Json::UInt64>(phantom_entries);
+  jsv["hits"] = static_cast<Json::UInt64>(hits);
+  jsv["misses"] = static_cast<Json::UInt64>(misses);
+  jsv["shards"] = static_cast<Json::UInt64>(shards_.size());
+  return jsv;
+}
+
+std::size_t InMemoryCache::GetShardIndexOf(std::uint64_t hash) const noexcept {
+  // Low bits are used by `Shard::entries` for picking buckets, so we use the
+  // high ones here.
+  return (hash >> 32) % shards_.size();
+}
+
+InMemoryCache::Shard* InMemoryCache::GetShardOf(
+    std::uint64_t hash) const noexcept {
+  return shards_[GetShardIndexOf(hash)].get();
+}
 
-  {
-    std::scoped_lock _(lock_);
-    jsv["actual_size_in_bytes"] = static_cast<Json::UInt64>(
-        list_hit_once_.size + list_more_than_once_.size);
-    jsv["actual_entries"] = static_cast<Json::UInt64>(
-        list_hit_once_.list.size() + list_more_than_once_.list.size());
-    jsv["phantom_size_in_bytes"] = static_cast<Json::UInt64>(
-        list_hit_once_phantom_.size + list_more_than_once_phantom_.size);
-    jsv["phantom_entries"] =
-        static_cast<Json::UInt64>(list_hit_once_phantom_.list.size() +
-                                  list_more_than_once_phantom_.list.size());
+void InMemoryCache::PutCompacted(Shard* shard, std::uint64_t hash,
+                                 const std::string& key,
+                                 flare::NoncontiguousBuffer buffer) {
+  std::scoped_lock _(shard->lock);
+
+  // If the entry is already in our cache(means in t1 or t2), we replace the
+  // content of the entry simplely.
+  if (auto iter = shard->entries.find(hash); iter != shard->entries.end()) {
+    if (iter->second.key == key) {
+      UnsafeOverwrite(shard, &iter->second, std::move(buffer));
+      return;
+    }
+    // Hash collision. Only one of them can be cached, let's keep the new one.
+    UnsafeDropEntry(shard, &iter->second);
   }
 
-  jsv["hits"] =
-      static_cast<Json::UInt64>(hits_.load(std::memory_order_relaxed));
-  jsv["misses"] =
-      static_cast<Json::UInt64>(misses_.load(std::memory_order_relaxed));
-  return jsv;
+  auto entry_in_phantom = shard->phantom_entries.find(hash);
+  // The case the entry is in phantom list. We push it back into t1 or t2 cache
+  // list.
+  if (entry_in_phantom != shard->phantom_entries.end()) {
+    UnsafeCacheInPhantom(shard, &entry_in_phantom->second, key,
+                         std::move(buffer));
+  } else {
+    // The case the entry miss all the cache lists. We push it into t1 cache
+    // list.
+    UnsafeCacheIfMiss(shard, hash, key, std::move(buffer));
+  }
+  UnsafeEvictMemoryOverflow(shard);
 }
 
-void InMemoryCache::UnsafeOverwrite(const std::string& key,
-                                    const flare::NoncontiguousBuffer& buffer) {
-  auto iter = memory_buffer_mapper_.find(key);
-  FLARE_CHECK(iter != memory_buffer_mapper_.end());
-  iter->second.buffer = buffer;
-  auto origin_size = iter->second.entry_iter->second;
-  iter->second.belonging_list->size -= origin_size;
-  iter->second.entry_iter->second = buffer.ByteSize();
-  iter->second.belonging_list->size += iter->second.entry_iter->second;
-  if (buffer.ByteSize() > origin_size) {
-    EvictMemoryOverflow();
+void InMemoryCache::UnsafeOverwrite(Shard* shard, Entry* entry,
+                                    flare::NoncontiguousBuffer buffer) {
+  auto origin_size = entry->size;
+  entry->buffer = std::move(buffer);
+  entry->size = entry->buffer.ByteSize();
+  entry->belonging_list->size -= origin_size;
+  entry->belonging_list->size += entry->size;
+  if (entry->size > origin_size) {
+    UnsafeEvictMemoryOverflow(shard);
   }
 }
 
-void InMemoryCache::UnsafeCacheInPhantom(int phantom_index,
+void InMemoryCache::UnsafeCacheInPhantom(Shard* shard, PhantomEntry* phantom,
                                          const std::string& key,
-                                         CacheEntry* entry) {
+                                         flare::NoncontiguousBuffer buffer) {
+  auto&& b1 = shard->list_hit_once_phantom;
+  auto&& b2 = shard->list_more_than_once_phantom;
+  bool hit_more_than_once_phantom = phantom->belonging_list == &b2;
+
   // To update the adaptive variable according to which phantom list the entry
   // come from. If the entry come from b1, a increment of the variable make
   // cache pattern closer to LRU. Otherwise, closer to LFU.
-  auto buffer_size = entry->buffer.ByteSize();
-  if (phantom_index == 1) {
+  auto buffer_size = buffer.ByteSize();
+  if (!hit_more_than_once_phantom) {
     double ratio =
-        list_hit_once_phantom_.size < list_more_than_once_phantom_.size
-            ? static_cast<double>(list_more_than_once_phantom_.size) /
-                  list_hit_once_phantom_.size
-            : 1;
-    adaptive_size_of_once_ += buffer_size * ratio;
-    adaptive_size_of_once_ =
-        std::min(adaptive_size_of_once_, max_size_in_bytes_);
+        b1.size < b2.size ? static_cast<double>(b2.size) / b1.size : 1;
+    shard->adaptive_size_of_once += buffer_size * ratio;
+    shard->adaptive_size_of_once =
+        std::min(shard->adaptive_size_of_once, shard->max_size_in_bytes);
   } else {
     double ratio =
-        list_more_than_once_phantom_.size < list_hit_once_phantom_.size
-            ? static_cast<double>(list_hit_once_phantom_.size) /
-                  list_more_than_once_phantom_.size
-            : 1;
+        b2.size < b1.size ? static_cast<double>(b1.size) / b2.size : 1;
     buffer_size *= ratio;
-    adaptive_size_of_once_ = adaptive_size_of_once_ > buffer_size
-                                 ? adaptive_size_of_once_ - buffer_size
-                                 : 0;
+    shard->adaptive_size_of_once =
+        shard->adaptive_size_of_once > buffer_size
+            ? shard->adaptive_size_of_once - buffer_size
+            : 0;
   }
 
-  UnsafeAdaptiveAdjust(phantom_index);
-  UnsafePutEntryIntoList(key, entry, &list_more_than_once_);
-  memory_buffer_mapper_.insert(std::pair{key, std::move(*entry)});
-  phantom_entry_mapper_.erase(key);
+  // Evicting entries to phantom lists does not relocate `phantom`.
+  UnsafeAdaptiveAdjust(shard, hit_more_than_once_phantom);
+  auto hash = phantom->hash;
+  UnsafeDropPhantom(shard, phantom);
+  UnsafeAddEntry(shard, hash, key, std::move(buffer),
+                 &shard->list_more_than_once);
 }
 
-void InMemoryCache::UnsafeCacheIfMiss(const std::string& key,
-                                      CacheEntry* entry) {
-  auto remaining_size = entry->buffer.ByteSize();
-  if (list_hit_once_.size + list_more_than_once_.size + remaining_size >
-      max_size_in_bytes_) {
-    if (list_hit_once_.size + list_hit_once_phantom_.size + remaining_size >
-        max_size_in_bytes_) {
+void InMemoryCache::UnsafeCacheIfMiss(Shard* shard, std::uint64_t hash,
+                                      const std::string& key,
+                                      flare::NoncontiguousBuffer buffer) {
+  auto&& t1 = shard->list_hit_once;
+  auto&& b1 = shard->list_hit_once_phantom;
+  auto&& t2 = shard->list_more_than_once;
+  auto&& b2 = shard->list_more_than_once_phantom;
+  auto max_size = shard->max_size_in_bytes;
+
+  auto remaining_size = buffer.ByteSize();
+  if (t1.size + t2.size + remaining_size > max_size) {
+    if (t1.size + b1.size + remaining_size > max_size) {
       // Evict b1 first.
-      if (list_hit_once_phantom_.size > 0) {
-        remaining_size =
-            UnsafeTryEvict(&list_hit_once_phantom_, remaining_size, false);
+      if (b1.size > 0) {
+        remaining_size = UnsafeTryEvict(shard, &b1, remaining_size);
       }
       // If b1 is not big enough, continue to evict the t1.
       if (remaining_size) {
-        remaining_size = UnsafeTryEvict(&list_hit_once_, remaining_size, true);
+        remaining_size = UnsafeTryEvict(shard, &t1, remaining_size);
       }
     }
     if (remaining_size) {
-      if (list_hit_once_.size + list_more_than_once_.size +
-              list_hit_once_phantom_.size + list_more_than_once_phantom_.size +
-              remaining_size >
-          max_size_in_bytes_) {
-        if (list_hit_once_.size + list_more_than_once_.size +
-                list_hit_once_phantom_.size +
-                list_more_than_once_phantom_.size + remaining_size >=
-            2 * max_size_in_bytes_) {
+      if (t1.size + t2.size + b1.size + b2.size + remaining_size > max_size) {
+        if (t1.size + t2.size + b1.size + b2.size + remaining_size >=
+            2 * max_size) {
           // Evict b2 first.
-          if (list_more_than_once_phantom_.size > 0) {
-            remaining_size = UnsafeTryEvict(&list_more_than_once_phantom_,
-                                            remaining_size, false);
+          if (b2.size > 0) {
+            remaining_size = UnsafeTryEvict(shard, &b2, remaining_size);
           }
           // If b2 is not big enough, continue to evict the t2.
           if (remaining_size) {
-            remaining_size =
-                UnsafeTryEvict(&list_more_than_once_, remaining_size, true);
+            remaining_size = UnsafeTryEvict(shard, &t2, remaining_size);
           }
         } else {
-          UnsafeAdaptiveAdjust(1);
+          UnsafeAdaptiveAdjust(shard, false);
         }
       }
     }
   }
   // Finally fetch entry to the cache and move it to MRU position in T1.
-  UnsafePutEntryIntoList(key, entry, &list_hit_once_);
-  memory_buffer_mapper_.insert(std::pair{key, std::move(*entry)});
+  UnsafeAddEntry(shard, hash, key, std::move(buffer), &t1);
 }
 
-void InMemoryCache::UnsafePutEntryIntoList(const std::string& key,
-                                           CacheEntry* entry,
-                                           CacheList* dst_list) {
-  // Remove the entry from source list.
-  if (entry->belonging_list) {
-    FLARE_CHECK(entry->entry_iter != entry->belonging_list->list.end());
-    // Subtract the size of the entry from the source list.
-    if (phantom_entry_mapper_.count(key)) {
-      entry->belonging_list->size -=
-          phantom_entry_mapper_.at(key).second->second;
-    } else {
-      entry->belonging_list->size -= entry->entry_iter->second;
+void InMemoryCache::UnsafeAddEntry(Shard* shard, std::uint64_t hash,
+                                   const std::string& key,
+                                   flare::NoncontiguousBuffer buffer,
+                                   CacheList<Entry>* dst_list) {
+  auto [iter, inserted] = shard->entries.try_emplace(hash);
+  FLARE_CHECK(inserted);
+  auto&& entry = iter->second;
+  entry.hash = hash;
+  entry.key = key;
+  entry.size = buffer.ByteSize();
+  entry.buffer = std::move(buffer);
+  entry.belonging_list = dst_list;
+  dst_list->entries.push_front(&entry);
+  dst_list->size += entry.size;
+}
+
+void InMemoryCache::UnsafeMoveEntry(Entry* entry, CacheList<Entry>* dst_list) {
+  entry->belonging_list->entries.erase(entry);
+  entry->belonging_list->size -= entry->size;
+  entry->belonging_list = dst_list;
+  dst_list->entries.push_front(entry);
+  dst_list->size += entry->size;
+}
+
+void InMemoryCache::UnsafeDropEntry(Shard* shard, Entry* entry) {
+  auto hash = entry->hash;  // `entry` itself is destroyed on erasure.
+  entry->belonging_list->entries.erase(entry);
+  entry->belonging_list->size -= entry->size;
+  shard->entries.erase(hash);
+}
+
+void InMemoryCache::UnsafeRemove(Shard* shard, std::uint64_t hash,
+                                 const std::string& key) {
+  if (auto iter = shard->entries.find(hash); iter != shard->entries.end()) {
+    if (iter->second.key == key) {
+      UnsafeDropEntry(shard, &iter->second);
     }
-    entry->belonging_list->list.erase(entry->entry_iter);
-    entry->entry_iter = entry->belonging_list->list.end();
+    // Otherwise it's another key colliding with `key`, leave it alone.
+  } else if (auto iter = shard->phantom_entries.find(hash);
+             iter != shard->phantom_entries.end()) {
+    UnsafeDropPhantom(shard, &iter->second);
   }
-  // Push the entry to destination list.
-  std::size_t size = entry->buffer.ByteSize();
-  dst_list->list.emplace_front(key, size);
-  dst_list->size += entry->buffer.ByteSize();
-  entry->belonging_list = dst_list;
-  entry->entry_iter = entry->belonging_list->list.begin();
 }
 
-std::size_t InMemoryCache::UnsafeTryEvict(CacheList* cache_list,
-                                          std::size_t desired_byte_size,
-                                          bool in_memory) {
+void InMemoryCache::UnsafeDropPhantom(Shard* shard, PhantomEntry* phantom) {
+  auto hash = phantom->hash;
+  phantom->belonging_list->entries.erase(phantom);
+  phantom->belonging_list->size -= phantom->size;
+  shard->phantom_entries.erase(hash);
+}
+
+std::size_t InMemoryCache::UnsafeTryEvict(Shard* shard,
+                                          CacheList<Entry>* cache_list,
+                                          std::size_t desired_byte_size) {
   while (desired_byte_size && cache_list->size) {
-    auto remove_size = cache_list->list.back().second;
-    cache_list->size -= remove_size;
+    auto entry = cache_list->entries.back();
     desired_byte_size =
-        desired_byte_size > remove_size ? desired_byte_size - remove_size : 0;
-    if (in_memory) {
-      memory_buffer_mapper_.erase(cache_list->list.back().first);
-    } else {
-      phantom_entry_mapper_.erase(cache_list->list.back().first);
-      UnsafeAdaptiveAdjust(1);
-    }
-    cache_list->list.pop_back();
+        desired_byte_size > entry->size ? desired_byte_size - entry->size : 0;
+    UnsafeDropEntry(shard, entry);
   }
   return desired_byte_size;
 }
 
-void InMemoryCache::EvictMemoryOverflow() {
-  while (list_hit_once_.size + list_more_than_once_.size > max_size_in_bytes_) {
-    if (list_hit_once_.size > adaptive_size_of_once_) {
-      EvictHitOnceToPhantom();
+std::size_t InMemoryCache::UnsafeTryEvict(Shard* shard,
+                                          CacheList<PhantomEntry>* cache_list,
+                                          std::size_t desired_byte_size) {
+  while (desired_byte_size && cache_list->size) {
+    auto phantom = cache_list->entries.back();
+    desired_byte_size = desired_byte_size > phantom->size
+                            ? desired_byte_size - phantom->size
+                            : 0;
+    UnsafeDropPhantom(shard, phantom);
+    UnsafeAdaptiveAdjust(shard, false);
+  }
+  return desired_byte_size;
+}
+
+void InMemoryCache::UnsafeEvictMemoryOverflow(Shard* shard) {
+  auto&& t1 = shard->list_hit_once;
+  auto&& b1 = shard->list_hit_once_phantom;
+  auto&& t2 = shard->list_more_than_once;
+  auto&& b2 = shard->list_more_than_once_phantom;
+  auto max_size = shard->max_size_in_bytes;
+
+  while (t1.size + t2.size > max_size) {
+    if (t1.size > shard->adaptive_size_of_once) {
+      UnsafeEvictToPhantom(shard, &t1, &b1);
     } else {
-      EvictMoreThanOnceToPhantom();
+      UnsafeEvictToPhantom(shard, &t2, &b2);
     }
   }
-  while (list_hit_once_.size + list_hit_once_phantom_.size >
-         max_size_in_bytes_) {
-    auto remove_size = list_hit_once_phantom_.list.back().second;
-    list_hit_once_phantom_.size -= remove_size;
-    phantom_entry_mapper_.erase(list_hit_once_phantom_.list.back().first);
-    list_hit_once_phantom_.list.pop_back();
+  while (t1.size + b1.size > max_size) {
+    UnsafeDropPhantom(shard, b1.entries.back());
   }
-
-  while (list_more_than_once_.size + list_more_than_once_phantom_.size >
-         max_size_in_bytes_) {
-    auto remove_size = list_more_than_once_phantom_.list.back().second;
-    list_more_than_once_phantom_.size -= remove_size;
-    phantom_entry_mapper_.erase(list_more_than_once_phantom_.list.back().first);
-    list_more_than_once_phantom_.list.pop_back();
+  while (t2.size + b2.size > max_size) {
+    UnsafeDropPhantom(shard, b2.entries.back());
   }
 }
 
-void InMemoryCache::EvictHitOnceToPhantom() {
-  auto key = list_hit_once_.list.back().first;
-  auto&& entry = memory_buffer_mapper_.at(key);
-  UnsafePutEntryIntoList(key, &entry, &list_hit_once_phantom_);
-  phantom_entry_mapper_[key] = std::pair(1, entry.entry_iter);
-  memory_buffer_mapper_.erase(key);
-}
-
-void InMemoryCache::EvictMoreThanOnceToPhantom() {
-  auto key = list_more_than_once_.list.back().first;
-  auto&& entry = memory_buffer_mapper_.at(key);
-  UnsafePutEntryIntoList(key, &entry, &list_more_than_once_phantom_);
-  phantom_entry_mapper_[key] = std::pair(2, entry.entry_iter);
-  memory_buffer_mapper_.erase(key);
+void InMemoryCache::UnsafeEvictToPhantom(
+    Shard* shard, CacheList<Entry>* cache_list,
+    CacheList<PhantomEntry>* phantom_list) {
+  auto entry = cache_list->entries.back();
+  auto [iter, inserted] = shard->phantom_entries.try_emplace(entry->hash);
+  FLARE_CHECK(inserted);
+  auto&& phantom = iter->second;
+  phantom.hash = entry->hash;
+  phantom.size = entry->size;
+  phantom.belonging_list = phantom_list;
+  phantom_list->entries.push_front(&phantom);
+  phantom_list->size += phantom.size;
+  UnsafeDropEntry(shard, entry);
 }
 
-void InMemoryCache::UnsafeAdaptiveAdjust(int phantom_index) {
-  if (list_hit_once_.size > adaptive_size_of_once_ ||
-      (phantom_index == 2 && list_hit_once_.size >= adaptive_size_of_once_)) {
-    if (list_hit_once_.size) {
-      EvictHitOnceToPhantom();
+void InMemoryCache::UnsafeAdaptiveAdjust(Shard* shard,
+                                         bool hit_more_than_once_phantom) {
+  auto&& t1 = shard->list_hit_once;
+  auto&& t2 = shard->list_more_than_once;
+  if (t1.size > shard->adaptive_size_of_once ||
+      (hit_more_than_once_phantom && t1.size >= shard->adaptive_size_of_once)) {
+    if (t1.size) {
+      UnsafeEvictToPhantom(shard, &t1, &shard->list_hit_once_phantom);
     }
   } else {
-    auto adaptive_size_of_t2 = max_size_in_bytes_ - adaptive_size_of_once_;
-    if (list_more_than_once_.size &&
-        list_more_than_once_.size >= adaptive_size_of_t2) {
-      EvictMoreThanOnceToPhantom();
+    auto adaptive_size_of_t2 =
+        shard->max_size_in_bytes - shard->adaptive_size_of_once;
+    if (t2.size && t2.size >= adaptive_size_of_t2) {
+      UnsafeEvictToPhantom(shard, &t2, &shard->list_more_than_once_phantom);
     }
   }
 }
@@ -16,17 +16,18 @@
 #define YADCC_CACHE_IN_MEMORY_CACHE_H_
 
 #include <cstddef>
-#include <list>
+#include <cstdint>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
 #include <unordered_map>
-#include <utility>
 #include <vector>
 
 #include "jsoncpp/value.h"
 
 #include "flare/base/buffer.h"
+#include "flare/base/internal/doubly_linked_list.h"
 
 namespace yadcc::cache {
 
@@ -36,92 +37,153 @@ namespace yadcc::cache {
 //
 // Our implementation is a little different from the paper, mainly because the
 // size of the cached pages in the paper is fixed.
+//
+// Keys are spread among several shards by their hash, each shard runs ARC on
+// its own (with its own lists and adaptive state) under its own lock.
 class InMemoryCache {
  public:
-  // We must supply the max byte size we want the cache hold.
-  explicit InMemoryCache(std::size_t max_size);
+  // We must supply the max byte size we want the cache hold. It's evenly split
+  // among `shards`, entries larger than a shard are never cached.
+  explicit InMemoryCache(std::size_t max_size, std::size_t shards = 1);
+  ~InMemoryCache();
 
   bool Put(const std::string& key, const flare::NoncontiguousBuffer& buffer);
+
+  // Cache `buffer` found in L2. Returned is a buffer of the same bytes, which
+  // shares its (compacted) storage with the one cached, so it can be sent to
+  // the requestor without another copy.
+  flare::NoncontiguousBuffer Promote(const std::string& key,
+                                     const flare::NoncontiguousBuffer& buffer);
+
+  // The buffer returned shares its storage with the one cached, the bytes are
+  // not copied.
   std::optional<flare::NoncontiguousBuffer> TryGet(const std::string& key);
+
+  // Drop `keys` from the cache, along with their phantoms (if any). Each shard
+  // is locked once, and each key is removed in constant time.
+  //
+  // This is called with keys purged from L2, to keep L1 coherent with it.
   void Remove(const std::vector<std::string>& keys);
+
   std::vector<std::string> GetKeys() const;
 
   Json::Value DumpInternals() const;
 
  private:
-  typedef std::list<std::pair<std::string, std::size_t>>::iterator
-      EntryIterator;
-
+  template <class T>
   struct CacheList {
-    std::size_t size = 0;
-    std::list<std::pair<std::string, std::size_t>> list;
+    std::size_t size = 0;  // In bytes.
+
+    // Most recently used one comes first.
+    flare::internal::DoublyLinkedList<T, &T::chain> entries;
   };
 
-  struct CacheEntry {
+  // Entry in T1 or T2. This is the only place where the key is stored, the
+  // index is keyed by hash of the key.
+  struct Entry {
+    flare::internal::DoublyLinkedListEntry chain;
+    CacheList<Entry>* belonging_list;
+    std::uint64_t hash;
+    std::string key;
+    std::size_t size;  // Same as `buffer.ByteSize()`.
     flare::NoncontiguousBuffer buffer;
-    CacheList* belonging_list;
-    EntryIterator entry_iter;
+  };
+
+  // Entry in B1 or B2. Only hash of the key is kept. Should two keys collide,
+  // the only harm is that ARC adapts itself a bit inaccurately.
+  struct PhantomEntry {
+    flare::internal::DoublyLinkedListEntry chain;
+    CacheList<PhantomEntry>* belonging_list;
+    std::uint64_t hash;
+    std::size_t size;
+  };
+
+  struct Shard {
+    std::size_t max_size_in_bytes;
+
+    mutable std::mutex lock;
+    std::uint64_t hits = 0, misses = 0;
+
+    // This variable describes the size of the T1 cache and varies with the
+    // cache hit pattern. The larger the variable, the closer to LRU.
+    // Otherwise, the closer to LFU.
+    std::size_t adaptive_size_of_once = 0;
+
+    // The Cache list store entries which hit exactly once.
+    CacheList<Entry> list_hit_once;
+    // The Cache list store entries which evcited from t1.
+    CacheList<PhantomEntry> list_hit_once_phantom;
+    // The Cache list store entries which hit more than once.
+    CacheList<Entry> list_more_than_once;
+    // The Cache list store entries which evcited from t2.
+    CacheList<PhantomEntry> list_more_than_once_phantom;
+
+    // Keyed by hash of the key. In case two keys collide, only one of them is
+    // cached. Nodes of `std::unordered_map` are never relocated, so they're
+    // chained in the lists above directly.
+    std::unordered_map<std::uint64_t, Entry> entries;
+    std::unordered_map<std::uint64_t, PhantomEntry> phantom_entries;
   };
 
  private:
-  // Replace the content of the entry which is already in our actaul cache list.
-  void UnsafeOverwrite(const std::string& key,
-                       const flare::NoncontiguousBuffer& buffer);
+  std::size_t GetShardIndexOf(std::uint64_t hash) const noexcept;
+  Shard* GetShardOf(std::uint64_t hash) const noexcept;
 
-  // Transfer the entry from ont cache list to another.
-  void UnsafePutEntryIntoList(const std::string& key, CacheEntry* entry,
-                              CacheList* dst_list);
+  // `buffer` must have been compacted.
+  void PutCompacted(Shard* shard, std::uint64_t hash, const std::string& key,
+                    flare::NoncontiguousBuffer buffer);
+
+  // Replace the content of the entry which is already in our actaul cache list.
+  void UnsafeOverwrite(Shard* shard, Entry* entry,
+                       flare::NoncontiguousBuffer buffer);
 
   // Cache the entry if entry is in phantom lists.
-  void UnsafeCacheInPhantom(int phantom_index, const std::string& key,
-                            CacheEntry* entry);
+  void UnsafeCacheInPhantom(Shard* shard, PhantomEntry* phantom,
+                            const std::string& key,
+                            flare::NoncontiguousBuffer buffer);
 
   // Cache the entry if entry all miss.
-  void UnsafeCacheIfMiss(const std::string& key, CacheEntry* entry);
+  void UnsafeCacheIfMiss(Shard* shard, std::uint64_t hash,
+                         const std::string& key,
+                         flare::NoncontiguousBuffer buffer);
+
+  // Create a new entry at MRU position of `dst_list`.
+  void UnsafeAddEntry(Shard* shard, std::uint64_t hash, const std::string& key,
+                      flare::NoncontiguousBuffer buffer,
+                      CacheList<Entry>* dst_list);
+
+  // Move the entry to MRU position of `dst_list`.
+  void UnsafeMoveEntry(Entry* entry, CacheList<Entry>* dst_list);
+
+  // Drop the entry from the cache, without leaving a phantom.
+  void UnsafeDropEntry(Shard* shard, Entry* entry);
+
+  // Remove `key`, or its phantom, from `shard`.
+  void UnsafeRemove(Shard* shard, std::uint64_t hash, const std::string& key);
+
+  // Drop the phantom entry.
+  void UnsafeDropPhantom(Shard* shard, PhantomEntry* phantom);
 
   // Adaptive adjustment of the cache pattern among LRU and LFU.
-  void UnsafeAdaptiveAdjust(int phantom_index);
+  void UnsafeAdaptiveAdjust(Shard* shard, bool hit_more_than_once_phantom);
 
   // Try to get enough space from the cache list to add new entry. If is not
   // enough, return the remaining size.
-  std::size_t UnsafeTryEvict(CacheList* cache_list,
-                             std::size_t desired_byte_size, bool in_memory);
+  std::size_t UnsafeTryEvict(Shard* shard, CacheList<Entry>* cache_list,
+                             std::size_t desired_byte_size);
+  std::size_t UnsafeTryEvict(Shard* shard,
+                             CacheList<PhantomEntry>* cache_list,
+                             std::size_t desired_byte_size);
 
   // If memory overflows, we should evict some entries.
-  void EvictMemoryOverflow();
-
-  // Evict entries in once list to phantom.
-  void EvictHitOnceToPhantom();
+  void UnsafeEvictMemoryOverflow(Shard* shard);
 
-  // Evict entries in more than once list to phantom.
-  void EvictMoreThanOnceToPhantom();
+  // Evict LRU entry in `cache_list` to `phantom_list`.
+  void UnsafeEvictToPhantom(Shard* shard, CacheList<Entry>* cache_list,
+                            CacheList<PhantomEntry>* phantom_list);
 
  private:
-  const std::size_t max_size_in_bytes_;
-
-  std::atomic<std::uint64_t> hits_{}, misses_{};
-
-  // This variable describes the size of the T1 cache and varies with the cache
-  // hit pattern.  The larger the variable, the closer to LRU. Otherwise, the
-  // closer to LFU.
-  std::size_t adaptive_size_of_once_{0};
-
-  // The Cache list store entries which hit exactly once.
-  CacheList list_hit_once_;
-  // The Cache list store entries which evcited from t1.
-  CacheList list_hit_once_phantom_;
-  // The Cache list store entries which hit more than once.
-  CacheList list_more_than_once_;
-  // The Cache list store entries which evcited from t2.
-  CacheList list_more_than_once_phantom_;
-
-  mutable std::mutex lock_;
-  std::unordered_map<std::string, CacheEntry> memory_buffer_mapper_;
-
-  // The first field in pair represents the index of the phantom list, and then
-  // second describe the iterator where the entry is in.
-  std::unordered_map<std::string, std::pair<int, EntryIterator>>
-      phantom_entry_mapper_;
+  std::vector<std::unique_ptr<Shard>> shards_;
 };
 
 }  // namespace yadcc::cache
@@ -0,0 +1,188 @@
+// Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+//
+// Licensed under the BSD 3-Clause License (the "License"); you may not use this
+// file except in compliance with the License. You may obtain a copy of the
+// License at
+//
+// https://opensource.org/licenses/BSD-3-Clause
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include <malloc.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "flare/base/buffer.h"
+#include "flare/base/logging.h"
+#include "flare/base/string.h"
+
+#include "yadcc/cache/in_memory_cache.h"
+
+// Hit throughput of `InMemoryCache` against number of threads, with a single
+// shard (which is what we used to have, a single lock guarding everything) and
+// with 32 shards.
+//
+// Bytes of memory used per cached entry, besides the value itself, compared to
+// the layout we used to have (where each key is stored in a hash map and again
+// in a `std::list` node).
+
+namespace {
+
+// Allocations are only counted while this is set, so that the hit benchmark is
+// not slowed down by contention on `allocated_bytes`.
+std::atomic<bool> counting_allocations{false};
+std::atomic<std::int64_t> allocated_bytes{};
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+  auto ptr = std::malloc(size);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  if (counting_allocations.load(std::memory_order_relaxed)) {
+    allocated_bytes.fetch_add(malloc_usable_size(ptr),
+                              std::memory_order_relaxed);
+  }
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+  if (ptr && counting_allocations.load(std::memory_order_relaxed)) {
+    allocated_bytes.fetch_sub(malloc_usable_size(ptr),
+                              std::memory_order_relaxed);
+  }
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept { operator delete(ptr); }
+
+namespace yadcc::cache {
+
+constexpr auto kEntries = 10000;
+constexpr auto kValueSize = 1000;
+
+// Our keys look like this.
+std::string MakeKey(int index) {
+  return flare::Format("yadcc-cxx2-{:064x}", index);
+}
+
+flare::NoncontiguousBuffer CompactBuffer(
+    const flare::NoncontiguousBuffer& buffer) {
+  flare::NoncontiguousBuffer result;
+  result.Append(flare::MakeForeignBuffer(flare::FlattenSlow(buffer)));
+  return result;
+}
+
+// Bookkeeping of entries in T1 / T2 of the `InMemoryCache` we used to have.
+class LegacyLayout {
+ public:
+  bool Put(const std::string& key, const flare::NoncontiguousBuffer& buffer) {
+    list_.emplace_front(key, buffer.ByteSize());
+    mapper_.insert(std::pair{
+        key, CacheEntry{CompactBuffer(buffer), &list_, list_.begin()}});
+    return true;
+  }
+
+ private:
+  using EntryList = std::list<std::pair<std::string, std::size_t>>;
+
+  struct CacheEntry {
+    flare::NoncontiguousBuffer buffer;
+    EntryList* belonging_list;
+    EntryList::iterator entry_iter;
+  };
+
+  EntryList list_;
+  std::unordered_map<std::string, CacheEntry> mapper_;
+};
+
+template <class T, class... Args>
+void BenchmarkOverhead(benchmark::State& state, Args... args) {
+  std::vector<std::pair<std::string, flare::NoncontiguousBuffer>> entries;
+  for (int i = 0; i != kEntries; ++i) {
+    entries.emplace_back(MakeKey(i),
+                         flare::CreateBufferSlow(std::string(kValueSize, i)));
+  }
+
+  std::int64_t bytes = 0;
+  while (state.KeepRunning()) {
+    allocated_bytes = 0;
+    counting_allocations = true;
+    {
+      auto cache = std::make_unique<T>(args...);
+      for (auto&& [k, v] : entries) {
+        FLARE_CHECK(cache->Put(k, v));
+      }
+      bytes += allocated_bytes.load();
+      counting_allocations = false;
+    }
+  }
+  state.counters["overhead_bytes_per_entry"] =
+      static_cast<double>(bytes) / state.iterations() / kEntries - kValueSize;
+}
+
+void Benchmark_LegacyLayoutOverhead(benchmark::State& state) {
+  BenchmarkOverhead<LegacyLayout>(state);
+}
+
+void Benchmark_InMemoryCacheOverhead(benchmark::State& state) {
+  BenchmarkOverhead<InMemoryCache>(state, kEntries * kValueSize * 2,
+                                   state.range(0));
+}
+
+BENCHMARK(Benchmark_LegacyLayoutOverhead)->Iterations(10);
+BENCHMARK(Benchmark_InMemoryCacheOverhead)->Arg(1)->Arg(32)->Iterations(10);
+
+void Benchmark_Hit(benchmark::State& state) {
+  // Created once for all thread counts.
+  static const auto kCaches = [] {
+    std::map<int, std::unique_ptr<InMemoryCache>> caches;
+    for (auto shards : {1, 32}) {
+      // Large enough for every shard to hold all of its entries.
+      auto&& cache = caches[shards] =
+          std::make_unique<InMemoryCache>(kEntries * kValueSize * 4, shards);
+      for (int i = 0; i != kEntries; ++i) {
+        FLARE_CHECK(cache->Put(
+            MakeKey(i), flare::CreateBufferSlow(std::string(kValueSize, i))));
+      }
+    }
+    return caches;
+  }();
+  static const auto kKeys = [] {
+    std::vector<std::string> keys;
+    for (int i = 0; i != kEntries; ++i) {
+      keys.push_back(MakeKey(i));
+    }
+    return keys;
+  }();
+  static std::atomic<int> next_thread{};
+
+  auto&& cache = *kCaches.at(state.range(0));
+  // Each thread walks through the keys in its own order.
+  std::size_t index = next_thread.fetch_add(1, std::memory_order_relaxed);
+  while (state.KeepRunning()) {
+    index = (index + 7919) % kEntries;
+    benchmark::DoNotOptimize(cache.TryGet(kKeys[index]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(Benchmark_Hit)->Arg(1)->Arg(32)->ThreadRange(1, 64)->UseRealTime();
+
+}  // namespace yadcc::cache
@@ -14,12 +14,20 @@
 
 #include "yadcc/cache/in_memory_cache.h"
 
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "gtest/gtest.h"
 
 #include "flare/base/buffer.h"
 #include "flare/base/random.h"
 #include "flare/base/string.h"
 
+using namespace std::literals;
+
 namespace yadcc::cache {
 
 TEST(InMemoryCache, All) {
@@ -91,4 +99,108 @@ TEST(InMemoryCache, All) {
   EXPECT_TRUE(flare::FlattenSlow(*overwrite_result) == overwrite_value);
 }
 
+TEST(InMemoryCache, Shards) {
+  InMemoryCache in_memory_cache(1000000, 16);
+
+  for (int i = 0; i != 1000; ++i) {
+    EXPECT_TRUE(
+        in_memory_cache.Put(flare::Format("my-key-{}", i),
+                            flare::CreateBufferSlow(std::string(100, i))));
+  }
+  for (int i = 0; i != 1000; ++i) {
+    auto result = in_memory_cache.TryGet(flare::Format("my-key-{}", i));
+    ASSERT_TRUE(result);
+    EXPECT_EQ(std::string(100, i), flare::FlattenSlow(*result));
+  }
+  EXPECT_EQ(1000, in_memory_cache.GetKeys().size());
+
+  std::vector<std::string> removing;
+  for (int i = 0; i != 500; ++i) {
+    removing.push_back(flare::Format("my-key-{}", i));
+  }
+  in_memory_cache.Remove(removing);
+  EXPECT_FALSE(in_memory_cache.TryGet("my-key-0"));
+  EXPECT_TRUE(in_memory_cache.TryGet("my-key-500"));
+
+  auto internals = in_memory_cache.DumpInternals();
+  EXPECT_EQ(500, internals["actual_entries"].asUInt64());
+  EXPECT_EQ(500 * 100, internals["actual_size_in_bytes"].asUInt64());
+  EXPECT_EQ(1001, internals["hits"].asUInt64());
+  EXPECT_EQ(1, internals["misses"].asUInt64());
+
+  // Each shard holds 62500 bytes, so this one can never be cached.
+  EXPECT_FALSE(in_memory_cache.Put("large", flare::CreateBufferSlow(
+                                                std::string(100000, 'a'))));
+}
+
+TEST(InMemoryCache, Promote) {
+  InMemoryCache in_memory_cache(1000);
+
+  auto promoted =
+      in_memory_cache.Promote("my-key", flare::CreateBufferSlow("my value"));
+  EXPECT_EQ("my value", flare::FlattenSlow(promoted));
+  auto result = in_memory_cache.TryGet("my-key");
+  ASSERT_TRUE(result);
+  EXPECT_EQ("my value", flare::FlattenSlow(*result));
+
+  // Too large to be cached, returned as is.
+  promoted = in_memory_cache.Promote(
+      "large", flare::CreateBufferSlow(std::string(1001, 'a')));
+  EXPECT_EQ(1001, promoted.ByteSize());
+  EXPECT_FALSE(in_memory_cache.TryGet("large"));
+}
+
+TEST(InMemoryCache, RemovePhantom) {
+  InMemoryCache in_memory_cache(1000);
+
+  in_memory_cache.Put("key1", flare::CreateBufferSlow(std::string(600, 'a')));
+  EXPECT_TRUE(in_memory_cache.TryGet("key1"));  // Moved to t2.
+  // Not enough space for both, so key2 is evicted to b1 immediately.
+  in_memory_cache.Put("key2", flare::CreateBufferSlow(std::string(600, 'b')));
+  EXPECT_EQ(1, in_memory_cache.DumpInternals()["phantom_entries"].asUInt64());
+
+  in_memory_cache.Remove({"key1", "key2", "key3"});
+  auto internals = in_memory_cache.DumpInternals();
+  EXPECT_EQ(0, internals["actual_entries"].asUInt64());
+  EXPECT_EQ(0, internals["actual_size_in_bytes"].asUInt64());
+  EXPECT_EQ(0, internals["phantom_entries"].asUInt64());
+  EXPECT_EQ(0, internals["phantom_size_in_bytes"].asUInt64());
+}
+
+// I would suggest you to run this UT with TSan.
+TEST(InMemoryCache, Torture) {
+  InMemoryCache in_memory_cache(100000, 8);
+
+  std::thread ts[16];
+  std::atomic<bool> stopped{false};
+  for (auto&& t : ts) {
+    t = std::thread([&] {
+      while (!stopped) {
+        auto key = std::to_string(flare::Random(0, 4096));
+        auto op = flare::Random(0, 10);
+        if (op < 4) {
+          in_memory_cache.Put(key, flare::CreateBufferSlow(std::string(
+                                       flare::Random(0, 200), 'a')));
+        } else if (op < 9) {
+          in_memory_cache.TryGet(key);
+        } else if (op == 9) {
+          in_memory_cache.Remove({key});
+        } else {
+          in_memory_cache.DumpInternals();
+        }
+      }
+    });
+  }
+  std::this_thread::sleep_for(2s);
+  stopped = true;
+  for (auto&& t : ts) {
+    t.join();
+  }
+
+  auto internals = in_memory_cache.DumpInternals();
+  EXPECT_LE(internals["actual_size_in_bytes"].asUInt64(), 100000);
+  EXPECT_EQ(internals["actual_entries"].asUInt64(),
+            in_memory_cache.GetKeys().size());
+}
+
 }  // namespace yadcc::cache
@@ -28,7 +28,7 @@ std::optional<flare::NoncontiguousBuffer> NullCacheEngine::TryGet(
 void NullCacheEngine::Put(const std::string& key,
                           const flare::NoncontiguousBuffer& bytes) {}
 
-void NullCacheEngine::Purge() {}
+std::vector<std::string> NullCacheEngine::Purge() { return {}; }
 
 Json::Value NullCacheEngine::DumpInternals() const { return Json::Value(); }
 
@@ -39,7 +39,7 @@ class NullCacheEngine : public CacheEngine {
   void Put(const std::string& key,
            const flare::NoncontiguousBuffer& bytes) override;
 
-  void Purge() override;
+  std::vector<std::string> Purge() override;
 
   Json::Value DumpInternals() const override;
 };
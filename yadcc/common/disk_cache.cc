@@ -25,6 +25,7 @@
 #include <chrono>
 #include <cstdio>
 #include <cstring>
+#include <iterator>
 #include <map>
 #include <mutex>
 #include <optional>
@@ -439,10 +440,14 @@ void DiskCache::Put(const std::string& key,
   cache_fills_.fetch_add(1, std::memory_order_relaxed);
 }
 
-void DiskCache::Purge() {
+std::vector<std::string> DiskCache::Purge() {
+  std::vector<std::string> purged;
   for (auto&& [path, limit] : options_.shards) {
-    PurgeCacheAt(path, limit);
+    auto keys = PurgeCacheAt(path, limit);
+    purged.insert(purged.end(), std::make_move_iterator(keys.begin()),
+                  std::make_move_iterator(keys.end()));
   }
+  return purged;
 }
 
 Json::Value DiskCache::DumpInternals() const {
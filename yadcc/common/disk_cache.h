@@ -77,7 +77,9 @@ class DiskCache {
   // to make space.
   //
   // It's slow, and may block `TryGet` / `Put`, so don't call it too often.
-  void Purge();
+  //
+  // Keys of the entries discarded are returned.
+  std::vector<std::string> Purge();
 
   // Dumps internals about the cache.
   Json::Value DumpInternals() const;
@@ -85,7 +85,7 @@ TEST(DiskCache, All) {
   }
 
   // Discard some entries to keep size under limit.
-  cache.Purge();
+  auto purged = cache.Purge();
 
   // They shouldn't be discarded.
   for (int i = 0; i != 100; ++i) {
@@ -110,6 +110,7 @@ TEST(DiskCache, All) {
 
   EXPECT_LE(now_used_bytes, 1048576);
   EXPECT_GT(keys_discarded, 0);
+  EXPECT_EQ(keys_discarded, purged.size());
 
   static constexpr auto kHealthyEntries = 10;
   auto not_touched = 0;
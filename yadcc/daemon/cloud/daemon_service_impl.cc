@@ -41,6 +41,10 @@ using namespace std::literals;
 DEFINE_int32(cpu_load_average_seconds, 15,
              "This option controls the how long should we average CPU usage to "
              "determine load on this machine.");
+DEFINE_int32(runnable_tasks_average_seconds, 3,
+             "This option controls how long should we average number of "
+             "runnable tasks reported to the scheduler. This should be much "
+             "shorter than `cpu_load_average_seconds`.");
 
 // Declaring this flag here doesn't seem right, TBH.
 DECLARE_string(servant_priority);
@@ -76,6 +80,7 @@ void DaemonServiceImpl::QueueCxxCompilationTask(
     controller->SetFailed(status.code(), status.message());
     return;
   }
+  task->SetRequestor(flare::EndpointGetIp(controller->GetRemotePeer()));
 
   // Submit the command to our execution engine.
   auto task_id =
@@ -194,6 +199,7 @@ void DaemonServiceImpl::Heartbeat(std::chrono::nanoseconds expires_in) {
           {"user", scheduler::SERVANT_PRIORITY_USER},
       };
 
+  std::scoped_lock _(heartbeat_lock_);
   scheduler::SchedulerService_SyncStub stub(FLAGS_scheduler_uri);
   scheduler::HeartbeatRequest req;
   flare::RpcClientController ctlr;
@@ -202,6 +208,7 @@ void DaemonServiceImpl::Heartbeat(std::chrono::nanoseconds expires_in) {
   req.set_next_heartbeat_in_ms(expires_in / 1ms);
   req.set_version(version_for_upgrade);
   req.set_location(network_location_);
+  req.set_zone(FLAGS_zone);
   req.set_servant_priority(kServantPriorities.at(FLAGS_servant_priority));
   req.set_memory_available_in_bytes(GetMemoryAvailable());
   req.set_total_memory_in_bytes(GetTotalMemory());
@@ -213,25 +220,59 @@ void DaemonServiceImpl::Heartbeat(std::chrono::nanoseconds expires_in) {
         flare::underlying_value(capacity.error()));
   }
   req.set_num_processors(GetNumberOfProcessors());
+  req.set_num_physical_cores(GetNumberOfPhysicalCores());
+  req.set_smt_ways(GetSmtWays());
   // If our try is failed, we get 1min loadavg instead.
   req.set_current_load(TryGetProcessorLoad(FLAGS_cpu_load_average_seconds * 1s)
                            .value_or(GetProcessorLoadInLastMinute()));
-  for (auto&& e : CompilerRegistry::Instance()->EnumerateEnvironments()) {
-    *req.add_env_descs() = e;
-  }
-  for (auto&& e : ExecutionEngine::Instance()->EnumerateTasks()) {
-    auto running_task_info = req.add_running_tasks();
-    running_task_info->set_servant_location(network_location_);
-    running_task_info->set_task_grant_id(e.task_grant_id);
-    running_task_info->set_servant_task_id(e.servant_task_id);
-    running_task_info->set_task_digest(
-        static_cast<RemoteTask*>(e.task.Get())->GetDigest());
+  // Not reported (left as 0) if there aren't enough samples yet.
+  req.set_runnable_tasks(
+      TryGetRunnableTasks(FLAGS_runnable_tasks_average_seconds * 1s)
+          .value_or(0));
+  ServantState state;
+  UnsafeFillServantState(&req, &state);
+  for (auto&& e : ExecutionEngine::Instance()->TakeCompletedTasks()) {
+    auto task = static_cast<RemoteTask*>(e.task.Get());
+    auto key = task->GetCostKey();
+    if (!key) {
+      continue;
+    }
+    auto completed_task_info = req.add_completed_tasks();
+    completed_task_info->set_task_cost_key(*key);
+    completed_task_info->set_compile_time_ms(e.elapsed / 1ms);
+    completed_task_info->set_peak_memory_in_bytes(e.peak_memory_in_bytes);
+    completed_task_info->set_requestor_ip(task->GetRequestor());
+    completed_task_info->set_compiler_digest(task->GetCompilerDigest());
+    completed_task_info->set_started_at_ms(
+        e.started_at.time_since_epoch() / 1ms);
   }
   auto result = stub.Heartbeat(req, &ctlr);
+  if (result && result->full_snapshot_required()) {
+    // The scheduler does not know the state our delta is against (it has
+    // likely been restarted). Resend the heartbeat with our full state.
+    FLARE_LOG_INFO("Scheduler requested our full state, resending heartbeat.");
+    acknowledged_epoch_ = 0;
+    acknowledged_state_ = {};
+    req.clear_completed_tasks();  // They've been accepted anyway.
+    UnsafeFillServantState(&req, &state);
+    flare::RpcClientController retry_ctlr;
+    result = stub.Heartbeat(req, &retry_ctlr);
+  }
   if (!result) {
+    // The scheduler may or may not have seen this heartbeat. Either way, our
+    // next delta is against the state acknowledged before, and the scheduler
+    // will ask for our full state if it has moved on.
     FLARE_LOG_WARNING("Failed to send heartbeat to scheduler.");
     return;
   }
+  if (result->acknowledged_epoch() == req.epoch()) {
+    acknowledged_epoch_ = req.epoch();
+    acknowledged_state_ = std::move(state);
+  } else {
+    // Older scheduler, it only understands full state.
+    acknowledged_epoch_ = 0;
+    acknowledged_state_ = {};
+  }
 
   // Were any tasks not known to the scheduler, kill it.
   ExecutionEngine::Instance()->KillExpiredTasks(
@@ -241,6 +282,48 @@ void DaemonServiceImpl::Heartbeat(std::chrono::nanoseconds expires_in) {
       {result->acceptable_tokens().begin(), result->acceptable_tokens().end()});
 }
 
+void DaemonServiceImpl::UnsafeFillServantState(
+    scheduler::HeartbeatRequest* req, ServantState* state) {
+  req->set_epoch(next_heartbeat_epoch_++);
+  req->set_base_epoch(acknowledged_epoch_);
+  req->clear_env_descs();
+  req->clear_removed_env_digests();
+  req->clear_running_tasks();
+  req->clear_removed_running_tasks();
+  *state = {};
+
+  // If nothing has been acknowledged, `acknowledged_state_` is empty, and
+  // everything is sent.
+  for (auto&& e : CompilerRegistry::Instance()->EnumerateEnvironments()) {
+    state->environments.insert(e.compiler_digest());
+    if (acknowledged_state_.environments.count(e.compiler_digest()) == 0) {
+      *req->add_env_descs() = e;
+    }
+  }
+  for (auto&& e : acknowledged_state_.environments) {
+    if (state->environments.count(e) == 0) {
+      req->add_removed_env_digests(e);
+    }
+  }
+  for (auto&& e : ExecutionEngine::Instance()->EnumerateTasks()) {
+    state->running_tasks.insert(e.servant_task_id);
+    if (acknowledged_state_.running_tasks.count(e.servant_task_id)) {
+      continue;
+    }
+    auto running_task_info = req->add_running_tasks();
+    running_task_info->set_servant_location(network_location_);
+    running_task_info->set_task_grant_id(e.task_grant_id);
+    running_task_info->set_servant_task_id(e.servant_task_id);
+    running_task_info->set_task_digest(
+        static_cast<RemoteTask*>(e.task.Get())->GetDigest());
+  }
+  for (auto&& e : acknowledged_state_.running_tasks) {
+    if (state->running_tasks.count(e) == 0) {
+      req->add_removed_running_tasks(e);
+    }
+  }
+}
+
 bool DaemonServiceImpl::IsTokenAcceptable(const std::string& token) {
   std::shared_lock _(token_lock_);
   return token_verifier_->Verify(token);
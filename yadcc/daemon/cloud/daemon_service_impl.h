@@ -16,12 +16,16 @@
 #define YADCC_DAEMON_CLOUD_DAEMON_SERVICE_IMPL_H_
 
 #include <chrono>
+#include <cstdint>
 #include <memory>
 #include <shared_mutex>
 #include <string>
 #include <unordered_set>
 
+#include "flare/fiber/mutex.h"
+
 #include "yadcc/api/daemon.flare.pb.h"
+#include "yadcc/api/scheduler.pb.h"
 #include "yadcc/common/token_verifier.h"
 #include "yadcc/daemon/cloud/execution_engine.h"
 
@@ -59,6 +63,20 @@ class DaemonServiceImpl : public SyncDaemonService {
   // `0` is recognized by the scheduler as a signal that we're leaving.
   void Heartbeat(std::chrono::nanoseconds expires_in);
 
+  // Environments and running tasks we've reported to the scheduler.
+  struct ServantState {
+    std::unordered_set<std::string> environments;  // Compiler digests.
+    std::unordered_set<std::uint64_t> running_tasks;  // Servant task IDs.
+  };
+
+  // Fill environments and running tasks into `req`. If the scheduler has
+  // acknowledged one of our heartbeats, only what's changed since then is
+  // filled. Our current state is returned in `state`.
+  //
+  // `heartbeat_lock_` must be held by the caller.
+  void UnsafeFillServantState(scheduler::HeartbeatRequest* req,
+                              ServantState* state);
+
   // Tests if a token should be accepted.
   bool IsTokenAcceptable(const std::string& token);
 
@@ -71,6 +89,15 @@ class DaemonServiceImpl : public SyncDaemonService {
   // This is the reason why the heart beats.
   std::uint64_t pacemaker_;
 
+  // Serializes heartbeats. `Stop()` may race with our pacemaker.
+  flare::fiber::Mutex heartbeat_lock_;
+  std::uint64_t next_heartbeat_epoch_ = 1;
+  // Epoch of the last heartbeat acknowledged by the scheduler, and the state it
+  // carried. Later heartbeats are sent as a delta against it. `0` if there's
+  // none, in which case full state is sent.
+  std::uint64_t acknowledged_epoch_ = 0;
+  ServantState acknowledged_state_;
+
   std::shared_mutex token_lock_;
   // All tokens are rejected before this verifier is initialized.
   std::unique_ptr<TokenVerifier> token_verifier_ =
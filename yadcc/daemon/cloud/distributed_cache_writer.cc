@@ -15,16 +15,34 @@
 #include "yadcc/daemon/cloud/distributed_cache_writer.h"
 
 #include <chrono>
+#include <utility>
+
+#include "gflags/gflags.h"
 
 #include "flare/base/never_destroyed.h"
+#include "flare/fiber/async.h"
+#include "flare/fiber/this_fiber.h"
+#include "flare/rpc/protocol/protobuf/rpc_meta.pb.h"
 #include "flare/rpc/rpc_client_controller.h"
 
 #include "yadcc/daemon/common_flags.h"
 
 using namespace std::literals;
 
+DEFINE_int32(cache_write_batch_window_ms, 10,
+             "Cache writes issued within this window (in milliseconds) are "
+             "sent to the cache server in a single RPC.");
+
 namespace yadcc::daemon::cloud {
 
+namespace {
+
+// A batch is issued immediately once it reaches either of these limits.
+constexpr std::size_t kMaxWritesPerBatch = 16;
+constexpr std::size_t kMaxBytesPerBatch = 16 * 1024 * 1024;
+
+}  // namespace
+
 DistributedCacheWriter* DistributedCacheWriter::Instance() {
   static flare::NeverDestroyed<DistributedCacheWriter> writer;
   return writer.Get();
@@ -58,27 +76,109 @@ flare::Future<bool> DistributedCacheWriter::AsyncWrite(
     return true;
   }
 
+  PendingWrite write{key, WriteCacheEntry(cache_entry)};
+  auto future = write.promise.GetFuture();
+  std::vector<PendingWrite> ready;
+  bool first;
+  {
+    std::scoped_lock _(batch_lock_);
+    first = pending_writes_.empty();
+    pending_bytes_ += write.bytes.ByteSize();
+    pending_writes_.push_back(std::move(write));
+    if (pending_writes_.size() >= kMaxWritesPerBatch ||
+        pending_bytes_ >= kMaxBytesPerBatch) {
+      ready.swap(pending_writes_);
+      pending_bytes_ = 0;
+    }
+  }
+
+  if (!ready.empty()) {
+    IssueWrites(std::move(ready));
+  } else if (first) {
+    // If the batch is issued early (since it's full), this timer may fire in
+    // the middle of the next batch's window. That's harmless, the next batch
+    // is just issued a bit early.
+    flare::fiber::Async([this] {
+      flare::this_fiber::SleepFor(FLAGS_cache_write_batch_window_ms * 1ms);
+      std::vector<PendingWrite> writes;
+      {
+        std::scoped_lock _(batch_lock_);
+        writes.swap(pending_writes_);
+        pending_bytes_ = 0;
+      }
+      if (!writes.empty()) {
+        IssueWrites(std::move(writes));
+      }
+    });
+  }
+  return future;
+}
+
+void DistributedCacheWriter::IssueWrites(std::vector<PendingWrite> writes) {
+  if (writes.size() == 1) {
+    return IssueWrite(std::move(writes[0]));
+  }
+
+  struct Context {
+    cache::PutEntriesRequest req;
+    flare::RpcClientController ctlr;
+    std::vector<PendingWrite> writes;
+  };
+
+  auto ctx = std::make_shared<Context>();
+  flare::NoncontiguousBufferBuilder builder;
+
+  ctx->req.set_token(FLAGS_token);
+  for (auto&& e : writes) {
+    auto&& location = ctx->req.add_values();
+    location->set_offset(builder.ByteSize());
+    location->set_size(e.bytes.ByteSize());
+    ctx->req.add_keys(e.key);
+    builder.Append(e.bytes);  // `e.bytes` is kept in case we need to retry.
+  }
+  ctx->writes = std::move(writes);
+  ctx->ctlr.SetTimeout(5s);
+  ctx->ctlr.SetRequestAttachment(builder.DestructiveGet());
+  cache_stub_->PutEntries(ctx->req, &ctx->ctlr).Then([this, ctx](auto result) {
+    if (!result &&
+        result.error().code() == flare::rpc::STATUS_METHOD_NOT_FOUND) {
+      // The cache server does not support batching, write them one by one.
+      for (auto&& e : ctx->writes) {
+        IssueWrite(std::move(e));
+      }
+      return;
+    }
+    FLARE_LOG_WARNING_IF(!result,
+                         "Failed to populate {} compilation cache entries: {}",
+                         ctx->writes.size(),
+                         result ? "" : result.error().ToString());
+    for (auto&& e : ctx->writes) {
+      e.promise.SetValue(!!result);
+    }
+  });
+}
+
+void DistributedCacheWriter::IssueWrite(PendingWrite write) {
   struct Context {
     cache::PutEntryRequest req;
     flare::RpcClientController ctlr;
+    flare::Promise<bool> promise;
   };
 
   auto ctx = std::make_shared<Context>();
 
   ctx->req.set_token(FLAGS_token);
-  ctx->req.set_key(key);
+  ctx->req.set_key(write.key);
+  ctx->promise = std::move(write.promise);
   ctx->ctlr.SetTimeout(5s);
-  ctx->ctlr.SetRequestAttachment(WriteCacheEntry(cache_entry));
-  return cache_stub_->PutEntry(ctx->req, &ctx->ctlr)
-      .Then([ctx, key](auto result) {
-        if (!result) {
-          FLARE_LOG_WARNING(
-              "Failed to populate compilation cache entry [{}]: {}", key,
-              result.error().ToString());
-          return false;
-        }
-        return true;
-      });
+  ctx->ctlr.SetRequestAttachment(std::move(write.bytes));
+  cache_stub_->PutEntry(ctx->req, &ctx->ctlr).Then([ctx](auto result) {
+    if (!result) {
+      FLARE_LOG_WARNING("Failed to populate compilation cache entry [{}]: {}",
+                        ctx->req.key(), result.error().ToString());
+    }
+    ctx->promise.SetValue(!!result);
+  });
 }
 
 void DistributedCacheWriter::Stop() {
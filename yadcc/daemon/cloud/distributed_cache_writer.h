@@ -16,7 +16,9 @@
 #define YADCC_DAEMON_CLOUD_DISTRIBUTED_CACHE_WRITER_H_
 
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include "flare/base/buffer.h"
 #include "flare/base/future.h"
@@ -36,6 +38,9 @@ namespace yadcc::daemon::cloud {
 // OTOH, allowing anyone to write to our distributed cache can pose a security
 // risk (Frankly though, so long as the user can act as a compile-server, it's
 // inherently insecure.).
+//
+// Writes issued within `FLAGS_cache_write_batch_window_ms` are coalesced into a
+// single `PutEntries` RPC.
 class DistributedCacheWriter {
  public:
   static DistributedCacheWriter* Instance();
@@ -50,8 +55,27 @@ class DistributedCacheWriter {
   void Stop();
   void Join();
 
+ private:
+  struct PendingWrite {
+    std::string key;
+    flare::NoncontiguousBuffer bytes;
+    flare::Promise<bool> promise;
+  };
+
+  // Issue `writes` in a single RPC.
+  void IssueWrites(std::vector<PendingWrite> writes);
+
+  // Write a single entry via `PutEntry`.
+  void IssueWrite(PendingWrite write);
+
  private:
   std::unique_ptr<cache::CacheService_AsyncStub> cache_stub_;
+
+  // Writes not issued yet. They're issued once the batching window (started by
+  // the first of them) expires, or they accumulate to our limit.
+  std::mutex batch_lock_;
+  std::vector<PendingWrite> pending_writes_;
+  std::size_t pending_bytes_ = 0;
 };
 
 }  // namespace yadcc::daemon::cloud
@@ -14,8 +14,13 @@
 
 #include "yadcc/daemon/cloud/distributed_cache_writer.h"
 
+#include <string>
+#include <vector>
+
 #include "gtest/gtest.h"
 
+#include "flare/base/buffer.h"
+#include "flare/fiber/async.h"
 #include "flare/fiber/future.h"
 #include "flare/init/override_flag.h"
 #include "flare/testing/main.h"
@@ -24,6 +29,7 @@
 #include "yadcc/api/cache.pb.h"
 
 FLARE_OVERRIDE_FLAG(cache_server_uri, "mock://what-ever-it-wants-to-be");
+FLARE_OVERRIDE_FLAG(cache_write_batch_window_ms, 100);
 
 namespace yadcc::daemon::cloud {
 
@@ -39,6 +45,21 @@ void HandlePutEntryFailed(const cache::PutEntryRequest& request,
   controller->SetFailed("failed");
 }
 
+void HandlePutEntriesSuccess(const cache::PutEntriesRequest& request,
+                             cache::PutEntriesResponse* response,
+                             flare::RpcServerController* controller) {
+  auto attachment = flare::FlattenSlow(controller->GetRequestAttachment());
+  ASSERT_EQ(3, request.keys().size());
+  ASSERT_EQ(3, request.values().size());
+  for (int i = 0; i != request.keys().size(); ++i) {
+    auto&& location = request.values(i);
+    auto entry = TryParseCacheEntry(flare::CreateBufferSlow(
+        attachment.substr(location.offset(), location.size())));
+    ASSERT_TRUE(entry);
+    EXPECT_EQ(request.keys(i), entry->standard_output);
+  }
+}
+
 TEST(DistributedCacheWriter, Success) {
   FLARE_EXPECT_RPC(cache::CacheService::PutEntry, ::testing::_)
       .WillRepeatedly(flare::testing::HandleRpc(HandlePutEntrySuccess));
@@ -62,6 +83,26 @@ TEST(DistributedCacheWriter, Failure) {
           CacheEntry{0, {}, {}, {}, flare::CreateBufferSlow("object file")})));
 }
 
+TEST(DistributedCacheWriter, Batch) {
+  FLARE_EXPECT_RPC(cache::CacheService::PutEntry, ::testing::_).Times(0);
+  FLARE_EXPECT_RPC(cache::CacheService::PutEntries, ::testing::_)
+      .WillOnce(flare::testing::HandleRpc(HandlePutEntriesSuccess));
+
+  // Issued concurrently, these writes are sent in a single RPC.
+  std::vector<flare::Future<bool>> futures;
+  for (int i = 0; i != 3; ++i) {
+    futures.push_back(flare::fiber::Async([i] {
+      auto key = "my cache key" + std::to_string(i);
+      return flare::fiber::BlockingGet(
+          DistributedCacheWriter::Instance()->AsyncWrite(
+              key, CacheEntry{0, key, {}, {}, flare::CreateBufferSlow("o")}));
+    }));
+  }
+  for (auto&& e : flare::fiber::BlockingGet(flare::WhenAll(&futures))) {
+    EXPECT_TRUE(e);
+  }
+}
+
 }  // namespace yadcc::daemon::cloud
 
 FLARE_TEST_MAIN
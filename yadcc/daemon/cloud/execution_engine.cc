@@ -14,6 +14,7 @@
 
 #include "yadcc/daemon/cloud/execution_engine.h"
 
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -68,6 +69,9 @@ namespace yadcc::daemon::cloud {
 
 constexpr auto kDefaultNiceLevel = 5;
 
+// Maximum number of completed tasks kept for `TakeCompletedTasks`.
+constexpr std::size_t kMaxPendingCompletedTasks = 1024;
+
 namespace {
 
 // See if CGroups are applied to limit processor / memory resources. Returns
@@ -186,6 +190,19 @@ std::optional<std::uint64_t> ExecutionEngine::TryQueueTask(
     std::uint64_t grant_id, flare::RefPtr<ExecutionTask> user_task) {
   std::scoped_lock _(tasks_lock_);
 
+  // A grant admits a single task at a time. Grants leased to a delegate are
+  // reused by it for successive tasks, but never for concurrent ones.
+  //
+  // We don't check if the lease is still in effect here. The scheduler keeps
+  // the grant alive until `leased_until` and reports it as expired (which we
+  // kill in `KillExpiredTasks`) afterwards, so a grant used beyond its lease
+  // can't run for long anyway.
+  if (running_grants_.count(grant_id)) {
+    FLARE_LOG_WARNING_EVERY_SECOND(
+        "Rejecting task. Task grant [{}] is already in use.", grant_id);
+    return {};
+  }
+
   auto task_id = TryStartingNewTaskUnsafe();
   if (!task_id) {
     return {};
@@ -209,8 +226,7 @@ std::optional<std::uint64_t> ExecutionEngine::TryQueueTask(
   auto pid = StartProgram(cmd, kDefaultNiceLevel, temp_in.fd(),
                           task->stdout_file->fd(), task->stderr_file->fd(),
                           true /* Isolated process group. */);
-  task->grant_id = grant_id;  // Well we don't check for duplicate here, it
-                              // won't hurt us.
+  task->grant_id = grant_id;
   task->client_ref_count = 1;
   // TODO(luobogao): Enable it (preferably unconditionally).
   task->limit_cpu = false;
@@ -218,6 +234,7 @@ std::optional<std::uint64_t> ExecutionEngine::TryQueueTask(
   task->process_id = pid;
   task->task = std::move(user_task);
   task->exposition_only.command = cmd;
+  running_grants_[grant_id] = task;
 
   // Wake up pid waiter.
   waitpid_semaphore_.release();
@@ -274,6 +291,7 @@ void ExecutionEngine::FreeTask(std::uint64_t task_id) {
     // No other client wait on the task, clean it.
     task_free = task->second;
     (void)tasks_.erase(task);
+    RemoveRunningGrantUnsafe(task_free.Get());
   }
 
   // If it's alive, kill it.
@@ -291,15 +309,23 @@ std::vector<ExecutionEngine::Task> ExecutionEngine::EnumerateTasks() const {
   return result;
 }
 
+std::vector<ExecutionEngine::CompletedTask>
+ExecutionEngine::TakeCompletedTasks() {
+  std::scoped_lock _(tasks_lock_);
+  std::vector<CompletedTask> result(completed_tasks_.begin(),
+                                    completed_tasks_.end());
+  completed_tasks_.clear();
+  return result;
+}
+
 void ExecutionEngine::KillExpiredTasks(
     const std::unordered_set<std::uint64_t>& expired_grant_ids) {
   auto killed = 0;
   {
     std::scoped_lock _(tasks_lock_);
-    for (auto&& [k, v] : tasks_) {
-      if (v->is_running.load(std::memory_order_relaxed) &&
-          expired_grant_ids.count(v->grant_id) != 0) {
-        KillTask(v.Get());
+    for (auto&& e : expired_grant_ids) {
+      if (auto iter = running_grants_.find(e); iter != running_grants_.end()) {
+        KillTask(iter->second.Get());
         ++killed;
       }
     }
@@ -389,6 +415,13 @@ std::optional<std::uint64_t> ExecutionEngine::TryStartingNewTaskUnsafe() {
   return task_id;
 }
 
+void ExecutionEngine::RemoveRunningGrantUnsafe(TaskDesc* task) {
+  if (auto iter = running_grants_.find(task->grant_id);
+      iter != running_grants_.end() && iter->second.Get() == task) {
+    running_grants_.erase(iter);
+  }
+}
+
 void ExecutionEngine::OnCleanupTimer() {
   auto now = flare::ReadCoarseSteadyClock();
   std::vector<flare::RefPtr<TaskDesc>> freeing;
@@ -413,7 +446,8 @@ void ExecutionEngine::OnCleanupTimer() {
 }
 
 // Called in fiber environment.
-void ExecutionEngine::OnProcessExitCallback(pid_t pid, int exit_code) {
+void ExecutionEngine::OnProcessExitCallback(pid_t pid, int exit_code,
+                                            std::size_t peak_memory_in_bytes) {
   // FIXME: Holding this lock for too long does not seems a good idea
   std::unique_lock lk(tasks_lock_);
 
@@ -444,6 +478,19 @@ void ExecutionEngine::OnProcessExitCallback(pid_t pid, int exit_code) {
   // Mark the task as finished.
   task->completed_at = flare::ReadCoarseSteadyClock();
   task->is_running.store(false, std::memory_order_relaxed);
+  RemoveRunningGrantUnsafe(task.Get());
+  if (exit_code == 0) {
+    // Cost of failed ones are not representative.
+    if (completed_tasks_.size() >= kMaxPendingCompletedTasks) {
+      completed_tasks_.pop_front();
+    }
+    auto elapsed = flare::ReadSteadyClock() - task->started_at;
+    completed_tasks_.push_back(
+        CompletedTask{.task = task->task,
+                      .started_at = flare::ReadSystemClock() - elapsed,
+                      .elapsed = elapsed,
+                      .peak_memory_in_bytes = peak_memory_in_bytes});
+  }
 
   auto out = task->stdout_file->ReadAll(), err = task->stderr_file->ReadAll();
   // Hopefully unlock prior calling user's callback won't hurt.
@@ -468,7 +515,8 @@ void ExecutionEngine::ProcessWaiterProc() {
     }
 
     int status;
-    auto pid = wait(&status);
+    struct rusage usage;
+    auto pid = wait4(-1, &status, 0, &usage);
 
     // This is a special case. If we're waken up due to quit signal, there's a
     // time window between we kill last subprocess and `running_tasks_` become
@@ -483,8 +531,11 @@ void ExecutionEngine::ProcessWaiterProc() {
     FLARE_LOG_WARNING_IF_EVERY_SECOND(
         exit_code == -1, "Process [{}] exited abnormally: {}.", pid, status);
 
-    flare::StartFiberFromPthread(
-        [this, pid, exit_code] { OnProcessExitCallback(pid, exit_code); });
+    // `ru_maxrss` is in kilobytes.
+    std::size_t peak_memory = usage.ru_maxrss * 1024;
+    flare::StartFiberFromPthread([this, pid, exit_code, peak_memory] {
+      OnProcessExitCallback(pid, exit_code, peak_memory);
+    });
   }
 }
 
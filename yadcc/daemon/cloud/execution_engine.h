@@ -21,6 +21,7 @@
 #include <chrono>
 #include <condition_variable>
 #include <cstdint>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <optional>
@@ -98,6 +99,20 @@ class ExecutionEngine {
     flare::RefPtr<ExecutionTask> task;
   };
 
+  // Describes a task that has completed successfully.
+  struct CompletedTask {
+    flare::RefPtr<ExecutionTask> task;
+
+    // When the command was started, in system clock.
+    std::chrono::system_clock::time_point started_at;
+
+    // Wall-clock time the command ran for.
+    std::chrono::nanoseconds elapsed;
+
+    // Peak resident set size of the command (including its children).
+    std::size_t peak_memory_in_bytes;
+  };
+
   static ExecutionEngine* Instance();
 
   ExecutionEngine();
@@ -107,8 +122,8 @@ class ExecutionEngine {
   // In case the daemon is not ready for accepting tasks, a reason is returned.
   flare::Expected<std::size_t, NotAcceptingTaskReason> GetMaximumTasks() const;
 
-  // Queue a task for execution. If there's already too many tasks running, a
-  // failure is returned.
+  // Queue a task for execution. If there's already too many tasks running, or
+  // `grant_id` is being used by another running task, a failure is returned.
   std::optional<std::uint64_t> TryQueueTask(
       std::uint64_t grant_id, flare::RefPtr<ExecutionTask> user_task);
 
@@ -133,6 +148,10 @@ class ExecutionEngine {
   // Enumerate all tasks.
   std::vector<Task> EnumerateTasks() const;
 
+  // Take tasks that have completed successfully since last call. If this
+  // method is not called often enough, older ones are dropped.
+  std::vector<CompletedTask> TakeCompletedTasks();
+
   // Forcibly kill all tasks whose grant ID is not in the given list.
   //
   // For tasks just started within time of `tolerance`, they're exempted. This
@@ -209,8 +228,14 @@ class ExecutionEngine {
   // either freed by a later call to `FreeTask`, or our cleanup timer.
   void KillTask(TaskDesc* task);
 
+  // Remove `task` from `running_grants_`, if it's there. `tasks_lock_` must be
+  // held by the caller.
+  void RemoveRunningGrantUnsafe(TaskDesc* task);
+
   void OnCleanupTimer();
-  void OnProcessExitCallback(pid_t pid, int exit_code);  // In Fiber env.
+  // Called in Fiber env.
+  void OnProcessExitCallback(pid_t pid, int exit_code,
+                             std::size_t peak_memory_in_bytes);
   void ProcessWaiterProc();
 
   Json::Value DumpTasks();
@@ -234,6 +259,12 @@ class ExecutionEngine {
   // Task referenced by this map is either running or waiting to be read by
   // remote daemon.
   std::unordered_map<std::uint64_t, flare::RefPtr<TaskDesc>> tasks_;
+  // Tasks in `tasks_` that are still running, keyed by their grant ID.
+  // Protected by `tasks_lock_`.
+  std::unordered_map<std::uint64_t, flare::RefPtr<TaskDesc>> running_grants_;
+  // Tasks completed but not taken by `TakeCompletedTasks` yet. Protected by
+  // `tasks_lock_`.
+  std::deque<CompletedTask> completed_tasks_;
 
   std::thread waitpid_worker_;
   // Released each timer a new subprocess is started.
@@ -108,6 +108,12 @@ TEST(ExecutionEngine, Task) {
   EXPECT_EQ("hello", result->output);
   EXPECT_EQ("", result->error);
 
+  auto completed = ExecutionEngine::Instance()->TakeCompletedTasks();
+  ASSERT_EQ(1, completed.size());
+  EXPECT_EQ(result, completed[0].task.Get());
+  EXPECT_GT(completed[0].peak_memory_in_bytes, 0);
+  EXPECT_TRUE(ExecutionEngine::Instance()->TakeCompletedTasks().empty());
+
   // Exit code.
   auto false_task = ExecutionEngine::Instance()->TryQueueTask(
       2, MakeTestingTask("/bin/false", ""));
@@ -116,6 +122,8 @@ TEST(ExecutionEngine, Task) {
   EXPECT_TRUE(wait_result);
   result = static_cast<TestingTask*>(wait_result->Get());
   EXPECT_EQ(1, result->exit_code);
+  // Failed ones are not reported.
+  EXPECT_TRUE(ExecutionEngine::Instance()->TakeCompletedTasks().empty());
 
   // Long running task.
   auto sleeping_task = ExecutionEngine::Instance()->TryQueueTask(
@@ -177,6 +185,21 @@ TEST(ExecutionEngine, Stability) {
   }
   EXPECT_EQ(1000, TestingTask::times_called);
 
+  // A grant can't be used by two tasks at the same time.
+  auto sleeping_task = ExecutionEngine::Instance()->TryQueueTask(
+      2, MakeTestingTask("/bin/sleep 1000", ""));
+  ASSERT_TRUE(sleeping_task);
+  EXPECT_FALSE(ExecutionEngine::Instance()->TryQueueTask(
+      2, MakeTestingTask("/bin/cat", "")));
+  auto cat_task = ExecutionEngine::Instance()->TryQueueTask(
+      3, MakeTestingTask("/bin/cat", ""));
+  ASSERT_TRUE(cat_task);
+  EXPECT_TRUE(ExecutionEngine::Instance()->WaitForTask(*cat_task, 10s));
+  ExecutionEngine::Instance()->FreeTask(*cat_task);
+  ExecutionEngine::Instance()->KillExpiredTasks({2});
+  std::this_thread::sleep_for(1s);  // Wait for `/bin/sleep` termination.
+  ExecutionEngine::Instance()->FreeTask(*sleeping_task);
+
   ExecutionEngine::Instance()->Stop();
   ExecutionEngine::Instance()->Join();
 }
@@ -30,6 +30,12 @@ flare::Compressor* GetZstdCompressor() {
 
 }  // namespace
 
+void RemoteTask::SetRequestor(std::string requestor) {
+  requestor_ = std::move(requestor);
+}
+
+const std::string& RemoteTask::GetRequestor() const { return requestor_; }
+
 int RemoteTask::GetExitCode() const { return exit_code_; }
 
 const std::string& RemoteTask::GetStandardOutput() const { return stdout_; }
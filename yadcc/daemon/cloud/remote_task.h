@@ -62,6 +62,27 @@ class RemoteTask : public ExecutionTask {
   // provide extra optimization possibilities in certain case.)
   virtual std::optional<std::string> GetCacheKey() const = 0;
 
+  // Get key for the scheduler to learn cost of this task (@sa: `CompletedTask`
+  // in `api/scheduler.proto`).
+  //
+  // If cost of this task is not worth learning, this method returns
+  // `std::nullopt`.
+  virtual std::optional<std::string> GetCostKey() const = 0;
+
+  // Get compiler digest of the environment this task runs in. It's reported
+  // to the scheduler along with cost of this task, for tracing purpose.
+  virtual std::string GetCompilerDigest() const = 0;
+
+  ///////////////////////////////////////////////////
+  // Methods below are provided by this class, and //
+  // may be called at any time.                    //
+  ///////////////////////////////////////////////////
+
+  // Requestor (IP) who submitted this task. It's set by whoever accepted the
+  // task, and is reported to the scheduler for tracing purpose as well.
+  void SetRequestor(std::string requestor);
+  const std::string& GetRequestor() const;
+
   //////////////////////////////////////////////////////////
   // Methods below are provided by this class.            //
   // They may not be called until the task has completed. //
@@ -109,6 +130,8 @@ class RemoteTask : public ExecutionTask {
                     flare::NoncontiguousBuffer standard_error) override;
 
  private:
+  std::string requestor_;
+
   int exit_code_;
   std::string stdout_, stderr_;
 
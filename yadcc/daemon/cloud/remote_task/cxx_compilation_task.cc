@@ -220,6 +220,14 @@ std::optional<std::string> CxxCompilationTask::GetCacheKey() const {
   return GetCxxCacheEntryKey(env_desc_, invocation_arguments_, source_digest_);
 }
 
+std::optional<std::string> CxxCompilationTask::GetCostKey() const {
+  return GetCxxTaskCostKey(env_desc_, source_path_);
+}
+
+std::string CxxCompilationTask::GetCompilerDigest() const {
+  return env_desc_.compiler_digest();
+}
+
 flare::Expected<CxxCompilationTask::OobOutput, flare::Status>
 CxxCompilationTask::GetOobOutput(int exit_code,
                                  const std::string& standard_output,
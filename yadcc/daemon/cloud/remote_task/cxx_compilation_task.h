@@ -43,6 +43,8 @@ class CxxCompilationTask : public RemoteTask {
 
   std::string GetDigest() const override;
   std::optional<std::string> GetCacheKey() const override;
+  std::optional<std::string> GetCostKey() const override;
+  std::string GetCompilerDigest() const override;
 
  protected:
   flare::Expected<OobOutput, flare::Status> GetOobOutput(
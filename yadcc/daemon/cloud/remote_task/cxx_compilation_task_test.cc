@@ -63,6 +63,8 @@ TEST(CxxCompilationTask, All) {
   EXPECT_EQ(
       GetCxxTaskDigest(req.env_desc(), req.invocation_arguments(), src_digest),
       task.GetDigest());
+  EXPECT_EQ(GetCxxTaskCostKey(req.env_desc(), req.source_path()),
+            *task.GetCostKey());
 
   WriteAll(file_prefix + ".o", flare::CreateBufferSlow("output"));
   WriteAll(file_prefix + ".gcno",
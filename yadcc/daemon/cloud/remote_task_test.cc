@@ -34,6 +34,10 @@ class FancyRemoteTask : public RemoteTask {
   Json::Value DumpInternals() const override { return {}; }
   std::string GetDigest() const override { return ""; }
   std::optional<std::string> GetCacheKey() const override { return ""; }
+  std::optional<std::string> GetCostKey() const override {
+    return std::nullopt;
+  }
+  std::string GetCompilerDigest() const override { return ""; }
 
  protected:
   flare::Expected<OobOutput, flare::Status> GetOobOutput(
@@ -54,6 +58,10 @@ class ErrorRemoteTask : public RemoteTask {
   Json::Value DumpInternals() const override { return {}; }
   std::string GetDigest() const override { return ""; }
   std::optional<std::string> GetCacheKey() const override { return ""; }
+  std::optional<std::string> GetCostKey() const override {
+    return std::nullopt;
+  }
+  std::string GetCompilerDigest() const override { return ""; }
 
  protected:
   flare::Expected<OobOutput, flare::Status> GetOobOutput(
@@ -36,6 +36,12 @@ DEFINE_string(cache_server_uri, "",
 DEFINE_string(token, "",
               "This token is used for accessing scheduler and cache server.");
 
+DEFINE_string(zone, "",
+              "Zone (datacenter, rack, etc.) this machine is in. If set, tasks "
+              "are preferably assigned to servants in the same zone (and vice "
+              "versa), so as to avoid transferring large requests across "
+              "datacenter boundary.");
+
 namespace yadcc::daemon {
 
 // Version 1: First version support auto-upgrade.
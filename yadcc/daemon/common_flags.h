@@ -28,6 +28,9 @@ DECLARE_string(cache_server_uri);
 // Token to access scheduler / cache server.
 DECLARE_string(token);
 
+// Zone (datacenter, rack, etc.) we're in.
+DECLARE_string(zone);
+
 namespace yadcc::daemon {
 
 // This version is bumped only if we think an upgrade should be performed by our
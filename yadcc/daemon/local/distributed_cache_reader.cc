@@ -21,7 +21,9 @@
 
 #include "flare/base/compression.h"
 #include "flare/base/never_destroyed.h"
+#include "flare/fiber/future.h"
 #include "flare/fiber/this_fiber.h"
+#include "flare/rpc/protocol/protobuf/rpc_meta.pb.h"
 #include "flare/rpc/rpc_client_controller.h"
 
 #include "yadcc/daemon/cache_format.h"
@@ -29,8 +31,19 @@
 
 using namespace std::literals;
 
+DEFINE_int32(cache_read_batch_window_ms, 2,
+             "Cache reads issued within this window (in milliseconds) are "
+             "sent to the cache server in a single RPC.");
+
 namespace yadcc::daemon::local {
 
+namespace {
+
+// Responses can be large, so we don't batch too many reads together.
+constexpr std::size_t kMaxReadsPerBatch = 32;
+
+}  // namespace
+
 flare::Decompressor* GetZstdDecompressor() {
   thread_local auto decompressor = flare::MakeDecompressor("zstd");
   return decompressor.get();
@@ -68,29 +81,22 @@ std::optional<CacheEntry> DistributedCacheReader::TryRead(
   }
 
   {
+    auto fingerprint = XxHash()(key);
     std::scoped_lock _(bf_lock_);
     if (last_bf_update_ + 10min >
             flare::ReadCoarseSteadyClock() /* It's still fresh (kind of). */
-        && !cache_bf_.PossiblyContains(key)) {
+        && !cache_bf_.PossiblyContains(key) &&
+        recent_key_fingerprints_.count(fingerprint) == 0) {
       return std::nullopt;
     }
   }
 
-  cache::TryGetEntryRequest req;
-  req.set_token(FLAGS_token);
-  req.set_key(key);
-
-  flare::RpcClientController ctlr;
-  ctlr.SetTimeout(10s);  // The response can be large.
-  auto result = cache_stub_->TryGetEntry(req, &ctlr);
-  if (!result) {
-    // RPC failures are logged.
-    FLARE_LOG_WARNING_IF(result.error().code() != cache::STATUS_NOT_FOUND,
-                         "Failed to load cache: {}", result.error().ToString());
+  auto bytes = BatchedRead(key);
+  if (!bytes) {
     return std::nullopt;
   }
 
-  auto parsed = TryParseCacheEntry(ctlr.GetResponseAttachment());
+  auto parsed = TryParseCacheEntry(*std::move(bytes));
   if (!parsed) {
     FLARE_LOG_ERROR_EVERY_SECOND(
         "Unexpected: Compilation cache entry [{}] is found but it cannot be "
@@ -112,11 +118,114 @@ void DistributedCacheReader::Join() {
   // NOTHING.
 }
 
+std::optional<flare::NoncontiguousBuffer> DistributedCacheReader::BatchedRead(
+    const std::string& key) {
+  flare::Promise<std::optional<flare::NoncontiguousBuffer>> promise;
+  auto future = promise.GetFuture();
+  std::shared_ptr<ReadBatch> batch, ready;
+  bool first;
+  {
+    std::scoped_lock _(batch_lock_);
+    if (!pending_reads_) {
+      pending_reads_ = std::make_shared<ReadBatch>();
+    }
+    batch = pending_reads_;
+    first = batch->reads.empty();
+    batch->reads.push_back(PendingRead{key, std::move(promise)});
+    if (batch->reads.size() >= kMaxReadsPerBatch) {
+      pending_reads_ = nullptr;  // Issue it now.
+      ready = batch;
+    }
+  }
+
+  if (!ready && first) {
+    flare::this_fiber::SleepFor(FLAGS_cache_read_batch_window_ms * 1ms);
+    std::scoped_lock _(batch_lock_);
+    if (pending_reads_ == batch) {  // Otherwise it's been issued when full.
+      pending_reads_ = nullptr;
+      ready = batch;
+    }
+  }
+  if (ready) {
+    // Once detached from `pending_reads_`, no one else touches it.
+    IssueReads(std::move(ready->reads));
+  }
+  return flare::fiber::BlockingGet(std::move(future));
+}
+
+void DistributedCacheReader::IssueReads(std::vector<PendingRead> reads) {
+  if (reads.size() == 1) {
+    reads[0].promise.SetValue(ReadOne(reads[0].key));
+    return;
+  }
+
+  cache::TryGetEntriesRequest req;
+  req.set_token(FLAGS_token);
+  for (auto&& e : reads) {
+    req.add_keys(e.key);
+  }
+
+  flare::RpcClientController ctlr;
+  ctlr.SetTimeout(10s);  // The response can be large.
+  auto result = cache_stub_->TryGetEntries(req, &ctlr);
+  if (!result && result.error().code() == flare::rpc::STATUS_METHOD_NOT_FOUND) {
+    // The cache server does not support batching, read them one by one.
+    for (auto&& e : reads) {
+      e.promise.SetValue(ReadOne(e.key));
+    }
+    return;
+  }
+  if (!result || result->values().size() != static_cast<int>(reads.size())) {
+    FLARE_LOG_WARNING_EVERY_SECOND(
+        "Failed to load cache: {}",
+        result ? "Unexpected response." : result.error().ToString());
+    for (auto&& e : reads) {
+      e.promise.SetValue(std::nullopt);
+    }
+    return;
+  }
+
+  auto&& attachment = ctlr.GetResponseAttachment();
+  for (std::size_t i = 0; i != reads.size(); ++i) {
+    auto&& location = result->values(i);
+    // Cache servers of older versions don't set `found`, and report cache
+    // misses with a `size` of zero.
+    if ((!location.found() && location.size() == 0) ||
+        location.offset() > attachment.ByteSize() ||
+        location.size() > attachment.ByteSize() - location.offset()) {
+      reads[i].promise.SetValue(std::nullopt);  // Cache miss.
+      continue;
+    }
+    auto value = attachment;
+    value.Skip(location.offset());
+    reads[i].promise.SetValue(value.Cut(location.size()));
+  }
+}
+
+std::optional<flare::NoncontiguousBuffer> DistributedCacheReader::ReadOne(
+    const std::string& key) {
+  cache::TryGetEntryRequest req;
+  req.set_token(FLAGS_token);
+  req.set_key(key);
+
+  flare::RpcClientController ctlr;
+  ctlr.SetTimeout(10s);  // The response can be large.
+  auto result = cache_stub_->TryGetEntry(req, &ctlr);
+  if (!result) {
+    // RPC failures are logged.
+    FLARE_LOG_WARNING_IF(result.error().code() != cache::STATUS_NOT_FOUND,
+                         "Failed to load cache: {}", result.error().ToString());
+    return std::nullopt;
+  }
+  return ctlr.GetResponseAttachment();
+}
+
 void DistributedCacheReader::LoadCacheBloomFilter() {
   auto now = flare::ReadCoarseSteadyClock();
   cache::FetchBloomFilterRequest req;
 
   req.set_token(FLAGS_token);
+  req.set_accept_key_fingerprints(true);
   {
     std::scoped_lock _(bf_lock_);
     if (last_bf_full_update_.time_since_epoch() == 0s) {
@@ -142,13 +251,21 @@ void DistributedCacheReader::LoadCacheBloomFilter() {
   if (result->incremental()) {  // Incremental update.
     last_bf_update_ = now;
 
-    for (auto&& e : result->newly_populated_keys()) {
+    {
       std::scoped_lock _(bf_lock_);
-      cache_bf_.Add(e);
+      // Cache servers that don't recognize `accept_key_fingerprints` return
+      // keys as is.
+      for (auto&& e : result->newly_populated_keys()) {
+        cache_bf_.Add(e);
+      }
+      for (auto&& e : result->newly_populated_key_fingerprints()) {
+        recent_key_fingerprints_.insert(e);
+      }
     }
 
     FLARE_VLOG(1, "Fetched {} newly populated cache entry keys.",
-               result->newly_populated_keys().size());
+               result->newly_populated_keys().size() +
+                   result->newly_populated_key_fingerprints().size());
   } else {  // Full update.
     last_bf_full_update_ = last_bf_update_ = now;
 
@@ -169,6 +286,8 @@ void DistributedCacheReader::LoadCacheBloomFilter() {
     std::scoped_lock _(bf_lock_);
     cache_bf_ =
         flare::experimental::SaltedBloomFilter(bytes, result->num_hashes());
+    // They're covered by the full bloom filter.
+    recent_key_fingerprints_.clear();
   }
 }
 
@@ -19,8 +19,12 @@
 #include <mutex>
 #include <optional>
 #include <string>
+#include <unordered_set>
+#include <vector>
 
+#include "flare/base/buffer.h"
 #include "flare/base/experimental/bloom_filter.h"
+#include "flare/base/future.h"
 
 #include "yadcc/api/cache.flare.pb.h"
 #include "yadcc/common/xxhash.h"
@@ -29,6 +33,9 @@
 namespace yadcc::daemon::local {
 
 // This class is responsible for reading from our compilation cache.
+//
+// Reads issued concurrently (within `FLAGS_cache_read_batch_window_ms`) are
+// coalesced into a single `TryGetEntries` RPC.
 class DistributedCacheReader {
  public:
   static DistributedCacheReader* Instance();
@@ -43,16 +50,43 @@ class DistributedCacheReader {
   void Join();
 
  private:
+  struct PendingRead {
+    std::string key;
+    flare::Promise<std::optional<flare::NoncontiguousBuffer>> promise;
+  };
+
+  struct ReadBatch {
+    std::vector<PendingRead> reads;
+  };
+
   void LoadCacheBloomFilter();
 
+  // Read `key` along with other reads issued within a short while.
+  std::optional<flare::NoncontiguousBuffer> BatchedRead(const std::string& key);
+
+  // Issue `reads` in a single RPC. All of them are satisfied on return.
+  void IssueReads(std::vector<PendingRead> reads);
+
+  // Read a single entry via `TryGetEntry`.
+  std::optional<flare::NoncontiguousBuffer> ReadOne(const std::string& key);
+
  private:
   std::unique_ptr<cache::CacheService_SyncStub> cache_stub_;
 
+  // The batch that's accepting new reads. The first reader of a batch issues it
+  // after the batching window, unless it's filled up (and issued) before then.
+  std::mutex batch_lock_;
+  std::shared_ptr<ReadBatch> pending_reads_;
+
   std::uint64_t reload_bf_timer_;
   std::mutex bf_lock_;
   std::chrono::steady_clock::time_point last_bf_full_update_{};
   std::chrono::steady_clock::time_point last_bf_update_{};
   flare::experimental::SaltedBloomFilter cache_bf_;
+
+  // Fingerprints of keys populated since last full update of `cache_bf_`, as
+  // returned by incremental updates.
+  std::unordered_set<std::uint64_t> recent_key_fingerprints_;
 };
 
 }  // namespace yadcc::daemon::local
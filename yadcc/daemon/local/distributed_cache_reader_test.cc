@@ -14,9 +14,13 @@
 
 #include "yadcc/daemon/local/distributed_cache_reader.h"
 
+#include <optional>
+#include <vector>
+
 #include "gtest/gtest.h"
 #include "xxhash/xxhash.h"
 
+#include "flare/base/buffer.h"
 #include "flare/base/compression.h"
 #include "flare/base/experimental/bloom_filter.h"
 #include "flare/fiber/future.h"
@@ -31,6 +35,7 @@
 using namespace std::literals;
 
 FLARE_OVERRIDE_FLAG(cache_server_uri, "mock://what-ever-it-wants-to-be");
+FLARE_OVERRIDE_FLAG(cache_read_batch_window_ms, 100);
 
 namespace yadcc::daemon::local {
 
@@ -59,7 +64,8 @@ void HandleFetchBloomFilter(const cache::FetchBloomFilterRequest& req,
         *flare::Compress(&*flare::MakeCompressor("zstd"), bf.GetBytes()));
   } else {
     resp->set_incremental(true);
-    resp->add_newly_populated_keys("my cache key4");
+    EXPECT_TRUE(req.accept_key_fingerprints());
+    resp->add_newly_populated_key_fingerprints(XxHash()("my cache key4"));
   }
 }
 
@@ -73,6 +79,25 @@ void HandleTryGetEntry(const cache::TryGetEntryRequest& request,
                                  .files = flare::CreateBufferSlow("obj")}));
 }
 
+void HandleTryGetEntries(const cache::TryGetEntriesRequest& request,
+                         cache::TryGetEntriesResponse* response,
+                         flare::RpcServerController* controller) {
+  flare::NoncontiguousBufferBuilder builder;
+  for (auto&& key : request.keys()) {
+    auto&& location = response->add_values();
+    if (key == "my cache key2") {
+      continue;  // Not found.
+    }
+    auto value = WriteCacheEntry(CacheEntry{
+        .exit_code = 0, .standard_output = key, .standard_error = "err"});
+    location->set_found(true);
+    location->set_offset(builder.ByteSize());
+    location->set_size(value.ByteSize());
+    builder.Append(value);
+  }
+  controller->SetResponseAttachment(builder.DestructiveGet());
+}
+
 }  // namespace
 
 TEST(DistributedCacheReader, Success) {
@@ -98,6 +123,26 @@ TEST(DistributedCacheReader, Success) {
   EXPECT_TRUE(result);
 }
 
+TEST(DistributedCacheReader, Batch) {
+  FLARE_EXPECT_RPC(cache::CacheService::TryGetEntry, ::testing::_).Times(0);
+  FLARE_EXPECT_RPC(cache::CacheService::TryGetEntries, ::testing::_)
+      .WillOnce(flare::testing::HandleRpc(HandleTryGetEntries));
+
+  // Issued concurrently, these reads are sent in a single RPC.
+  std::vector<flare::Future<std::optional<CacheEntry>>> futures;
+  for (auto&& key : {"my cache key1", "my cache key2", "my cache key3"}) {
+    futures.push_back(flare::fiber::Async([key] {
+      return DistributedCacheReader::Instance()->TryRead(key);
+    }));
+  }
+  auto results = flare::fiber::BlockingGet(flare::WhenAll(&futures));
+  ASSERT_TRUE(results[0]);
+  EXPECT_EQ("my cache key1", results[0]->standard_output);
+  EXPECT_FALSE(results[1]);
+  ASSERT_TRUE(results[2]);
+  EXPECT_EQ("my cache key3", results[2]->standard_output);
+}
+
 TEST(DistributedCacheReader, BloomFilterMiss) {
   FLARE_EXPECT_RPC(cache::CacheService::TryGetEntry, ::testing::_).Times(0);
   EXPECT_FALSE(DistributedCacheReader::Instance()->TryRead("my cache key5"));
@@ -75,6 +75,11 @@ class DistributedTask {
   // identical tasks.
   virtual std::string GetDigest() const = 0;
 
+  // Get cost key of this task (@sa: `CompletedTask` in `api/scheduler.proto`).
+  //
+  // The scheduler places the task by historical cost of tasks of the same key.
+  virtual std::string GetCostKey() const = 0;
+
   // Get environment required by this task.
   //
   // The dispatcher uses it to grab a servant from scheduler.
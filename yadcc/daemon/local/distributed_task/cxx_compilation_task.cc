@@ -44,6 +44,10 @@ std::string CxxCompilationTask::GetDigest() const {
   return GetCxxTaskDigest(env_desc_, invocation_arguments_, source_digest_);
 }
 
+std::string CxxCompilationTask::GetCostKey() const {
+  return GetCxxTaskCostKey(env_desc_, source_path_);
+}
+
 flare::Expected<std::uint64_t, flare::Status> CxxCompilationTask::StartTask(
     const std::string& token, std::uint64_t grant_id,
     cloud::DaemonService_SyncStub* stub) {
@@ -38,6 +38,7 @@ class CxxCompilationTask : public UserTask<WaitForCxxTaskResponse> {
   CacheControl GetCacheSetting() const override { return cache_control_; }
   std::string GetCacheKey() const override;
   std::string GetDigest() const override;
+  std::string GetCostKey() const override;
   const EnvironmentDesc& GetEnvironmentDesc() const override {
     return env_desc_;
   }
@@ -229,8 +229,11 @@ void DistributedTaskDispatcher::PerformOneTask(flare::RefPtr<TaskDesc> task) {
   }
 
   // Start a new servant task.
-  StartNewServantTask(task.Get());
-  actually_run_.fetch_add(1, std::memory_order_relaxed);
+  if (StartNewServantTask(task.Get())) {
+    reuse_existing_result_.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    actually_run_.fetch_add(1, std::memory_order_relaxed);
+  }
 }
 
 bool DistributedTaskDispatcher::TryReadCacheIfAllowed(TaskDesc* task) {
@@ -258,14 +261,20 @@ bool DistributedTaskDispatcher::TryGetExistingTaskResult(TaskDesc* task) {
   if (!running_task) {
     return false;
   }
+  return TryReferenceExistingTask(task, running_task->servant_location,
+                                  running_task->servant_task_id);
+}
 
+bool DistributedTaskDispatcher::TryReferenceExistingTask(
+    TaskDesc* task, const std::string& servant_location,
+    std::uint64_t servant_task_id) {
   cloud::DaemonService_SyncStub stub(
       FLAGS_debugging_always_use_servant_at.empty()
-          ? flare::Format("flare://{}", running_task->servant_location)
+          ? flare::Format("flare://{}", servant_location)
           : FLAGS_debugging_always_use_servant_at);
   cloud::ReferenceTaskRequest req;
   req.set_token(config_keeper_.GetServingDaemonToken());
-  req.set_task_id(running_task->servant_task_id);
+  req.set_task_id(servant_task_id);
 
   flare::RpcClientController ctlr;
   auto result = stub.ReferenceTask(req, &ctlr);
@@ -289,26 +298,38 @@ bool DistributedTaskDispatcher::TryGetExistingTaskResult(TaskDesc* task) {
     task->ready_at = flare::ReadCoarseSteadyClock();
     task->last_keep_alive_at = flare::ReadCoarseSteadyClock();
     task->task_grant_id = 0;
-    task->servant_location = running_task->servant_location;
+    task->servant_location = servant_location;
     task->dispatched_at = flare::ReadCoarseSteadyClock();
     task->state = TaskState::Dispatched;
-    task->servant_task_id = running_task->servant_task_id;
+    task->servant_task_id = servant_task_id;
   }
 
   WaitServantForTaskWithRetry(task, &stub);
   return true;
 }
 
-void DistributedTaskDispatcher::StartNewServantTask(TaskDesc* task) {
+bool DistributedTaskDispatcher::StartNewServantTask(TaskDesc* task) {
+  // The first time we ask for a grant, the scheduler checks if an identical
+  // task has been started since we looked it up.
+  std::optional<scheduler::RunningTask> existing_task;
+  auto task_grant = task_grant_keeper_.Get(
+      task->task->GetEnvironmentDesc(), task->task->GetCostKey(), 1s,
+      task->task->GetDigest(), &existing_task);
+  if (existing_task &&
+      TryReferenceExistingTask(task, existing_task->servant_location(),
+                               existing_task->servant_task_id())) {
+    return true;
+  }
+
   // Wait until we can dispatch the task.
-  std::optional<TaskGrantKeeper::GrantDesc> task_grant;
   while (!task_grant && !task->aborted.load(std::memory_order_relaxed)) {
-    task_grant = task_grant_keeper_.Get(task->task->GetEnvironmentDesc(), 1s);
+    task_grant = task_grant_keeper_.Get(task->task->GetEnvironmentDesc(),
+                                        task->task->GetCostKey(), 1s);
   }
   if (!task_grant) {
     FLARE_LOG_ERROR("Task {} cannot be started in time. Aborted.",
                     task->task_id);
-    return;
+    return false;
   }
 
   FLARE_VLOG(1, "Dispatching task to servant [{}].",
@@ -329,8 +350,11 @@ void DistributedTaskDispatcher::StartNewServantTask(TaskDesc* task) {
     task->servant_location = task_grant->servant_location;
   }
 
+  // The grant can be used for another task only if the servant is known to
+  // have finished with it. (It matters only if the grant is leased.)
+  bool reusable = false;
   flare::ScopedDeferred __(
-      [&] { task_grant_keeper_.Free(task_grant->grant_id); });
+      [&] { task_grant_keeper_.Free(task_grant->grant_id, reusable); });
 
   // Create a channel to the servant.
   cloud::DaemonService_SyncStub stub(
@@ -348,7 +372,7 @@ void DistributedTaskDispatcher::StartNewServantTask(TaskDesc* task) {
     // If we have task's ID in hand we actually can fall-though here. Even if
     // the RPC times out, the submission could have nonetheless succeeded. In
     // this case it's only the response had been delayed (or dropped).
-    return;
+    return false;
   }
   {
     std::scoped_lock _(task->lock);  // For updating task state.
@@ -359,10 +383,11 @@ void DistributedTaskDispatcher::StartNewServantTask(TaskDesc* task) {
   }
 
   flare::ScopedDeferred ___([&] { FreeServantTask(*servant_task_id, &stub); });
-  WaitServantForTaskWithRetry(task, &stub);
+  reusable = WaitServantForTaskWithRetry(task, &stub);
+  return false;
 }
 
-void DistributedTaskDispatcher::WaitServantForTaskWithRetry(
+bool DistributedTaskDispatcher::WaitServantForTaskWithRetry(
     TaskDesc* task, cloud::DaemonService_SyncStub* from) {
   // We tolerance at most so many **successive** wait failure.
   constexpr auto kRpcRetries = 4;  // Timeout is 3s, up to 120s.
@@ -416,8 +441,9 @@ void DistributedTaskDispatcher::WaitServantForTaskWithRetry(
     std::scoped_lock _(task->lock);
     task->output = *wait_result;
     // TODO(luobogao): We can immediately wake up waiter (if any) by now.
-    break;
+    return true;
   }
+  return false;
 }
 
 flare::Expected<DistributedTaskOutput,
@@ -109,8 +109,17 @@ class DistributedTaskDispatcher {
   // task.
   bool TryGetExistingTaskResult(TaskDesc* task);
 
+  // Reference task `servant_task_id` running on `servant_location` and wait for
+  // its result.
+  bool TryReferenceExistingTask(TaskDesc* task,
+                                const std::string& servant_location,
+                                std::uint64_t servant_task_id);
+
   // This method submits task to a compile-server and wait for its completion.
-  void StartNewServantTask(TaskDesc* task);
+  //
+  // If the scheduler reports an identical task is running when we ask for a
+  // grant, that task is reused instead, and `true` is returned.
+  bool StartNewServantTask(TaskDesc* task);
 
   // Wait on `servant` for task with ID `servant_task_id`.
   //
@@ -118,7 +127,8 @@ class DistributedTaskDispatcher {
   flare::Expected<DistributedTaskOutput, ServantWaitStatus> WaitServantForTask(
       std::uint64_t servant_task_id, cloud::DaemonService_SyncStub* from);
 
-  void WaitServantForTaskWithRetry(TaskDesc* task,
+  // Returns `true` if the task is known to have completed on the servant.
+  bool WaitServantForTaskWithRetry(TaskDesc* task,
                                    cloud::DaemonService_SyncStub* from);
 
   void FreeServantTask(std::uint64_t servant_task_id,
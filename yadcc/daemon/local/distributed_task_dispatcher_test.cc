@@ -49,6 +49,7 @@ class TestingTask : public DistributedTask {
   }
   std::string GetCacheKey() const override { return cache_key; }
   std::string GetDigest() const override { return digest; }
+  std::string GetCostKey() const override { return {}; }
   const EnvironmentDesc& GetEnvironmentDesc() const override {
     static const EnvironmentDesc env;
     return env;
@@ -74,12 +75,23 @@ class TestingTask : public DistributedTask {
 
 }  // namespace
 
-scheduler::WaitForStartingTaskResponse MakeWaitForTaskResponse(int grant_id) {
-  scheduler::WaitForStartingTaskResponse result;
-  auto ptr = result.add_grants();
-  ptr->set_task_grant_id(grant_id);
-  ptr->set_servant_location("not-used-as-we've-override-it-via-GFlags");
-  return result;
+void SubscribeTaskGrantsHandler(
+    const scheduler::SubscribeTaskGrantsRequest& req,
+    scheduler::SubscribeTaskGrantsResponse* resp,
+    flare::RpcServerController* ctlr) {
+  // Demand is satisfied as soon as it's made.
+  for (auto&& e : req.demand_deltas()) {
+    for (int i = 0; i < e.delta(); ++i) {
+      auto ptr = resp->add_grants();
+      ptr->set_compiler_digest(e.env_desc().compiler_digest());
+      ptr->set_task_grant_id(1);
+      ptr->set_servant_location("not-used-as-we've-override-it-via-GFlags");
+      ptr->set_expires_in_ms(15000);
+    }
+  }
+  if (req.milliseconds_to_wait()) {
+    flare::this_fiber::SleepFor(10ms);  // Nothing to wait for.
+  }
 }
 
 EnvironmentDesc MakeEnvironmentDesc(const std::string& s) {
@@ -167,9 +179,14 @@ TEST(DistributedTaskDispatcher, All) {
   ///////////////////////////////////
 
   std::atomic<std::size_t> freed_tasks{};
+  // No identical task is running, so lookups find nothing to join.
   FLARE_EXPECT_RPC(scheduler::SchedulerService::WaitForStartingTask,
                    ::testing::_)
-      .WillRepeatedly(flare::testing::Return(MakeWaitForTaskResponse(1)));
+      .WillRepeatedly(
+          flare::testing::Return(scheduler::WaitForStartingTaskResponse()));
+  FLARE_EXPECT_RPC(scheduler::SchedulerService::SubscribeTaskGrants,
+                   ::testing::_)
+      .WillRepeatedly(flare::testing::HandleRpc(SubscribeTaskGrantsHandler));
   FLARE_EXPECT_RPC(scheduler::SchedulerService::KeepTaskAlive, ::testing::_)
       .WillRepeatedly(flare::testing::HandleRpc(KeepTaskAliveHandler));
   FLARE_EXPECT_RPC(scheduler::SchedulerService::FreeTask, ::testing::_)
@@ -14,68 +14,111 @@
 
 #include "yadcc/daemon/local/running_task_keeper.h"
 
+#include <algorithm>
 #include <chrono>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "flare/base/chrono.h"
-#include "flare/base/string.h"
-#include "flare/fiber/timer.h"
+#include "flare/base/logging.h"
 #include "flare/rpc/rpc_client_controller.h"
 
-#include "yadcc/daemon/task_digest.h"
-
 using namespace std::literals;
 
 namespace yadcc::daemon::local {
 
-RunningTaskKeeper::RunningTaskKeeper() {
-  sync_timer_ = flare::fiber::SetTimer(flare::ReadCoarseSteadyClock(), 1s,
-                                       [this] { Refresh(); });
-  last_update_time_ = flare::ReadCoarseSteadyClock();
-}
+namespace {
 
-RunningTaskKeeper::~RunningTaskKeeper() {}
+// Must not exceed what's allowed by the scheduler (@sa:
+// `max_running_task_lookups`).
+constexpr std::size_t kMaxDigestsPerLookup = 1000;
 
-void RunningTaskKeeper::Refresh() {
-  scheduler::GetRunningTasksRequest req;
-  flare::RpcClientController ctlr;
-  auto result = scheduler_stub_.GetRunningTasks(req, &ctlr);
-
-  if (!result) {
-    FLARE_LOG_WARNING("Failed to get running tasks from scheduler.");
-    std::scoped_lock _(lock_);
-    // Clear if elapse time is over 5 seconds since last update. Avoid keeping
-    // stale data in case of communication failure with the scheduler.
-    if (flare::ReadCoarseSteadyClock() - last_update_time_ > 5s) {
-      running_tasks_.clear();
-    }
-    return;
-  }
+// Each task being submitted waits for the lookup, so it must be quick. If the
+// scheduler does not respond in time, we'd rather compile the task ourselves.
+constexpr auto kLookupTimeout = 100ms;
 
-  std::unordered_map<std::string, TaskDesc> tmp_running_tasks;
-  for (auto&& running_task : result->running_tasks()) {
-    TaskDesc task_desc = {.servant_location = running_task.servant_location(),
-                          .servant_task_id = running_task.servant_task_id()};
-    tmp_running_tasks[running_task.task_digest()] = std::move(task_desc);
-  }
+// Including time spent in waiting for the lookup in progress to complete.
+constexpr auto kMaxLookupDelay = 2 * kLookupTimeout;
 
-  std::scoped_lock _(lock_);
-  last_update_time_ = flare::ReadCoarseSteadyClock();
-  running_tasks_.swap(tmp_running_tasks);
-}
+}  // namespace
+
+RunningTaskKeeper::RunningTaskKeeper() = default;
+
+RunningTaskKeeper::~RunningTaskKeeper() {}
 
 std::optional<RunningTaskKeeper::TaskDesc> RunningTaskKeeper::TryFindTask(
-    const std::string& task_digest) const {
-  std::scoped_lock _(lock_);
-  auto result = running_tasks_.find(task_digest);
-  if (result != running_tasks_.end()) {
+    const std::string& task_digest) {
+  std::unique_lock lk(lock_);
+  if (!pending_batch_) {
+    pending_batch_ = std::make_shared<Batch>();
+  }
+  auto batch = pending_batch_;
+  batch->task_digests.push_back(task_digest);
+
+  // Wait until someone else has looked up our batch, or we can do it ourselves.
+  if (!batch_cv_.wait_until(
+          lk, flare::ReadCoarseSteadyClock() + kMaxLookupDelay,
+          [&] { return batch->done || !lookup_in_progress_; })) {
+    FLARE_LOG_WARNING_EVERY_SECOND(
+        "Timeout in waiting for running task lookup. Skipped.");
+    return std::nullopt;
+  }
+  if (!batch->done) {
+    // We're the first one to see the previous lookup completed, let's send the
+    // batch.
+    pending_batch_ = nullptr;
+    lookup_in_progress_ = true;
+    lk.unlock();
+    auto running_tasks = LookupRunningTasks(batch->task_digests);
+    lk.lock();
+    batch->running_tasks = std::move(running_tasks);
+    batch->done = true;
+    lookup_in_progress_ = false;
+    batch_cv_.notify_all();
+  }
+
+  auto result = batch->running_tasks.find(task_digest);
+  if (result != batch->running_tasks.end()) {
     return result->second;
   }
   return std::nullopt;
 }
 
-void RunningTaskKeeper::Stop() { flare::fiber::KillTimer(sync_timer_); }
+void RunningTaskKeeper::Stop() {}
 
 void RunningTaskKeeper::Join() {}
 
+std::unordered_map<std::string, RunningTaskKeeper::TaskDesc>
+RunningTaskKeeper::LookupRunningTasks(
+    const std::vector<std::string>& task_digests) {
+  std::unordered_map<std::string, TaskDesc> result;
+  for (std::size_t i = 0; i < task_digests.size(); i += kMaxDigestsPerLookup) {
+    scheduler::LookupRunningTasksRequest req;
+    flare::RpcClientController ctlr;
+    auto end = std::min(task_digests.size(), i + kMaxDigestsPerLookup);
+    for (auto j = i; j != end; ++j) {
+      req.add_task_digests(task_digests[j]);
+    }
+    ctlr.SetTimeout(kLookupTimeout);
+    auto lookup = scheduler_stub_.LookupRunningTasks(req, &ctlr);
+    if (!lookup) {
+      // Not a big deal, the tasks are compiled once more. The rest are not
+      // looked up either, the scheduler is unlikely to do better for them.
+      FLARE_LOG_WARNING_EVERY_SECOND(
+          "Failed to look up running tasks from scheduler: {}",
+          lookup.error().ToString());
+      break;
+    }
+    for (auto&& running_task : lookup->running_tasks()) {
+      result[running_task.task_digest()] = {
+          .servant_location = running_task.servant_location(),
+          .servant_task_id = running_task.servant_task_id()};
+    }
+  }
+  return result;
+}
+
 }  // namespace yadcc::daemon::local
@@ -15,12 +15,15 @@
 #ifndef YADCC_DAEMON_LOCAL_RUNNING_TASK_KEEPER_H_
 #define YADCC_DAEMON_LOCAL_RUNNING_TASK_KEEPER_H_
 
-#include <chrono>
 #include <cstdint>
-#include <mutex>
+#include <memory>
 #include <optional>
 #include <string>
 #include <unordered_map>
+#include <vector>
+
+#include "flare/fiber/condition_variable.h"
+#include "flare/fiber/mutex.h"
 
 #include "yadcc/api/daemon.flare.pb.h"
 #include "yadcc/api/scheduler.flare.pb.h"
@@ -28,8 +31,11 @@
 
 namespace yadcc::daemon::local {
 
-// This class is designed to synchronize running task information from the
+// This class is designed to look up running task information from the
 // scheduler and reduce duplicate compilation of the same task.
+//
+// Lookups are done on demand. Lookups issued while another one is in progress
+// are batched into a single RPC.
 class RunningTaskKeeper {
  public:
   RunningTaskKeeper();
@@ -42,21 +48,29 @@ class RunningTaskKeeper {
 
   // If the compilation task has already existed on cluster, we find where is it
   // first.
-  std::optional<TaskDesc> TryFindTask(const std::string& task_digest) const;
+  std::optional<TaskDesc> TryFindTask(const std::string& task_digest);
 
   void Stop();
   void Join();
 
  private:
-  void Refresh();
+  struct Batch {
+    std::vector<std::string> task_digests;
+    bool done = false;
+    std::unordered_map<std::string, TaskDesc> running_tasks;
+  };
+
+  std::unordered_map<std::string, TaskDesc> LookupRunningTasks(
+      const std::vector<std::string>& task_digests);
 
  private:
   scheduler::SchedulerService_SyncStub scheduler_stub_{FLAGS_scheduler_uri};
 
-  mutable std::mutex lock_;
-  std::unordered_map<std::string, TaskDesc> running_tasks_;
-  std::chrono::steady_clock::time_point last_update_time_;
-  std::uint64_t sync_timer_;
+  flare::fiber::Mutex lock_;
+  flare::fiber::ConditionVariable batch_cv_;
+  bool lookup_in_progress_ = false;
+  // Lookups to be sent once the one in progress completes.
+  std::shared_ptr<Batch> pending_batch_;
 };
 
 }  // namespace yadcc::daemon::local
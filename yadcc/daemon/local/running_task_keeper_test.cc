@@ -14,8 +14,12 @@
 
 #include "yadcc/daemon/local/running_task_keeper.h"
 
-#include <thread>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include "flare/fiber/async.h"
+#include "flare/fiber/future.h"
 #include "flare/init/override_flag.h"
 #include "flare/testing/main.h"
 #include "flare/testing/rpc_mock.h"
@@ -23,47 +27,56 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
-#include "yadcc/daemon/task_digest.h"
-
 FLARE_OVERRIDE_FLAG(scheduler_uri, "mock://whatever-it-wants-to-be");
 
-using namespace std::literals;
-
 namespace yadcc::daemon::local {
 
-void GetRunningTasksHandler(const scheduler::GetRunningTasksRequest& request,
-                            scheduler::GetRunningTasksResponse* response,
-                            flare::RpcServerController* controller) {
-  static auto count = 0;
-  if (++count <= 2) {
+void LookupRunningTasksHandler(
+    const scheduler::LookupRunningTasksRequest& request,
+    scheduler::LookupRunningTasksResponse* response,
+    flare::RpcServerController* controller) {
+  for (auto&& e : request.task_digests()) {
     for (int i = 0; i < 3; ++i) {
-      auto running_task = response->add_running_tasks();
-      running_task->set_servant_task_id(i);
-      running_task->set_task_grant_id(i + 100);
-      running_task->set_task_digest("task digest" + std::to_string(i));
+      if (e == "task digest" + std::to_string(i)) {
+        auto running_task = response->add_running_tasks();
+        running_task->set_servant_location("192.0.2.1:8335");
+        running_task->set_servant_task_id(i);
+        running_task->set_task_grant_id(i + 100);
+        running_task->set_task_digest(e);
+      }
     }
   }
 }
 
 TEST(RunningTaskKeeper, ALL) {
-  FLARE_EXPECT_RPC(scheduler::SchedulerService::GetRunningTasks, ::testing::_)
-      .WillRepeatedly(flare::testing::HandleRpc(GetRunningTasksHandler));
+  FLARE_EXPECT_RPC(scheduler::SchedulerService::LookupRunningTasks,
+                   ::testing::_)
+      .WillRepeatedly(flare::testing::HandleRpc(LookupRunningTasksHandler));
 
   RunningTaskKeeper running_task_keeper;
-  std::this_thread::sleep_for(1s);
   for (int i = 0; i < 3; ++i) {
-    EXPECT_TRUE(
-        !!running_task_keeper.TryFindTask("task digest" + std::to_string(i)));
+    auto task =
+        running_task_keeper.TryFindTask("task digest" + std::to_string(i));
+    ASSERT_TRUE(task);
+    EXPECT_EQ("192.0.2.1:8335", task->servant_location);
+    EXPECT_EQ(i, task->servant_task_id);
   }
+  EXPECT_FALSE(running_task_keeper.TryFindTask("task digest3"));
 
-  std::this_thread::sleep_for(2s);
-  for (int i = 0; i < 3; ++i) {
-    EXPECT_FALSE(
-        !!running_task_keeper.TryFindTask("task digest" + std::to_string(i)));
+  // Concurrent lookups.
+  std::vector<flare::Future<bool>> lookups;
+  for (int i = 0; i < 100; ++i) {
+    lookups.push_back(flare::fiber::Async([&, i] {
+      return !!running_task_keeper.TryFindTask("task digest" +
+                                               std::to_string(i % 6));
+    }));
+  }
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(i % 6 < 3, flare::fiber::BlockingGet(std::move(lookups[i])));
   }
 
   running_task_keeper.Stop();
-  std::this_thread::sleep_for(1s);  // Wait for timer to be fully killed.
+  running_task_keeper.Join();
 }
 
 }  // namespace yadcc::daemon::local
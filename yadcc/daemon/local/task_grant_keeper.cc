@@ -14,13 +14,18 @@
 
 #include "yadcc/daemon/local/task_grant_keeper.h"
 
+#include <algorithm>
 #include <chrono>
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <vector>
+
+#include "gflags/gflags.h"
 
 #include "flare/base/deferred.h"
 #include "flare/base/logging.h"
+#include "flare/base/random.h"
 #include "flare/fiber/fiber.h"
 #include "flare/fiber/future.h"
 #include "flare/fiber/this_fiber.h"
@@ -28,14 +33,87 @@
 
 #include "yadcc/daemon/common_flags.h"
 
+DEFINE_string(task_priority_class, "interactive",
+              "Priority class of compilation tasks started on this machine. "
+              "Set it to `ci` or `batch` on build machines, so that tasks "
+              "from developers' machines are served in priority when the "
+              "cluster is saturated.");
+DEFINE_bool(lease_task_grants, false,
+            "If set, grants for starting tasks are leased from the scheduler "
+            "in blocks, and reused for our tasks until the lease expires. This "
+            "saves us (and the scheduler) a round trip per task.");
+DEFINE_int32(task_grant_lease_max_slots, 16,
+             "Maximum number of grants leased at once for a given "
+             "environment.");
+DEFINE_int32(task_grant_lease_seconds, 30,
+             "Duration of leases requested from the scheduler.");
+
 using namespace std::literals;
 
 namespace yadcc::daemon::local {
 
-TaskGrantKeeper::TaskGrantKeeper() : scheduler_stub_(FLAGS_scheduler_uri) {}
+namespace {
+
+// Maximum time for a call to `SubscribeTaskGrants` to wait for grants.
+constexpr auto kMaxWait = 5s;
+
+// Tolerance of possible network delay.
+constexpr auto kNetworkDelayTolerance = 5s;
+
+constexpr auto kExpiresIn = 15s;
+
+static_assert(kExpiresIn > kNetworkDelayTolerance + 1s,
+              "Otherwise the grant can possibly expire immediately after RPC "
+              "finishes..");
+
+// Number of grants we prefetch for each environment in use. Prefetching
+// helps to reduce latency in critical path.
+constexpr auto kPrefetchGrants = 1;
+
+// The scheduler rejects demand beyond its `max_subscribed_demand` for an
+// environment, and tells us its value in its response. We assume its default
+// until then. Tasks beyond that wait for grants freed up by our other tasks.
+constexpr auto kMaxSubscribedDemand = 256;
+
+// Our demand is sampled for sizing leases over this period.
+constexpr auto kPeakDemandWindow = 10s;
+
+// Interval between two checks for leased grants expired while not in use.
+constexpr auto kLeaseSweepInterval = 1s;
+
+}  // namespace
+
+TaskGrantKeeper::TaskGrantKeeper()
+    : scheduler_stub_(FLAGS_scheduler_uri),
+      subscription_id_(flare::Random<std::uint64_t>()),
+      max_subscribed_demand_(kMaxSubscribedDemand) {
+  if (FLAGS_task_priority_class == "interactive") {
+    priority_class_ = scheduler::TASK_PRIORITY_CLASS_INTERACTIVE;
+  } else if (FLAGS_task_priority_class == "ci") {
+    priority_class_ = scheduler::TASK_PRIORITY_CLASS_CI;
+  } else if (FLAGS_task_priority_class == "batch") {
+    priority_class_ = scheduler::TASK_PRIORITY_CLASS_BATCH;
+  } else {
+    FLARE_LOG_FATAL("Unrecognized task priority class [{}].",
+                    FLAGS_task_priority_class);
+  }
+  if (FLAGS_lease_task_grants) {
+    if (FLAGS_task_grant_lease_seconds * 1s <= kNetworkDelayTolerance + 1s) {
+      FLARE_LOG_FATAL(
+          "Leases would expire immediately after they're made. Increase "
+          "`task_grant_lease_seconds`.");
+    }
+    // Grants are leased by per-environment fibers, started on demand.
+    return;
+  }
+  poller_ = flare::Fiber([this] { GrantPollerProc(); });
+  updater_ = flare::Fiber([this] { DemandUpdaterProc(); });
+}
 
 std::optional<TaskGrantKeeper::GrantDesc> TaskGrantKeeper::Get(
-    const EnvironmentDesc& desc, const std::chrono::nanoseconds& timeout) {
+    const EnvironmentDesc& desc, const std::string& task_cost_key,
+    const std::chrono::nanoseconds& timeout, const std::string& task_digest,
+    std::optional<scheduler::RunningTask>* existing_task) {
   PerEnvGrantKeeper* keeper;
   {
     std::scoped_lock _(lock_);
@@ -43,143 +121,450 @@ std::optional<TaskGrantKeeper::GrantDesc> TaskGrantKeeper::Get(
     if (!e) {
       e = std::make_unique<PerEnvGrantKeeper>();
       e->env_desc = desc;
-      e->fetcher =
-          flare::Fiber([this, env = e.get()] { GrantFetcherProc(env); });
+      if (FLAGS_lease_task_grants) {
+        e->leaser =
+            flare::Fiber([this, env = e.get()] { GrantLeaserProc(env); });
+      }
     }
     keeper = e.get();
   }
 
+  auto deadline = flare::ReadCoarseSteadyClock() + timeout;
+
+  // Expired grants are returned once we've released the lock.
+  std::vector<std::uint64_t> expired;
+  flare::ScopedDeferred free_expired([&] {
+    if (!expired.empty()) {
+      FreeGrants(expired);
+    }
+  });
+
   std::unique_lock lk(keeper->lock);
   // Drop expired grants first.
   while (!keeper->remaining.empty() &&
          // We don't compensate for network delay here. We've already done that
-         // in `GrantFetcherProc`.
-         keeper->remaining.front().expires_at <
-             flare::ReadCoarseSteadyClock()) {
+         // when the grant was saved.
+         keeper->remaining.top().expires_at < flare::ReadCoarseSteadyClock()) {
+    expired.push_back(keeper->remaining.top().grant_id);
     keeper->remaining.pop();
   }
 
   // We still have some. Satisfied without incur an RPC.
   if (!keeper->remaining.empty()) {
-    auto result = keeper->remaining.front();
+    auto result = keeper->remaining.top();
     keeper->remaining.pop();
+    NotifyDemandChanged(keeper);  // To prefetch the next one.
     return result;
   }
 
+  // We'd have to wait otherwise. Before that, let the scheduler check if an
+  // identical task has been started elsewhere. The check itself does not
+  // allocate (nor wait for) a grant, so we're accounted in our demand below
+  // for all the time we're waiting for one.
+  if (existing_task && !task_digest.empty()) {
+    lk.unlock();
+    *existing_task = LookupExistingTask(desc, task_digest, timeout);
+    if (*existing_task) {
+      return std::nullopt;
+    }
+    lk.lock();
+  }
+
   ++keeper->waiters;
-  flare::ScopedDeferred _([&] { FLARE_CHECK_GE(--keeper->waiters, 0); });
+  keeper->unreported_cost_keys.push_back(task_cost_key);
+  flare::ScopedDeferred _([&] {
+    FLARE_CHECK_GE(--keeper->waiters, 0);
+    NotifyDemandChanged(keeper);
+  });
 
-  keeper->need_more_cv.notify_all();
-  if (!keeper->available_cv.wait_for(
-          lk, timeout, [&] { return !keeper->remaining.empty(); })) {
+  // All grants we've leased are in use. Take it into account when sizing our
+  // next lease.
+  auto now = flare::ReadCoarseSteadyClock();
+  if (now - keeper->peak_demand_since > kPeakDemandWindow) {
+    keeper->peak_demand = 0;
+    keeper->peak_demand_since = now;
+  }
+  keeper->peak_demand =
+      std::max(keeper->peak_demand, keeper->leased + keeper->waiters);
+
+  NotifyDemandChanged(keeper);
+  if (!keeper->available_cv.wait_until(
+          lk, deadline, [&] { return !keeper->remaining.empty(); })) {
     return {};
   }
-  auto result = keeper->remaining.front();
+  auto result = keeper->remaining.top();
   keeper->remaining.pop();
   return result;
 }
 
-void TaskGrantKeeper::Free(std::uint64_t grant_id) {
-  struct Context {
-    scheduler::FreeTaskRequest req;
-    flare::RpcClientController ctlr;
-  };
-
-  auto ctx = std::make_shared<Context>();
-  ctx->req.set_token(FLAGS_token);
-  ctx->req.add_task_grant_ids(grant_id);
-  ctx->ctlr.SetTimeout(5s);
-
-  // Done asynchronously, the result is discard. Failure doesn't harm.
-  scheduler_stub_.FreeTask(ctx->req, &ctx->ctlr)
-      .Then([ctx = ctx, grant_id](auto result) {
-        FLARE_LOG_WARNING_IF(
-            !result, "Failed to free task grant [{}]. Ignoring", grant_id);
-      });
+void TaskGrantKeeper::Free(std::uint64_t grant_id, bool reusable) {
+  {
+    std::scoped_lock _(lock_);
+    if (auto iter = leased_.find(grant_id);
+        iter != leased_.end() && reusable &&
+        iter->second.grant.expires_at > flare::ReadCoarseSteadyClock()) {
+      // Keep it for our next task.
+      auto keeper = iter->second.keeper;
+      std::scoped_lock lk(keeper->lock);
+      keeper->remaining.push(iter->second.grant);
+      keeper->available_cv.notify_one();
+      return;
+    }
+  }
+  FreeGrants({grant_id});
 }
 
 void TaskGrantKeeper::Stop() {
-  std::scoped_lock _(lock_);
   leaving_.store(true, std::memory_order_relaxed);
-  for (auto&& [_, v] : keepers_) {
-    v->need_more_cv.notify_all();
+  std::vector<std::uint64_t> leased;
+  {
+    std::scoped_lock _(lock_);
+    for (auto&& [_, v] : keepers_) {
+      std::scoped_lock lk(v->lock);
+      v->need_lease_cv.notify_all();
+    }
+    for (auto&& [k, _] : leased_) {
+      leased.push_back(k);
+    }
   }
+  // Don't keep them occupied until the lease ends.
+  if (!leased.empty()) {
+    FreeGrants(leased);
+  }
+  std::scoped_lock _(demand_lock_);
+  demand_cv_.notify_all();
 }
 
 void TaskGrantKeeper::Join() {
+  if (poller_.joinable()) {
+    poller_.join();
+    updater_.join();
+  }
   // Locking should not be necessary here as not one else could have been able
   // to add new elements to the map once `Stop()` finishes.
   for (auto&& [_, v] : keepers_) {
-    v->fetcher.join();
+    if (v->leaser.joinable()) {
+      v->leaser.join();
+    }
   }
 }
 
-void TaskGrantKeeper::GrantFetcherProc(PerEnvGrantKeeper* keeper) {
-  constexpr auto kMaxWait = 5s;
-  // Tolerance of possible network delay.
-  constexpr auto kNetworkDelayTolerance = 5s;
-  constexpr auto kExpiresIn = 15s;
-
-  static_assert(kExpiresIn > kMaxWait + kNetworkDelayTolerance + 1s,
-                "Otherwise the grant can possibly expire immediately after RPC "
-                "finishes..");
+void TaskGrantKeeper::NotifyDemandChanged(PerEnvGrantKeeper* keeper) {
+  if (FLAGS_lease_task_grants) {
+    keeper->need_lease_cv.notify_all();  // `keeper->lock` is held by caller.
+    return;
+  }
+  std::scoped_lock _(demand_lock_);
+  demand_changed_ = true;
+  demand_cv_.notify_all();
+}
 
+void TaskGrantKeeper::GrantLeaserProc(PerEnvGrantKeeper* keeper) {
   while (!leaving_.load(std::memory_order_relaxed)) {
     std::unique_lock lk(keeper->lock);
-    keeper->need_more_cv.wait(lk, [&] {
-      return leaving_.load(std::memory_order_relaxed) ||
-             keeper->remaining.empty();
+    auto need_lease = [&] {
+      return keeper->waiters && keeper->remaining.empty();
+    };
+    keeper->need_lease_cv.wait_for(lk, kLeaseSweepInterval, [&] {
+      return leaving_.load(std::memory_order_relaxed) || need_lease();
     });
+
+    // Grants expired while not in use are returned periodically. Otherwise
+    // they'd be accounted in `leased` (and therefore not leased again) until
+    // someone calls `Get`.
+    std::vector<std::uint64_t> expired;
+    auto now = flare::ReadCoarseSteadyClock();
+    while (!keeper->remaining.empty() &&
+           keeper->remaining.top().expires_at < now) {
+      expired.push_back(keeper->remaining.top().grant_id);
+      keeper->remaining.pop();
+    }
+    if (!expired.empty()) {
+      lk.unlock();
+      FreeGrants(expired);
+      lk.lock();
+    }
     if (leaving_.load(std::memory_order_relaxed)) {
       break;
     }
+    if (!need_lease()) {
+      continue;
+    }
 
-    auto before_rpc_now = flare::ReadCoarseSteadyClock();
-    scheduler::WaitForStartingTaskRequest req;
+    scheduler::AcquireTaskLeaseRequest req;
     flare::RpcClientController ctlr;
 
     req.set_token(FLAGS_token);
-    req.set_milliseconds_to_wait(kMaxWait / 1ms);
-    req.set_next_keep_alive_in_ms(kExpiresIn / 1ms);
     *req.mutable_env_desc() = keeper->env_desc;
-    req.set_immediate_reqs(keeper->waiters);
-    req.set_prefetch_reqs(1);
+    // Enough for our recent peak demand, and at least those waiting now.
+    req.set_desired_slots(
+        std::min(std::max(keeper->peak_demand - keeper->leased,
+                          keeper->waiters),
+                 FLAGS_task_grant_lease_max_slots));
+    req.set_milliseconds_to_wait(kMaxWait / 1ms);
+    req.set_lease_duration_ms(FLAGS_task_grant_lease_seconds * 1000);
     req.set_min_version(version_for_upgrade);
+    req.set_zone(FLAGS_zone);
+    req.set_priority_class(priority_class_);
+    // The first slot goes to the one waiting for the longest.
+    if (!keeper->unreported_cost_keys.empty()) {
+      req.set_task_cost_key(keeper->unreported_cost_keys.front());
+    }
+    keeper->unreported_cost_keys.clear();
     ctlr.SetTimeout(kMaxWait + 5s);
 
     // We don't want to hold lock during RPC.
     lk.unlock();
+    auto before_rpc_now = flare::ReadCoarseSteadyClock();
     auto result = flare::fiber::BlockingGet(
-        scheduler_stub_.WaitForStartingTask(req, &ctlr));
+        scheduler_stub_.AcquireTaskLease(req, &ctlr));
+    if (!result) {
+      FLARE_LOG_WARNING_IF_EVERY_SECOND(
+          result.error().code() != scheduler::STATUS_NO_QUOTA_AVAILABLE,
+          "Failed to lease grants for starting new tasks: {}",
+          result.error().ToString());
+      // Sleep for a while before retry if we fail.
+      flare::this_fiber::SleepFor(100ms);
+      continue;
+    }
+
+    std::scoped_lock _(lock_);
     lk.lock();
-    if (result) {
-      // Per method definition the scheduler is not required to wait until all
-      // desired grants are available. Instead, the scheduler is permitted to
-      // satisfy part of our requests. So don't assume the size of the result
-      // array.
-      for (int i = 0; i != result->grants().size(); ++i) {
-        keeper->remaining.push(GrantDesc{
+    for (auto&& lease : result->leases()) {
+      for (auto&& e : lease.task_grant_ids()) {
+        GrantDesc grant{
             // Using timestamp prior to RPC issue, let's be conservative.
-            .expires_at = before_rpc_now + kExpiresIn - kNetworkDelayTolerance,
-            .grant_id = result->grants(i).task_grant_id(),
-            .servant_location = result->grants(i).servant_location()});
+            .expires_at = before_rpc_now + lease.expires_in_ms() * 1ms -
+                          kNetworkDelayTolerance,
+            .grant_id = e,
+            .servant_location = lease.servant_location()};
+        leased_[e] = LeasedGrant{.keeper = keeper, .grant = grant};
+        keeper->remaining.push(grant);
+        ++keeper->leased;
       }
-      keeper->available_cv.notify_all();
-    } else {
-      if (result.error().code() != scheduler::STATUS_NO_QUOTA_AVAILABLE ||
-          req.immediate_reqs()) {
-        FLARE_LOG_WARNING("Failed to acquire grant for starting new task: {}",
-                          result.error().ToString());
-      } else {
-        FLARE_VLOG(1,
-                   "Unable to prefetch grant for possible new-coming task. The "
-                   "cloud is busy.");
+    }
+    keeper->available_cv.notify_all();
+  }
+}
+
+void TaskGrantKeeper::FreeGrants(const std::vector<std::uint64_t>& grant_ids) {
+  struct Context {
+    scheduler::FreeTaskRequest req;
+    flare::RpcClientController ctlr;
+  };
+
+  auto ctx = std::make_shared<Context>();
+  ctx->req.set_token(FLAGS_token);
+  {
+    std::scoped_lock _(lock_);
+    for (auto&& e : grant_ids) {
+      ctx->req.add_task_grant_ids(e);
+      if (auto iter = leased_.find(e); iter != leased_.end()) {
+        std::scoped_lock lk(iter->second.keeper->lock);
+        --iter->second.keeper->leased;
+        leased_.erase(iter);
+      }
+    }
+  }
+  ctx->ctlr.SetTimeout(5s);
+
+  // Done asynchronously, the result is discard. Failure doesn't harm.
+  scheduler_stub_.FreeTask(ctx->req, &ctx->ctlr)
+      .Then([ctx = ctx](auto result) {
+        FLARE_LOG_WARNING_IF(!result, "Failed to free task grants. Ignoring");
+      });
+}
+
+std::optional<scheduler::RunningTask> TaskGrantKeeper::LookupExistingTask(
+    const EnvironmentDesc& desc, const std::string& task_digest,
+    std::chrono::nanoseconds timeout) {
+  scheduler::WaitForStartingTaskRequest req;
+  flare::RpcClientController ctlr;
+
+  // Neither `immediate_reqs` nor `prefetch_reqs` is set, so the scheduler
+  // only waits if a task of the same digest has been allocated.
+  auto max_wait = std::min<std::chrono::nanoseconds>(timeout, kMaxWait);
+  req.set_token(FLAGS_token);
+  req.set_milliseconds_to_wait(max_wait / 1ms);
+  req.set_next_keep_alive_in_ms(kExpiresIn / 1ms);
+  *req.mutable_env_desc() = desc;
+  req.set_min_version(version_for_upgrade);
+  req.set_zone(FLAGS_zone);
+  req.set_task_digest(task_digest);
+  req.set_priority_class(priority_class_);
+  ctlr.SetTimeout(max_wait + 5s);
+
+  auto result = flare::fiber::BlockingGet(
+      scheduler_stub_.WaitForStartingTask(req, &ctlr));
+  if (!result) {
+    // Older schedulers fail such requests with `STATUS_NO_QUOTA_AVAILABLE`.
+    FLARE_LOG_WARNING_IF_EVERY_SECOND(
+        result.error().code() != scheduler::STATUS_NO_QUOTA_AVAILABLE,
+        "Failed to look up existing task: {}", result.error().ToString());
+    return std::nullopt;
+  }
+  if (!result->has_existing_task()) {
+    return std::nullopt;
+  }
+  return result->existing_task();
+}
+
+void TaskGrantKeeper::GrantPollerProc() {
+  while (!leaving_.load(std::memory_order_relaxed)) {
+    {
+      // Nothing to poll until the scheduler knows about our subscription.
+      std::unique_lock lk(demand_lock_);
+      demand_cv_.wait(lk, [&] {
+        return leaving_.load(std::memory_order_relaxed) || subscribed_;
+      });
+      if (leaving_.load(std::memory_order_relaxed)) {
+        break;
       }
+    }
+
+    auto req = MakeSubscribeRequest();
+    req.set_milliseconds_to_wait(kMaxWait / 1ms);
+    if (!CallSubscribeTaskGrants(req, kMaxWait + 5s)) {
       // Sleep for a while before retry if we fail.
       flare::this_fiber::SleepFor(100ms);
-      // Retry then, hopefully now we fetched more grants to start new tasks.
     }
   }
 }
 
+void TaskGrantKeeper::DemandUpdaterProc() {
+  std::uint64_t sequence = 0;
+  while (true) {
+    bool reset;
+    int max_demand;
+    {
+      std::unique_lock lk(demand_lock_);
+      demand_cv_.wait(lk, [&] {
+        return leaving_.load(std::memory_order_relaxed) || demand_changed_ ||
+               !subscribed_;
+      });
+      if (leaving_.load(std::memory_order_relaxed)) {
+        break;
+      }
+      reset = !subscribed_;
+      demand_changed_ = false;
+      max_demand = max_subscribed_demand_;
+    }
+
+    // Deltas are calculated against what we've told the scheduler. If we're
+    // (re-)subscribing, the full demand is sent instead.
+    auto req = MakeSubscribeRequest();
+    req.set_sequence(++sequence);
+    req.set_reset(reset);
+    {
+      std::scoped_lock _(lock_);
+      for (auto&& [digest, keeper] : keepers_) {
+        std::scoped_lock lk(keeper->lock);
+        auto desired = std::clamp<int>(
+            keeper->waiters + kPrefetchGrants -
+                static_cast<int>(keeper->remaining.size()),
+            0, max_demand);
+        if (reset || desired != keeper->subscribed) {
+          auto&& added = req.add_demand_deltas();
+          *added->mutable_env_desc() = keeper->env_desc;
+          added->set_delta(reset ? desired : desired - keeper->subscribed);
+          keeper->subscribed = desired;
+
+          // Demand added is for those started waiting most recently.
+          auto&& keys = keeper->unreported_cost_keys;
+          auto count = std::min<std::size_t>(std::max(added->delta(), 0),
+                                             keys.size());
+          for (auto i = keys.size() - count; i != keys.size(); ++i) {
+            added->add_task_cost_keys(keys[i]);
+          }
+        }
+        keeper->unreported_cost_keys.clear();
+      }
+    }
+    if (!reset && req.demand_deltas().empty()) {
+      continue;
+    }
+
+    // Retry until the scheduler has seen it. It won't apply the same sequence
+    // twice.
+    while (!leaving_.load(std::memory_order_relaxed) &&
+           !CallSubscribeTaskGrants(req, 5s)) {
+      flare::this_fiber::SleepFor(100ms);
+    }
+  }
+}
+
+scheduler::SubscribeTaskGrantsRequest TaskGrantKeeper::MakeSubscribeRequest() {
+  scheduler::SubscribeTaskGrantsRequest req;
+  req.set_token(FLAGS_token);
+  req.set_subscription_id(subscription_id_);
+  req.set_next_keep_alive_in_ms(kExpiresIn / 1ms);
+  req.set_min_version(version_for_upgrade);
+  req.set_zone(FLAGS_zone);
+  req.set_priority_class(priority_class_);
+  return req;
+}
+
+bool TaskGrantKeeper::CallSubscribeTaskGrants(
+    const scheduler::SubscribeTaskGrantsRequest& req,
+    std::chrono::nanoseconds timeout) {
+  flare::RpcClientController ctlr;
+  ctlr.SetTimeout(timeout);
+  auto result = flare::fiber::BlockingGet(
+      scheduler_stub_.SubscribeTaskGrants(req, &ctlr));
+  auto now = flare::ReadCoarseSteadyClock();
+  if (!result) {
+    FLARE_LOG_WARNING_EVERY_SECOND("Failed to subscribe to task grants: {}",
+                                   result.error().ToString());
+    if (result.error().code() != scheduler::STATUS_INVALID_ARGUMENT) {
+      return false;
+    }
+    // Our demand is beyond what the scheduler accepts (presumably it's been
+    // configured with a smaller cap since it last told us). Retrying the same
+    // request won't help, re-send our full demand with a smaller cap instead.
+    std::scoped_lock _(demand_lock_);
+    max_subscribed_demand_ = std::max(max_subscribed_demand_ / 2, 1);
+    subscribed_ = false;
+    demand_cv_.notify_all();
+    return true;
+  }
+  {
+    auto max_demand = static_cast<int>(result->max_demand_per_environment());
+    std::scoped_lock _(demand_lock_);
+    if (result->resync_required() || req.reset()) {
+      subscribed_ = !result->resync_required();
+      demand_cv_.notify_all();
+    }
+    // Left zero by older schedulers.
+    if (max_demand && max_demand != max_subscribed_demand_) {
+      max_subscribed_demand_ = max_demand;
+      demand_changed_ = true;  // So that our demand is clamped again.
+      demand_cv_.notify_all();
+    }
+  }
+
+  for (auto&& e : result->grants()) {
+    PerEnvGrantKeeper* keeper = nullptr;
+    {
+      std::scoped_lock _(lock_);
+      if (auto iter = keepers_.find(e.compiler_digest());
+          iter != keepers_.end()) {
+        keeper = iter->second.get();
+      }
+    }
+    if (!keeper) {  // Shouldn't happen.
+      FreeGrants({e.task_grant_id()});
+      continue;
+    }
+    std::scoped_lock _(keeper->lock);
+    keeper->remaining.push(GrantDesc{
+        .expires_at =
+            now + e.expires_in_ms() * 1ms - kNetworkDelayTolerance,
+        .grant_id = e.task_grant_id(),
+        .servant_location = e.servant_location()});
+    keeper->subscribed = std::max(keeper->subscribed - 1, 0);
+    keeper->available_cv.notify_all();
+  }
+  return true;
+}
+
 }  // namespace yadcc::daemon::local
@@ -23,6 +23,7 @@
 #include <queue>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "flare/fiber/condition_variable.h"
 #include "flare/fiber/fiber.h"
@@ -34,6 +35,9 @@ namespace yadcc::daemon::local {
 
 // This class helps us to grab, and if necessary, prefetch grants for starting
 // new tasks, from our scheduler.
+//
+// If `--lease_task_grants` is set, grants are leased from the scheduler in
+// blocks instead, and reused for our tasks in turn until the lease expires.
 class TaskGrantKeeper {
  public:
   // Describes a task grant alloacted by the scheduler.
@@ -51,12 +55,26 @@ class TaskGrantKeeper {
 
   TaskGrantKeeper();
 
-  // Grab a grant for starting new task.
-  std::optional<GrantDesc> Get(const EnvironmentDesc& desc,
-                               const std::chrono::nanoseconds& timeout);
+  // Grab a grant for starting new task. `task_cost_key` (if known) is passed to
+  // the scheduler so that the grant we wait for is placed by cost of the task.
+  //
+  // If we have no grant at hand and `existing_task` is given, the scheduler is
+  // asked for a task of `task_digest` first. Should a task of the same digest
+  // have been started (by anyone) and not finished yet, it's returned in
+  // `existing_task` instead, and no grant is returned. Otherwise we wait for
+  // a grant as usual.
+  std::optional<GrantDesc> Get(
+      const EnvironmentDesc& desc, const std::string& task_cost_key,
+      const std::chrono::nanoseconds& timeout,
+      const std::string& task_digest = "",
+      std::optional<scheduler::RunningTask>* existing_task = nullptr);
 
   // Free a previous allocated grant.
-  void Free(std::uint64_t grant_id);
+  //
+  // A leased grant is kept for our next task instead, unless its lease has
+  // expired, or `reusable` is not set (e.g., the servant might still be running
+  // a task with it).
+  void Free(std::uint64_t grant_id, bool reusable = true);
 
   void Stop();
   void Join();
@@ -64,33 +82,87 @@ class TaskGrantKeeper {
  private:
   struct PerEnvGrantKeeper;
 
-  // Wake up the fiber for fetching new grants.
-  void WakeGrantFetcherFor(const EnvironmentDesc& desc);
+  // Wake up the fiber for updating our demand, or for leasing more grants of
+  // `keeper`.
+  void NotifyDemandChanged(PerEnvGrantKeeper* keeper);
+
+  // Lease more grants for `keeper` once its grants are used up.
+  void GrantLeaserProc(PerEnvGrantKeeper* keeper);
+
+  // Return grants to the scheduler.
+  void FreeGrants(const std::vector<std::uint64_t>& grant_ids);
+
+  // Call `WaitForStartingTask` (without requesting any grant) for a task of
+  // `task_digest` started by anyone. @sa: `Get`.
+  std::optional<scheduler::RunningTask> LookupExistingTask(
+      const EnvironmentDesc& desc, const std::string& task_digest,
+      std::chrono::nanoseconds timeout);
+
+  // Keeps a call to `SubscribeTaskGrants` pending, so that grants are handed
+  // to us as soon as they're made.
+  void GrantPollerProc();
 
-  void GrantFetcherProc(PerEnvGrantKeeper* keeper);
+  // Sends changes in our demand to the scheduler as they happen.
+  void DemandUpdaterProc();
+
+  // Fill fields common to all calls to `SubscribeTaskGrants`.
+  scheduler::SubscribeTaskGrantsRequest MakeSubscribeRequest();
+
+  // Call `SubscribeTaskGrants`, and save grants returned. Returns `false` if
+  // the call fails and is worth retrying.
+  bool CallSubscribeTaskGrants(const scheduler::SubscribeTaskGrantsRequest& req,
+                               std::chrono::nanoseconds timeout);
 
  private:
   struct PerEnvGrantKeeper {
     EnvironmentDesc env_desc;  // Our environment.
 
     flare::fiber::Mutex lock;
-    flare::fiber::ConditionVariable need_more_cv, available_cv;
+    flare::fiber::ConditionVariable available_cv;
+    flare::fiber::ConditionVariable need_lease_cv;
 
     // Number of waiters waiting on us.
     int waiters = 0;
 
+    // Cost keys of waiters that started waiting since we last asked the
+    // scheduler for grants, in the order they started waiting.
+    std::vector<std::string> unreported_cost_keys;
+
     // Available grants. They'll either be handed to `waiters`, or in case we
     // have spare ones, save here.
     //
     // Besides, if we prefetched some grants, they're saved here too.
     // Prefetching helps to reduce latency in critical path.
-    std::queue<GrantDesc> remaining;
+    //
+    // Grants expiring first are handed out first.
+    std::priority_queue<GrantDesc> remaining;
 
-    // Fiber for fetching more grants.
-    flare::Fiber fetcher;
+    // Demand we've told the scheduler and not satisfied yet, as far as we
+    // know.
+    int subscribed = 0;
+
+    // Leased grants not returned yet, either in use or in `remaining`.
+    int leased = 0;
+
+    // Peak of our demand (grants in use plus waiters) recently seen. Leases are
+    // sized by it.
+    int peak_demand = 0;
+    std::chrono::steady_clock::time_point peak_demand_since{};
+
+    // Only used in lease mode.
+    flare::Fiber leaser;
+  };
+
+  struct LeasedGrant {
+    PerEnvGrantKeeper* keeper;
+    GrantDesc grant;
   };
 
   scheduler::SchedulerService_AsyncStub scheduler_stub_;
+  scheduler::TaskPriorityClass priority_class_;
+
+  // Our standing demand is kept by the scheduler under this ID.
+  std::uint64_t subscription_id_;
 
   flare::fiber::Mutex lock_;
   std::atomic<bool> leaving_ = false;
@@ -98,6 +170,21 @@ class TaskGrantKeeper {
   // We never clean up this map, in case the client keep sending us random
   // environment, this will be a DoS vulnerability.
   std::unordered_map<std::string, std::unique_ptr<PerEnvGrantKeeper>> keepers_;
+
+  // Leased grants we haven't returned yet. Protected by `lock_`.
+  std::unordered_map<std::uint64_t, LeasedGrant> leased_;
+
+  // Acquired after `lock_` and `PerEnvGrantKeeper::lock`, if they're needed.
+  flare::fiber::Mutex demand_lock_;
+  flare::fiber::ConditionVariable demand_cv_;
+  bool demand_changed_ = false;
+  // Set once the scheduler has acknowledged our full demand, and cleared if
+  // it asks us to re-send it.
+  bool subscribed_ = false;
+  // Demand of a single environment the scheduler accepts, as told by it.
+  int max_subscribed_demand_;
+
+  flare::Fiber poller_, updater_;
 };
 
 }  // namespace yadcc::daemon::local
@@ -16,8 +16,10 @@
 
 #include <chrono>
 
+#include "gflags/gflags.h"
 #include "gtest/gtest.h"
 
+#include "flare/fiber/this_fiber.h"
 #include "flare/init/override_flag.h"
 #include "flare/testing/main.h"
 #include "flare/testing/rpc_mock.h"
@@ -26,34 +28,110 @@
 
 FLARE_OVERRIDE_FLAG(scheduler_uri, "mock://whatever-it-wants-to-be");
 
+DECLARE_bool(lease_task_grants);
+
 using namespace std::literals;
 
 namespace yadcc::daemon::local {
 
-scheduler::WaitForStartingTaskResponse MakeWaitForTaskResponse(int grant_id) {
-  scheduler::WaitForStartingTaskResponse result;
-  auto ptr = result.add_grants();
-  ptr->set_task_grant_id(grant_id);
-  return result;
-}
-
 TEST(DistributedTaskDispatcher, All) {
   std::atomic<std::size_t> freed_tasks{};
-  FLARE_EXPECT_RPC(scheduler::SchedulerService::WaitForStartingTask,
+  std::atomic<std::uint64_t> next_grant_id{1};
+  std::atomic<std::size_t> cost_keys_seen{};
+  FLARE_EXPECT_RPC(scheduler::SchedulerService::SubscribeTaskGrants,
                    ::testing::_)
-      .WillRepeatedly(flare::testing::Return(MakeWaitForTaskResponse(1)));
+      .WillRepeatedly(flare::testing::HandleRpc(
+          [&](const scheduler::SubscribeTaskGrantsRequest& req,
+              scheduler::SubscribeTaskGrantsResponse* resp, auto&&) {
+            // Demand is satisfied as soon as it's made.
+            for (auto&& e : req.demand_deltas()) {
+              for (auto&& key : e.task_cost_keys()) {
+                cost_keys_seen += key == "my-cost-key";
+              }
+              for (int i = 0; i < e.delta(); ++i) {
+                auto ptr = resp->add_grants();
+                ptr->set_compiler_digest(e.env_desc().compiler_digest());
+                ptr->set_task_grant_id(next_grant_id++);
+                ptr->set_expires_in_ms(15000);
+              }
+            }
+            if (req.milliseconds_to_wait()) {
+              flare::this_fiber::SleepFor(10ms);  // Nothing to wait for.
+            }
+          }));
   FLARE_EXPECT_RPC(scheduler::SchedulerService::FreeTask, ::testing::_)
       .WillRepeatedly(
           flare::testing::HandleRpc([&](auto&&...) { ++freed_tasks; }));
 
   TaskGrantKeeper keeper;
 
-  auto result = keeper.Get(EnvironmentDesc(), 1s);
+  auto result = keeper.Get(EnvironmentDesc(), "my-cost-key", 1s);
   ASSERT_TRUE(result);
   EXPECT_EQ(1, result->grant_id);
+  EXPECT_EQ(1, cost_keys_seen);
+
+  // The next one has been prefetched along with it.
+  result = keeper.Get(EnvironmentDesc(), "", 1s);
+  ASSERT_TRUE(result);
+  EXPECT_EQ(2, result->grant_id);
+
+  keeper.Stop();
+  keeper.Join();
+}
+
+TEST(DistributedTaskDispatcher, Lease) {
+  FLAGS_lease_task_grants = true;
+
+  std::atomic<std::size_t> leases{}, freed_tasks{};
+  std::atomic<std::uint64_t> next_grant_id{1};
+  FLARE_EXPECT_RPC(scheduler::SchedulerService::AcquireTaskLease, ::testing::_)
+      .WillRepeatedly(flare::testing::HandleRpc(
+          [&](const scheduler::AcquireTaskLeaseRequest& req,
+              scheduler::AcquireTaskLeaseResponse* resp, auto&&) {
+            ++leases;
+            auto lease = resp->add_leases();
+            for (int i = 0; i != req.desired_slots(); ++i) {
+              lease->add_task_grant_ids(next_grant_id++);
+            }
+            lease->set_expires_in_ms(30000);
+          }));
+  FLARE_EXPECT_RPC(scheduler::SchedulerService::FreeTask, ::testing::_)
+      .WillRepeatedly(flare::testing::HandleRpc(
+          [&](const scheduler::FreeTaskRequest& req, auto&&...) {
+            freed_tasks += req.task_grant_ids().size();
+          }));
+
+  TaskGrantKeeper keeper;
+
+  auto first = keeper.Get(EnvironmentDesc(), "", 1s);
+  ASSERT_TRUE(first);
+  EXPECT_EQ(1, first->grant_id);
+  auto second = keeper.Get(EnvironmentDesc(), "", 1s);
+  ASSERT_TRUE(second);
+  EXPECT_EQ(2, second->grant_id);
+  EXPECT_EQ(2, leases);
+
+  // Freed grant is reused without bothering the scheduler.
+  keeper.Free(first->grant_id);
+  auto third = keeper.Get(EnvironmentDesc(), "", 1s);
+  ASSERT_TRUE(third);
+  EXPECT_EQ(1, third->grant_id);
+  EXPECT_EQ(2, leases);
+
+  // Unless it's not reusable.
+  keeper.Free(second->grant_id, false);
+  keeper.Free(third->grant_id, false);
+  flare::this_fiber::SleepFor(100ms);
+  EXPECT_EQ(2, freed_tasks);
 
+  // Grants still leased (either in use or not) are returned on leaving.
+  auto fourth = keeper.Get(EnvironmentDesc(), "", 1s);
+  ASSERT_TRUE(fourth);
   keeper.Stop();
   keeper.Join();
+  flare::this_fiber::SleepFor(100ms);
+  EXPECT_EQ(next_grant_id - 1, freed_tasks);
+  FLAGS_lease_task_grants = false;
 }
 
 }  // namespace yadcc::daemon::local
@@ -14,14 +14,18 @@
 
 #include "yadcc/daemon/sysinfo.h"
 
+#include <sched.h>
 #include <sys/statvfs.h>
 
 #include <chrono>
 #include <cstdio>
 #include <deque>
 #include <fstream>
+#include <map>
+#include <numeric>
 #include <optional>
 #include <string>
+#include <utility>
 
 #include "flare/base/chrono.h"
 #include "flare/base/internal/cpu.h"
@@ -54,6 +58,10 @@ std::uint64_t sample_timer_;
 
 std::deque<double> sys_uptime_samples_;
 
+std::mutex runnable_tasks_samples_lock_;
+
+std::deque<std::size_t> runnable_tasks_samples_;
+
 double GetProcessorIdleTime() {
   static const auto kUserHz = sysconf(_SC_CLK_TCK);
 
@@ -69,6 +77,66 @@ double GetProcessorIdleTime() {
   return idle;
 }
 
+std::size_t GetRunnableTasks() {
+  // @sa: https://man7.org/linux/man-pages/man5/proc.5.html
+  //
+  // The fourth field is "currently runnable kernel scheduling entities" /
+  // "kernel scheduling entities that currently exist".
+  std::ifstream ifile("/proc/loadavg");
+  FLARE_LOG_FATAL_IF(
+      !ifile, "Open '/proc/loadavg' failed, so we can`t sample runnable tasks");
+  double temp;
+  std::size_t runnable;
+  ifile >> temp >> temp >> temp >> runnable;
+  FLARE_CHECK(ifile, "Unexpected format of '/proc/loadavg'.");
+  return runnable;
+}
+
+struct CpuTopology {
+  std::size_t physical_cores;
+  std::size_t smt_ways;
+};
+
+// Reads topology of processors available to us (as determined by CPU
+// affinity). If the topology is not available (e.g., in some containerized
+// environments), each processor is treated as a physical core.
+CpuTopology GetCpuTopology() {
+  CpuTopology fallback = {.physical_cores = GetNumberOfProcessors(),
+                          .smt_ways = 1};
+  cpu_set_t cpus;
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0) {
+    FLARE_LOG_WARNING("Failed to get CPU affinity, assuming SMT is disabled.");
+    return fallback;
+  }
+
+  // (Package ID, core ID) -> number of hardware threads.
+  std::map<std::pair<int, int>, std::size_t> cores;
+  for (int i = 0; i != CPU_SETSIZE; ++i) {
+    if (!CPU_ISSET(i, &cpus)) {
+      continue;
+    }
+    auto prefix = flare::Format("/sys/devices/system/cpu/cpu{}/topology/", i);
+    std::ifstream package_file(prefix + "physical_package_id");
+    std::ifstream core_file(prefix + "core_id");
+    int package_id, core_id;
+    if (!(package_file >> package_id) || !(core_file >> core_id)) {
+      FLARE_LOG_WARNING(
+          "Failed to read topology of CPU #{}, assuming SMT is disabled.", i);
+      return fallback;
+    }
+    ++cores[{package_id, core_id}];
+  }
+  if (cores.empty()) {
+    return fallback;
+  }
+
+  CpuTopology result = {.physical_cores = cores.size(), .smt_ways = 1};
+  for (auto&& [_, threads] : cores) {
+    result.smt_ways = std::max(result.smt_ways, threads);
+  }
+  return result;
+}
+
 ProcMemInfo GetProcMemInfo() {
   ProcMemInfo info;
   std::ifstream in("/proc/meminfo");
@@ -115,11 +183,22 @@ void SampleProcessorIdleTime() {
   }
 }
 
+void SampleRunnableTasks() {
+  std::scoped_lock _(runnable_tasks_samples_lock_);
+  runnable_tasks_samples_.emplace_back(GetRunnableTasks());
+  if (runnable_tasks_samples_.size() > kSampleCount) {
+    runnable_tasks_samples_.pop_front();
+  }
+}
+
 // We sample sys uptime periodically to get finer-grained sys load average.
 void InitializeSystemInfo() {
-  // We sample the sys uptime every 1s.
-  sample_timer_ = flare::fiber::SetTimer(flare::ReadCoarseSteadyClock(), 1s,
-                                         [] { SampleProcessorIdleTime(); });
+  // We sample the sys uptime (as well as runnable tasks) every 1s.
+  sample_timer_ =
+      flare::fiber::SetTimer(flare::ReadCoarseSteadyClock(), 1s, [] {
+        SampleProcessorIdleTime();
+        SampleRunnableTasks();
+      });
 }
 
 void ShutdownSystemInfo() { flare::fiber::KillTimer(sample_timer_); }
@@ -130,6 +209,17 @@ std::size_t GetNumberOfProcessors() {
   return num;
 }
 
+std::size_t GetNumberOfPhysicalCores() {
+  // Same as `GetNumberOfProcessors`, we don't support CPU hot-plugin.
+  static const auto topology = GetCpuTopology();
+  return topology.physical_cores;
+}
+
+std::size_t GetSmtWays() {
+  static const auto topology = GetCpuTopology();
+  return topology.smt_ways;
+}
+
 std::optional<std::size_t> TryGetProcessorLoad(std::chrono::seconds duration) {
   std::scoped_lock _(sys_uptime_samples_lock_);
   auto interval = duration / 1s;
@@ -142,6 +232,17 @@ std::optional<std::size_t> TryGetProcessorLoad(std::chrono::seconds duration) {
   return std::nullopt;
 }
 
+std::optional<std::size_t> TryGetRunnableTasks(std::chrono::seconds duration) {
+  std::scoped_lock _(runnable_tasks_samples_lock_);
+  std::size_t interval = duration / 1s;
+  if (interval && interval <= runnable_tasks_samples_.size()) {
+    auto sum = std::accumulate(runnable_tasks_samples_.end() - interval,
+                               runnable_tasks_samples_.end(), std::size_t(0));
+    return (sum + interval - 1) / interval;
+  }
+  return std::nullopt;
+}
+
 std::size_t GetProcessorLoadInLastMinute() {
   double loadavg = 0.0;
   // We are interested in first load average
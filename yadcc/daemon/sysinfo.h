@@ -34,12 +34,27 @@ void ShutdownSystemInfo();
 // The result is rounded up.
 std::optional<std::size_t> TryGetProcessorLoad(std::chrono::seconds duration);
 
+// Get average number of runnable threads (including the one doing sampling)
+// in recent duration. This reflects the load of the host much faster than
+// loadavg. Nullopt will return, if you pass more than 1min duration.
+//
+// The result is rounded up.
+std::optional<std::size_t> TryGetRunnableTasks(std::chrono::seconds duration);
+
 // Get 1min loadavg with calling getloadavg.
 std::size_t GetProcessorLoadInLastMinute();
 
 // To get number of processors in our host.
 std::size_t GetNumberOfProcessors();
 
+// To get number of physical cores (that is, hyperthreads of the same core are
+// counted once) available to us.
+std::size_t GetNumberOfPhysicalCores();
+
+// To get number of hardware threads per physical core. This is 1 if SMT is
+// disabled, and 2 for the most common SMT configuration.
+std::size_t GetSmtWays();
+
 // To get available memory in our host.
 std::size_t GetMemoryAvailable();
 
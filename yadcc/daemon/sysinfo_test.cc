@@ -105,6 +105,45 @@ TEST(Sysinfo, Loadavg) {
   ShutdownSystemInfo();
 }
 
+TEST(Sysinfo, RunnableTasks) {
+  static const auto kThreads = std::min<int>(5, GetNumberOfProcessors());
+
+  std::atomic<bool> shutdown = false;
+  InitializeSystemInfo();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i) {
+    threads.emplace_back([&] {
+      while (!shutdown) {
+      }
+    });
+  }
+
+  // Waiting for samples enough.
+  std::this_thread::sleep_for(3s);
+
+  auto v = TryGetRunnableTasks(2s);
+  ASSERT_TRUE(v);
+  EXPECT_GE(*v, threads.size());
+  FLARE_LOG_INFO("Runnable tasks: {}", *v);
+  EXPECT_FALSE(TryGetRunnableTasks(100s));
+
+  shutdown = true;
+  for (auto& t : threads) {
+    t.join();
+  }
+  threads.clear();
+  ShutdownSystemInfo();
+}
+
+TEST(Sysinfo, CpuTopology) {
+  EXPECT_GT(GetNumberOfPhysicalCores(), 0);
+  EXPECT_LE(GetNumberOfPhysicalCores(), GetNumberOfProcessors());
+  EXPECT_GE(GetSmtWays(), 1);
+  EXPECT_GE(GetNumberOfPhysicalCores() * GetSmtWays(), GetNumberOfProcessors());
+  FLARE_LOG_INFO("Physical cores: {}, SMT ways: {}.",
+                 GetNumberOfPhysicalCores(), GetSmtWays());
+}
+
 TEST(Sysinfo, Memory) {
   constexpr std::size_t kBufferSize = 2ULL * 1024 * 1024 * 1024;
   std::size_t mem_available1, mem_available2;
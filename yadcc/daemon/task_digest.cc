@@ -29,4 +29,10 @@ std::string GetCxxTaskDigest(const EnvironmentDesc& env_desc,
                                          invocation_arguments, source_digest}));
 }
 
+std::string GetCxxTaskCostKey(const EnvironmentDesc& env_desc,
+                              const std::string_view& source_path) {
+  return flare::EncodeHex(
+      flare::Blake3({"cxx-cost", env_desc.compiler_digest(), source_path}));
+}
+
 }  // namespace yadcc::daemon
@@ -29,6 +29,11 @@ std::string GetCxxTaskDigest(const EnvironmentDesc& env_desc,
                              const std::string_view& invocation_arguments,
                              const std::string_view& source_digest);
 
+// Generates a key for looking up historical cost of C++ task. Unlike task
+// digest, it's not affected by edits to the source file.
+std::string GetCxxTaskCostKey(const EnvironmentDesc& env_desc,
+                              const std::string_view& source_path);
+
 }  // namespace yadcc::daemon
 
 #endif  // YADCC_DAEMON_TASK_DIGEST_H_
@@ -31,4 +31,12 @@ TEST(TaskDigest, ALL) {
                              "my source digest"));
 }
 
+TEST(TaskDigest, CostKey) {
+  EnvironmentDesc env_desc;
+  env_desc.set_compiler_digest("my compiler digest");
+  EXPECT_EQ(flare::EncodeHex(flare::Blake3(
+                {"cxx-cost", env_desc.compiler_digest(), "path/to/a.cc"})),
+            GetCxxTaskCostKey(env_desc, "path/to/a.cc"));
+}
+
 }  // namespace yadcc::daemon
@@ -0,0 +1,148 @@
+// Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+//
+// Licensed under the BSD 3-Clause License (the "License"); you may not use this
+// file except in compliance with the License. You may obtain a copy of the
+// License at
+//
+// https://opensource.org/licenses/BSD-3-Clause
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "yadcc/scheduler/dispatcher_metrics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+#include "flare/base/logging.h"
+
+using namespace std::literals;
+
+namespace yadcc::scheduler {
+
+void LatencyHistogram::Report(std::chrono::nanoseconds latency) noexcept {
+  auto ms = std::max<std::int64_t>(latency / 1ms, 0);
+  // Bucket `i` holds latencies with `i` significant bits (in milliseconds).
+  std::size_t index = ms ? 64 - __builtin_clzll(ms) : 0;
+  buckets_[std::min(index, kBuckets - 1)].fetch_add(1,
+                                                    std::memory_order_relaxed);
+
+  std::uint64_t us = std::max<std::int64_t>(latency / 1us, 0);
+  sum_us_.fetch_add(us, std::memory_order_relaxed);
+  auto max = max_us_.load(std::memory_order_relaxed);
+  while (us > max &&
+         !max_us_.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+    // `max` is reloaded on failure.
+  }
+}
+
+std::uint64_t LatencyHistogram::GetCount() const noexcept {
+  std::uint64_t count = 0;
+  for (auto&& e : buckets_) {
+    count += e.load(std::memory_order_relaxed);
+  }
+  return count;
+}
+
+std::chrono::nanoseconds LatencyHistogram::GetPercentile(
+    double ratio) const noexcept {
+  std::array<std::uint64_t, kBuckets> buckets;
+  std::uint64_t count = 0;
+  for (std::size_t i = 0; i != kBuckets; ++i) {
+    buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    count += buckets[i];
+  }
+  if (!count) {
+    return 0ns;
+  }
+
+  auto rank = std::max<std::uint64_t>(std::ceil(ratio * count), 1);
+  std::uint64_t seen = 0;
+  for (std::size_t i = 0; i != kBuckets - 1; ++i) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      return std::chrono::milliseconds(1ULL << i);
+    }
+  }
+  // It's in the last bucket, which has no upper bound.
+  return std::chrono::microseconds(max_us_.load(std::memory_order_relaxed));
+}
+
+Json::Value LatencyHistogram::Dump() const {
+  Json::Value jsv;
+  auto count = GetCount();
+  jsv["count"] = static_cast<Json::UInt64>(count);
+  jsv["average_ms"] =
+      count ? sum_us_.load(std::memory_order_relaxed) / 1000.0 / count : 0.0;
+  jsv["p50_ms"] = static_cast<Json::Int64>(GetPercentile(0.5) / 1ms);
+  jsv["p90_ms"] = static_cast<Json::Int64>(GetPercentile(0.9) / 1ms);
+  jsv["p99_ms"] = static_cast<Json::Int64>(GetPercentile(0.99) / 1ms);
+  jsv["max_ms"] = static_cast<Json::UInt64>(
+      max_us_.load(std::memory_order_relaxed) / 1000);
+  return jsv;
+}
+
+const char* GetAllocationOutcomeName(AllocationOutcome outcome) {
+  switch (outcome) {
+    case AllocationOutcome::Immediate:
+      return "immediate";
+    case AllocationOutcome::Waited:
+      return "waited";
+    case AllocationOutcome::Subscribed:
+      return "subscribed";
+    case AllocationOutcome::Joined:
+      return "joined";
+    case AllocationOutcome::Timeout:
+      return "timeout";
+    case AllocationOutcome::EnvironmentNotFound:
+      return "environment_not_found";
+  }
+  FLARE_UNREACHABLE();
+}
+
+void AllocationCounters::Add(const AllocationCounters& other) {
+  for (std::size_t i = 0; i != kAllocationOutcomes; ++i) {
+    outcomes[i] += other.outcomes[i];
+  }
+  expired += other.expired;
+}
+
+Json::Value AllocationCounters::Dump() const {
+  Json::Value jsv;
+  for (std::size_t i = 0; i != kAllocationOutcomes; ++i) {
+    jsv[GetAllocationOutcomeName(static_cast<AllocationOutcome>(i))] =
+        static_cast<Json::UInt64>(outcomes[i]);
+  }
+  jsv["expired"] = static_cast<Json::UInt64>(expired);
+  return jsv;
+}
+
+AllocationDecisionLog::AllocationDecisionLog(std::size_t capacity)
+    : decisions_(capacity) {
+  FLARE_CHECK_GT(capacity, 0);
+}
+
+AllocationDecision* AllocationDecisionLog::Append() {
+  auto result = &decisions_[next_];
+  if (++next_ == decisions_.size()) {
+    next_ = 0;
+    wrapped_ = true;
+  }
+  return result;
+}
+
+std::vector<AllocationDecision> AllocationDecisionLog::GetDecisions() const {
+  std::vector<AllocationDecision> result;
+  if (wrapped_) {
+    result.assign(decisions_.begin() + next_, decisions_.end());
+  }
+  result.insert(result.end(), decisions_.begin(), decisions_.begin() + next_);
+  return result;
+}
+
+}  // namespace yadcc::scheduler
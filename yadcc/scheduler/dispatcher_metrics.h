@@ -0,0 +1,136 @@
+// Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+//
+// Licensed under the BSD 3-Clause License (the "License"); you may not use this
+// file except in compliance with the License. You may obtain a copy of the
+// License at
+//
+// https://opensource.org/licenses/BSD-3-Clause
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#ifndef YADCC_SCHEDULER_DISPATCHER_METRICS_H_
+#define YADCC_SCHEDULER_DISPATCHER_METRICS_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "jsoncpp/value.h"
+
+#include "yadcc/api/scheduler.pb.h"
+
+namespace yadcc::scheduler {
+
+// Distribution of latencies, in exponentially growing buckets of milliseconds.
+//
+// Reporting is lock-free and can be done concurrently with everything else.
+class LatencyHistogram {
+ public:
+  void Report(std::chrono::nanoseconds latency) noexcept;
+
+  // Number of latencies reported.
+  std::uint64_t GetCount() const noexcept;
+
+  // Estimated `ratio` (in [0, 1]) percentile. The result is the upper bound of
+  // the bucket the percentile falls in.
+  std::chrono::nanoseconds GetPercentile(double ratio) const noexcept;
+
+  // Count, average, percentiles and maximum, in milliseconds.
+  Json::Value Dump() const;
+
+ private:
+  // Bucket 0 is [0ms, 1ms), bucket i is [2^(i-1)ms, 2^i ms). The last one
+  // holds everything beyond (which is longer than an hour).
+  static constexpr std::size_t kBuckets = 24;
+
+  std::array<std::atomic<std::uint64_t>, kBuckets> buckets_{};
+  std::atomic<std::uint64_t> sum_us_{};
+  std::atomic<std::uint64_t> max_us_{};
+};
+
+// Outcome of a request for starting new tasks.
+enum class AllocationOutcome {
+  // A servant was available at the time of request.
+  Immediate,
+
+  // A servant was handed to the requestor while it was waiting.
+  Waited,
+
+  // Made for standing demand of a subscription.
+  Subscribed,
+
+  // The requestor joined a running task of the same digest instead.
+  Joined,
+
+  // No servant was available before the requestor gave up.
+  Timeout,
+
+  // No servant recognizes the environment requested.
+  EnvironmentNotFound
+};
+
+constexpr std::size_t kAllocationOutcomes = 6;
+
+// Name of `outcome` for display purpose.
+const char* GetAllocationOutcomeName(AllocationOutcome outcome);
+
+// Number of requests of each outcome, along with number of tasks expired.
+struct AllocationCounters {
+  std::array<std::uint64_t, kAllocationOutcomes> outcomes{};
+  std::uint64_t expired = 0;
+
+  // Accumulate `other` into us.
+  void Add(const AllocationCounters& other);
+
+  Json::Value Dump() const;
+};
+
+// Describes how a request was served.
+struct AllocationDecision {
+  std::chrono::steady_clock::time_point decided_at;
+  AllocationOutcome outcome;
+  std::string requestor_ip;
+  std::string compiler_digest;
+  TaskPriorityClass priority_class;
+
+  // Time the requestor waited for the decision.
+  std::chrono::nanoseconds waited;
+
+  // Not set unless a task is allocated.
+  std::uint64_t task_id;
+  std::string servant_location;
+};
+
+// Keeps a bounded number of most recent decisions. Recording into a full log
+// overwrites the oldest one in place, so it does not allocate memory unless a
+// longer string is recorded.
+//
+// This class is NOT thread-safe.
+class AllocationDecisionLog {
+ public:
+  explicit AllocationDecisionLog(std::size_t capacity);
+
+  // Returns the slot for recording a new decision. All fields should be filled
+  // by the caller.
+  AllocationDecision* Append();
+
+  // Decisions recorded, oldest first.
+  std::vector<AllocationDecision> GetDecisions() const;
+
+ private:
+  std::vector<AllocationDecision> decisions_;
+  std::size_t next_ = 0;
+  bool wrapped_ = false;
+};
+
+}  // namespace yadcc::scheduler
+
+#endif  // YADCC_SCHEDULER_DISPATCHER_METRICS_H_
@@ -0,0 +1,69 @@
+// Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+//
+// Licensed under the BSD 3-Clause License (the "License"); you may not use this
+// file except in compliance with the License. You may obtain a copy of the
+// License at
+//
+// https://opensource.org/licenses/BSD-3-Clause
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "yadcc/scheduler/dispatcher_metrics.h"
+
+#include "gtest/gtest.h"
+
+using namespace std::literals;
+
+namespace yadcc::scheduler {
+
+TEST(LatencyHistogram, Percentile) {
+  LatencyHistogram histogram;
+  EXPECT_EQ(0ns, histogram.GetPercentile(0.5));
+
+  for (int i = 0; i != 90; ++i) {
+    histogram.Report(3ms);  // [2ms, 4ms)
+  }
+  for (int i = 0; i != 9; ++i) {
+    histogram.Report(100ms);  // [64ms, 128ms)
+  }
+  histogram.Report(2h);  // Beyond the last bucket.
+
+  EXPECT_EQ(100, histogram.GetCount());
+  EXPECT_EQ(4ms, histogram.GetPercentile(0.5));
+  EXPECT_EQ(4ms, histogram.GetPercentile(0.9));
+  EXPECT_EQ(128ms, histogram.GetPercentile(0.99));
+  EXPECT_EQ(2h, histogram.GetPercentile(1));
+
+  auto dumped = histogram.Dump();
+  EXPECT_EQ(100, dumped["count"].asUInt64());
+  EXPECT_EQ(7200000, dumped["max_ms"].asUInt64());
+}
+
+TEST(AllocationDecisionLog, Wraparound) {
+  AllocationDecisionLog log(3);
+  EXPECT_TRUE(log.GetDecisions().empty());
+
+  for (int i = 1; i <= 2; ++i) {
+    log.Append()->task_id = i;
+  }
+  auto decisions = log.GetDecisions();
+  ASSERT_EQ(2, decisions.size());
+  EXPECT_EQ(1, decisions[0].task_id);
+  EXPECT_EQ(2, decisions[1].task_id);
+
+  // The oldest ones are overwritten.
+  for (int i = 3; i <= 7; ++i) {
+    log.Append()->task_id = i;
+  }
+  decisions = log.GetDecisions();
+  ASSERT_EQ(3, decisions.size());
+  EXPECT_EQ(5, decisions[0].task_id);
+  EXPECT_EQ(6, decisions[1].task_id);
+  EXPECT_EQ(7, decisions[2].task_id);
+}
+
+}  // namespace yadcc::scheduler
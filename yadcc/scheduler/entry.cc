@@ -50,6 +50,9 @@ int SchedulerStart(int argc, char** argv) {
   server.Stop();
   server.Join();
 
+  // So that our next incarnation starts with up-to-date state.
+  TaskDispatcher::Instance()->SaveSnapshot();
+
   return 0;
 }
 
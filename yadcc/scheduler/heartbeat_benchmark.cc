@@ -0,0 +1,153 @@
+// Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+//
+// Licensed under the BSD 3-Clause License (the "License"); you may not use this
+// file except in compliance with the License. You may obtain a copy of the
+// License at
+//
+// https://opensource.org/licenses/BSD-3-Clause
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "flare/base/logging.h"
+#include "flare/base/string.h"
+
+#include "yadcc/api/scheduler.pb.h"
+#include "yadcc/scheduler/servant_snapshot_keeper.h"
+#include "yadcc/scheduler/task_dispatcher.h"
+
+using namespace std::literals;
+
+// Cost of handling a heartbeat (encoding it at the servant side, and decoding
+// and applying it at the scheduler side) against number of running tasks on
+// each servant, with full state or delta-encoded heartbeats.
+//
+// Between two heartbeats, one task finishes and another one starts on the
+// servant.
+
+namespace yadcc::scheduler {
+
+constexpr auto kServants = 2000;
+constexpr auto kEnvironments = 10;
+
+class Servant {
+ public:
+  Servant(int index, int running_tasks)
+      : location_(flare::Format("10.0.{}.{}:8335", index / 256, index % 256)) {
+    for (int i = 0; i != running_tasks; ++i) {
+      running_tasks_.push_back(next_task_id_++);
+    }
+  }
+
+  // Simulate a task completion and a new task.
+  void Step() {
+    running_tasks_.erase(running_tasks_.begin());
+    running_tasks_.push_back(next_task_id_++);
+  }
+
+  // Serialized heartbeat.
+  std::string Heartbeat(bool delta) {
+    HeartbeatRequest req;
+    req.set_location(location_);
+    req.set_next_heartbeat_in_ms(10000);
+    req.set_version(8);
+    req.set_capacity(64);
+    req.set_num_processors(64);
+    req.set_servant_priority(SERVANT_PRIORITY_DEDICATED);
+    req.set_epoch(++epoch_);
+    if (delta && !acknowledged_tasks_.empty()) {
+      req.set_base_epoch(epoch_ - 1);
+      req.add_removed_running_tasks(acknowledged_tasks_.front());
+      AddRunningTask(running_tasks_.back(), &req);
+    } else {
+      for (int i = 0; i != kEnvironments; ++i) {
+        req.add_env_descs()->set_compiler_digest(flare::Format("{:064x}", i));
+      }
+      for (auto&& e : running_tasks_) {
+        AddRunningTask(e, &req);
+      }
+    }
+    acknowledged_tasks_ = running_tasks_;
+    return req.SerializeAsString();
+  }
+
+ private:
+  void AddRunningTask(std::uint64_t id, HeartbeatRequest* req) {
+    auto task = req->add_running_tasks();
+    task->set_servant_location(location_);
+    task->set_task_grant_id(id);
+    task->set_servant_task_id(id);
+    task->set_task_digest(flare::Format("{:064x}", id));
+  }
+
+ private:
+  std::string location_;
+  std::uint64_t epoch_ = 0;
+  std::uint64_t next_task_id_ = 1;
+  std::vector<std::uint64_t> running_tasks_;
+  std::vector<std::uint64_t> acknowledged_tasks_;
+};
+
+// Mimics what `SchedulerServiceImpl::Heartbeat` does.
+void HandleHeartbeat(const std::string& bytes, ServantSnapshotKeeper* keeper) {
+  HeartbeatRequest req;
+  FLARE_CHECK(req.ParseFromString(bytes));
+  auto snapshot = keeper->Apply(req.location(), req, 10s);
+  FLARE_CHECK(snapshot);
+
+  ServantPersonality servant;
+  servant.observed_location = servant.reported_location = req.location();
+  servant.version = req.version();
+  servant.num_processors = req.num_processors();
+  servant.max_tasks = req.capacity();
+  servant.priority = req.servant_priority();
+  servant.environments = std::move(snapshot->environments);
+  TaskDispatcher::Instance()->KeepServantAlive(servant, 10s);
+  TaskDispatcher::Instance()->NotifyServantRunningTasks(
+      req.location(), std::move(snapshot->running_tasks));
+}
+
+void BenchmarkHeartbeat(benchmark::State& state, bool delta) {
+  ServantSnapshotKeeper keeper;
+  std::vector<Servant> servants;
+  for (int i = 0; i != kServants; ++i) {
+    servants.emplace_back(i, state.range(0));
+    HandleHeartbeat(servants.back().Heartbeat(false), &keeper);
+  }
+
+  int index = 0;
+  std::size_t bytes = 0;
+  while (state.KeepRunning()) {
+    auto&& servant = servants[index++ % kServants];
+    servant.Step();
+    auto heartbeat = servant.Heartbeat(delta);
+    HandleHeartbeat(heartbeat, &keeper);
+    bytes += heartbeat.size();
+  }
+  state.counters["bytes_per_heartbeat"] =
+      static_cast<double>(bytes) / state.iterations();
+}
+
+void Benchmark_FullHeartbeat(benchmark::State& state) {
+  BenchmarkHeartbeat(state, false);
+}
+
+void Benchmark_DeltaHeartbeat(benchmark::State& state) {
+  BenchmarkHeartbeat(state, true);
+}
+
+BENCHMARK(Benchmark_FullHeartbeat)->RangeMultiplier(4)->Range(4, 64);
+BENCHMARK(Benchmark_DeltaHeartbeat)->RangeMultiplier(4)->Range(4, 64);
+
+}  // namespace yadcc::scheduler
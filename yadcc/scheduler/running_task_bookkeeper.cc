@@ -17,6 +17,7 @@
 #include <algorithm>
 #include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace yadcc::scheduler {
@@ -24,13 +25,21 @@ namespace yadcc::scheduler {
 void RunningTaskBookkeeper::SetServantRunningTasks(
     const std::string& servant_location, std::vector<RunningTask> tasks) {
   std::scoped_lock _(lock_);
-  running_tasks_.erase(servant_location);
-  running_tasks_.emplace(servant_location, std::move(tasks));
+  auto&& running = running_tasks_[servant_location];
+  UnsafeUnindexServant(running);
+  running = std::move(tasks);
+  for (auto&& e : running) {
+    tasks_by_digest_.emplace(e.task_digest(), &e);
+  }
 }
 
 void RunningTaskBookkeeper::DropServant(const std::string& servant_location) {
   std::scoped_lock _(lock_);
-  running_tasks_.erase(servant_location);
+  if (auto iter = running_tasks_.find(servant_location);
+      iter != running_tasks_.end()) {
+    UnsafeUnindexServant(iter->second);
+    running_tasks_.erase(iter);
+  }
 }
 
 std::vector<RunningTask> RunningTaskBookkeeper::GetRunningTasks() const {
@@ -42,4 +51,29 @@ std::vector<RunningTask> RunningTaskBookkeeper::GetRunningTasks() const {
   return result;
 }
 
+std::vector<RunningTask> RunningTaskBookkeeper::LookupRunningTasks(
+    const std::vector<std::string>& task_digests) const {
+  std::vector<RunningTask> result;
+  std::scoped_lock _(lock_);
+  for (auto&& e : task_digests) {
+    if (auto iter = tasks_by_digest_.find(e); iter != tasks_by_digest_.end()) {
+      result.push_back(*iter->second);
+    }
+  }
+  return result;
+}
+
+void RunningTaskBookkeeper::UnsafeUnindexServant(
+    const std::vector<RunningTask>& tasks) {
+  for (auto&& e : tasks) {
+    auto [begin, end] = tasks_by_digest_.equal_range(e.task_digest());
+    for (auto iter = begin; iter != end; ++iter) {
+      if (iter->second == &e) {
+        tasks_by_digest_.erase(iter);
+        break;
+      }
+    }
+  }
+}
+
 }  // namespace yadcc::scheduler
@@ -37,9 +37,19 @@ class RunningTaskBookkeeper {
   // Share all running tasks of cluster with daemons.
   std::vector<RunningTask> GetRunningTasks() const;
 
+  // Find running tasks of the given digests. At most one task is returned for
+  // each digest, digests not found are ignored.
+  std::vector<RunningTask> LookupRunningTasks(
+      const std::vector<std::string>& task_digests) const;
+
+ private:
+  void UnsafeUnindexServant(const std::vector<RunningTask>& tasks);
+
  private:
   mutable std::mutex lock_;
   std::unordered_map<std::string, std::vector<RunningTask>> running_tasks_;
+  // Indexes tasks in `running_tasks_` by their digests.
+  std::unordered_multimap<std::string, const RunningTask*> tasks_by_digest_;
 };
 
 }  // namespace yadcc::scheduler
@@ -14,6 +14,7 @@
 
 #include "yadcc/scheduler/running_task_bookkeeper.h"
 
+#include <string>
 #include <vector>
 
 #include "gmock/gmock.h"
@@ -41,4 +42,29 @@ TEST(RunningTaskBookkeeper, ALL) {
   EXPECT_TRUE(running_task_bookkeeper.GetRunningTasks().empty());
 }
 
+TEST(RunningTaskBookkeeper, Lookup) {
+  RunningTaskBookkeeper running_task_bookkeeper;
+  std::vector<RunningTask> tasks;
+  for (int i = 0; i < 3; ++i) {
+    tasks.emplace_back();
+    tasks.back().set_servant_task_id(i + 100);
+    tasks.back().set_task_digest("digest" + std::to_string(i));
+  }
+  running_task_bookkeeper.SetServantRunningTasks("my location", tasks);
+
+  auto result =
+      running_task_bookkeeper.LookupRunningTasks({"digest1", "digest5"});
+  ASSERT_EQ(1, result.size());
+  EXPECT_EQ(101, result[0].servant_task_id());
+
+  // Tasks no longer running are not found.
+  tasks.erase(tasks.begin() + 1);
+  running_task_bookkeeper.SetServantRunningTasks("my location", tasks);
+  EXPECT_TRUE(running_task_bookkeeper.LookupRunningTasks({"digest1"}).empty());
+  EXPECT_EQ(1, running_task_bookkeeper.LookupRunningTasks({"digest2"}).size());
+
+  running_task_bookkeeper.DropServant("my location");
+  EXPECT_TRUE(running_task_bookkeeper.LookupRunningTasks({"digest0"}).empty());
+}
+
 }  // namespace yadcc::scheduler
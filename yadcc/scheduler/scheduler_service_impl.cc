@@ -14,8 +14,11 @@
 
 #include "yadcc/scheduler/scheduler_service_impl.h"
 
+#include <algorithm>
 #include <chrono>
+#include <optional>
 #include <string>
+#include <utility>
 
 #include "gflags/gflags.h"
 #include "openssl/rand.h"
@@ -28,16 +31,27 @@
 #include "flare/rpc/rpc_server_controller.h"
 
 #include "yadcc/common/token_verifier.h"
+#include "yadcc/scheduler/servant_snapshot_keeper.h"
 #include "yadcc/scheduler/task_dispatcher.h"
 
 using namespace std::literals;
 
+DECLARE_int32(max_subscribed_demand);
+
 DEFINE_int32(min_daemon_version, 0,
              "Daemons whose version are older than this option won't be "
              "accepted by this scheduler.");
 DEFINE_int32(serving_daemon_token_rollout_interval, 3600,
              "Interval in seconds between new token to access serving daemon "
              "is rolled out.");
+DEFINE_int32(max_running_task_lookups, 1000,
+             "Maximum number of task digests a single `LookupRunningTasks` "
+             "call may carry.");
+DEFINE_int32(max_task_lease_slots, 16,
+             "Maximum number of slots a single `AcquireTaskLease` call may "
+             "lease.");
+DEFINE_int32(max_task_lease_seconds, 60,
+             "Maximum duration of leases made by `AcquireTaskLease`.");
 
 namespace yadcc::scheduler {
 
@@ -120,18 +134,43 @@ void SchedulerServiceImpl::Heartbeat(const HeartbeatRequest& request,
     return;
   }
 
+  // Only servants may report task costs, these costs drive task placement.
+  //
+  // Tasks completed are reported only once, so don't lose them even if we
+  // can't handle the rest of this heartbeat.
+  bool servant_verified = is_servant_verifier_->Verify(request.token());
+  if (servant_verified) {
+    TaskDispatcher::Instance()->NotifyServantCompletedTasks(
+        {request.completed_tasks().begin(), request.completed_tasks().end()});
+  }
+
+  // Environments and running tasks are possibly delta-encoded, recover them
+  // first.
+  auto snapshot =
+      servant_snapshots_.Apply(observed_location, request, expires_in);
+  if (!snapshot) {
+    FLARE_LOG_INFO("Requesting full snapshot from servant [{}].",
+                   observed_location);
+    response->set_full_snapshot_required(true);
+    return;
+  }
+
   // Notify the dispatcher about this heartbeat then.
   ServantPersonality servant;
   servant.version = request.version();
   servant.observed_location = observed_location;
   servant.reported_location = reported_location;
+  servant.zone = request.zone();
   servant.current_load = request.current_load();
+  servant.runnable_tasks = request.runnable_tasks();
   servant.num_processors = request.num_processors();
   if (servant.num_processors == 0) {
     // Older daemon does not report number of processors present, so fake a
     // value here.
     servant.num_processors = request.capacity();
   }
+  servant.num_physical_cores = request.num_physical_cores();
+  servant.smt_ways = request.smt_ways();
   servant.total_memory_in_bytes = request.total_memory_in_bytes();
   servant.memory_available_in_bytes = request.memory_available_in_bytes();
   servant.priority = request.servant_priority();
@@ -151,13 +190,11 @@ void SchedulerServiceImpl::Heartbeat(const HeartbeatRequest& request,
     servant.max_tasks = 0;
     servant.not_accepting_task_reason = NOT_ACCEPTING_TASK_REASON_BEHIND_NAT;
   }
-  if (!is_servant_verifier_->Verify(request.token())) {
+  if (!servant_verified) {
     servant.max_tasks = 0;
     servant.not_accepting_task_reason = NOT_ACCEPTING_TASK_REASON_NOT_VERIFIED;
   }
-  for (auto&& e : request.env_descs()) {
-    servant.environments.push_back(e);
-  }
+  servant.environments = std::move(snapshot->environments);
 
   // Well by our definition, if `expires_in` is 0, the servant should be removed
   // immediately. Here we don't take that specially. Instead, we're relying on
@@ -178,11 +215,13 @@ void SchedulerServiceImpl::Heartbeat(const HeartbeatRequest& request,
   // Sent back the task the daemon should be running on. Any tasks not listed
   // here will likely be killed by the daemon.
   auto expired_task = TaskDispatcher::Instance()->NotifyServantRunningTasks(
-      request.location(),
-      {request.running_tasks().begin(), request.running_tasks().end()});
+      request.location(), std::move(snapshot->running_tasks));
   for (auto&& e : expired_task) {
     response->add_expired_tasks(e);
   }
+  if (request.epoch()) {
+    response->set_acknowledged_epoch(request.epoch());
+  }
 
   // It's not always a sign of error, `response->expired_tasks().empty()` can be
   // non-empty because of the following reasons:
@@ -228,46 +267,185 @@ void SchedulerServiceImpl::WaitForStartingTask(
   TaskPersonality task;
   task.requestor_ip = flare::EndpointGetIp(controller->GetRemotePeer());
   task.min_version = request.min_version();
+  task.zone = request.zone();
   task.env_desc = request.env_desc();
+  task.expected_cost =
+      TaskDispatcher::Instance()->GetExpectedTaskCost(request.task_cost_key());
+  task.task_digest = request.task_digest();
+  // Older clients don't tell us, their tasks are treated as interactive ones.
+  task.priority_class =
+      request.priority_class() == TASK_PRIORITY_CLASS_UNKNOWN
+          ? TASK_PRIORITY_CLASS_INTERACTIVE
+          : request.priority_class();
+
+  // All grants are allocated in one shot. Only the first grant is waited for.
+  std::optional<RunningTask> existing_task;
+  auto result = TaskDispatcher::Instance()->WaitForStartingNewTasks(
+      task, next_keep_alive, flare::ReadCoarseSteadyClock() + max_wait,
+      request.immediate_reqs(), request.prefetch_reqs(), &existing_task);
+  if (existing_task) {
+    *response->mutable_existing_task() = std::move(*existing_task);
+    return;
+  }
+  if (!result) {
+    // Prefetch-only requests are not treated as errors. The caller is not
+    // actually waiting for them.
+    if (result.error() == WaitStatus::EnvironmentNotFound &&
+        request.immediate_reqs()) {
+      controller->SetFailed(STATUS_ENVIRONMENT_NOT_AVAILABLE,
+                            "No matched servant environment.");
+      return;
+    }
+  } else {
+    for (auto&& e : *result) {
+      auto&& added = response->add_grants();
+      added->set_task_grant_id(e.task_id);
+      added->set_servant_location(e.servant_location);
+    }
+  }
 
-  auto now = flare::ReadCoarseSteadyClock();
-  for (int i = 0; i != request.immediate_reqs(); ++i) {
-    auto result = TaskDispatcher::Instance()->WaitForStartingNewTask(
-        task, next_keep_alive,
-        // Note that we can't wait except for the first task. If we wait for too
-        // long for the remaining tasks, the first task may have already been
-        // expired before we even return.
-        now + (i == 0 ? max_wait : 0s), false);
-    if (!result) {
-      if (result.error() == WaitStatus::EnvironmentNotFound) {
-        controller->SetFailed(STATUS_ENVIRONMENT_NOT_AVAILABLE,
-                              "No matched servant environment.");
-        return;
-      }
-      break;
+  // Requests only looking for a task to join get nothing otherwise, that's
+  // not an error.
+  if (response->grants().empty() &&
+      (request.immediate_reqs() || request.prefetch_reqs())) {
+    controller->SetFailed(STATUS_NO_QUOTA_AVAILABLE,
+                          "The compilation cloud is busy now.");
+    return;
+  }
+}
+
+void SchedulerServiceImpl::SubscribeTaskGrants(
+    const SubscribeTaskGrantsRequest& request,
+    SubscribeTaskGrantsResponse* response,
+    flare::RpcServerController* controller) {
+  flare::AddLoggingItemToRpc(controller->GetRemotePeer().ToString());
+
+  // Verify the requestor first.
+  if (!is_user_verifier_->Verify(request.token())) {
+    controller->SetFailed(STATUS_ACCESS_DENIED);
+    return;
+  }
+
+  auto max_wait = request.milliseconds_to_wait() * 1ms;
+  auto next_keep_alive = request.next_keep_alive_in_ms() * 1ms;
+  if (max_wait > 10s || next_keep_alive > 30s) {
+    controller->SetFailed(STATUS_INVALID_ARGUMENT);
+    return;
+  }
+
+  response->set_max_demand_per_environment(FLAGS_max_subscribed_demand);
+  for (auto&& e : request.demand_deltas()) {
+    if (e.delta() > FLAGS_max_subscribed_demand ||
+        e.delta() < (request.reset() ? 0 : -FLAGS_max_subscribed_demand)) {
+      controller->SetFailed(STATUS_INVALID_ARGUMENT);
+      return;
     }
-    auto&& added = response->add_grants();
-    added->set_task_grant_id(result->task_id);
-    added->set_servant_location(result->servant_location);
   }
 
-  for (int i = 0; i != request.prefetch_reqs(); ++i) {
-    auto result = TaskDispatcher::Instance()->WaitForStartingNewTask(
-        task, next_keep_alive,
-        now + (response->grants().empty() ? max_wait : 0s), true);
-    if (!result) {
-      break;
+  if (request.reset() || !request.demand_deltas().empty()) {
+    std::vector<DemandDelta> deltas;
+    for (auto&& e : request.demand_deltas()) {
+      auto&& added = deltas.emplace_back();
+      added.personality.requestor_ip =
+          flare::EndpointGetIp(controller->GetRemotePeer());
+      added.personality.min_version = request.min_version();
+      added.personality.zone = request.zone();
+      added.personality.env_desc = e.env_desc();
+      added.personality.priority_class =
+          request.priority_class() == TASK_PRIORITY_CLASS_UNKNOWN
+              ? TASK_PRIORITY_CLASS_INTERACTIVE
+              : request.priority_class();
+      added.delta = e.delta();
+      for (int i = 0; i < std::min(e.task_cost_keys().size(), e.delta());
+           ++i) {
+        added.expected_costs.push_back(
+            TaskDispatcher::Instance()->GetExpectedTaskCost(
+                e.task_cost_keys(i)));
+      }
+    }
+    if (!TaskDispatcher::Instance()->UpdateSubscription(
+            request.subscription_id(), request.sequence(), request.reset(),
+            deltas, next_keep_alive)) {
+      response->set_resync_required(true);
+      return;
     }
+  }
+
+  auto result = TaskDispatcher::Instance()->WaitForSubscribedAllocations(
+      request.subscription_id(), flare::ReadCoarseSteadyClock() + max_wait);
+  if (!result) {
+    response->set_resync_required(true);
+    return;
+  }
+  auto now = flare::ReadCoarseSteadyClock();
+  for (auto&& e : *result) {
     auto&& added = response->add_grants();
-    added->set_task_grant_id(result->task_id);
-    added->set_servant_location(result->servant_location);
+    added->set_compiler_digest(e.compiler_digest);
+    added->set_task_grant_id(e.allocation.task_id);
+    added->set_servant_location(e.allocation.servant_location);
+    added->set_expires_in_ms(
+        std::max<std::int64_t>((e.expires_at - now) / 1ms, 0));
   }
+}
 
-  if (response->grants().empty()) {
-    controller->SetFailed(STATUS_NO_QUOTA_AVAILABLE,
-                          "The compilation cloud is busy now.");
+void SchedulerServiceImpl::AcquireTaskLease(
+    const AcquireTaskLeaseRequest& request, AcquireTaskLeaseResponse* response,
+    flare::RpcServerController* controller) {
+  flare::AddLoggingItemToRpc(controller->GetRemotePeer().ToString());
+
+  // Verify the requestor first.
+  if (!is_user_verifier_->Verify(request.token())) {
+    controller->SetFailed(STATUS_ACCESS_DENIED);
+    return;
+  }
+
+  auto max_wait = request.milliseconds_to_wait() * 1ms;
+  if (max_wait > 10s || !request.desired_slots()) {
+    controller->SetFailed(STATUS_INVALID_ARGUMENT);
+    return;
+  }
+  auto duration = std::min<std::chrono::nanoseconds>(
+      request.lease_duration_ms() * 1ms, FLAGS_max_task_lease_seconds * 1s);
+  auto slots = std::min<std::size_t>(request.desired_slots(),
+                                     FLAGS_max_task_lease_slots);
+
+  TaskPersonality task;
+  task.requestor_ip = flare::EndpointGetIp(controller->GetRemotePeer());
+  task.min_version = request.min_version();
+  task.zone = request.zone();
+  task.env_desc = request.env_desc();
+  task.expected_cost =
+      TaskDispatcher::Instance()->GetExpectedTaskCost(request.task_cost_key());
+  task.priority_class =
+      request.priority_class() == TASK_PRIORITY_CLASS_UNKNOWN
+          ? TASK_PRIORITY_CLASS_INTERACTIVE
+          : request.priority_class();
+
+  auto result = TaskDispatcher::Instance()->WaitForLeasingTasks(
+      task, duration, flare::ReadCoarseSteadyClock() + max_wait, slots);
+  if (!result) {
+    if (result.error() == WaitStatus::EnvironmentNotFound) {
+      controller->SetFailed(STATUS_ENVIRONMENT_NOT_AVAILABLE,
+                            "No matched servant environment.");
+    } else {
+      controller->SetFailed(STATUS_NO_QUOTA_AVAILABLE,
+                            "The compilation cloud is busy now.");
+    }
     return;
   }
+
+  // Slots on the same servant are returned as a single lease. Allocations
+  // don't spread over many servants, so a linear scan is fine.
+  for (auto&& e : *result) {
+    auto leases = response->mutable_leases();
+    auto iter = std::find_if(leases->begin(), leases->end(), [&](auto&& l) {
+      return l.servant_location() == e.servant_location;
+    });
+    auto lease = iter != leases->end() ? &*iter : response->add_leases();
+    lease->set_servant_location(e.servant_location);
+    lease->add_task_grant_ids(e.task_id);
+    lease->set_expires_in_ms(duration / 1ms);
+  }
 }
 
 void SchedulerServiceImpl::KeepTaskAlive(
@@ -317,6 +495,20 @@ void SchedulerServiceImpl::GetRunningTasks(
   }
 }
 
+void SchedulerServiceImpl::LookupRunningTasks(
+    const LookupRunningTasksRequest& request,
+    LookupRunningTasksResponse* response,
+    flare::RpcServerController* controller) {
+  if (request.task_digests().size() > FLAGS_max_running_task_lookups) {
+    controller->SetFailed(STATUS_INVALID_ARGUMENT);
+    return;
+  }
+  for (auto&& running_task : TaskDispatcher::Instance()->LookupRunningTasks(
+           {request.task_digests().begin(), request.task_digests().end()})) {
+    *response->add_running_tasks() = std::move(running_task);
+  }
+}
+
 std::vector<std::string>
 SchedulerServiceImpl::DetermineActiveServingDaemonTokens() {
   std::scoped_lock _(lock_);
@@ -24,6 +24,7 @@
 
 #include "yadcc/api/scheduler.flare.pb.h"
 #include "yadcc/common/token_verifier.h"
+#include "yadcc/scheduler/servant_snapshot_keeper.h"
 
 namespace yadcc::scheduler {
 
@@ -40,6 +41,12 @@ class SchedulerServiceImpl : public SyncSchedulerService {
   void WaitForStartingTask(const WaitForStartingTaskRequest& request,
                            WaitForStartingTaskResponse* response,
                            flare::RpcServerController* controller) override;
+  void SubscribeTaskGrants(const SubscribeTaskGrantsRequest& request,
+                           SubscribeTaskGrantsResponse* response,
+                           flare::RpcServerController* controller) override;
+  void AcquireTaskLease(const AcquireTaskLeaseRequest& request,
+                        AcquireTaskLeaseResponse* response,
+                        flare::RpcServerController* controller) override;
   void KeepTaskAlive(const KeepTaskAliveRequest& request,
                      KeepTaskAliveResponse* response,
                      flare::RpcServerController* controller) override;
@@ -49,6 +56,9 @@ class SchedulerServiceImpl : public SyncSchedulerService {
   void GetRunningTasks(const GetRunningTasksRequest& request,
                        GetRunningTasksResponse* response,
                        flare::RpcServerController* controller) override;
+  void LookupRunningTasks(const LookupRunningTasksRequest& request,
+                          LookupRunningTasksResponse* response,
+                          flare::RpcServerController* controller) override;
 
  private:
   std::vector<std::string> DetermineActiveServingDaemonTokens();
@@ -57,6 +67,9 @@ class SchedulerServiceImpl : public SyncSchedulerService {
   std::unique_ptr<TokenVerifier> is_user_verifier_;
   std::unique_ptr<TokenVerifier> is_servant_verifier_;
 
+  // Last acknowledged state of servants.
+  ServantSnapshotKeeper servant_snapshots_;
+
   std::mutex lock_;
   std::chrono::steady_clock::time_point next_serving_daemon_token_rollout_{};
   // Exactly 3 tokens in this list:
@@ -82,6 +82,10 @@ TEST(SchedulerServiceImpl, TokenWithIntersection) {
     FLAGS_acceptable_user_tokens = "token1,token2";
     FLAGS_acceptable_servant_tokens = "token2,token3";
     TaskDispatcher::Instance()->servants_.servants.clear();
+    TaskDispatcher::Instance()->servants_.expirations.clear();
+    for (auto&& e : TaskDispatcher::Instance()->shards_) {
+      e->environments.clear();
+    }
 
     SchedulerServiceImpl impl;
     flare::RpcServerController ctlr;
@@ -117,7 +121,7 @@ TEST(SchedulerServiceImpl, TokenWithIntersection) {
     EXPECT_EQ(STATUS_ACCESS_DENIED, ctlr.ErrorCode());
 
     std::set<std::string> endpoints;
-    for (auto&& e : TaskDispatcher::Instance()->servants_.servants) {
+    for (auto&& [_, e] : TaskDispatcher::Instance()->servants_.servants) {
       endpoints.insert(e->personality.reported_location);
     }
     ASSERT_EQ(1, endpoints.count("192.0.2.128:6666"));
@@ -132,6 +136,10 @@ TEST(SchedulerServiceImpl, TokenWithoutIntersection) {
     FLAGS_acceptable_user_tokens = "token1";
     FLAGS_acceptable_servant_tokens = "token2";
     TaskDispatcher::Instance()->servants_.servants.clear();
+    TaskDispatcher::Instance()->servants_.expirations.clear();
+    for (auto&& e : TaskDispatcher::Instance()->shards_) {
+      e->environments.clear();
+    }
 
     SchedulerServiceImpl impl;
     flare::RpcServerController ctlr;
@@ -161,7 +169,7 @@ TEST(SchedulerServiceImpl, TokenWithoutIntersection) {
     EXPECT_EQ(STATUS_ACCESS_DENIED, ctlr.ErrorCode());
 
     std::set<std::string> endpoints;
-    for (auto&& e : TaskDispatcher::Instance()->servants_.servants) {
+    for (auto&& [_, e] : TaskDispatcher::Instance()->servants_.servants) {
       endpoints.insert(e->personality.reported_location);
       FLARE_LOG_ERROR("{}", e->personality.reported_location);
     }
@@ -171,6 +179,70 @@ TEST(SchedulerServiceImpl, TokenWithoutIntersection) {
   });
 }
 
+TEST(SchedulerServiceImpl, CompletedTasksFromUnverifiedServant) {
+  flare::fiber::ExecutionContext::Create()->Execute([&] {
+    FLAGS_acceptable_user_tokens = "token1";
+    FLAGS_acceptable_servant_tokens = "token2";
+
+    SchedulerServiceImpl impl;
+    flare::RpcServerController ctlr;
+
+    HeartbeatRequest req;
+    HeartbeatResponse resp;
+    req.set_servant_priority(SERVANT_PRIORITY_USER);
+    req.set_location("192.0.2.128:6666");
+    flare::testing::SetRpcServerRemotePeer(
+        &ctlr, flare::EndpointFromString("192.0.2.1:12345"));
+    auto&& completed = req.add_completed_tasks();
+    completed->set_task_cost_key("unverified-cost-key");
+    completed->set_compile_time_ms(1000);
+    completed->set_peak_memory_in_bytes(1 << 30);
+
+    // Accepted as a user, but not as a servant.
+    req.set_token("token1");
+    impl.Heartbeat(req, &resp, &ctlr);
+    ASSERT_FALSE(ctlr.Failed());
+    EXPECT_FALSE(TaskDispatcher::Instance()->GetExpectedTaskCost(
+        "unverified-cost-key"));
+
+    ctlr.Reset();
+    req.set_token("token2");
+    completed->set_task_cost_key("verified-cost-key");
+    impl.Heartbeat(req, &resp, &ctlr);
+    ASSERT_FALSE(ctlr.Failed());
+    EXPECT_TRUE(
+        TaskDispatcher::Instance()->GetExpectedTaskCost("verified-cost-key"));
+  });
+}
+
+TEST(SchedulerServiceImpl, SubscribeTaskGrantsExcessiveDemand) {
+  flare::fiber::ExecutionContext::Create()->Execute([&] {
+    FLAGS_acceptable_user_tokens = "token1";
+
+    SchedulerServiceImpl impl;
+    flare::RpcServerController ctlr;
+
+    SubscribeTaskGrantsRequest req;
+    SubscribeTaskGrantsResponse resp;
+    req.set_token("token1");
+    req.set_subscription_id(1);
+    req.set_reset(true);
+    flare::testing::SetRpcServerRemotePeer(
+        &ctlr, flare::EndpointFromString("192.0.2.1:12345"));
+    auto&& delta = req.add_demand_deltas();
+    delta->mutable_env_desc()->set_compiler_digest("my-digest");
+    delta->set_delta(1000000);
+
+    impl.SubscribeTaskGrants(req, &resp, &ctlr);
+    EXPECT_EQ(STATUS_INVALID_ARGUMENT, ctlr.ErrorCode());
+
+    ctlr.Reset();
+    delta->set_delta(-1);
+    impl.SubscribeTaskGrants(req, &resp, &ctlr);
+    EXPECT_EQ(STATUS_INVALID_ARGUMENT, ctlr.ErrorCode());
+  });
+}
+
 }  // namespace yadcc::scheduler
 
 FLARE_TEST_MAIN
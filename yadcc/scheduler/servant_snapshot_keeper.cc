@@ -0,0 +1,132 @@
+// Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+//
+// Licensed under the BSD 3-Clause License (the "License"); you may not use this
+// file except in compliance with the License. You may obtain a copy of the
+// License at
+//
+// https://opensource.org/licenses/BSD-3-Clause
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "yadcc/scheduler/servant_snapshot_keeper.h"
+
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include "flare/base/chrono.h"
+
+using namespace std::literals;
+
+namespace yadcc::scheduler {
+
+namespace {
+
+// Servant's state is kept a bit longer than the servant itself, in case its
+// heartbeat is delayed.
+constexpr auto kExpirationSlack = 10s;
+
+// Interval between two purges of expired servants.
+constexpr auto kPurgeInterval = 1s;
+
+}  // namespace
+
+std::optional<ServantSnapshotKeeper::Snapshot> ServantSnapshotKeeper::Apply(
+    const std::string& location, const HeartbeatRequest& heartbeat,
+    std::chrono::nanoseconds expires_in) {
+  auto now = flare::ReadCoarseSteadyClock();
+  std::scoped_lock _(lock_);
+
+  UnsafePurgeExpired(now);
+
+  if (heartbeat.base_epoch() == 0) {
+    // Full snapshot. This is also the case for older daemons, which do not
+    // know about delta-encoding at all.
+    Snapshot result;
+    result.environments.assign(heartbeat.env_descs().begin(),
+                               heartbeat.env_descs().end());
+    result.running_tasks.assign(heartbeat.running_tasks().begin(),
+                                heartbeat.running_tasks().end());
+    if (heartbeat.epoch() == 0 || expires_in == 0ns) {
+      // Either the servant won't send us a delta, or it's leaving.
+      servants_.erase(location);
+      return result;
+    }
+    auto&& state = servants_[location];
+    state.epoch = heartbeat.epoch();
+    state.expires_at = now + expires_in + kExpirationSlack;
+    state.environments.clear();
+    state.running_tasks.clear();
+    for (auto&& e : result.environments) {
+      state.environments[e.compiler_digest()] = e;
+    }
+    for (auto&& e : result.running_tasks) {
+      state.running_tasks[e.servant_task_id()] = e;
+    }
+    return result;
+  }
+
+  auto iter = servants_.find(location);
+  if (iter == servants_.end() || iter->second.epoch != heartbeat.base_epoch()) {
+    return std::nullopt;
+  }
+
+  // Apply the delta.
+  auto&& state = iter->second;
+  for (auto&& e : heartbeat.removed_env_digests()) {
+    state.environments.erase(e);
+  }
+  for (auto&& e : heartbeat.env_descs()) {
+    state.environments[e.compiler_digest()] = e;
+  }
+  for (auto&& e : heartbeat.removed_running_tasks()) {
+    state.running_tasks.erase(e);
+  }
+  for (auto&& e : heartbeat.running_tasks()) {
+    state.running_tasks[e.servant_task_id()] = e;
+  }
+  state.epoch = heartbeat.epoch();
+  state.expires_at = now + expires_in + kExpirationSlack;
+
+  Snapshot result;
+  result.environments.reserve(state.environments.size());
+  result.running_tasks.reserve(state.running_tasks.size());
+  for (auto&& [k, v] : state.environments) {
+    result.environments.push_back(v);
+  }
+  for (auto&& [k, v] : state.running_tasks) {
+    result.running_tasks.push_back(v);
+  }
+  if (expires_in == 0ns) {
+    servants_.erase(iter);
+  }
+  return result;
+}
+
+std::size_t ServantSnapshotKeeper::GetSize() const {
+  std::scoped_lock _(lock_);
+  return servants_.size();
+}
+
+void ServantSnapshotKeeper::UnsafePurgeExpired(
+    std::chrono::steady_clock::time_point now) {
+  if (now < next_purge_) {
+    return;
+  }
+  next_purge_ = now + kPurgeInterval;
+  for (auto iter = servants_.begin(); iter != servants_.end();) {
+    if (iter->second.expires_at < now) {
+      iter = servants_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+}  // namespace yadcc::scheduler
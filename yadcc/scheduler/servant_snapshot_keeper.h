@@ -0,0 +1,81 @@
+// Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+//
+// Licensed under the BSD 3-Clause License (the "License"); you may not use this
+// file except in compliance with the License. You may obtain a copy of the
+// License at
+//
+// https://opensource.org/licenses/BSD-3-Clause
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#ifndef YADCC_SCHEDULER_SERVANT_SNAPSHOT_KEEPER_H_
+#define YADCC_SCHEDULER_SERVANT_SNAPSHOT_KEEPER_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "yadcc/api/env_desc.pb.h"
+#include "yadcc/api/scheduler.pb.h"
+
+namespace yadcc::scheduler {
+
+// Reassembles servants' state from their heartbeats.
+//
+// Environments and running tasks rarely change between two consecutive
+// heartbeats, so once we've acknowledged a heartbeat, the servant sends only
+// what has been added or removed since then (@sa: `HeartbeatRequest.epoch` in
+// `api/scheduler.proto`). This class keeps the last acknowledged state of each
+// servant so that the full state can be recovered.
+class ServantSnapshotKeeper {
+ public:
+  // Full state of a servant.
+  struct Snapshot {
+    std::vector<EnvironmentDesc> environments;
+    std::vector<RunningTask> running_tasks;
+  };
+
+  // Apply `heartbeat` received from servant at `location`, and returns full
+  // state of the servant after applying it.
+  //
+  // `std::nullopt` is returned if `heartbeat` is a delta against a state we
+  // don't know (e.g., we've restarted, or the servant has missed our
+  // acknowledgement). The servant should be asked for a full snapshot then.
+  //
+  // State of the servant is dropped if it does not send us another heartbeat
+  // in `expires_in`.
+  std::optional<Snapshot> Apply(const std::string& location,
+                                const HeartbeatRequest& heartbeat,
+                                std::chrono::nanoseconds expires_in);
+
+  // Number of servants whose state is kept.
+  std::size_t GetSize() const;
+
+ private:
+  struct ServantState {
+    std::uint64_t epoch;
+    std::chrono::steady_clock::time_point expires_at;
+    std::unordered_map<std::string, EnvironmentDesc> environments;
+    std::unordered_map<std::uint64_t, RunningTask> running_tasks;
+  };
+
+  void UnsafePurgeExpired(std::chrono::steady_clock::time_point now);
+
+ private:
+  mutable std::mutex lock_;
+  std::chrono::steady_clock::time_point next_purge_{};
+  std::unordered_map<std::string, ServantState> servants_;
+};
+
+}  // namespace yadcc::scheduler
+
+#endif  // YADCC_SCHEDULER_SERVANT_SNAPSHOT_KEEPER_H_
@@ -0,0 +1,120 @@
+// Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+//
+// Licensed under the BSD 3-Clause License (the "License"); you may not use this
+// file except in compliance with the License. You may obtain a copy of the
+// License at
+//
+// https://opensource.org/licenses/BSD-3-Clause
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+
+#include "yadcc/scheduler/servant_snapshot_keeper.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using namespace std::literals;
+
+namespace yadcc::scheduler {
+
+namespace {
+
+std::vector<std::string> GetDigests(
+    const ServantSnapshotKeeper::Snapshot& snapshot) {
+  std::vector<std::string> result;
+  for (auto&& e : snapshot.environments) {
+    result.push_back(e.compiler_digest());
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+std::vector<std::uint64_t> GetTaskIds(
+    const ServantSnapshotKeeper::Snapshot& snapshot) {
+  std::vector<std::uint64_t> result;
+  for (auto&& e : snapshot.running_tasks) {
+    result.push_back(e.servant_task_id());
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+}  // namespace
+
+TEST(ServantSnapshotKeeper, Delta) {
+  ServantSnapshotKeeper keeper;
+
+  HeartbeatRequest full;
+  full.set_epoch(1);
+  full.add_env_descs()->set_compiler_digest("a");
+  full.add_env_descs()->set_compiler_digest("b");
+  full.add_running_tasks()->set_servant_task_id(1);
+  full.add_running_tasks()->set_servant_task_id(2);
+  auto snapshot = keeper.Apply("192.0.2.1:8335", full, 10s);
+  ASSERT_TRUE(snapshot);
+  EXPECT_EQ((std::vector<std::string>{"a", "b"}), GetDigests(*snapshot));
+  EXPECT_EQ((std::vector<std::uint64_t>{1, 2}), GetTaskIds(*snapshot));
+
+  HeartbeatRequest delta;
+  delta.set_epoch(2);
+  delta.set_base_epoch(1);
+  delta.add_env_descs()->set_compiler_digest("c");
+  delta.add_removed_env_digests("a");
+  delta.add_running_tasks()->set_servant_task_id(3);
+  delta.add_removed_running_tasks(1);
+  snapshot = keeper.Apply("192.0.2.1:8335", delta, 10s);
+  ASSERT_TRUE(snapshot);
+  EXPECT_EQ((std::vector<std::string>{"b", "c"}), GetDigests(*snapshot));
+  EXPECT_EQ((std::vector<std::uint64_t>{2, 3}), GetTaskIds(*snapshot));
+
+  // Delta against an epoch not acknowledged.
+  delta.set_epoch(4);
+  delta.set_base_epoch(3);
+  EXPECT_FALSE(keeper.Apply("192.0.2.1:8335", delta, 10s));
+
+  // Delta from a servant we know nothing about.
+  EXPECT_FALSE(keeper.Apply("192.0.2.2:8335", delta, 10s));
+}
+
+TEST(ServantSnapshotKeeper, OlderDaemon) {
+  ServantSnapshotKeeper keeper;
+
+  HeartbeatRequest full;
+  full.add_env_descs()->set_compiler_digest("a");
+  full.add_running_tasks()->set_servant_task_id(1);
+  auto snapshot = keeper.Apply("192.0.2.1:8335", full, 10s);
+  ASSERT_TRUE(snapshot);
+  EXPECT_EQ((std::vector<std::string>{"a"}), GetDigests(*snapshot));
+  EXPECT_EQ((std::vector<std::uint64_t>{1}), GetTaskIds(*snapshot));
+
+  // No state is kept for servants that never send delta.
+  EXPECT_EQ(0, keeper.GetSize());
+}
+
+TEST(ServantSnapshotKeeper, Leaving) {
+  ServantSnapshotKeeper keeper;
+
+  HeartbeatRequest full;
+  full.set_epoch(1);
+  full.add_env_descs()->set_compiler_digest("a");
+  ASSERT_TRUE(keeper.Apply("192.0.2.1:8335", full, 10s));
+  EXPECT_EQ(1, keeper.GetSize());
+
+  HeartbeatRequest delta;
+  delta.set_epoch(2);
+  delta.set_base_epoch(1);
+  auto snapshot = keeper.Apply("192.0.2.1:8335", delta, 0s);
+  ASSERT_TRUE(snapshot);
+  EXPECT_EQ((std::vector<std::string>{"a"}), GetDigests(*snapshot));
+  EXPECT_EQ(0, keeper.GetSize());
+}
+
+}  // namespace yadcc::scheduler
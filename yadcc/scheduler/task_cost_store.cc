@@ -0,0 +1,76 @@
+// Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+//
+// Licensed under the BSD 3-Clause License (the "License"); you may not use this
+// file except in compliance with the License. You may obtain a copy of the
+// License at
+//
+// https://opensource.org/licenses/BSD-3-Clause
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "yadcc/scheduler/task_cost_store.h"
+
+#include <algorithm>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "flare/base/logging.h"
+
+namespace yadcc::scheduler {
+
+namespace {
+
+// Weight of the newest sample when averaging compilation time.
+constexpr auto kNewSampleWeight = 0.25;
+
+}  // namespace
+
+TaskCostStore::TaskCostStore(std::size_t capacity) : capacity_(capacity) {
+  FLARE_CHECK_GT(capacity_, 0);
+}
+
+void TaskCostStore::Report(const std::string& key, const TaskCost& observed) {
+  std::scoped_lock _(lock_);
+  auto iter = costs_.find(key);
+  if (iter == costs_.end()) {
+    if (costs_.size() >= capacity_) {
+      costs_.erase(lru_.back().first);
+      lru_.pop_back();
+    }
+    lru_.emplace_front(key, observed);
+    costs_.emplace(key, lru_.begin());
+    return;
+  }
+
+  lru_.splice(lru_.begin(), lru_, iter->second);
+  auto&& cost = iter->second->second;
+  cost.compile_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      cost.compile_time * (1 - kNewSampleWeight) +
+      observed.compile_time * kNewSampleWeight);
+  cost.peak_memory_in_bytes = std::max<std::size_t>(
+      cost.peak_memory_in_bytes * (1 - kNewSampleWeight) +
+          observed.peak_memory_in_bytes * kNewSampleWeight,
+      observed.peak_memory_in_bytes);
+}
+
+std::optional<TaskCost> TaskCostStore::TryGet(const std::string& key) {
+  std::scoped_lock _(lock_);
+  auto iter = costs_.find(key);
+  if (iter == costs_.end()) {
+    return std::nullopt;
+  }
+  lru_.splice(lru_.begin(), lru_, iter->second);
+  return iter->second->second;
+}
+
+std::size_t TaskCostStore::GetSize() const {
+  std::scoped_lock _(lock_);
+  return costs_.size();
+}
+
+}  // namespace yadcc::scheduler
@@ -0,0 +1,74 @@
+// Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+//
+// Licensed under the BSD 3-Clause License (the "License"); you may not use this
+// file except in compliance with the License. You may obtain a copy of the
+// License at
+//
+// https://opensource.org/licenses/BSD-3-Clause
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#ifndef YADCC_SCHEDULER_TASK_COST_STORE_H_
+#define YADCC_SCHEDULER_TASK_COST_STORE_H_
+
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace yadcc::scheduler {
+
+// Cost of a task observed by the servant.
+struct TaskCost {
+  // Wall-clock time the compiler ran for.
+  std::chrono::nanoseconds compile_time{};
+
+  // Peak resident set size of the compiler.
+  std::size_t peak_memory_in_bytes = 0;
+};
+
+// Historical cost of tasks, keyed by task cost key (@sa: `CompletedTask` in
+// `api/scheduler.proto`). Servants feed us cost of tasks they've completed, and
+// we estimate cost of later tasks of the same key from them.
+//
+// Only a bounded number of keys is kept, the least recently used ones are
+// evicted first.
+class TaskCostStore {
+ public:
+  explicit TaskCostStore(std::size_t capacity);
+
+  // Account cost of a task that has just completed.
+  //
+  // Compilation time is averaged (exponentially weighted) over recent samples.
+  // For memory, we're conservative and never estimate a value lower than the
+  // latest sample.
+  void Report(const std::string& key, const TaskCost& observed);
+
+  // Get estimated cost of task of the given key, if it's ever reported.
+  std::optional<TaskCost> TryGet(const std::string& key);
+
+  // Number of keys we know about.
+  std::size_t GetSize() const;
+
+ private:
+  using LruList = std::list<std::pair<std::string, TaskCost>>;
+
+  std::size_t capacity_;
+
+  mutable std::mutex lock_;
+  // Most recently used one comes first.
+  LruList lru_;
+  std::unordered_map<std::string, LruList::iterator> costs_;
+};
+
+}  // namespace yadcc::scheduler
+
+#endif  // YADCC_SCHEDULER_TASK_COST_STORE_H_
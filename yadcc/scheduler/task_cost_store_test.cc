@@ -0,0 +1,61 @@
+// Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+//
+// Licensed under the BSD 3-Clause License (the "License"); you may not use this
+// file except in compliance with the License. You may obtain a copy of the
+// License at
+//
+// https://opensource.org/licenses/BSD-3-Clause
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include "yadcc/scheduler/task_cost_store.h"
+
+#include "gtest/gtest.h"
+
+using namespace std::literals;
+
+namespace yadcc::scheduler {
+
+TEST(TaskCostStore, Average) {
+  TaskCostStore store(10);
+
+  EXPECT_FALSE(store.TryGet("key"));
+  store.Report("key", TaskCost{.compile_time = 8s,
+                               .peak_memory_in_bytes = 1000});
+  auto cost = store.TryGet("key");
+  ASSERT_TRUE(cost);
+  EXPECT_EQ(8s, cost->compile_time);
+  EXPECT_EQ(1000, cost->peak_memory_in_bytes);
+
+  store.Report("key", TaskCost{.compile_time = 4s,
+                               .peak_memory_in_bytes = 200});
+  cost = store.TryGet("key");
+  ASSERT_TRUE(cost);
+  EXPECT_EQ(7s, cost->compile_time);
+  EXPECT_EQ(800, cost->peak_memory_in_bytes);
+
+  // Memory estimation is never lower than the latest sample.
+  store.Report("key", TaskCost{.compile_time = 7s,
+                               .peak_memory_in_bytes = 2000});
+  EXPECT_EQ(2000, store.TryGet("key")->peak_memory_in_bytes);
+}
+
+TEST(TaskCostStore, Eviction) {
+  TaskCostStore store(2);
+
+  store.Report("a", TaskCost{.compile_time = 1s});
+  store.Report("b", TaskCost{.compile_time = 2s});
+  EXPECT_TRUE(store.TryGet("a"));  // `b` is the least recently used one now.
+  store.Report("c", TaskCost{.compile_time = 3s});
+
+  EXPECT_EQ(2, store.GetSize());
+  EXPECT_TRUE(store.TryGet("a"));
+  EXPECT_FALSE(store.TryGet("b"));
+  EXPECT_TRUE(store.TryGet("c"));
+}
+
+}  // namespace yadcc::scheduler
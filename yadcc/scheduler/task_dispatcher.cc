@@ -18,12 +18,18 @@
 
 #include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
 #include <limits>
+#include <memory>
 #include <mutex>
 #include <vector>
 
 #include "gflags/gflags.h"
 
+#include "flare/base/chrono.h"
 #include "flare/base/internal/time_view.h"
 #include "flare/base/logging.h"
 #include "flare/base/never_destroyed.h"
@@ -36,6 +42,65 @@ DEFINE_string(servant_min_memory_for_accepting_new_task, "10G",
               "If memory avaiable is less than "
               "`servant_min_memory_for_accepting_new_task`, "
               "servant will be excluded when dispatching.");
+DEFINE_string(servant_default_task_memory, "0",
+              "Memory a task is assumed to use at its peak if we haven't "
+              "learned it from earlier runs of similar tasks. Tasks are only "
+              "assigned to a servant if, after assigning them, memory "
+              "available on it is still no less than "
+              "`servant_min_memory_for_accepting_new_task`. Unlike learned "
+              "ones, this is not reserved against servant's total memory.");
+DEFINE_int32(servant_load_decay_seconds, 15,
+             "Contribution of tasks completed on a servant to its reported "
+             "load is assumed to decay exponentially with this time constant. "
+             "This should match `cpu_load_average_seconds` of the daemons.");
+DEFINE_int32(requestor_affinity_window, 10,
+             "Servants used by a requestor in the last this many seconds are "
+             "preferred when assigning new tasks from the same requestor, so "
+             "as to reuse its connections.");
+DEFINE_double(requestor_affinity_max_utilization, 0.75,
+              "Servants recently used by a requestor are only preferred if "
+              "their utilization is lower than this ratio. Otherwise the least "
+              "utilized servant is used. Setting it to 0 disables affinity.");
+DEFINE_int32(long_task_threshold_ms, 10000,
+             "Tasks that are expected (from history) to run longer than this "
+             "are assigned to dedicated servants in priority to all other "
+             "servants, including those recently used by the requestor.");
+DEFINE_int32(short_task_threshold_ms, 2000,
+             "Tasks that are expected (from history) to finish within this "
+             "period are preferably assigned to non-dedicated servants, so as "
+             "to leave dedicated servants for longer ones.");
+DEFINE_int32(task_cost_store_capacity, 200000,
+             "Maximum number of task cost keys whose cost is remembered.");
+DEFINE_int32(max_task_joining_wait_ms, 2000,
+             "If a task of the same digest has been allocated but not yet "
+             "reported running by its servant, requestors of the same digest "
+             "wait for up to this period before starting a task of their "
+             "own. This should be longer than servants' heartbeat interval.");
+DEFINE_int32(allocation_shards, 16,
+             "Dispatcher state is sharded by compiler digest into this many "
+             "shards, each with its own lock. Allocations for environments in "
+             "different shards are made in parallel.");
+DEFINE_int32(max_subscribed_demand, 256,
+             "Maximum number of grants a subscription may be waiting for at "
+             "the same time for a given environment.");
+DEFINE_string(dispatcher_snapshot_path, "",
+              "If set, servants and task grants are periodically persisted to "
+              "this file, and restored from it on startup. This way "
+              "restarting the scheduler won't fail tasks in flight, nor stall "
+              "the cluster until servants heartbeat again.");
+DEFINE_int32(dispatcher_snapshot_interval_seconds, 5,
+             "Interval between two snapshots of dispatcher state.");
+DEFINE_int32(interactive_task_weight, 8,
+             "When the cluster is saturated, waiters of different priority "
+             "classes are served in proportion to their weights.");
+DEFINE_int32(ci_task_weight, 2, "See `interactive_task_weight`.");
+DEFINE_int32(batch_task_weight, 1, "See `interactive_task_weight`.");
+DEFINE_double(ci_task_max_dedicated_utilization, 0.9,
+              "CI tasks are not assigned to dedicated servants whose "
+              "utilization would exceed this ratio. The rest of their "
+              "capacity is reserved for interactive tasks.");
+DEFINE_double(batch_task_max_dedicated_utilization, 0.75,
+              "Same as `ci_task_max_dedicated_utilization`, for batch tasks.");
 
 using namespace std::literals;
 
@@ -43,6 +108,15 @@ namespace yadcc::scheduler {
 
 namespace {
 
+// Number of recently used servants remembered for each requestor.
+constexpr std::size_t kMaxRecentServantsPerRequestor = 16;
+
+// Value of `Shard::oldest_waiter_since` if there's no waiter in the shard.
+constexpr auto kNoWaiter = std::numeric_limits<std::int64_t>::max();
+
+// Subscriptions not polled for this long are dropped.
+constexpr auto kSubscriptionIdleTimeout = 30s;
+
 std::string FormatTime(const flare::internal::SystemClockView& view) {
   auto time = std::chrono::system_clock::to_time_t(view.Get());
   struct tm buf;
@@ -52,14 +126,52 @@ std::string FormatTime(const flare::internal::SystemClockView& view) {
   return buffer;
 }
 
-bool ContainsEnvironmentSlow(const std::vector<EnvironmentDesc>& envs,
-                             const EnvironmentDesc& looking_for) {
-  for (auto&& e : envs) {
-    if (e.compiler_digest() == looking_for.compiler_digest()) {
-      return true;
-    }
+// Decay `value` exponentially for `elapsed`, in the same way as loadavg does.
+double DecayLoad(double value, std::chrono::nanoseconds elapsed) {
+  return value *
+         std::exp(-std::chrono::duration<double>(elapsed).count() /
+                  std::max(FLAGS_servant_load_decay_seconds, 1));
+}
+
+// Number of physical cores of the servant.
+std::size_t GetPhysicalCores(const ServantPersonality& personality) {
+  if (personality.num_physical_cores) {
+    return personality.num_physical_cores;
+  }
+  // Older daemons don't report it. Assume 2-way SMT as we used to do.
+  return (personality.num_processors + 1) / 2;
+}
+
+// Index of priority class in `WaiterQueue::classes`.
+std::size_t GetClassIndex(TaskPriorityClass priority_class) {
+  switch (priority_class) {
+    case TASK_PRIORITY_CLASS_CI:
+      return 1;
+    case TASK_PRIORITY_CLASS_BATCH:
+      return 2;
+    default:
+      return 0;  // Interactive, or unknown.
+  }
+}
+
+double GetClassWeight(std::size_t index) {
+  auto weight = index == 0   ? FLAGS_interactive_task_weight
+                : index == 1 ? FLAGS_ci_task_weight
+                             : FLAGS_batch_task_weight;
+  return std::max(weight, 1);
+}
+
+// Ratio of a dedicated servant's capacity that tasks of the given class may
+// use.
+double GetMaxDedicatedUtilization(TaskPriorityClass priority_class) {
+  switch (priority_class) {
+    case TASK_PRIORITY_CLASS_CI:
+      return FLAGS_ci_task_max_dedicated_utilization;
+    case TASK_PRIORITY_CLASS_BATCH:
+      return FLAGS_batch_task_max_dedicated_utilization;
+    default:
+      return 1;
   }
-  return false;
 }
 
 // Dirty-and-quick test if `ip_port` and `ip2` points to the same host.
@@ -76,74 +188,375 @@ TaskDispatcher* TaskDispatcher::Instance() {
 }
 
 TaskDispatcher::TaskDispatcher()
-    : internal_exposer_("yadcc/task_dispatcher",
-                        [this] { return DumpInternals(); }) {
+    : task_costs_(FLAGS_task_cost_store_capacity),
+      internal_exposer_("yadcc/task_dispatcher",
+                        [this] { return DumpInternals(); }),
+      metrics_exposer_("yadcc/task_dispatcher_metrics",
+                       [this] { return DumpMetrics(); }) {
+  FLARE_CHECK_GT(FLAGS_allocation_shards, 0);
+  for (int i = 0; i != FLAGS_allocation_shards; ++i) {
+    auto&& shard = shards_.emplace_back(std::make_unique<Shard>());
+    shard->index = i;
+    shard->oldest_waiter_since = kNoWaiter;
+  }
   expiration_timer_ = flare::fiber::SetTimer(flare::ReadCoarseSteadyClock(), 1s,
                                              [this] { OnExpirationTimer(); });
   auto memory_demand =
       TryParseSize(FLAGS_servant_min_memory_for_accepting_new_task);
   FLARE_CHECK(memory_demand);
   min_memory_for_new_task_ = *memory_demand;
+  auto default_task_memory = TryParseSize(FLAGS_servant_default_task_memory);
+  FLARE_CHECK(default_task_memory);
+  default_task_memory_ = *default_task_memory;
+
+  if (!FLAGS_dispatcher_snapshot_path.empty()) {
+    LoadSnapshot();
+    auto interval = FLAGS_dispatcher_snapshot_interval_seconds * 1s;
+    snapshot_writer_ = std::thread([this] { SnapshotWriterProc(); });
+    snapshot_timer_ =
+        flare::fiber::SetTimer(flare::ReadCoarseSteadyClock() + interval,
+                               interval, [this] { OnSnapshotTimer(); });
+  }
 }
 
 TaskDispatcher::~TaskDispatcher() {
   flare::fiber::KillTimer(expiration_timer_);
+  if (snapshot_timer_) {
+    flare::fiber::KillTimer(*snapshot_timer_);
+  }
+  if (snapshot_writer_.joinable()) {
+    {
+      std::scoped_lock _(snapshot_lock_);
+      snapshot_writer_leaving_ = true;
+    }
+    snapshot_cv_.notify_one();
+    snapshot_writer_.join();
+  }
 }
 
 flare::Expected<TaskAllocation, WaitStatus>
 TaskDispatcher::WaitForStartingNewTask(
     const TaskPersonality& personality, std::chrono::nanoseconds expires_in,
     std::chrono::steady_clock::time_point timeout, bool prefetching) {
+  auto result =
+      WaitForStartingNewTasks(personality, expires_in, timeout,
+                              prefetching ? 0 : 1, prefetching ? 1 : 0);
+  if (!result) {
+    return result.error();
+  }
+  FLARE_CHECK_EQ(result->size(), 1);
+  return result->front();
+}
+
+flare::Expected<std::vector<TaskAllocation>, WaitStatus>
+TaskDispatcher::WaitForStartingNewTasks(
+    const TaskPersonality& personality, std::chrono::nanoseconds expires_in,
+    std::chrono::steady_clock::time_point timeout, std::size_t immediate_reqs,
+    std::size_t prefetch_reqs, std::optional<RunningTask>* existing_task) {
   // FIXME: Maybe we should bail out immediately if the requested compiler
   // digest is not recognized. Doing this allows the user to fallback to its
   // local compiler. Otherwise the user would wait indefinitely.
 
-  std::unique_lock lk(allocation_lock_);
-  std::vector<ServantDesc*> servants_free;
-  while (true) {
-    auto servants_eligible = UnsafeEnumerateEligibleServants(personality);
-    if (servants_eligible.empty()) {
-      // If the environment is not recognized, bail out early.
+  std::vector<TaskAllocation> allocations;
+  auto total_reqs = immediate_reqs + prefetch_reqs;
+  auto join_only =
+      !total_reqs && existing_task && !personality.task_digest.empty();
+  if (!total_reqs && !join_only) {
+    return allocations;
+  }
+  auto since = flare::ReadCoarseSteadyClock();
+
+  // Cost estimation and digest (if any) applies to the first immediate
+  // request only.
+  const TaskPersonality* rest_personality = &personality;
+  std::optional<TaskPersonality> personality_of_rest;
+  if (personality.expected_cost || !personality.task_digest.empty()) {
+    personality_of_rest = personality;
+    personality_of_rest->expected_cost.reset();
+    personality_of_rest->task_digest.clear();
+    rest_personality = &*personality_of_rest;
+  }
+  auto&& first_personality = immediate_reqs ? personality : *rest_personality;
+
+  auto shard = GetShardOf(personality.env_desc.compiler_digest());
+  std::unique_lock lk(shard->lock);
+  // Prefetched grants are not for a specific task, there's nothing to join.
+  if (existing_task && (immediate_reqs || join_only) &&
+      !personality.task_digest.empty()) {
+    auto wait_until = std::min(
+        timeout, flare::ReadCoarseSteadyClock() +
+                     FLAGS_max_task_joining_wait_ms * 1ms);
+    if (auto running = UnsafeWaitForRunningTaskOf(
+            shard, personality.task_digest, wait_until, &lk)) {
+      ++shard->joined_tasks;
+      UnsafeRecordDecision(shard, AllocationOutcome::Joined, personality, since,
+                           nullptr);
+      *existing_task = std::move(*running);
+      return allocations;
+    }
+  }
+  if (join_only) {
+    return allocations;
+  }
+  UnsafeDrainDirtyServants(shard);
+  auto servants_eligible = UnsafeFindEligibleServants(shard, personality);
+  if (!servants_eligible) {
+    // If the environment is not recognized, bail out early.
+    UnsafeRecordDecision(shard, AllocationOutcome::EnvironmentNotFound,
+                         personality, since, nullptr);
+    return WaitStatus::EnvironmentNotFound;
+  }
+  allocations.reserve(total_reqs);
+  if (auto allocation =
+          UnsafeTryAllocateTask(shard, *servants_eligible, first_personality,
+                                expires_in, immediate_reqs == 0)) {
+    // A eligible servant is available.
+    UnsafeRecordDecision(shard, AllocationOutcome::Immediate, personality,
+                         since, &*allocation);
+    allocations.push_back(std::move(*allocation));
+  } else {
+    // Wait for available servant then. Whoever frees a servant allocates the
+    // task for us.
+    Waiter waiter;
+    waiter.personality = &first_personality;
+    waiter.expires_in = expires_in;
+    waiter.prefetching = immediate_reqs == 0;
+    waiter.since = flare::ReadCoarseSteadyClock();
+    UnsafeEnqueueWaiter(shard, &waiter);
+    // Whoever freed a servant after we drained dirty servants above but
+    // before we're enqueued might have missed us. (@sa: `ServeWaitersOf`.)
+    UnsafeDrainDirtyServants(shard);
+    if (!waiter.cv.wait_until(lk, timeout, [&] {
+          return waiter.allocation || waiter.environment_gone;
+        })) {
+      UnsafeDequeueWaiter(shard, &waiter);
+      UnsafeRecordDecision(shard, AllocationOutcome::Timeout, personality,
+                           since, nullptr);
+      return WaitStatus::Timeout;
+    }
+    // The waiter has been dequeued by whoever woke us up.
+    if (waiter.environment_gone) {
+      UnsafeRecordDecision(shard, AllocationOutcome::EnvironmentNotFound,
+                           personality, since, nullptr);
       return WaitStatus::EnvironmentNotFound;
     }
-    servants_free = UnsafeEnumerateFreeServants(servants_eligible);
-    if (!servants_free.empty()) {
-      // We've got at least one servant, keep going.
+    UnsafeRecordDecision(shard, AllocationOutcome::Waited, personality, since,
+                         &*waiter.allocation);
+    allocations.push_back(*waiter.allocation);
+
+    // We've been waiting, and servants may have gone in the meantime.
+    servants_eligible = UnsafeFindEligibleServants(shard, personality);
+    if (!servants_eligible) {
+      return allocations;
+    }
+  }
+
+  // For the rest, we can't wait. If we wait for too long for the remaining
+  // tasks, the first task may have already been expired before we even
+  // return.
+  //
+  // Note that servant's utilization is updated on each allocation, so picking
+  // servants repeatedly here naturally spreads allocations among servants.
+  while (allocations.size() != total_reqs) {
+    auto allocation = UnsafeTryAllocateTask(
+        shard, *servants_eligible, *rest_personality, expires_in,
+        allocations.size() >= immediate_reqs);
+    if (!allocation) {
       break;
     }
+    allocations.push_back(std::move(*allocation));
+  }
+  return allocations;
+}
 
-    // Wait for available servant then.
-    if (allocation_cv_.wait_until(lk, timeout) == std::cv_status::timeout) {
-      return WaitStatus::Timeout;
+flare::Expected<std::vector<TaskAllocation>, WaitStatus>
+TaskDispatcher::WaitForLeasingTasks(
+    const TaskPersonality& personality, std::chrono::nanoseconds duration,
+    std::chrono::steady_clock::time_point timeout, std::size_t slots) {
+  auto result =
+      WaitForStartingNewTasks(personality, duration, timeout, slots, 0);
+  if (!result) {
+    return result;
+  }
+
+  // All of them are allocated from the environment's shard.
+  auto shard = GetShardOf(personality.env_desc.compiler_digest());
+  std::scoped_lock _(shard->lock);
+  for (auto&& e : *result) {
+    // It can't have been renewed yet, the requestor does not know it.
+    if (auto iter = shard->tasks.tasks.find(e.task_id);
+        iter != shard->tasks.tasks.end()) {
+      iter->second.leased_until = iter->second.expires_at;
+    }
+  }
+  return result;
+}
+
+std::optional<TaskAllocation> TaskDispatcher::UnsafeTryAllocateTask(
+    Shard* shard, const EnvironmentIndex& servants,
+    const TaskPersonality& personality, std::chrono::nanoseconds expires_in,
+    bool prefetching) {
+  // The servant picked can be fully used by other shards before we assign the
+  // task to it. In this case it has been re-indexed, so we just pick again.
+  while (auto pick = UnsafePickServantFor(shard, servants, personality)) {
+    if (auto allocation = UnsafeTryAllocateTaskOn(shard, pick, personality,
+                                                  expires_in, prefetching)) {
+      return allocation;
+    }
+  }
+  return std::nullopt;
+}
+
+std::optional<TaskAllocation> TaskDispatcher::UnsafeTryAllocateTaskOn(
+    Shard* shard, ServantDesc* servant, const TaskPersonality& personality,
+    std::chrono::nanoseconds expires_in, bool prefetching) {
+  auto expected_memory = GetExpectedMemory(personality);
+  auto task_id = shard->tasks.next_task_id * shards_.size() + shard->index;
+  FLARE_CHECK_EQ(shard->tasks.tasks.count(task_id), 0);
+  TaskDesc* task;
+  {
+    std::scoped_lock _(servant->lock);
+    if (servant->running_tasks >= GetCapacityAvailable(*servant) ||
+        !HasMemoryFor(*servant, expected_memory,
+                      personality.expected_cost.has_value())) {
+      task = nullptr;
+    } else {
+      ++servant->running_tasks;
+      ++servant->ever_assigned_tasks;
+      servant->task_memory.total += expected_memory;
+      if (personality.expected_cost) {
+        servant->task_memory.learned += expected_memory;
+      }
+      servant->task_memory.since_report += expected_memory;
+      ++servant->generation;
+
+      // Create descriptor of the newly-started task
+      task = &shard->tasks.tasks[task_id];
+      task->task_id = task_id;
+      task->personality = personality;
+      task->belonging_servant = flare::RefPtr(flare::ref_ptr, servant);
+      task->started_at = flare::ReadCoarseSteadyClock();
+      task->renewed_at = task->started_at;
+      task->expires_at = flare::ReadCoarseSteadyClock() + expires_in;
+      task->is_prefetch = prefetching;
+      task->expected_memory = expected_memory;
+      servant->tasks.push_back(task);
+    }
+  }
+  UnsafeReindexServant(shard, servant);
+  if (!task) {
+    return std::nullopt;
+  }
+  ++shard->tasks.next_task_id;
+  shard->tasks.expirations.emplace(task->expires_at, task_id);
+  if (!personality.task_digest.empty()) {
+    auto [iter, inserted] =
+        shard->tasks.by_digest.try_emplace(personality.task_digest, task_id);
+    if (!inserted && shard->tasks.tasks.at(iter->second).zombie) {
+      iter->second = task_id;  // Replaces the dead one.
     }
   }
 
-  // A eligible servant is available.
-  auto pick = UnsafePickServantFor(servants_free, personality.requestor_ip);
-  ++pick->running_tasks;
-  ++pick->ever_assigned_tasks;
+  UnsafeRecordAffinity(shard, servant, personality);
+  if (!personality.zone.empty()) {
+    auto&& counters = shard->zone_counters[personality.zone];
+    ++counters.allocations;
+    counters.cross_zone_allocations +=
+        servant->indexed[shard->index].zone != personality.zone;
+  }
+  return TaskAllocation{.task_id = task_id,
+                        .servant_location = servant->location};
+}
 
-  // Create descriptor of the newly-started task
-  auto task_id = tasks_.next_task_id.fetch_add(1, std::memory_order_relaxed);
-  FLARE_CHECK_EQ(tasks_.tasks.count(task_id), 0);
-  auto&& task = tasks_.tasks[task_id];
-  task.task_id = task_id;
-  task.personality = personality;
-  task.belonging_servant = flare::RefPtr(flare::ref_ptr, pick);
-  task.started_at = flare::ReadCoarseSteadyClock();
-  task.expires_at = flare::ReadCoarseSteadyClock() + expires_in;
-  task.is_prefetch = prefetching;
+bool TaskDispatcher::UpdateSubscription(
+    std::uint64_t subscription_id, std::uint64_t sequence, bool reset,
+    const std::vector<DemandDelta>& deltas,
+    std::chrono::nanoseconds expires_in) {
+  std::scoped_lock _(subscriptions_lock_);
+  auto iter = subscriptions_.find(subscription_id);
+  if (iter == subscriptions_.end()) {
+    if (!reset) {
+      return false;
+    }
+    iter = subscriptions_
+               .emplace(subscription_id, std::make_unique<Subscription>())
+               .first;
+    std::scoped_lock lk(iter->second->lock);
+    iter->second->last_polled_at = flare::ReadCoarseSteadyClock();
+  }
+  auto subscription = iter->second.get();
+  if (!reset && sequence <= subscription->last_sequence) {
+    return true;  // Applied already.
+  }
+  subscription->last_sequence = sequence;
+  subscription->expires_in = expires_in;
+
+  std::unordered_set<std::string> mentioned;
+  for (auto&& e : deltas) {
+    auto&& digest = e.personality.env_desc.compiler_digest();
+    auto [demand_iter, inserted] = subscription->demands.try_emplace(digest);
+    auto&& demand = demand_iter->second;
+    auto shard = GetShardOf(digest);
+    std::scoped_lock lk(shard->lock);
+    if (inserted) {
+      demand.subscription = subscription;
+    }
+    // Waiters enqueued already keep pointing to it.
+    demand.personality = e.personality;
+    demand.personality.expected_cost.reset();
+    demand.personality.task_digest.clear();
+    auto standing = static_cast<std::int64_t>(demand.waiters.size());
+    // Demand beyond the cap is dropped. The requestor keeps waiting for grants
+    // it already has demanded.
+    auto desired = std::min<std::int64_t>(reset ? e.delta : standing + e.delta,
+                                          FLAGS_max_subscribed_demand);
+    UnsafeAdjustDemand(shard, &demand, desired - standing, e.expected_costs);
+    mentioned.insert(digest);
+  }
+  if (reset) {
+    for (auto&& [digest, demand] : subscription->demands) {
+      if (!mentioned.count(digest)) {
+        auto shard = GetShardOf(digest);
+        std::scoped_lock lk(shard->lock);
+        UnsafeAdjustDemand(shard, &demand,
+                           -static_cast<std::int64_t>(demand.waiters.size()));
+      }
+    }
+  }
+  return true;
+}
 
-  return TaskAllocation{
-      .task_id = task_id,
-      .servant_location = pick->personality.observed_location};
+std::optional<std::vector<SubscribedTaskAllocation>>
+TaskDispatcher::WaitForSubscribedAllocations(
+    std::uint64_t subscription_id,
+    std::chrono::steady_clock::time_point timeout) {
+  Subscription* subscription;
+  std::unique_lock<flare::fiber::Mutex> lk;
+  {
+    std::scoped_lock _(subscriptions_lock_);
+    auto iter = subscriptions_.find(subscription_id);
+    if (iter == subscriptions_.end()) {
+      return std::nullopt;
+    }
+    // It won't be dropped while we're polling it.
+    subscription = iter->second.get();
+    lk = std::unique_lock(subscription->lock);
+    ++subscription->pollers;
+  }
+  subscription->cv.wait_until(
+      lk, timeout, [&] { return !subscription->allocations.empty(); });
+  --subscription->pollers;
+  subscription->last_polled_at = flare::ReadCoarseSteadyClock();
+  return std::exchange(subscription->allocations, {});
 }
 
 bool TaskDispatcher::KeepTaskAlive(std::uint64_t task_id,
                                    std::chrono::nanoseconds new_expires_in) {
-  std::scoped_lock _(allocation_lock_);
-  auto iter = tasks_.tasks.find(task_id);
-  if (iter == tasks_.tasks.end()) {
+  auto shard = GetShardOfTask(task_id);
+  std::scoped_lock _(shard->lock);
+  auto&& tasks = shard->tasks;
+  auto iter = tasks.tasks.find(task_id);
+  if (iter == tasks.tasks.end()) {
     // FIXME: This warning can be spurious. It a daemon calls both `FreeTask`
     // and `KeepTaskAlive` simultaneously, requests reordering can trigger this
     // warning falsely.
@@ -160,63 +573,514 @@ bool TaskDispatcher::KeepTaskAlive(std::uint64_t task_id,
         (flare::ReadCoarseSteadyClock() - iter->second.expires_at) / 1s);
     return false;
   }
-  iter->second.expires_at = flare::ReadCoarseSteadyClock() + new_expires_in;
+  auto&& task = iter->second;
+  auto now = flare::ReadCoarseSteadyClock();
+  keep_alive_lag_.Report(now - task.renewed_at);
+  task.renewed_at = now;
+  auto expires_at = std::max(now + new_expires_in, task.leased_until);
+  FLARE_CHECK_EQ(tasks.expirations.erase({task.expires_at, task_id}), 1);
+  task.expires_at = expires_at;
+  tasks.expirations.emplace(task.expires_at, task_id);
   return true;
 }
 
 void TaskDispatcher::FreeTask(std::uint64_t task_id) {
-  std::scoped_lock _(allocation_lock_);
-  UnsafeFreeTasks({task_id});
+  auto shard = GetShardOfTask(task_id);
+  flare::RefPtr<ServantDesc> servant;
+  {
+    std::scoped_lock _(shard->lock);
+    servant = UnsafeFreeTask(shard, task_id);
+  }
+  if (servant) {
+    // And hand the servant to the next waiter, if there is one.
+    MarkServantDirty(servant.Get(), shard);
+    ServeWaitersOf(servant.Get());
+  }
 }
 
-void TaskDispatcher::UnsafeFreeTasks(
-    const std::vector<std::uint64_t>& task_ids) {
+void TaskDispatcher::FreeTasks(const std::vector<std::uint64_t>& task_ids) {
+  std::vector<flare::RefPtr<ServantDesc>> servants;
   for (auto&& e : task_ids) {
-    auto iter = tasks_.tasks.find(e);
-    if (iter == tasks_.tasks.end()) {
-      FLARE_LOG_WARNING_EVERY_SECOND("Unexpected: Freeing unknown task [{}].",
-                                     e);
-      return;
+    auto shard = GetShardOfTask(e);
+    std::scoped_lock _(shard->lock);
+    auto servant = UnsafeFreeTask(shard, e);
+    if (servant &&
+        std::none_of(servants.begin(), servants.end(),
+                     [&](auto&& x) { return x.Get() == servant.Get(); })) {
+      servants.push_back(std::move(servant));
+    }
+  }
+  for (auto&& e : servants) {
+    MarkServantDirty(e.Get(), nullptr);
+    ServeWaitersOf(e.Get());
+  }
+}
+
+flare::RefPtr<TaskDispatcher::ServantDesc> TaskDispatcher::UnsafeFreeTask(
+    Shard* shard, std::uint64_t task_id) {
+  auto&& tasks = shard->tasks;
+  auto iter = tasks.tasks.find(task_id);
+  if (iter == tasks.tasks.end()) {
+    FLARE_LOG_WARNING_EVERY_SECOND("Unexpected: Freeing unknown task [{}].",
+                                   task_id);
+    return nullptr;
+  }
+  auto&& task = iter->second;
+  auto servant = task.belonging_servant;
+  {
+    std::scoped_lock _(servant->lock);
+    if (!task.zombie) {
+      // Zombies are not likely to have been running, so only non-zombies are
+      // accounted.
+      UnsafeRecordTaskCompletion(
+          servant.Get(), flare::ReadCoarseSteadyClock() - task.started_at);
+    }
+    servant->task_memory.total -= task.expected_memory;
+    if (task.personality.expected_cost) {
+      servant->task_memory.learned -= task.expected_memory;
+    }
+    if (!task.memory_reported) {
+      servant->task_memory.since_report -= task.expected_memory;
+    }
+    FLARE_CHECK(servant->tasks.erase(&task));
+    --servant->running_tasks;
+    ++servant->generation;
+  }
+  if (!task.zombie) {
+    FLARE_CHECK_EQ(tasks.expirations.erase({task.expires_at, task_id}), 1);
+    grant_lifetime_.Report(flare::ReadCoarseSteadyClock() - task.started_at);
+  }
+  if (auto digest = tasks.by_digest.find(task.personality.task_digest);
+      digest != tasks.by_digest.end() && digest->second == task_id) {
+    tasks.by_digest.erase(digest);
+    shard->task_running_cv.notify_all();
+  }
+  tasks.tasks.erase(iter);
+  UnsafeReindexServant(shard, servant.Get());
+  return servant;
+}
+
+std::optional<RunningTask> TaskDispatcher::UnsafeWaitForRunningTaskOf(
+    Shard* shard, const std::string& task_digest,
+    std::chrono::steady_clock::time_point timeout,
+    std::unique_lock<flare::fiber::Mutex>* lock) {
+  auto&& tasks = shard->tasks;
+  auto find_task = [&]() -> TaskDesc* {
+    auto iter = tasks.by_digest.find(task_digest);
+    if (iter == tasks.by_digest.end()) {
+      return nullptr;
+    }
+    auto&& task = tasks.tasks.at(iter->second);
+    return task.zombie ? nullptr : &task;
+  };
+  shard->task_running_cv.wait_until(*lock, timeout, [&] {
+    auto task = find_task();
+    return !task || task->servant_task_id;
+  });
+
+  auto task = find_task();
+  if (!task || !task->servant_task_id) {
+    return std::nullopt;
+  }
+  RunningTask result;
+  result.set_servant_task_id(*task->servant_task_id);
+  result.set_task_grant_id(task->task_id);
+  result.set_servant_location(task->belonging_servant->location);
+  result.set_task_digest(task_digest);
+  return result;
+}
+
+void TaskDispatcher::UnsafeEnqueueWaiter(Shard* shard, Waiter* waiter) {
+  auto&& queue =
+      shard->waiters[waiter->personality->env_desc.compiler_digest()];
+  auto&& cls =
+      queue.classes[GetClassIndex(waiter->personality->priority_class)];
+  if (cls.round_robin.empty()) {
+    cls.pass = std::max(cls.pass, queue.virtual_time);
+  }
+  auto&& requestor = cls.requestors[waiter->personality->requestor_ip];
+  if (requestor.waiters.empty()) {
+    requestor.pos = cls.round_robin.insert(cls.round_robin.end(), &requestor);
+  }
+  waiter->pos = requestor.waiters.insert(requestor.waiters.end(), waiter);
+
+  auto [since, inserted] = shard->waiting_since.emplace(waiter->since, waiter);
+  FLARE_CHECK(inserted);
+  if (since == shard->waiting_since.begin()) {
+    shard->oldest_waiter_since = waiter->since.time_since_epoch().count();
+  }
+}
+
+void TaskDispatcher::UnsafeDequeueWaiter(Shard* shard, Waiter* waiter) {
+  auto queue_iter =
+      shard->waiters.find(waiter->personality->env_desc.compiler_digest());
+  FLARE_CHECK(queue_iter != shard->waiters.end());
+  auto&& queue = queue_iter->second;
+  auto&& cls =
+      queue.classes[GetClassIndex(waiter->personality->priority_class)];
+  auto requestor_iter = cls.requestors.find(waiter->personality->requestor_ip);
+  FLARE_CHECK(requestor_iter != cls.requestors.end());
+  auto&& requestor = requestor_iter->second;
+
+  requestor.waiters.erase(waiter->pos);
+  if (requestor.waiters.empty()) {
+    cls.round_robin.erase(requestor.pos);
+    cls.requestors.erase(requestor_iter);
+    if (std::all_of(queue.classes.begin(), queue.classes.end(),
+                    [](auto&& e) { return e.round_robin.empty(); })) {
+      shard->waiters.erase(queue_iter);
+    }
+  }
+
+  // The shard-wide minimum only changes if it's the oldest one leaving.
+  auto since = shard->waiting_since.find({waiter->since, waiter});
+  FLARE_CHECK(since != shard->waiting_since.end());
+  bool was_oldest = since == shard->waiting_since.begin();
+  shard->waiting_since.erase(since);
+  if (was_oldest) {
+    shard->oldest_waiter_since =
+        shard->waiting_since.empty()
+            ? kNoWaiter
+            : shard->waiting_since.begin()->first.time_since_epoch().count();
+  }
+}
+
+TaskDispatcher::Waiter* TaskDispatcher::GetNextWaiter(
+    const WaiterQueue& queue,
+    const std::vector<const ClassWaiters*>& excluded) {
+  const ClassWaiters* chosen = nullptr;
+  for (auto&& e : queue.classes) {
+    if (e.round_robin.empty() ||
+        std::find(excluded.begin(), excluded.end(), &e) != excluded.end()) {
+      continue;
+    }
+    if (!chosen || e.pass < chosen->pass) {
+      chosen = &e;
+    }
+  }
+  return chosen ? chosen->round_robin.front()->waiters.front() : nullptr;
+}
+
+void TaskDispatcher::ServeWaitersOf(ServantDesc* servant) {
+  std::vector<std::pair<std::int64_t, Shard*>> shards;
+  {
+    std::scoped_lock _(servant->lock);
+    for (auto&& e : servant->shards) {
+      auto shard = shards_[e].get();
+      // Waiters enqueued after we've read this drain dirty servants once
+      // they're enqueued, and will see `servant` marked dirty by our caller.
+      if (auto since = shard->oldest_waiter_since.load(); since != kNoWaiter) {
+        shards.emplace_back(since, shard);
+      }
+    }
+  }
+
+  // Shards whose oldest waiter has been waiting for the longest are served
+  // first.
+  std::sort(shards.begin(), shards.end());
+  for (auto&& [since, shard] : shards) {
+    std::scoped_lock _(shard->lock);
+    UnsafeDrainDirtyServants(shard);
+    UnsafeServeWaitersOf(shard, servant);
+    if (auto&& indexed = servant->indexed[shard->index];
+        !indexed.environments.empty() && !indexed.free) {
+      break;  // Nothing left for other shards.
+    }
+  }
+}
+
+void TaskDispatcher::UnsafeServeWaitersOf(Shard* shard, ServantDesc* servant) {
+  auto&& indexed = servant->indexed[shard->index];
+  // Classes whose next waiter can't be satisfied by servants available.
+  // (Presumably because of `min_version`, or capacity reserved for classes of
+  // higher priority.)
+  std::vector<const ClassWaiters*> unsatisfiable;
+
+  while (indexed.free) {
+    // Let's see which environment's waiter has been waiting for the longest.
+    Waiter* waiter = nullptr;
+    WaiterQueue* queue = nullptr;
+    const EnvironmentIndex* servants_eligible = nullptr;
+    for (auto&& [digest, index] : indexed.environments) {
+      auto iter = shard->waiters.find(digest);
+      if (iter == shard->waiters.end()) {
+        continue;
+      }
+      auto next = GetNextWaiter(iter->second, unsatisfiable);
+      if (next && (!waiter || next->since < waiter->since)) {
+        waiter = next;
+        queue = &iter->second;
+        servants_eligible = index;
+      }
+    }
+    if (!waiter) {
+      return;  // No one is waiting.
+    }
+
+    // This is usually `servant` itself, unless some other servant is more
+    // preferable for the waiter.
+    auto allocation =
+        UnsafeTryAllocateTask(shard, *servants_eligible, *waiter->personality,
+                              waiter->expires_in, waiter->prefetching);
+    auto class_index = GetClassIndex(waiter->personality->priority_class);
+    auto&& cls = queue->classes[class_index];
+    if (!allocation) {
+      unsatisfiable.push_back(&cls);
+      continue;
+    }
+
+    // Charge the class for this grant.
+    queue->virtual_time = cls.pass;
+    cls.pass += 1 / GetClassWeight(class_index);
+
+    // Dequeue the waiter, and move its requestor to the end of the round-robin
+    // list. Other requestors are served before it's served again.
+    if (auto requestor = cls.round_robin.front();
+        requestor->waiters.size() > 1) {
+      cls.round_robin.splice(cls.round_robin.end(), cls.round_robin,
+                             requestor->pos);
+    }
+    UnsafeDequeueWaiter(shard, waiter);  // `queue` may be destroyed.
+    if (waiter->demand) {
+      // Otherwise it's accounted by the waiter itself once it wakes up.
+      UnsafeRecordDecision(shard, AllocationOutcome::Subscribed,
+                           *waiter->personality, waiter->since, &*allocation);
+    }
+    UnsafeHandOver(waiter, std::move(*allocation));
+  }
+}
+
+void TaskDispatcher::UnsafeHandOver(Waiter* waiter, TaskAllocation allocation) {
+  if (auto demand = waiter->demand) {
+    DeliverToSubscription(demand->subscription,
+                          demand->personality.env_desc.compiler_digest(),
+                          std::move(allocation), waiter->expires_in);
+    demand->waiters.erase(waiter->demand_pos);
+  } else {
+    waiter->allocation = std::move(allocation);
+    waiter->cv.notify_one();
+  }
+}
+
+void TaskDispatcher::DeliverToSubscription(
+    Subscription* subscription, const std::string& compiler_digest,
+    TaskAllocation allocation, std::chrono::nanoseconds expires_in) {
+  {
+    std::scoped_lock _(subscription->lock);
+    subscription->allocations.push_back(SubscribedTaskAllocation{
+        .compiler_digest = compiler_digest,
+        .allocation = std::move(allocation),
+        .expires_at = flare::ReadCoarseSteadyClock() + expires_in});
+  }
+  subscription->cv.notify_all();
+}
+
+void TaskDispatcher::UnsafeAdjustDemand(
+    Shard* shard, SubscribedDemand* demand, std::int64_t delta,
+    const std::vector<std::optional<TaskCost>>& expected_costs) {
+  auto expires_in = demand->subscription->expires_in;
+  // Withdraw the most recent ones first.
+  for (; delta < 0 && !demand->waiters.empty(); ++delta) {
+    UnsafeDequeueWaiter(shard, &demand->waiters.back());
+    demand->waiters.pop_back();
+  }
+  if (delta <= 0) {
+    return;
+  }
+
+  UnsafeDrainDirtyServants(shard);
+  auto servants_eligible =
+      UnsafeFindEligibleServants(shard, demand->personality);
+  for (std::size_t i = 0; delta > 0; --delta, ++i) {
+    std::optional<TaskPersonality> own_personality;
+    if (i < expected_costs.size() && expected_costs[i]) {
+      own_personality = demand->personality;
+      own_personality->expected_cost = expected_costs[i];
+    }
+    auto&& personality =
+        own_personality ? *own_personality : demand->personality;
+    if (servants_eligible) {
+      if (auto allocation = UnsafeTryAllocateTask(
+              shard, *servants_eligible, personality, expires_in, false)) {
+        UnsafeRecordDecision(shard, AllocationOutcome::Subscribed, personality,
+                             flare::ReadCoarseSteadyClock(), &*allocation);
+        DeliverToSubscription(demand->subscription,
+                              demand->personality.env_desc.compiler_digest(),
+                              std::move(*allocation), expires_in);
+        continue;
+      }
+      servants_eligible = nullptr;  // Wait for servants then.
+    }
+    auto&& waiter = demand->waiters.emplace_back();
+    waiter.demand_pos = std::prev(demand->waiters.end());
+    waiter.own_personality = std::move(own_personality);
+    waiter.personality = waiter.own_personality ? &*waiter.own_personality
+                                                : &demand->personality;
+    waiter.expires_in = expires_in;
+    waiter.prefetching = false;
+    waiter.since = flare::ReadCoarseSteadyClock();
+    waiter.demand = demand;
+    UnsafeEnqueueWaiter(shard, &waiter);
+  }
+  // Whoever freed a servant after we drained dirty servants above but before
+  // we're enqueued might have missed us. (@sa: `ServeWaitersOf`.)
+  UnsafeDrainDirtyServants(shard);
+}
+
+void TaskDispatcher::SweepSubscriptions() {
+  auto now = flare::ReadCoarseSteadyClock();
+  std::vector<std::uint64_t> untaken;
+  {
+    std::scoped_lock _(subscriptions_lock_);
+    for (auto iter = subscriptions_.begin(); iter != subscriptions_.end();) {
+      auto&& subscription = *iter->second;
+      {
+        std::scoped_lock lk(subscription.lock);
+        if (subscription.pollers ||
+            subscription.last_polled_at + kSubscriptionIdleTimeout > now) {
+          ++iter;
+          continue;
+        }
+      }
+      FLARE_LOG_INFO("Dropping subscription [{}] not polled for {} seconds.",
+                     iter->first, (now - subscription.last_polled_at) / 1s);
+      for (auto&& [digest, demand] : subscription.demands) {
+        auto shard = GetShardOf(digest);
+        std::scoped_lock lk(shard->lock);
+        UnsafeAdjustDemand(shard, &demand,
+                           -static_cast<std::int64_t>(demand.waiters.size()));
+      }
+      {
+        // No one else is delivering to it, now that its waiters are gone.
+        std::scoped_lock lk(subscription.lock);
+        for (auto&& e : subscription.allocations) {
+          untaken.push_back(e.allocation.task_id);
+        }
+      }
+      iter = subscriptions_.erase(iter);
+    }
+  }
+  FreeTasks(untaken);
+}
+
+void TaskDispatcher::UnsafeAbortOrphanWaiters(Shard* shard) {
+  std::vector<Waiter*> aborting;
+  for (auto&& [digest, queue] : shard->waiters) {
+    if (shard->environments.count(digest)) {
+      continue;
+    }
+    for (auto&& cls : queue.classes) {
+      for (auto&& requestor : cls.round_robin) {
+        std::copy_if(requestor->waiters.begin(), requestor->waiters.end(),
+                     std::back_inserter(aborting),
+                     [](auto&& e) { return !e->demand; });
+      }
+    }
+  }
+  for (auto&& e : aborting) {
+    UnsafeDequeueWaiter(shard, e);
+    e->environment_gone = true;
+    e->cv.notify_one();
+  }
+}
+
+void TaskDispatcher::MarkServantDirty(ServantDesc* servant,
+                                      const Shard* except) {
+  std::scoped_lock _(servant->lock);
+  for (auto&& e : servant->shards) {
+    auto shard = shards_[e].get();
+    if (shard == except) {
+      continue;
+    }
+    std::scoped_lock lk(shard->dirty_lock);
+    if (auto&& indexed = servant->indexed[e]; !indexed.dirty) {
+      indexed.dirty = true;
+      shard->dirty_servants.push_back(flare::RefPtr(flare::ref_ptr, servant));
     }
-    --iter->second.belonging_servant->running_tasks;
-    FLARE_CHECK_EQ(tasks_.tasks.erase(e), 1);
   }
+}
 
-  // And wake any waiter up. Note that we must wake up all waiters as not all
-  // waiters are equal.
-  allocation_cv_.notify_all();
+void TaskDispatcher::UnsafeDrainDirtyServants(Shard* shard) {
+  std::vector<flare::RefPtr<ServantDesc>> servants;
+  {
+    std::scoped_lock _(shard->dirty_lock);
+    servants.swap(shard->dirty_servants);
+    for (auto&& e : servants) {
+      e->indexed[shard->index].dirty = false;
+    }
+  }
+  for (auto&& e : servants) {
+    UnsafeReindexServant(shard, e.Get());
+  }
+  if (!shard->waiters.empty()) {
+    for (auto&& e : servants) {
+      UnsafeServeWaitersOf(shard, e.Get());
+    }
+  }
 }
 
 void TaskDispatcher::KeepServantAlive(const ServantPersonality& servant,
                                       std::chrono::nanoseconds expires_in) {
-  std::scoped_lock _(allocation_lock_);
+  std::unique_lock lk(servants_lock_);
+  flare::RefPtr<ServantDesc> desc;
 
   // Let's see if we're renewing an existing servant.
-  for (auto&& e : servants_.servants) {
-    if (e->personality.observed_location == servant.observed_location) {
+  if (auto iter = servants_.servants.find(servant.observed_location);
+      iter != servants_.servants.end()) {
+    desc = iter->second;
+    {
+      std::scoped_lock lk(desc->lock);
       // Had anything changed, respect whatever reported by the servant.
-      e->personality = servant;
-      e->expires_at = flare::ReadCoarseSteadyClock() + expires_in;
-      return;
+      desc->personality = servant;
+      UnsafeRecordLoadReport(desc.Get());
+      ++desc->generation;
     }
-  }
-
-  // New servant then.
-  auto&& added =
-      servants_.servants.emplace_back(flare::MakeRefCounted<ServantDesc>());
-  added->personality = servant;
-  added->discovered_at = flare::ReadCoarseSteadyClock();
-  added->expires_at = flare::ReadCoarseSteadyClock() + expires_in;
-  added->running_tasks = 0;
-  if (servant.observed_location != servant.reported_location) {
-    FLARE_LOG_INFO(
-        "Discovered new servant at [{}]. The servant is reporting itself at "
-        "[{}]. It's likely the servant is behind NAT.",
-        servant.observed_location, servant.reported_location);
+    FLARE_CHECK_EQ(
+        servants_.expirations.erase({desc->expires_at, desc->serial}), 1);
+    desc->expires_at = flare::ReadCoarseSteadyClock() + expires_in;
+    servants_.expirations.emplace(std::pair(desc->expires_at, desc->serial),
+                                  desc.Get());
   } else {
-    FLARE_LOG_INFO("Discovered new servant at [{}].",
-                   servant.observed_location);
+    // New servant then.
+    desc = UnsafeAddServant(servant, expires_in);
+    if (servant.observed_location != servant.reported_location) {
+      FLARE_LOG_INFO(
+          "Discovered new servant at [{}]. The servant is reporting itself at "
+          "[{}]. It's likely the servant is behind NAT.",
+          servant.observed_location, servant.reported_location);
+    } else {
+      FLARE_LOG_INFO("Discovered new servant at [{}].",
+                     servant.observed_location);
+    }
   }
+  lk.unlock();
+
+  // Re-indexing the servant only touches shards it's (or was) indexed in, so
+  // heartbeats from other servants don't have to wait for us.
+  {
+    std::scoped_lock _(desc->index_lock);
+    if (desc->removed) {
+      return;  // Expired right after we released `servants_lock_`.
+    }
+    UnsafeUpdateServantShards(desc.Get());
+  }
+  ServeWaitersOf(desc.Get());
+}
+
+flare::RefPtr<TaskDispatcher::ServantDesc> TaskDispatcher::UnsafeAddServant(
+    const ServantPersonality& personality,
+    std::chrono::nanoseconds expires_in) {
+  auto desc = servants_.servants[personality.observed_location] =
+      flare::MakeRefCounted<ServantDesc>();
+  desc->location = personality.observed_location;
+  desc->personality = personality;
+  desc->discovered_at = flare::ReadCoarseSteadyClock();
+  desc->expires_at = flare::ReadCoarseSteadyClock() + expires_in;
+  desc->serial = servants_.next_serial++;
+  desc->indexed = std::make_unique<IndexedServant[]>(shards_.size());
+  servants_.expirations.emplace(std::pair(desc->expires_at, desc->serial),
+                                desc.Get());
+  return desc;
 }
 
 std::vector<std::uint64_t> TaskDispatcher::NotifyServantRunningTasks(
@@ -227,19 +1091,17 @@ std::vector<std::uint64_t> TaskDispatcher::NotifyServantRunningTasks(
                  std::back_insert_iterator(task_grant_ids),
                  [](const RunningTask& t) { return t.task_grant_id(); });
 
-  std::scoped_lock _(allocation_lock_);
   // Find the servant's descriptor first.
-  ServantDesc* servant = nullptr;
-  for (auto&& e : servants_.servants) {
-    if (e->personality.observed_location == servant_location) {
-      servant = e.Get();
-      break;
+  flare::RefPtr<ServantDesc> servant;
+  {
+    std::scoped_lock _(servants_lock_);
+    auto servant_iter = servants_.servants.find(servant_location);
+
+    // The servant itself has expired?
+    if (servant_iter == servants_.servants.end()) {
+      return task_grant_ids;
     }
-  }
-
-  // The servant itself has expired?
-  if (!servant) {
-    return task_grant_ids;
+    servant = servant_iter->second;
   }
 
   // For any tasks marked as zombie and not recognized by the servant, they're
@@ -251,13 +1113,36 @@ std::vector<std::uint64_t> TaskDispatcher::NotifyServantRunningTasks(
   // task, we're safe. (Otherwise we may overschedule tasks to the node and
   // result in task rejection. This, in turn, should be handled by the client
   // itself.).
-  UnsafeSweepZombiesOf(servant, {task_grant_ids.begin(), task_grant_ids.end()});
+  std::unordered_set<std::uint64_t> running_tasks(task_grant_ids.begin(),
+                                                  task_grant_ids.end());
+  SweepZombiesOf(servant.Get(), running_tasks);
+
+  // If we were restarted, tasks that were running before but have completed
+  // while we were down are not freed by their requestors.
+  std::vector<std::uint64_t> completed_tasks;
+  {
+    std::scoped_lock _(servant->lock);
+    for (auto&& e : servant->running_at_snapshot) {
+      if (!running_tasks.count(e)) {
+        completed_tasks.push_back(e);
+      }
+    }
+    servant->running_at_snapshot.clear();
+  }
+  FLARE_LOG_INFO_IF(!completed_tasks.empty(),
+                    "Freeing {} tasks completed on servant [{}] while we were "
+                    "restarting.",
+                    completed_tasks.size(), servant->location);
+  FreeTasks(completed_tasks);
 
   // Any tasks reported by the servant but unknown to us should be returned.
   std::unordered_set<std::uint64_t> permitted_tasks;
-  for (auto&& [k, v] : tasks_.tasks) {
-    if (v.belonging_servant.Get() == servant && !v.zombie) {
-      permitted_tasks.insert(k);
+  {
+    std::scoped_lock _(servant->lock);
+    for (auto&& e : servant->tasks) {
+      if (!e.zombie) {
+        permitted_tasks.insert(e.task_id);
+      }
     }
   }
   std::vector<std::uint64_t> unknown_tasks;
@@ -265,12 +1150,35 @@ std::vector<std::uint64_t> TaskDispatcher::NotifyServantRunningTasks(
     if (!permitted_tasks.count(it->task_grant_id())) {
       unknown_tasks.push_back(it->task_grant_id());
       FLARE_VLOG(1, "Servant [{}] reported a unknown task [{}].",
-                 servant->personality.observed_location, it->task_grant_id());
+                 servant->location, it->task_grant_id());
       it = tasks.erase(it);
     } else {
       ++it;
     }
   }
+
+  // Record servant-side task IDs, grabbing lock of each shard only once.
+  std::vector<std::pair<Shard*, const RunningTask*>> known_tasks;
+  for (auto&& e : tasks) {
+    known_tasks.emplace_back(GetShardOfTask(e.task_grant_id()), &e);
+  }
+  std::sort(known_tasks.begin(), known_tasks.end(), [](auto&& x, auto&& y) {
+    return x.first->index < y.first->index;
+  });
+  for (auto iter = known_tasks.begin(); iter != known_tasks.end();) {
+    auto shard = iter->first;
+    std::scoped_lock _(shard->lock);
+    for (; iter != known_tasks.end() && iter->first == shard; ++iter) {
+      auto task = shard->tasks.tasks.find(iter->second->task_grant_id());
+      if (task == shard->tasks.tasks.end() || task->second.servant_task_id) {
+        continue;  // Freed in the meantime, or known already.
+      }
+      task->second.servant_task_id = iter->second->servant_task_id();
+      if (!task->second.personality.task_digest.empty()) {
+        shard->task_running_cv.notify_all();  // Someone may want to join it.
+      }
+    }
+  }
   running_task_bookkeeper_.SetServantRunningTasks(servant_location,
                                                   std::move(tasks));
   return unknown_tasks;
@@ -280,188 +1188,716 @@ std::vector<RunningTask> TaskDispatcher::GetRunningTasks() const {
   return running_task_bookkeeper_.GetRunningTasks();
 }
 
+std::vector<RunningTask> TaskDispatcher::LookupRunningTasks(
+    const std::vector<std::string>& task_digests) const {
+  return running_task_bookkeeper_.LookupRunningTasks(task_digests);
+}
+
+void TaskDispatcher::NotifyServantCompletedTasks(
+    const std::vector<CompletedTask>& tasks) {
+  for (auto&& e : tasks) {
+    if (e.started_at_ms()) {  // Not reported by older servants.
+      // Consumed by `task_dispatcher_simulator --convert_log`. Keep them in
+      // sync.
+      //
+      // This is logged per task actually run, instead of per grant. A grant
+      // may be used by several tasks in a row if it's leased.
+      FLARE_VLOG(1,
+                 "Task trace: started_at_ms={} requestor={} env={} "
+                 "ran_for_ms={} memory={} cost_key={}",
+                 e.started_at_ms(), e.requestor_ip(), e.compiler_digest(),
+                 e.compile_time_ms(), e.peak_memory_in_bytes(),
+                 e.task_cost_key());
+    }
+    if (e.task_cost_key().empty()) {
+      continue;
+    }
+    task_costs_.Report(
+        e.task_cost_key(),
+        TaskCost{.compile_time = e.compile_time_ms() * 1ms,
+                 .peak_memory_in_bytes = e.peak_memory_in_bytes()});
+  }
+}
+
+std::optional<TaskCost> TaskDispatcher::GetExpectedTaskCost(
+    const std::string& task_cost_key) {
+  if (task_cost_key.empty()) {
+    return std::nullopt;
+  }
+  return task_costs_.TryGet(task_cost_key);
+}
+
+void TaskDispatcher::SaveSnapshot() {
+  if (FLAGS_dispatcher_snapshot_path.empty()) {
+    return;
+  }
+  std::uint64_t sequence;
+  {
+    std::scoped_lock _(snapshot_lock_);
+    sequence = next_snapshot_sequence_++;
+  }
+  WriteSnapshot(sequence, CaptureSnapshot().SerializeAsString());
+}
+
+void TaskDispatcher::OnSnapshotTimer() {
+  std::uint64_t sequence;
+  {
+    std::scoped_lock _(snapshot_lock_);
+    sequence = next_snapshot_sequence_++;
+  }
+  auto bytes = CaptureSnapshot().SerializeAsString();
+  {
+    std::scoped_lock _(snapshot_lock_);
+    if (pending_snapshot_ && pending_snapshot_->first > sequence) {
+      return;  // We're late.
+    }
+    pending_snapshot_.emplace(sequence, std::move(bytes));
+  }
+  snapshot_cv_.notify_one();
+}
+
+void TaskDispatcher::SnapshotWriterProc() {
+  std::unique_lock lk(snapshot_lock_);
+  while (true) {
+    snapshot_cv_.wait(
+        lk, [&] { return snapshot_writer_leaving_ || pending_snapshot_; });
+    if (snapshot_writer_leaving_) {
+      break;
+    }
+    auto [sequence, bytes] = std::move(*pending_snapshot_);
+    pending_snapshot_.reset();
+    lk.unlock();
+    WriteSnapshot(sequence, bytes);
+    lk.lock();
+  }
+}
+
+void TaskDispatcher::WriteSnapshot(std::uint64_t sequence,
+                                   const std::string& bytes) {
+  std::scoped_lock _(snapshot_file_lock_);
+  if (sequence < last_written_snapshot_) {
+    return;  // Don't overwrite a more recent one.
+  }
+  last_written_snapshot_ = sequence;
+
+  // Written to a temporary file first, so that we never leave a truncated
+  // snapshot behind.
+  auto temp_path = FLAGS_dispatcher_snapshot_path + ".tmp";
+  std::ofstream output(temp_path, std::ios::binary | std::ios::trunc);
+  if (!output.write(bytes.data(), bytes.size()) || !output.flush()) {
+    FLARE_LOG_WARNING_EVERY_SECOND("Failed to write snapshot to [{}].",
+                                   temp_path);
+    return;
+  }
+  output.close();
+  if (std::rename(temp_path.c_str(),
+                  FLAGS_dispatcher_snapshot_path.c_str()) != 0) {
+    FLARE_LOG_WARNING_EVERY_SECOND("Failed to rename [{}] to [{}].", temp_path,
+                                   FLAGS_dispatcher_snapshot_path);
+  }
+}
+
+TaskDispatcher::Shard* TaskDispatcher::GetShardOf(
+    const std::string& compiler_digest) const noexcept {
+  return shards_[std::hash<std::string>{}(compiler_digest) % shards_.size()]
+      .get();
+}
+
+TaskDispatcher::Shard* TaskDispatcher::GetShardOfTask(
+    std::uint64_t task_id) const noexcept {
+  return shards_[task_id % shards_.size()].get();
+}
+
 std::size_t TaskDispatcher::GetCapacityAvailable(
     const ServantDesc& servant_desc) const noexcept {
   auto&& personality = servant_desc.personality;
-  if (personality.total_memory_in_bytes /* It's reported? */ &&
-      personality.memory_available_in_bytes < min_memory_for_new_task_) {
+  if (!HasMemoryFor(servant_desc, default_task_memory_, false)) {
     // Due to low memory condition, no new task can be acceptable. Therefore we
     // mark its capacity as the number of running tasks to prevent more tasks to
     // be dispatched to it.
     return servant_desc.running_tasks;
   }
 
-  // FIXME: This is not very accurate.
-  //
-  // If we've just finished a heavy compilation task, `foreign_load` may be
-  // spuriously larger than actual.
+  // Due to sampling delay on `personality.current_load`, load of compilation
+  // tasks that have just completed can still be accounted in it. Once the
+  // compilation finishes, `running_tasks` drops instantly, so subtracting
+  // `running_tasks` alone is not enough to compensate it. Were this not taken
+  // into consideration, we'd under-utilize the servant right after a burst.
   //
-  // This is due to sampling delay on `personality.current_load`.
-  //
-  // Once the compilation finishes, `running_tasks` drops instantly. Yet due to
-  // sampling delay on `current_load`, some (or all) of `current_load` that
-  // covers compilation jobs that have just completed, cannot be correctly
-  // compensated by subtracting `running_tasks` (which by now has reached zero).
-  //
-  // This shouldn't hurt much, but it does reduce machine utilization when we're
-  // heavy loaded.
+  // Therefore we track completed tasks and decay their contribution in the
+  // same way as loadavg does (see `completed_tasks`.). Those completed before
+  // the load was sampled are compensated by their decayed contribution at
+  // sampling time. Those completed afterwards were still running when the load
+  // was sampled, and are compensated by 1 each (as `running_tasks` did before
+  // they completed.).
+  auto&& completed = servant_desc.completed_tasks;
+  auto sampled_load =
+      std::max(personality.current_load - completed.at_report, 0.0);
+  if (personality.runnable_tasks) {
+    // The servant reported a finer-grained metric, which suffers much less
+    // from sampling delay.
+    sampled_load =
+        std::min(sampled_load, static_cast<double>(personality.runnable_tasks));
+  }
   auto foreign_load = std::max<std::int64_t>(
-      personality.current_load - servant_desc.running_tasks, 0);
-  std::size_t capacity_available =
-      std::max<std::int64_t>(personality.num_processors - foreign_load, 0);
+      std::lround(sampled_load - servant_desc.running_tasks -
+                  completed.since_report),
+      0);
+  std::size_t capacity_available = std::max<std::int64_t>(
+      static_cast<std::int64_t>(personality.num_processors) - foreign_load, 0);
   return std::min(personality.max_tasks, capacity_available);
 }
 
-// Allocation lock is held by the caller.
-std::vector<TaskDispatcher::ServantDesc*>
-TaskDispatcher::UnsafeEnumerateEligibleServants(
-    const TaskPersonality& requesting_task) {
-  // TODO(luobogao): Debugging code, we should turn it to an error code back to
-  // the caller (RPC caller.).
-  bool env_recognized = false;
-  std::vector<ServantDesc*> eligibles;
-
-  for (auto& e : servants_.servants) {
-    // Requested environment not available.
-    if (!ContainsEnvironmentSlow(e->personality.environments,
-                                 requesting_task.env_desc)) {
-      continue;
+bool TaskDispatcher::HasMemoryFor(const ServantDesc& servant_desc,
+                                  std::size_t memory,
+                                  bool learned) const noexcept {
+  auto&& personality = servant_desc.personality;
+  if (!personality.total_memory_in_bytes) {
+    return true;  // Not reported.
+  }
+  auto&& task_memory = servant_desc.task_memory;
+
+  // Tasks assigned after the servant reported its memory usage haven't been
+  // accounted by the servant yet.
+  auto available =
+      static_cast<std::int64_t>(personality.memory_available_in_bytes) -
+      static_cast<std::int64_t>(task_memory.since_report);
+  if (!learned) {
+    return available - static_cast<std::int64_t>(memory) >=
+           static_cast<std::int64_t>(min_memory_for_new_task_);
+  }
+
+  // Tasks assigned earlier can still be growing. Make sure that all of them
+  // fit in even if they reached their peak at the same time. Only peaks we've
+  // learned are reserved this way, a default guess reserved for each task of
+  // unknown cost would cap servant's capacity for no reason.
+  auto unallocated =
+      static_cast<std::int64_t>(personality.total_memory_in_bytes) -
+      static_cast<std::int64_t>(task_memory.learned);
+  return std::min(available, unallocated) -
+             static_cast<std::int64_t>(memory) >=
+         static_cast<std::int64_t>(min_memory_for_new_task_);
+}
+
+std::size_t TaskDispatcher::GetExpectedMemory(
+    const TaskPersonality& task) const noexcept {
+  if (task.expected_cost) {
+    return task.expected_cost->peak_memory_in_bytes;
+  }
+  return default_task_memory_;
+}
+
+void TaskDispatcher::UnsafeRecordTaskCompletion(
+    ServantDesc* servant, std::chrono::nanoseconds ran_for) {
+  auto&& completed = servant->completed_tasks;
+  auto now = flare::ReadCoarseSteadyClock();
+  // A task that has been running for a short period doesn't contribute much
+  // to the load average.
+  completed.decayed = DecayLoad(completed.decayed, now - completed.decayed_at) +
+                      (1 - DecayLoad(1, ran_for));
+  completed.decayed_at = now;
+  ++completed.since_report;
+}
+
+void TaskDispatcher::UnsafeRecordLoadReport(ServantDesc* servant) {
+  auto&& completed = servant->completed_tasks;
+  auto now = flare::ReadCoarseSteadyClock();
+  completed.decayed = DecayLoad(completed.decayed, now - completed.decayed_at);
+  completed.decayed_at = now;
+  completed.at_report = completed.decayed;
+  completed.since_report = 0;
+
+  // Memory used by tasks running by now is accounted in the report.
+  for (auto&& e : servant->tasks) {
+    e.memory_reported = true;
+  }
+  servant->task_memory.since_report = 0;
+}
+
+void TaskDispatcher::UnsafeUpdateServantShards(ServantDesc* servant) {
+  std::vector<std::size_t> shards;
+  std::vector<std::size_t> affected;
+  {
+    std::scoped_lock _(servant->lock);
+    auto&& personality = servant->personality;
+    // Servants not accepting tasks are not indexed at all.
+    if (personality.max_tasks) {
+      for (auto&& e : personality.environments) {
+        shards.push_back(GetShardOf(e.compiler_digest())->index);
+      }
     }
-    if (e->personality.max_tasks == 0) {
-      continue;
+    std::sort(shards.begin(), shards.end());
+    shards.erase(std::unique(shards.begin(), shards.end()), shards.end());
+
+    // Shards it's leaving are kept until it's unindexed there, so that changes
+    // of it are still propagated to them in the meantime.
+    std::set_union(shards.begin(), shards.end(), servant->shards.begin(),
+                   servant->shards.end(), std::back_inserter(affected));
+    servant->shards = affected;
+  }
+  for (auto&& e : affected) {
+    auto shard = shards_[e].get();
+    std::scoped_lock _(shard->lock);
+    UnsafeUnindexServant(shard, servant);
+    UnsafeIndexServant(shard, servant);
+  }
+  std::scoped_lock _(servant->lock);
+  servant->shards = std::move(shards);
+}
+
+void TaskDispatcher::UnsafeIndexServant(Shard* shard, ServantDesc* servant) {
+  auto&& indexed = servant->indexed[shard->index];
+  FLARE_CHECK(indexed.environments.empty());
+
+  {
+    std::scoped_lock _(servant->lock);
+    auto&& personality = servant->personality;
+    if (personality.max_tasks == 0) {
+      return;  // It's not accepting tasks at all, don't bother indexing it.
     }
-    if (e->personality.version < requesting_task.min_version) {
-      continue;
+
+    indexed.version = personality.version;
+    indexed.zone = personality.zone;
+    indexed.priority = personality.priority;
+    for (auto&& e : personality.environments) {
+      auto&& digest = e.compiler_digest();
+      if (GetShardOf(digest) != shard) {
+        continue;  // Indexed by other shards.
+      }
+      if (std::find_if(indexed.environments.begin(),
+                       indexed.environments.end(),
+                       [&](auto&& x) { return x.first == digest; }) !=
+          indexed.environments.end()) {
+        continue;  // Duplicate environment reported by the servant?
+      }
+      // Pointers to elements in `std::unordered_map` are not invalidated on
+      // rehash, so it's safe to keep them.
+      auto&& index = shard->environments[digest];
+      index.versions.insert(indexed.version);
+      indexed.environments.emplace_back(digest, &index);
+    }
+  }
+  if (!indexed.environments.empty()) {
+    UnsafeUpdateIndexPlacement(shard, servant);
+  }
+}
+
+void TaskDispatcher::UnsafeUnindexServant(Shard* shard, ServantDesc* servant) {
+  auto&& indexed = servant->indexed[shard->index];
+  for (auto&& [digest, index] : indexed.environments) {
+    if (indexed.free) {
+      RemoveFreeServant(indexed, index);
+      if (!indexed.zone.empty()) {
+        RemoveFreeServant(indexed, &index->zones.at(indexed.zone));
+      }
+    } else {
+      FLARE_CHECK_EQ(index->saturated.erase(servant), 1);
+    }
+    index->versions.erase(index->versions.find(indexed.version));
+    if (index->versions.empty()) {  // No servant recognizes it any more.
+      shard->environments.erase(digest);
+    }
+  }
+  indexed.environments.clear();
+  indexed.free = indexed.volunteer = indexed.dedicated_idle = false;
+}
+
+void TaskDispatcher::UnsafeReindexServant(Shard* shard, ServantDesc* servant) {
+  auto&& indexed = servant->indexed[shard->index];
+  if (indexed.environments.empty()) {
+    return;  // Not indexed here (any more), nothing to do.
+  }
+  for (auto&& [_, index] : indexed.environments) {
+    if (indexed.free) {
+      RemoveFreeServant(indexed, index);
+      if (!indexed.zone.empty()) {
+        RemoveFreeServant(indexed, &index->zones.at(indexed.zone));
+      }
+    } else {
+      index->saturated.erase(servant);
     }
-    env_recognized = true;
-    eligibles.push_back(e.Get());
   }
-  FLARE_LOG_ERROR_IF_EVERY_SECOND(
-      !env_recognized,
-      "Unrecognized compilation environment [{}] is requested by [{}].",
-      requesting_task.env_desc.compiler_digest(), requesting_task.requestor_ip);
-  return eligibles;
+  UnsafeUpdateIndexPlacement(shard, servant);
+}
+
+bool TaskDispatcher::UnsafeIsStale(const Shard& shard,
+                                   const ServantDesc& servant) {
+  // If we read an outdated generation here, we'd take the servant as up to
+  // date. That's fine, its capacity is checked again when allocating tasks.
+  return servant.indexed[shard.index].generation !=
+         servant.generation.load(std::memory_order_relaxed);
 }
 
-std::vector<TaskDispatcher::ServantDesc*>
-TaskDispatcher::UnsafeEnumerateFreeServants(
-    const std::vector<TaskDispatcher::ServantDesc*>& eligible_servants) {
-  std::vector<TaskDispatcher::ServantDesc*> free_servants;
-  for (auto& e : eligible_servants) {
+void TaskDispatcher::UnsafeUpdateIndexPlacement(Shard* shard,
+                                                ServantDesc* servant) {
+  auto&& indexed = servant->indexed[shard->index];
+  {
+    std::scoped_lock _(servant->lock);
+    auto&& personality = servant->personality;
+
     // Task allocated can be greater than max allowed. This happens when the
     // servant decreases its capacity after we've made some allocation (more
     // than its new capacity).
-    if (e->running_tasks >= GetCapacityAvailable(*e)) {
-      continue;
+    auto capacity = GetCapacityAvailable(*servant);
+    indexed.free = servant->running_tasks < capacity;
+    indexed.volunteer =
+        indexed.free && personality.priority != SERVANT_PRIORITY_DEDICATED;
+    // If there's a dedicated servant who still has idle physical cores, we
+    // prefer it. Once all its physical cores are busy, further tasks would be
+    // running on sibling hyperthreads, which are much slower. We'd rather use
+    // other servants then.
+    auto physical_cores = GetPhysicalCores(personality);
+    indexed.dedicated_idle =
+        indexed.free && personality.priority == SERVANT_PRIORITY_DEDICATED &&
+        servant->running_tasks < physical_cores;
+    if (indexed.free) {
+      indexed.key = {static_cast<double>(servant->running_tasks) / capacity,
+                     servant->serial};
+    }
+    if (indexed.dedicated_idle) {
+      indexed.dedicated_key = {
+          static_cast<double>(servant->running_tasks) / physical_cores,
+          servant->serial};
+    }
+    indexed.generation = servant->generation.load(std::memory_order_relaxed);
+  }
+
+  for (auto&& [_, index] : indexed.environments) {
+    if (indexed.free) {
+      AddFreeServant(servant, indexed, index);
+      if (!indexed.zone.empty()) {
+        AddFreeServant(servant, indexed, &index->zones[indexed.zone]);
+      }
+    } else {
+      index->saturated.insert(servant);
     }
-    free_servants.push_back(e);
   }
-  return free_servants;
+}
+
+void TaskDispatcher::AddFreeServant(ServantDesc* servant,
+                                    const IndexedServant& indexed,
+                                    FreeServants* servants) {
+  servants->free.emplace(indexed.key, servant);
+  if (indexed.volunteer) {
+    servants->volunteers.emplace(indexed.key, servant);
+  }
+  if (indexed.dedicated_idle) {
+    servants->dedicated_idle.emplace(indexed.dedicated_key, servant);
+  }
+}
+
+void TaskDispatcher::RemoveFreeServant(const IndexedServant& indexed,
+                                       FreeServants* servants) {
+  FLARE_CHECK_EQ(servants->free.erase(indexed.key), 1);
+  if (indexed.volunteer) {
+    FLARE_CHECK_EQ(servants->volunteers.erase(indexed.key), 1);
+  }
+  if (indexed.dedicated_idle) {
+    FLARE_CHECK_EQ(servants->dedicated_idle.erase(indexed.dedicated_key), 1);
+  }
+}
+
+const TaskDispatcher::EnvironmentIndex*
+TaskDispatcher::UnsafeFindEligibleServants(
+    Shard* shard, const TaskPersonality& requesting_task) {
+  auto iter =
+      shard->environments.find(requesting_task.env_desc.compiler_digest());
+  // Servants are removed from the index once they stopped accepting tasks, so
+  // existence of the index implies there's at least one servant. Yet we still
+  // need to check if any of them is recent enough.
+  if (iter == shard->environments.end() ||
+      *iter->second.versions.rbegin() < requesting_task.min_version) {
+    // TODO(luobogao): Debugging code, we should turn it to an error code back
+    // to the caller (RPC caller.).
+    FLARE_LOG_ERROR_EVERY_SECOND(
+        "Unrecognized compilation environment [{}] is requested by [{}].",
+        requesting_task.env_desc.compiler_digest(),
+        requesting_task.requestor_ip);
+    return nullptr;
+  }
+  return &iter->second;
 }
 
 TaskDispatcher::ServantDesc* TaskDispatcher::UnsafePickServantFor(
-    std::vector<ServantDesc*> servants, const std::string& requestor) {
-  // TODO(luobogao): I think we'd better assign a servant that the requestor has
-  // been using. This allows it to reuse TCP connection (avoid slow-start after
-  // idle), batch RPCs, etc. (But be care of not to use SMTs unless there are no
-  // other idle servant. Besides, do not overload a single machine to much so as
-  // not to block our daemon.).
+    Shard* shard, const EnvironmentIndex& servants,
+    const TaskPersonality& requesting_task) {
+  // Servants in the requestor's zone are preferred, so that (large) requests
+  // don't have to cross datacenter boundary. We spill to other zones only if
+  // all of them are busy.
+  if (!requesting_task.zone.empty()) {
+    if (auto iter = servants.zones.find(requesting_task.zone);
+        iter != servants.zones.end()) {
+      if (auto ptr = UnsafePickServantFrom(shard, servants, iter->second,
+                                           requesting_task)) {
+        return ptr;
+      }
+    }
+  }
+  return UnsafePickServantFrom(shard, servants, servants, requesting_task);
+}
 
+TaskDispatcher::ServantDesc* TaskDispatcher::UnsafePickServantFrom(
+    Shard* shard, const EnvironmentIndex& servants,
+    const FreeServants& candidates, const TaskPersonality& requesting_task) {
+  auto expected_memory = GetExpectedMemory(requesting_task);
+  auto max_dedicated_utilization =
+      GetMaxDedicatedUtilization(requesting_task.priority_class);
+  auto is_eligible = [&](ServantDesc& e) {
+    auto&& indexed = e.indexed[shard->index];
+    if (indexed.version < requesting_task.min_version) {
+      return false;
+    }
+    std::scoped_lock _(e.lock);
+    // Part of dedicated servants' capacity is reserved for tasks of higher
+    // priority.
+    if (max_dedicated_utilization < 1 &&
+        indexed.priority == SERVANT_PRIORITY_DEDICATED &&
+        e.running_tasks + 1 >
+            max_dedicated_utilization * GetCapacityAvailable(e)) {
+      return false;
+    }
+    return HasMemoryFor(e, expected_memory,
+                        requesting_task.expected_cost.has_value());
+  };
   // We prefer not to assign requestor's task to itself. This should leave more
   // resource to it for "non-distributable" work such as preprocessing.
-  ServantDesc* self = nullptr;
-  auto iter = std::find_if(servants.begin(), servants.end(), [&](auto&& e) {
-    return IsNetworkAddressEqual(e->personality.observed_location, requestor);
-  });
-  if (iter != servants.end()) {
-    self = *iter;
-    servants.erase(iter);
+  auto is_eligible_non_self = [&](ServantDesc& e) {
+    return !IsNetworkAddressEqual(e.location, requesting_task.requestor_ip) &&
+           is_eligible(e);
+  };
+
+  // Tasks of known cost are placed by their expected compilation time.
+  auto&& cost = requesting_task.expected_cost;
+  bool long_task =
+      cost && cost->compile_time >= FLAGS_long_task_threshold_ms * 1ms;
+  bool short_task =
+      cost && cost->compile_time <= FLAGS_short_task_threshold_ms * 1ms;
+
+  // A long task benefits much more from a fast servant than from reusing
+  // connections, so we put it on a dedicated servant whenever we can.
+  if (long_task) {
+    if (auto ptr = UnsafeTryPickServantFor(shard, candidates.dedicated_idle,
+                                           is_eligible_non_self)) {
+      return ptr;
+    }
+  }
+
+  // If the requestor has been using some servant, and that servant is not too
+  // busy, keep using it. This allows the requestor to reuse its TCP connection
+  // (avoid slow-start after idle), batch RPCs, etc.
+  //
+  // Short tasks are not allowed to stick to dedicated servants though. Neither
+  // are we allowed to pick servants other than `candidates`.
+  if (auto ptr = UnsafeTryPickRecentServantFor(
+          shard, servants, requesting_task, [&](ServantDesc& e) {
+            auto&& indexed = e.indexed[shard->index];
+            return !(short_task &&
+                     indexed.priority == SERVANT_PRIORITY_DEDICATED) &&
+                   (&candidates == &servants ||
+                    indexed.zone == requesting_task.zone) &&
+                   is_eligible_non_self(e);
+          })) {
+    return ptr;
+  }
+
+  // Leave dedicated servants for longer tasks if we can.
+  if (short_task) {
+    if (auto ptr = UnsafeTryPickServantFor(shard, candidates.volunteers,
+                                           is_eligible_non_self)) {
+      return ptr;
+    }
   }
 
   // If we can use a dedicated servant. Prefer it.
-  if (auto ptr = UnsafeTryPickDedicatedServantFor(servants)) {
+  if (auto ptr = UnsafeTryPickServantFor(shard, candidates.dedicated_idle,
+                                         is_eligible_non_self)) {
     return ptr;
   }
 
   // Otherwise let's see if we can use a servant other than the requestor
   // itself.
-  if (auto ptr = UnsafeTryPickAvailableServantFor(servants)) {
+  if (auto ptr = UnsafeTryPickServantFor(shard, candidates.free,
+                                         is_eligible_non_self)) {
     return ptr;
   }
 
-  // The requestor itself must be available for handling (its own) task then,
-  // otherwise we shouldn't be called.
-  FLARE_CHECK(self);
-  FLARE_CHECK_NE(GetCapacityAvailable(*self), 0);
-  return self;
+  // The requestor itself then, if it's available for handling its own task.
+  return UnsafeTryPickServantFor(shard, candidates.free, is_eligible);
 }
 
-TaskDispatcher::ServantDesc* TaskDispatcher::UnsafeTryPickDedicatedServantFor(
-    const std::vector<ServantDesc*>& servants) {
-  // If there's a dedicated servant who hasn't reach 50% load, use it.
+template <class F>
+TaskDispatcher::ServantDesc* TaskDispatcher::UnsafeTryPickServantFor(
+    Shard* shard, const OrderedServants& servants, F&& pred) {
+  // Servants are ordered by their utilization, so the first one satisfying
+  // `pred` is what we want.
   //
-  // FIXME: The 50% heuristic only applies if (2-way) SMT is enabled. We should
-  // report whether the servant enables SMT (and if yes, how many ways of SMTs
-  // are enabled), and refine the 50% check accordingly.
-  return UnsafeTryPickServantFor(servants, [](auto&& e) {
-    return e.personality.priority == SERVANT_PRIORITY_DEDICATED &&
-           e.running_tasks * 2 < e.personality.num_processors;
-  });
-}
-
-TaskDispatcher::ServantDesc* TaskDispatcher::UnsafeTryPickAvailableServantFor(
-    const std::vector<ServantDesc*>& servants) {
-  return UnsafeTryPickServantFor(servants, [](auto&&) { return true; });
+  // Usually only few servants are skipped (the requestor itself, or those too
+  // old for the request.), so this is effectively O(1).
+  for (auto iter = servants.begin(); iter != servants.end();) {
+    auto e = iter->second;
+    if (UnsafeIsStale(*shard, *e)) {
+      // Tasks have been assigned to it by other shards. Move it to where it
+      // should be, and continue from where it was.
+      auto key = iter->first;
+      UnsafeReindexServant(shard, e);
+      iter = servants.lower_bound(key);
+      continue;
+    }
+    if (pred(*e)) {
+      return e;
+    }
+    ++iter;
+  }
+  return nullptr;
 }
 
 template <class F>
-TaskDispatcher::ServantDesc* TaskDispatcher::UnsafeTryPickServantFor(
-    const std::vector<ServantDesc*>& servants, F&& pred) {
-  if (servants.empty()) {
+TaskDispatcher::ServantDesc* TaskDispatcher::UnsafeTryPickRecentServantFor(
+    Shard* shard, const EnvironmentIndex& servants,
+    const TaskPersonality& requesting_task, F&& pred) {
+  auto&& affinities = shard->affinities;
+  auto iter = affinities.requestors.find(requesting_task.requestor_ip);
+  if (iter == affinities.requestors.end()) {
     return nullptr;
   }
 
+  auto used_since = flare::ReadCoarseSteadyClock() -
+                    FLAGS_requestor_affinity_window * 1s;
   ServantDesc* result = nullptr;
-  double min_utilization = std::numeric_limits<double>::max();
+  for (auto&& [servant, last_used] : iter->second.recent_servants) {
+    if (last_used < used_since) {
+      continue;
+    }
+    if (UnsafeIsStale(*shard, *servant)) {
+      UnsafeReindexServant(shard, servant.Get());
+    }
+    auto&& indexed = servant->indexed[shard->index];
+    if (!indexed.free ||
+        // Be careful not to overload a single machine so as not to block the
+        // daemon running on it. For dedicated servants, we don't want to use
+        // SMTs unless there's no other idle servant either.
+        indexed.key.first >= FLAGS_requestor_affinity_max_utilization ||
+        (indexed.priority == SERVANT_PRIORITY_DEDICATED &&
+         !indexed.dedicated_idle) ||
+        !pred(*servant)) {
+      continue;
+    }
+    // The servant must be able to handle this environment as well.
+    if (std::none_of(
+            indexed.environments.begin(), indexed.environments.end(),
+            [&](auto&& e) { return e.second == &servants; })) {
+      continue;
+    }
+    if (!result || indexed.key < result->indexed[shard->index].key) {
+      result = servant.Get();
+    }
+  }
+  return result;
+}
 
-  for (auto&& e : servants) {
-    // This can't change unless the lock was released during enumeration and
-    // pick.
-    FLARE_CHECK_GT(e->personality.max_tasks, e->running_tasks);
+AllocationCounters* TaskDispatcher::UnsafeGetEnvironmentCounters(
+    Shard* shard, const std::string& digest) {
+  if (auto iter = shard->environment_counters.find(digest);
+      iter != shard->environment_counters.end()) {
+    return &iter->second;
+  }
+  if (!shard->environments.count(digest)) {
+    return &shard->unknown_environment_counters;
+  }
+  return &shard->environment_counters[digest];
+}
 
-    // These servants should be given to us in the first place.
-    FLARE_CHECK_NE(e->personality.max_tasks, 0);
-    FLARE_CHECK_NE(GetCapacityAvailable(*e), 0);
+void TaskDispatcher::UnsafeRecordDecision(
+    Shard* shard, AllocationOutcome outcome, const TaskPersonality& personality,
+    std::chrono::steady_clock::time_point since,
+    const TaskAllocation* allocation) {
+  auto now = flare::ReadCoarseSteadyClock();
+  auto&& digest = personality.env_desc.compiler_digest();
+  auto index = static_cast<std::size_t>(outcome);
+  ++UnsafeGetEnvironmentCounters(shard, digest)->outcomes[index];
+  ++shard->class_counters[GetClassIndex(personality.priority_class)]
+        .outcomes[index];
+  if (allocation) {
+    grant_wait_latency_.Report(now - since);
+  }
 
-    if (!pred(*e)) {
-      continue;
+  auto&& decision = *shard->recent_decisions.Append();
+  decision.decided_at = now;
+  decision.outcome = outcome;
+  decision.requestor_ip = personality.requestor_ip;
+  decision.compiler_digest = digest;
+  decision.priority_class = personality.priority_class;
+  decision.waited = now - since;
+  decision.task_id = allocation ? allocation->task_id : 0;
+  if (allocation) {
+    decision.servant_location = allocation->servant_location;
+  } else {
+    decision.servant_location.clear();
+  }
+}
+
+void TaskDispatcher::UnsafeRecordAffinity(Shard* shard, ServantDesc* servant,
+                                          const TaskPersonality& task) {
+  auto&& affinities = shard->affinities;
+  auto now = flare::ReadCoarseSteadyClock();
+  auto&& recent_servants =
+      affinities.requestors[task.requestor_ip].recent_servants;
+
+  ++affinities.allocations;
+  for (auto&& e : recent_servants) {
+    if (e.servant.Get() == servant) {
+      if (e.last_used + FLAGS_requestor_affinity_window * 1s >= now) {
+        ++affinities.reused;
+      }
+      e.last_used = now;
+      return;
     }
+  }
 
-    double utilization =
-        static_cast<double>(e->running_tasks) / GetCapacityAvailable(*e);
+  // Evict the least recently used one if there are too many.
+  if (recent_servants.size() >= kMaxRecentServantsPerRequestor) {
+    auto lru = std::min_element(
+        recent_servants.begin(), recent_servants.end(),
+        [](auto&& x, auto&& y) { return x.last_used < y.last_used; });
+    recent_servants.erase(lru);
+  }
+  recent_servants.push_back(RequestorAffinity::RecentServant{
+      .servant = flare::RefPtr(flare::ref_ptr, servant), .last_used = now});
+}
 
-    // Use the servant with lowest utilization.
-    if (!result || utilization < min_utilization) {
-      min_utilization = utilization;
-      result = e;
+void TaskDispatcher::UnsafeSweepAffinities(Shard* shard) {
+  auto used_since = flare::ReadCoarseSteadyClock() -
+                    FLAGS_requestor_affinity_window * 1s;
+  auto&& requestors = shard->affinities.requestors;
+  for (auto iter = requestors.begin(); iter != requestors.end();) {
+    auto&& recent_servants = iter->second.recent_servants;
+    recent_servants.erase(
+        std::remove_if(recent_servants.begin(), recent_servants.end(),
+                       [&](auto&& e) {
+                         return e.servant->removed || e.last_used < used_since;
+                       }),
+        recent_servants.end());
+    if (recent_servants.empty()) {
+      iter = requestors.erase(iter);
+    } else {
+      ++iter;
     }
   }
-
-  return result;
 }
 
-void TaskDispatcher::UnsafeSweepZombiesOf(
-    const ServantDesc* servant,
+void TaskDispatcher::SweepZombiesOf(
+    ServantDesc* servant,
     const std::unordered_set<std::uint64_t>& running_tasks) {
   std::size_t non_prefetch_zombies = 0;
   std::vector<std::uint64_t> sweeping;
 
-  // This can be slow if there are many concurrent tasks.
-  for (auto&& iter = tasks_.tasks.begin(); iter != tasks_.tasks.end(); ++iter) {
-    if (iter->second.belonging_servant.Get() == servant &&
-        iter->second.zombie && running_tasks.count(iter->first) == 0) {
-      sweeping.push_back(iter->first);
-      non_prefetch_zombies += !iter->second.is_prefetch;
+  {
+    std::scoped_lock _(servant->lock);
+    for (auto&& e : servant->tasks) {
+      if (e.zombie && running_tasks.count(e.task_id) == 0) {
+        sweeping.push_back(e.task_id);
+        non_prefetch_zombies += !e.is_prefetch;
+      }
     }
   }
 
@@ -472,136 +1908,440 @@ void TaskDispatcher::UnsafeSweepZombiesOf(
                        "Sweeping {} (non-prefetched) zombie tasks.",
                        non_prefetch_zombies);
   FLARE_VLOG(10, "Sweeping {} prefetched-but-not-used zombie tasks.");
-  UnsafeFreeTasks(sweeping);
+  FreeTasks(sweeping);
 }
 
-void TaskDispatcher::UnsafeSweepOrphans() {
+void TaskDispatcher::SweepOrphansOf(ServantDesc* servant) {
   std::vector<std::uint64_t> sweeping;
 
-  std::unordered_set<ServantDesc*> alive_servants;
-  for (auto&& e : servants_.servants) {
-    alive_servants.insert(e.Get());
+  {
+    std::scoped_lock _(servant->lock);
+    for (auto&& e : servant->tasks) {
+      sweeping.push_back(e.task_id);
+    }
   }
 
-  // This can be slow if there are many concurrent tasks.
-  for (auto&& iter = tasks_.tasks.begin(); iter != tasks_.tasks.end(); ++iter) {
-    if (alive_servants.count(iter->second.belonging_servant.Get()) == 0) {
-      sweeping.push_back(iter->first);
+  FLARE_LOG_WARNING_IF(!sweeping.empty(),
+                       "Sweeping {} orphan tasks of servant [{}].",
+                       sweeping.size(), servant->location);
+  FreeTasks(sweeping);
+}
+
+void TaskDispatcher::RemoveServant(const std::string& location) {
+  flare::RefPtr<ServantDesc> servant;
+  {
+    std::scoped_lock _(servants_lock_);
+    auto iter = servants_.servants.find(location);
+    if (iter == servants_.servants.end()) {
+      return;
     }
+    servant = iter->second;
+    FLARE_LOG_INFO("Removing servant [{}]. It served us for {} seconds.",
+                   servant->location,
+                   (flare::ReadCoarseSteadyClock() - servant->discovered_at) /
+                       1s);
+    UnsafeRemoveServant(servant.Get());
   }
+  SweepOrphansOf(servant.Get());
+}
 
-  FLARE_LOG_WARNING_IF(!sweeping.empty(), "Sweeping {} orphan tasks.",
-                       sweeping.size());
-  UnsafeFreeTasks(sweeping);
+void TaskDispatcher::UnsafeRemoveServant(ServantDesc* servant) {
+  running_task_bookkeeper_.DropServant(servant->location);
+  {
+    std::scoped_lock _(servant->index_lock);
+    for (auto&& e : servant->shards) {
+      auto shard = shards_[e].get();
+      std::scoped_lock lk(shard->lock);
+      UnsafeUnindexServant(shard, servant);
+    }
+    {
+      std::scoped_lock lk(servant->lock);
+      servant->shards.clear();
+    }
+    servant->removed = true;
+  }
+  FLARE_CHECK_EQ(
+      servants_.expirations.erase({servant->expires_at, servant->serial}), 1);
+  FLARE_CHECK_EQ(servants_.servants.erase(servant->location), 1);
 }
 
 void TaskDispatcher::OnExpirationTimer() {
   auto now = flare::ReadCoarseSteadyClock();
-  std::scoped_lock _(allocation_lock_);
+  std::vector<flare::RefPtr<ServantDesc>> removed;
+
+  {
+    std::scoped_lock _(servants_lock_);
 
-  // Remove expired servants.
-  for (auto iter = servants_.servants.begin();
-       iter != servants_.servants.end();) {
-    if ((*iter)->expires_at < now) {
+    // Remove expired servants. Only those really expired are visited.
+    while (!servants_.expirations.empty() &&
+           servants_.expirations.begin()->first.first < now) {
+      auto servant = flare::RefPtr(flare::ref_ptr,
+                                   servants_.expirations.begin()->second);
       FLARE_LOG_INFO(
           "Removing expired servant [{}]. It served us for {} seconds.",
-          (*iter)->personality.observed_location,
-          (flare::ReadCoarseSteadyClock() - (*iter)->discovered_at) / 1s);
-      running_task_bookkeeper_.DropServant(
-          (*iter)->personality.observed_location);
-      iter = servants_.servants.erase(iter);
-    } else {
-      ++iter;
+          servant->location,
+          (flare::ReadCoarseSteadyClock() - servant->discovered_at) / 1s);
+      UnsafeRemoveServant(servant.Get());
+      removed.push_back(std::move(servant));
     }
   }
 
   // Immediately forget (without making them zombie) about tasks whose servant
   // has gone.
-  UnsafeSweepOrphans();
+  for (auto&& e : removed) {
+    SweepOrphansOf(e.Get());
+  }
 
-  // Make expired tasks zombie.
-  for (auto iter = tasks_.tasks.begin(); iter != tasks_.tasks.end(); ++iter) {
-    if (iter->second.expires_at < now) {
-      iter->second.zombie = true;
+  for (auto&& shard : shards_) {
+    std::scoped_lock _(shard->lock);
+
+    // If all servants recognizing an environment have gone, there's no point
+    // in keep waiting on it.
+    UnsafeAbortOrphanWaiters(shard.get());
+
+    // Forget about servants no longer used by the requestors.
+    UnsafeSweepAffinities(shard.get());
+
+    // Make expired tasks zombie. Zombies are no longer subject to expiration.
+    auto&& tasks = shard->tasks;
+    while (!tasks.expirations.empty() &&
+           tasks.expirations.begin()->first < now) {
+      auto&& task = tasks.tasks.at(tasks.expirations.begin()->second);
+      tasks.expirations.erase(tasks.expirations.begin());
+      {
+        std::scoped_lock lk(task.belonging_servant->lock);
+        task.zombie = true;
+      }
+      auto&& digest = task.personality.env_desc.compiler_digest();
+      ++UnsafeGetEnvironmentCounters(shard, digest)->expired;
+      ++shard->class_counters[GetClassIndex(task.personality.priority_class)]
+            .expired;
+      if (!task.personality.task_digest.empty()) {
+        shard->task_running_cv.notify_all();  // It can't be joined any more.
+      }
       FLARE_VLOG(1,
                  "Task [{}] expired {} milliseconds ago. It has been there for "
                  "{} seconds.{}",
-                 iter->first, (now - iter->second.expires_at) / 1ms,
-                 (now - iter->second.started_at) / 1s,
-                 iter->second.is_prefetch
+                 task.task_id, (now - task.expires_at) / 1ms,
+                 (now - task.started_at) / 1s,
+                 task.is_prefetch
                      ? " The task was started because of a prefetch request."
                      : "");
     }
   }
+  // Subscribers that have gone won't take allocations made for them.
+  SweepSubscriptions();
+}
+
+void TaskDispatcher::LoadSnapshot() {
+  std::ifstream input(FLAGS_dispatcher_snapshot_path, std::ios::binary);
+  if (!input) {
+    FLARE_LOG_INFO("No snapshot found at [{}]. Starting from scratch.",
+                   FLAGS_dispatcher_snapshot_path);
+    return;
+  }
+  DispatcherSnapshot snapshot;
+  if (!snapshot.ParseFromIstream(&input)) {
+    FLARE_LOG_WARNING("Ignoring corrupted snapshot [{}].",
+                      FLAGS_dispatcher_snapshot_path);
+    return;
+  }
+  RestoreSnapshot(snapshot);
+}
+
+DispatcherSnapshot TaskDispatcher::CaptureSnapshot() {
+  DispatcherSnapshot snapshot;
+  auto now = flare::ReadCoarseSteadyClock();
+  snapshot.set_written_at_ms(flare::ReadSystemClock().time_since_epoch() / 1ms);
+
+  // Only servants (and their expiration time, which is protected by
+  // `servants_lock_`) are copied out under the lock. Serializing them is done
+  // without blocking heartbeats.
+  std::vector<std::pair<flare::RefPtr<ServantDesc>,
+                        std::chrono::steady_clock::time_point>>
+      servants;
+  {
+    std::scoped_lock _(servants_lock_);
+    servants.reserve(servants_.servants.size());
+    for (auto&& [k, v] : servants_.servants) {
+      servants.emplace_back(v, v->expires_at);
+    }
+  }
+
+  std::unordered_set<const ServantDesc*> captured_servants;
+  for (auto&& [v, expires_at] : servants) {
+    captured_servants.insert(v.Get());
+    auto&& servant = *snapshot.add_servants();
+    std::scoped_lock lk(v->lock);
+    auto&& personality = v->personality;
+    servant.set_version(personality.version);
+    servant.set_observed_location(personality.observed_location);
+    servant.set_reported_location(personality.reported_location);
+    servant.set_zone(personality.zone);
+    for (auto&& e : personality.environments) {
+      *servant.add_environments() = e;
+    }
+    servant.set_num_processors(personality.num_processors);
+    servant.set_num_physical_cores(personality.num_physical_cores);
+    servant.set_smt_ways(personality.smt_ways);
+    servant.set_current_load(personality.current_load);
+    servant.set_runnable_tasks(personality.runnable_tasks);
+    servant.set_total_memory_in_bytes(personality.total_memory_in_bytes);
+    servant.set_memory_available_in_bytes(
+        personality.memory_available_in_bytes);
+    servant.set_max_tasks(personality.max_tasks);
+    servant.set_priority(personality.priority);
+    servant.set_not_accepting_task_reason(
+        personality.not_accepting_task_reason);
+    servant.set_expires_in_ms(
+        std::max<std::int64_t>((expires_at - now) / 1ms, 0));
+  }
+
+  std::uint64_t next_task_id = 0;
+  for (auto&& shard : shards_) {
+    std::scoped_lock lk(shard->lock);
+    next_task_id = std::max<std::uint64_t>(
+        next_task_id, shard->tasks.next_task_id * shards_.size());
+    for (auto&& [id, task] : shard->tasks.tasks) {
+      if (task.zombie) {
+        continue;  // It's not likely to be running, and can't be renewed.
+      }
+      if (!captured_servants.count(task.belonging_servant.Get())) {
+        // Its servant joined after we copied the servants, it wouldn't be
+        // restored anyway.
+        continue;
+      }
+      auto&& captured = *snapshot.add_tasks();
+      captured.set_task_id(id);
+      captured.set_servant_location(task.belonging_servant->location);
+      captured.set_requestor_ip(task.personality.requestor_ip);
+      captured.set_min_version(task.personality.min_version);
+      captured.set_zone(task.personality.zone);
+      *captured.mutable_env_desc() = task.personality.env_desc;
+      captured.set_task_digest(task.personality.task_digest);
+      captured.set_priority_class(task.personality.priority_class);
+      if (auto&& cost = task.personality.expected_cost) {
+        auto&& expected_cost = *captured.mutable_expected_cost();
+        expected_cost.set_compile_time_ms(cost->compile_time / 1ms);
+        expected_cost.set_peak_memory_in_bytes(cost->peak_memory_in_bytes);
+      }
+      captured.set_is_prefetch(task.is_prefetch);
+      captured.set_expected_memory(task.expected_memory);
+      {
+        std::scoped_lock servant_lock(task.belonging_servant->lock);
+        captured.set_memory_reported(task.memory_reported);
+      }
+      if (task.servant_task_id) {
+        captured.set_running(true);
+        captured.set_servant_task_id(*task.servant_task_id);
+      }
+      captured.set_ran_for_ms((now - task.started_at) / 1ms);
+      captured.set_expires_in_ms(
+          std::max<std::int64_t>((task.expires_at - now) / 1ms, 0));
+      if (task.leased_until > now) {
+        captured.set_leased_for_ms((task.leased_until - now) / 1ms);
+      }
+    }
+  }
+  snapshot.set_next_task_id(next_task_id);
+  return snapshot;
+}
+
+void TaskDispatcher::RestoreSnapshot(const DispatcherSnapshot& snapshot) {
+  auto now = flare::ReadCoarseSteadyClock();
+  // Leases have kept running while we were down.
+  auto written_at = std::chrono::system_clock::time_point(
+      std::chrono::milliseconds(snapshot.written_at_ms()));
+  auto elapsed = std::max<std::chrono::nanoseconds>(
+      flare::ReadSystemClock() - written_at, 0ns);
+  std::size_t servants_restored = 0, tasks_restored = 0;
+
+  std::scoped_lock _(servants_lock_);
+  for (auto&& e : snapshot.servants()) {
+    auto expires_in = std::chrono::milliseconds(e.expires_in_ms()) - elapsed;
+    if (expires_in <= 0ns || servants_.servants.count(e.observed_location())) {
+      continue;  // Expired in the meantime, or has heartbeat-ed already.
+    }
+    ServantPersonality personality;
+    personality.version = e.version();
+    personality.observed_location = e.observed_location();
+    personality.reported_location = e.reported_location();
+    personality.zone = e.zone();
+    personality.environments.assign(e.environments().begin(),
+                                    e.environments().end());
+    personality.num_processors = e.num_processors();
+    personality.num_physical_cores = e.num_physical_cores();
+    personality.smt_ways = e.smt_ways();
+    personality.current_load = e.current_load();
+    personality.runnable_tasks = e.runnable_tasks();
+    personality.total_memory_in_bytes = e.total_memory_in_bytes();
+    personality.memory_available_in_bytes = e.memory_available_in_bytes();
+    personality.max_tasks = e.max_tasks();
+    personality.priority = e.priority();
+    personality.not_accepting_task_reason = e.not_accepting_task_reason();
+    auto servant = UnsafeAddServant(personality, expires_in);
+    std::scoped_lock lk(servant->index_lock);
+    UnsafeUpdateServantShards(servant.Get());
+    ++servants_restored;
+  }
+
+  for (auto&& e : snapshot.tasks()) {
+    auto expires_in = std::chrono::milliseconds(e.expires_in_ms()) - elapsed;
+    auto servant = servants_.servants.find(e.servant_location());
+    auto shard = GetShardOfTask(e.task_id());
+    if (expires_in <= 0ns || servant == servants_.servants.end()) {
+      continue;
+    }
+    if (shard != GetShardOf(e.env_desc().compiler_digest())) {
+      // `FLAGS_allocation_shards` has changed, so the task can't be found by
+      // its ID any more.
+      continue;
+    }
+    std::scoped_lock lk(shard->lock);
+    auto&& desc = servant->second;
+    auto [iter, inserted] = shard->tasks.tasks.try_emplace(e.task_id());
+    if (!inserted) {
+      continue;
+    }
+    auto&& task = iter->second;
+    task.task_id = e.task_id();
+    task.personality.requestor_ip = e.requestor_ip();
+    task.personality.min_version = e.min_version();
+    task.personality.zone = e.zone();
+    task.personality.env_desc = e.env_desc();
+    task.personality.task_digest = e.task_digest();
+    task.personality.priority_class = e.priority_class();
+    if (e.has_expected_cost()) {
+      task.personality.expected_cost = TaskCost{
+          .compile_time =
+              std::chrono::milliseconds(e.expected_cost().compile_time_ms()),
+          .peak_memory_in_bytes = e.expected_cost().peak_memory_in_bytes()};
+    }
+    task.belonging_servant = desc;
+    task.started_at =
+        now - elapsed - std::chrono::milliseconds(e.ran_for_ms());
+    task.expires_at = now + expires_in;
+    task.renewed_at = now;
+    task.is_prefetch = e.is_prefetch();
+    task.expected_memory = e.expected_memory();
+    if (e.leased_for_ms()) {
+      task.leased_until =
+          now - elapsed + std::chrono::milliseconds(e.leased_for_ms());
+    }
+    if (e.running()) {
+      task.servant_task_id = e.servant_task_id();
+    }
+    {
+      std::scoped_lock servant_lock(desc->lock);
+      task.memory_reported = e.memory_reported();
+      ++desc->running_tasks;
+      ++desc->ever_assigned_tasks;
+      desc->task_memory.total += task.expected_memory;
+      if (task.personality.expected_cost) {
+        desc->task_memory.learned += task.expected_memory;
+      }
+      if (!task.memory_reported) {
+        desc->task_memory.since_report += task.expected_memory;
+      }
+      if (e.running()) {
+        desc->running_at_snapshot.push_back(task.task_id);
+      }
+      ++desc->generation;
+      desc->tasks.push_back(&task);
+    }
+    shard->tasks.expirations.emplace(task.expires_at, task.task_id);
+    if (!task.personality.task_digest.empty()) {
+      shard->tasks.by_digest.try_emplace(task.personality.task_digest,
+                                         task.task_id);
+    }
+    UnsafeReindexServant(shard, desc.Get());
+    ++tasks_restored;
+  }
+
+  // Task IDs allocated by our previous incarnation are never reused.
+  for (auto&& shard : shards_) {
+    std::scoped_lock lk(shard->lock);
+    shard->tasks.next_task_id = std::max<std::uint64_t>(
+        shard->tasks.next_task_id,
+        (snapshot.next_task_id() + shards_.size() - 1) / shards_.size());
+  }
+  FLARE_LOG_INFO(
+      "Restored {} servants and {} tasks from snapshot taken {} seconds ago.",
+      servants_restored, tasks_restored, elapsed / 1s);
 }
 
 Json::Value TaskDispatcher::DumpInternals() {
-  std::scoped_lock _(allocation_lock_);
   Json::Value jsv;
   std::uint64_t cluster_capacity = 0;
   std::uint64_t capacity_unavailable = 0;
   std::uint64_t total_running = 0;
 
   // Servants.
-  for (int i = 0; i != servants_.servants.size(); ++i) {
-    auto&& entry = servants_.servants[i];
-    auto&& personality = entry->personality;
-    auto&& item = jsv["servants"][i];
-
-    item["version"] = personality.version;
-    if (personality.observed_location != personality.reported_location) {
-      item["observed_location"] = personality.observed_location;
-      item["reported_location"] = personality.reported_location;
-    } else {
-      item["location"] = personality.observed_location;
-    }
-    item["discovered_at"] = FormatTime(entry->discovered_at);
-    item["expires_at"] = FormatTime(entry->expires_at);
-    for (auto&& e : personality.environments) {
-      item["environments"].append(e.compiler_digest());
+  {
+    std::scoped_lock _(servants_lock_);
+    int index = 0;
+    for (auto&& [k, entry] : servants_.servants) {
+      std::scoped_lock lk(entry->lock);
+      auto&& personality = entry->personality;
+      auto&& item = jsv["servants"][index++];
+
+      item["version"] = personality.version;
+      if (personality.observed_location != personality.reported_location) {
+        item["observed_location"] = personality.observed_location;
+        item["reported_location"] = personality.reported_location;
+      } else {
+        item["location"] = personality.observed_location;
+      }
+      if (!personality.zone.empty()) {
+        item["zone"] = personality.zone;
+      }
+      item["discovered_at"] = FormatTime(entry->discovered_at);
+      item["expires_at"] = FormatTime(entry->expires_at);
+      for (auto&& e : personality.environments) {
+        item["environments"].append(e.compiler_digest());
+      }
+      item["priority"] = ServantPriority_Name(personality.priority);
+      if (personality.max_tasks) {
+        item["max_tasks"] = static_cast<Json::UInt64>(personality.max_tasks);
+      } else {
+        item["not_accepting_task_reason"] =
+            NotAcceptingTaskReason_Name(personality.not_accepting_task_reason);
+      }
+      item["num_processors"] =
+          static_cast<Json::UInt64>(personality.num_processors);
+      if (personality.num_physical_cores) {
+        item["num_physical_cores"] =
+            static_cast<Json::UInt64>(personality.num_physical_cores);
+        item["smt_ways"] = static_cast<Json::UInt64>(personality.smt_ways);
+      }
+      item["current_load"] =
+          static_cast<Json::UInt64>(personality.current_load);
+      if (personality.runnable_tasks) {
+        item["runnable_tasks"] =
+            static_cast<Json::UInt64>(personality.runnable_tasks);
+      }
+      item["recently_completed_load"] = entry->completed_tasks.at_report +
+                                        entry->completed_tasks.since_report;
+      item["capacity_available"] =
+          static_cast<Json::Int64>(GetCapacityAvailable(*entry));
+      item["total_memory_mb"] = static_cast<Json::UInt64>(
+          personality.total_memory_in_bytes / 1024 / 1024);
+      item["memory_available_mb"] = static_cast<Json::UInt64>(
+          personality.memory_available_in_bytes / 1024 / 1024);
+      item["task_memory_expected_mb"] =
+          static_cast<Json::UInt64>(entry->task_memory.total / 1024 / 1024);
+      item["running_tasks"] = static_cast<Json::UInt64>(entry->running_tasks);
+      item["ever_assigned_tasks"] =
+          static_cast<Json::UInt64>(entry->ever_assigned_tasks);
+
+      total_running += entry->running_tasks;
+      cluster_capacity += personality.max_tasks;
+      capacity_unavailable +=
+          personality.max_tasks - GetCapacityAvailable(*entry);
     }
-    item["priority"] = ServantPriority_Name(personality.priority);
-    if (personality.max_tasks) {
-      item["max_tasks"] = static_cast<Json::UInt64>(personality.max_tasks);
-    } else {
-      item["not_accepting_task_reason"] =
-          NotAcceptingTaskReason_Name(personality.not_accepting_task_reason);
-    }
-    item["num_processors"] =
-        static_cast<Json::UInt64>(personality.num_processors);
-    item["current_load"] = static_cast<Json::UInt64>(personality.current_load);
-    item["capacity_available"] =
-        static_cast<Json::Int64>(GetCapacityAvailable(*entry));
-    item["total_memory_mb"] = static_cast<Json::UInt64>(
-        personality.total_memory_in_bytes / 1024 / 1024);
-    item["memory_available_mb"] = static_cast<Json::UInt64>(
-        personality.memory_available_in_bytes / 1024 / 1024);
-    item["running_tasks"] = static_cast<Json::UInt64>(entry->running_tasks);
-    item["ever_assigned_tasks"] =
-        static_cast<Json::UInt64>(entry->ever_assigned_tasks);
-
-    total_running += entry->running_tasks;
-    cluster_capacity += personality.max_tasks;
-    capacity_unavailable +=
-        personality.max_tasks - GetCapacityAvailable(*entry);
-  }
-
-  // Tasks.
-  for (auto&& [k, v] : tasks_.tasks) {
-    auto&& item = jsv["tasks"][std::to_string(k)];
-
-    item["task_id"] = static_cast<Json::UInt64>(v.task_id);
-    item["requestor_ip"] = v.personality.requestor_ip;
-    item["compiler_digest"] = v.personality.env_desc.compiler_digest();
-    item["started_at"] = FormatTime(v.started_at);
-    item["expires_at"] = FormatTime(v.expires_at);
-    item["prefetched_task"] = v.is_prefetch;
-    item["servant_location"] =
-        v.belonging_servant->personality.observed_location;
-    item["zombie"] = v.zombie;
-  }
-
-  jsv["servants_up"] = static_cast<Json::UInt64>(servants_.servants.size());
+    jsv["servants_up"] = static_cast<Json::UInt64>(servants_.servants.size());
+  }
+
   jsv["running_tasks"] = static_cast<Json::UInt64>(total_running);
   jsv["capacity"] = static_cast<Json::UInt64>(cluster_capacity);
   // The result of subtraction can be negative, if some node is running more
@@ -610,6 +2350,147 @@ Json::Value TaskDispatcher::DumpInternals() {
   jsv["capacity_available"] = static_cast<Json::UInt64>(std::max<std::int64_t>(
       cluster_capacity - total_running - capacity_unavailable, 0));
   jsv["capacity_unavailable"] = static_cast<Json::UInt64>(capacity_unavailable);
+
+  std::uint64_t allocations = 0;
+  std::uint64_t reused = 0;
+  std::unordered_set<std::string> requestors;
+  std::uint64_t joined_tasks = 0;
+  for (auto&& shard : shards_) {
+    std::scoped_lock _(shard->lock);
+
+    // Tasks.
+    for (auto&& [k, v] : shard->tasks.tasks) {
+      auto&& item = jsv["tasks"][std::to_string(k)];
+
+      item["task_id"] = static_cast<Json::UInt64>(v.task_id);
+      item["requestor_ip"] = v.personality.requestor_ip;
+      item["compiler_digest"] = v.personality.env_desc.compiler_digest();
+      item["started_at"] = FormatTime(v.started_at);
+      item["expires_at"] = FormatTime(v.expires_at);
+      item["prefetched_task"] = v.is_prefetch;
+      item["expected_memory_mb"] =
+          static_cast<Json::UInt64>(v.expected_memory / 1024 / 1024);
+      item["servant_location"] = v.belonging_servant->location;
+      item["zombie"] = v.zombie;
+    }
+
+    // Environments.
+    for (auto&& [k, v] : shard->environments) {
+      auto&& item = jsv["environments"][k];
+
+      item["free_servants"] = static_cast<Json::UInt64>(v.free.size());
+      item["saturated_servants"] =
+          static_cast<Json::UInt64>(v.saturated.size());
+    }
+    for (auto&& [k, v] : shard->waiters) {
+      auto&& item = jsv["environments"][k]["waiters"];
+      for (auto&& cls : v.classes) {
+        for (auto&& [requestor, waiters] : cls.requestors) {
+          item[requestor] = static_cast<Json::UInt64>(
+              item[requestor].asUInt64() + waiters.waiters.size());
+        }
+      }
+    }
+
+    allocations += shard->affinities.allocations;
+    reused += shard->affinities.reused;
+    for (auto&& [k, v] : shard->affinities.requestors) {
+      requestors.insert(k);
+    }
+    joined_tasks += shard->joined_tasks;
+
+    // Allocations made to requestors of each zone.
+    for (auto&& [k, v] : shard->zone_counters) {
+      auto&& item = jsv["zones"][k];
+      item["allocations"] = static_cast<Json::UInt64>(
+          item["allocations"].asUInt64() + v.allocations);
+      item["cross_zone_allocations"] = static_cast<Json::UInt64>(
+          item["cross_zone_allocations"].asUInt64() +
+          v.cross_zone_allocations);
+    }
+  }
+
+  // Affinity between requestors and servants.
+  jsv["affinity"]["allocations"] = static_cast<Json::UInt64>(allocations);
+  jsv["affinity"]["connection_reused"] = static_cast<Json::UInt64>(reused);
+  jsv["affinity"]["connection_reuse_ratio"] =
+      allocations ? static_cast<double>(reused) / allocations : 0.0;
+  jsv["affinity"]["requestors"] =
+      static_cast<Json::UInt64>(requestors.size());
+
+  jsv["known_task_costs"] = static_cast<Json::UInt64>(task_costs_.GetSize());
+  jsv["joined_tasks"] = static_cast<Json::UInt64>(joined_tasks);
+  {
+    std::scoped_lock _(subscriptions_lock_);
+    jsv["subscriptions"] = static_cast<Json::UInt64>(subscriptions_.size());
+  }
+  return jsv;
+}
+
+Json::Value TaskDispatcher::DumpMetrics() {
+  static constexpr const char* kClassNames[] = {"interactive", "ci", "batch"};
+  static_assert(std::size(kClassNames) == kPriorityClasses);
+  auto now = flare::ReadCoarseSteadyClock();
+  Json::Value jsv;
+
+  jsv["grant_wait"] = grant_wait_latency_.Dump();
+  jsv["keep_alive_lag"] = keep_alive_lag_.Dump();
+  jsv["grant_lifetime"] = grant_lifetime_.Dump();
+
+  {
+    std::scoped_lock _(servants_lock_);
+    for (auto&& [k, entry] : servants_.servants) {
+      std::scoped_lock lk(entry->lock);
+      auto&& item = jsv["servants"][k];
+      auto minutes = std::max<double>(
+          std::chrono::duration<double>(now - entry->discovered_at) / 1min,
+          1);
+      item["assigned_tasks"] =
+          static_cast<Json::UInt64>(entry->ever_assigned_tasks);
+      item["assignments_per_minute"] = entry->ever_assigned_tasks / minutes;
+    }
+  }
+
+  std::vector<AllocationDecision> decisions;
+  AllocationCounters unknown_environment_counters;
+  std::array<AllocationCounters, kPriorityClasses> class_counters;
+  for (auto&& shard : shards_) {
+    std::scoped_lock _(shard->lock);
+    for (auto&& [k, v] : shard->environment_counters) {
+      jsv["environments"][k] = v.Dump();
+    }
+    unknown_environment_counters.Add(shard->unknown_environment_counters);
+    for (std::size_t i = 0; i != kPriorityClasses; ++i) {
+      class_counters[i].Add(shard->class_counters[i]);
+    }
+    auto recent = shard->recent_decisions.GetDecisions();
+    decisions.insert(decisions.end(), recent.begin(), recent.end());
+  }
+  jsv["unknown_environments"] = unknown_environment_counters.Dump();
+  for (std::size_t i = 0; i != kPriorityClasses; ++i) {
+    jsv["priority_classes"][kClassNames[i]] = class_counters[i].Dump();
+  }
+
+  // Most recent ones come last.
+  std::stable_sort(decisions.begin(), decisions.end(), [](auto&& x, auto&& y) {
+    return x.decided_at < y.decided_at;
+  });
+  auto&& recent_decisions = jsv["recent_decisions"];
+  recent_decisions = Json::arrayValue;
+  for (auto&& e : decisions) {
+    Json::Value item;
+    item["decided_at"] = FormatTime(e.decided_at);
+    item["outcome"] = GetAllocationOutcomeName(e.outcome);
+    item["requestor_ip"] = e.requestor_ip;
+    item["compiler_digest"] = e.compiler_digest;
+    item["priority_class"] = kClassNames[GetClassIndex(e.priority_class)];
+    item["waited_ms"] = static_cast<Json::Int64>(e.waited / 1ms);
+    if (e.task_id) {
+      item["task_id"] = static_cast<Json::UInt64>(e.task_id);
+      item["servant_location"] = e.servant_location;
+    }
+    recent_decisions.append(item);
+  }
   return jsv;
 }
 
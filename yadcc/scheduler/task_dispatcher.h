@@ -15,18 +15,29 @@
 #ifndef YADCC_SCHEDULER_TASK_DISPATCHER_H_
 #define YADCC_SCHEDULER_TASK_DISPATCHER_H_
 
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <cinttypes>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "gtest/gtest_prod.h"
 #include "jsoncpp/value.h"
 
 #include "flare/base/expected.h"
+#include "flare/base/internal/doubly_linked_list.h"
 #include "flare/base/exposed_var.h"
 #include "flare/base/ref_ptr.h"
 #include "flare/fiber/condition_variable.h"
@@ -34,7 +45,10 @@
 
 #include "yadcc/api/env_desc.pb.h"
 #include "yadcc/api/scheduler.pb.h"
+#include "yadcc/scheduler/dispatcher_metrics.h"
+#include "yadcc/scheduler/dispatcher_snapshot.pb.h"
 #include "yadcc/scheduler/running_task_bookkeeper.h"
+#include "yadcc/scheduler/task_cost_store.h"
 
 namespace yadcc::scheduler {
 
@@ -56,11 +70,31 @@ struct TaskPersonality {
   // Minimal daemon version specified.
   std::uint32_t min_version;
 
+  // Zone (datacenter, rack, etc.) the requestor is in, if declared. Servants
+  // in the same zone are preferred.
+  std::string zone;
+
   // We can only allocate compile-server that recognizes this environment to the
   // client. Otherwise the server we allocated will have no toolchain to serve
   // the client.
   EnvironmentDesc env_desc;
 
+  // Cost of this task as learned from earlier runs of similar tasks, if known.
+  // @sa: `TaskDispatcher::GetExpectedTaskCost`.
+  //
+  // When several tasks are allocated at once, this applies to the first one.
+  std::optional<TaskCost> expected_cost;
+
+  // Digest of this task, if known. If a task of the same digest is already
+  // running, the requestor may join it instead of starting a new one. @sa:
+  // `TaskDispatcher::WaitForStartingNewTasks`.
+  //
+  // When several tasks are allocated at once, this applies to the first one.
+  std::string task_digest;
+
+  // Priority class of this task.
+  TaskPriorityClass priority_class = TASK_PRIORITY_CLASS_INTERACTIVE;
+
   // I'm not sure if other environment personalities should be checked. e.g.,
   // Linux (distribution, I mean) version, ISA, etc.
 };
@@ -76,6 +110,27 @@ struct TaskAllocation {
   std::string servant_location;
 };
 
+// Change in standing demand of a subscription for an environment.
+struct DemandDelta {
+  // `expected_cost` and `task_digest` are ignored.
+  TaskPersonality personality;
+  std::int64_t delta;
+
+  // Cost of tasks the demand added by `delta` is for, in the order they
+  // started waiting. There can be fewer of them than `delta`. Ignored if
+  // `delta` is not positive.
+  std::vector<std::optional<TaskCost>> expected_costs;
+};
+
+// Allocation made for a subscription.
+struct SubscribedTaskAllocation {
+  std::string compiler_digest;
+  TaskAllocation allocation;
+
+  // Unless renewed, the allocation expires at this time.
+  std::chrono::steady_clock::time_point expires_at;
+};
+
 // Describes a servant.
 struct ServantPersonality {
   // TODO(luobogao): UUID
@@ -90,20 +145,32 @@ struct ServantPersonality {
   // above, it's likely the servant is behind NAT.
   std::string reported_location;
 
+  // Zone (datacenter, rack, etc.) the servant is in, if declared.
+  std::string zone;
+
   // Compilers available on the servant.
   std::vector<EnvironmentDesc> environments;
 
   // Maximum cpu core of daemon machine
   std::size_t num_processors;
 
+  // Number of physical cores (among `num_processors`) and number of hardware
+  // threads per core, if reported (0 otherwise).
+  std::size_t num_physical_cores = 0;
+  std::size_t smt_ways = 0;
+
   // Recent load average
   std::size_t current_load;
 
-  // Total memory of this servant.
-  std::size_t total_memory_in_bytes;
+  // Number of runnable threads recently, if reported (0 otherwise). This is
+  // sampled in a much shorter period than `current_load`.
+  std::size_t runnable_tasks = 0;
+
+  // Total memory of this servant, if reported (0 otherwise).
+  std::size_t total_memory_in_bytes = 0;
 
   // Available memory of this servant.
-  std::size_t memory_available_in_bytes;
+  std::size_t memory_available_in_bytes = 0;
 
   // Maximum concurrent task this servant can process.
   std::size_t max_tasks;
@@ -140,7 +207,74 @@ class TaskDispatcher {
       const TaskPersonality& personality, std::chrono::nanoseconds expires_in,
       std::chrono::steady_clock::time_point timeout, bool prefetching);
 
-  // Expands a task's allocation to `new_expires_in`.
+  // Same as `WaitForStartingNewTask`, except that up to `immediate_reqs +
+  // prefetch_reqs` tasks are allocated at once. Allocations after the first
+  // `immediate_reqs` ones are marked as prefetched.
+  //
+  // Only the first allocation is waited for (until `timeout`). The rest are
+  // allocated only if servants are immediately available. Therefore this
+  // method may return less allocations than requested. Allocations made are
+  // spread over servants by their utilization.
+  //
+  // Everything is done in a single critical section (of the environment's
+  // shard), so this is much cheaper than calling `WaitForStartingNewTask`
+  // repeatedly.
+  //
+  // If `existing_task` is given and a task of `personality.task_digest` has
+  // already been allocated to someone else, we wait (for a short while) for the
+  // servant to report it running, and return it in `existing_task` instead. No
+  // task is allocated (an empty vector is returned) in this case. Checking for
+  // such a task and allocating a new one is done atomically, so concurrent
+  // requests for the same digest start only one task.
+  //
+  // If both `immediate_reqs` and `prefetch_reqs` are 0, only the check for an
+  // existing task above is done. This does not wait at all unless a task of
+  // the same digest has been allocated.
+  flare::Expected<std::vector<TaskAllocation>, WaitStatus>
+  WaitForStartingNewTasks(const TaskPersonality& personality,
+                          std::chrono::nanoseconds expires_in,
+                          std::chrono::steady_clock::time_point timeout,
+                          std::size_t immediate_reqs,
+                          std::size_t prefetch_reqs,
+                          std::optional<RunningTask>* existing_task = nullptr);
+
+  // Same as `WaitForStartingNewTasks`, except that up to `slots` allocations
+  // are leased to the requestor for `duration`. The requestor reuses them for
+  // its tasks in turn, and renewing them won't bring their expiration earlier
+  // than the end of the lease.
+  flare::Expected<std::vector<TaskAllocation>, WaitStatus> WaitForLeasingTasks(
+      const TaskPersonality& personality, std::chrono::nanoseconds duration,
+      std::chrono::steady_clock::time_point timeout, std::size_t slots);
+
+  // Update standing demand of subscription `subscription_id` by `deltas`. Each
+  // unit of demand is served in the same way as a waiter of
+  // `WaitForStartingNewTask` is, except that allocations made for it are kept
+  // until fetched by `WaitForSubscribedAllocations`.
+  //
+  // If `reset` is set, `deltas` are relative to zero (environments not listed
+  // are no longer demanded), and the subscription is created if it does not
+  // exist yet. Otherwise deltas of a `sequence` no greater than the last one
+  // applied are ignored.
+  //
+  // Returns `false` if the subscription is not recognized (and `reset` is not
+  // set). The caller should re-send its full demand then.
+  bool UpdateSubscription(std::uint64_t subscription_id,
+                          std::uint64_t sequence, bool reset,
+                          const std::vector<DemandDelta>& deltas,
+                          std::chrono::nanoseconds expires_in);
+
+  // Wait until there are allocations made for the subscription or `timeout`
+  // is reached, and take all of them. `std::nullopt` is returned if the
+  // subscription is not recognized.
+  //
+  // Subscriptions not waited on for a while are dropped, and allocations not
+  // taken yet are freed.
+  std::optional<std::vector<SubscribedTaskAllocation>>
+  WaitForSubscribedAllocations(std::uint64_t subscription_id,
+                               std::chrono::steady_clock::time_point timeout);
+
+  // Expands a task's allocation to `new_expires_in`. Leased allocations don't
+  // expire before the end of their lease, though.
   //
   // Returns `false` if task ID given is not recognized (e.g., already expired).
   bool KeepTaskAlive(std::uint64_t task_id,
@@ -166,6 +300,10 @@ class TaskDispatcher {
   void KeepServantAlive(const ServantPersonality& servant,
                         std::chrono::nanoseconds expires_in);
 
+  // Remove servant at `location` immediately, as if it has expired. Tasks
+  // assigned to it are forgotten.
+  void RemoveServant(const std::string& location);
+
   // Update running tasks reported by the servant. This method is called as a
   // result of servant heartbeat.
   //
@@ -180,22 +318,38 @@ class TaskDispatcher {
   // Because of network delay problems, this infomation may be out of data.
   std::vector<RunningTask> GetRunningTasks() const;
 
- private:
-  struct ServantDesc : public flare::RefCounted<ServantDesc> {
-    ServantPersonality personality;
-    std::chrono::steady_clock::time_point discovered_at;
-    std::chrono::steady_clock::time_point expires_at;
+  // Find running tasks of the given digests. At most one task is returned for
+  // each digest.
+  std::vector<RunningTask> LookupRunningTasks(
+      const std::vector<std::string>& task_digests) const;
 
-    std::size_t running_tasks = 0;
-    std::size_t ever_assigned_tasks = 0;
+  // Learn cost of tasks completed by servants (and trace them, with `--v=1`).
+  // This method is called as a result of servant heartbeat.
+  void NotifyServantCompletedTasks(const std::vector<CompletedTask>& tasks);
 
-    // Get capacity available to us (not used by other jobs on the node.).
-  };
+  // Get expected cost of tasks of the given cost key, if we've learned it.
+  std::optional<TaskCost> GetExpectedTaskCost(const std::string& task_cost_key);
 
-  struct ServantRegistry {
-    std::vector<flare::RefPtr<ServantDesc>> servants;
-  };
+  ///////////////////
+  // Warm restart. //
+  ///////////////////
+
+  // Persist servants and task grants to `FLAGS_dispatcher_snapshot_path`, if
+  // it's set. This is done periodically. Calling it right before the scheduler
+  // quits allows the next instance to start with up-to-date state.
+  //
+  // The snapshot is loaded when the dispatcher is initialized.
+  void SaveSnapshot();
 
+ private:
+  struct EnvironmentIndex;
+  struct ServantDesc;
+  struct SubscribedDemand;
+
+  // Tasks are owned by the shard of their compiler digest. Fields accessed via
+  // `ServantDesc::tasks` (`memory_reported`, `zombie`) are protected by lock of
+  // `belonging_servant` (`zombie` is written with both locks held), the rest by
+  // lock of the shard.
   struct TaskDesc {
     std::uint64_t task_id;
     TaskPersonality personality;
@@ -204,6 +358,22 @@ class TaskDispatcher {
     std::chrono::steady_clock::time_point expires_at;
     bool is_prefetch;
 
+    // End of the lease if this task is leased. @sa: `WaitForLeasingTasks`.
+    std::chrono::steady_clock::time_point leased_until{};
+
+    // When the task was allocated or renewed last time.
+    std::chrono::steady_clock::time_point renewed_at;
+
+    // Memory this task is expected to use at its peak.
+    std::size_t expected_memory;
+
+    // Set once the servant has reported its memory usage after this task was
+    // assigned to it.
+    bool memory_reported = false;
+
+    // Set once the servant has reported this task running.
+    std::optional<std::uint64_t> servant_task_id;
+
     // We don't instantly forget about expired tasks (if this does happen).
     // Instead, we keep it as a zombie until a call to `KeepServantAlive`
     // signaling that this task is not running on the corresponding servant.
@@ -212,94 +382,719 @@ class TaskDispatcher {
     // servant is notified, we risks overloading the corresponding servant by
     // assigning new tasks to it immediately.
     bool zombie = false;
+
+    // Linked into `belonging_servant->tasks`.
+    flare::internal::DoublyLinkedListEntry chain;
+  };
+
+  // How a servant is indexed in a given shard. This is maintained by
+  // `UnsafeIndexServant` / `UnsafeUnindexServant` (with the shard's lock held),
+  // and should not be touched elsewhere.
+  struct IndexedServant {
+    // Compiler digests (and their indices) this servant is indexed under.
+    // Empty if the servant is not indexed at all (e.g., not accepting tasks,
+    // or has gone.).
+    std::vector<std::pair<std::string, EnvironmentIndex*>> environments;
+
+    // Key of this servant in `EnvironmentIndex::free` (as well as
+    // `EnvironmentIndex::volunteers`) / `EnvironmentIndex::dedicated_idle`
+    // respectively, if it's there.
+    std::pair<double, std::uint64_t> key;
+    std::pair<double, std::uint64_t> dedicated_key;
+    bool free = false;
+    bool volunteer = false;
+    bool dedicated_idle = false;
+
+    // Copied from `personality` at the time this servant is indexed, so that
+    // servants can be picked without grabbing their lock.
+    int version;
+    std::string zone;
+    ServantPriority priority;
+
+    // `ServantDesc::generation` the placement above was determined from.
+    // Allocations made in other shards don't re-index the servant here, so the
+    // placement can be stale. Stale ones are re-indexed once they're visited.
+    std::uint64_t generation = 0;
+
+    // Set if the servant is in `Shard::dirty_servants`. Protected by
+    // `Shard::dirty_lock`.
+    bool dirty = false;
+  };
+
+  struct ServantDesc : public flare::RefCounted<ServantDesc> {
+    // Same as `personality.observed_location`, but never changes. This one can
+    // be read without grabbing `lock`.
+    std::string location;
+    std::chrono::steady_clock::time_point discovered_at;
+
+    // Protected by `servants_lock_`.
+    std::chrono::steady_clock::time_point expires_at;
+
+    // Allocated in order of discovery. Used for breaking ties between servants
+    // of the same utilization (so that the servant discovered earlier wins.).
+    std::uint64_t serial;
+
+    // Protects fields below, unless stated otherwise. This lock is held only
+    // briefly, and no other lock may be acquired with it held.
+    std::mutex lock;
+
+    ServantPersonality personality;
+
+    std::size_t running_tasks = 0;
+    std::size_t ever_assigned_tasks = 0;
+
+    // Tasks completed recently. Due to sampling lag, they can still be
+    // accounted in `personality.current_load`. @sa: `GetCapacityAvailable`.
+    struct {
+      // Each completed task contributes to this value at its completion
+      // (depending on how long it has been running), and decays exponentially
+      // afterwards, in the same way as loadavg does.
+      double decayed = 0;
+      std::chrono::steady_clock::time_point decayed_at;
+
+      // Value of `decayed` as of the time `personality` was reported.
+      double at_report = 0;
+
+      // Tasks completed after `personality` was reported. They were still
+      // running when the load was sampled.
+      std::size_t since_report = 0;
+    } completed_tasks;
+
+    // Memory expected to be used by tasks assigned to this servant. @sa:
+    // `HasMemoryFor`.
+    struct {
+      // All tasks (including zombies).
+      std::size_t total = 0;
+
+      // Subset of `total` above. Tasks whose peak memory was learned from
+      // earlier runs. For the rest it's merely a guess.
+      std::size_t learned = 0;
+
+      // Tasks assigned after `personality` was reported. They're not accounted
+      // in `personality.memory_available_in_bytes`.
+      std::size_t since_report = 0;
+    } task_memory;
+
+    // All tasks (including zombies) assigned to this servant, in all shards.
+    flare::internal::DoublyLinkedList<TaskDesc, &TaskDesc::chain> tasks;
+
+    // Incremented each time something affecting placement of this servant
+    // (`running_tasks`, `personality`, etc.) changes. Only written with `lock`
+    // held. @sa: `IndexedServant::generation`.
+    std::atomic<std::uint64_t> generation{};
+
+    // Serializes (re-)indexing this servant in shards, so that the servant's
+    // heartbeats can be handled without holding `servants_lock_`. It's acquired
+    // before shard locks.
+    flare::fiber::Mutex index_lock;
+
+    // Shards this servant is (or is being) indexed in. This is written with
+    // both `index_lock` and `lock` held, so either of them is enough for
+    // reading it.
+    std::vector<std::size_t> shards;
+
+    // Set once the servant is removed from `ServantRegistry` (presumably due to
+    // keep-alive miss). Tasks assigned to it may still be referencing it. Only
+    // written with `index_lock` held, so it's never indexed again afterwards.
+    std::atomic<bool> removed{false};
+
+    // How this servant is indexed in each shard. `indexed[i]` is protected by
+    // lock of the `i`-th shard.
+    std::unique_ptr<IndexedServant[]> indexed;
+
+    // Tasks restored from a snapshot (@sa: `RestoreSnapshot`) that had been
+    // reported running on this servant. They're checked against the first
+    // running tasks reported by the servant after restart: Those no longer
+    // running have completed while we were down (so their requestors failed
+    // to free them), and are freed then.
+    std::vector<std::uint64_t> running_at_snapshot;
+  };
+
+  // Servants ordered by (utilization, serial). The first one is the least
+  // utilized one.
+  using OrderedServants =
+      std::map<std::pair<double, std::uint64_t>, ServantDesc*>;
+
+  // Servants that can accept at least one more task, ordered for picking.
+  struct FreeServants {
+    // All of them.
+    OrderedServants free;
+
+    // Subset of `free` above. Dedicated servants that still have idle physical
+    // cores. Utilization here refers to utilization of physical cores. This
+    // way we fill physical cores of all dedicated servants before putting
+    // tasks on sibling hyperthreads of any of them.
+    OrderedServants dedicated_idle;
+
+    // Subset of `free` above. Non-dedicated servants, i.e., machines whose
+    // owners volunteered to share their spare resources. Tasks known to be
+    // short are preferably assigned to them, leaving dedicated servants for
+    // long ones.
+    OrderedServants volunteers;
+  };
+
+  // Servants recognizing a given compilation environment.
+  struct EnvironmentIndex : FreeServants {
+    // Same as above, but only those in a given zone. Keyed by zone. Servants
+    // not declaring their zone are not indexed here.
+    std::unordered_map<std::string, FreeServants> zones;
+
+    // Servants that have reached their capacity.
+    std::unordered_set<ServantDesc*> saturated;
+
+    // Daemon version of all servants (free or saturated) above. This allows us
+    // to tell if a request for `min_version` can ever be satisfied.
+    std::multiset<int> versions;
+  };
+
+  struct ServantRegistry {
+    std::uint64_t next_serial = 0;
+
+    // Keyed by `personality.observed_location`.
+    std::unordered_map<std::string, flare::RefPtr<ServantDesc>> servants;
+
+    // Servants ordered by (`expires_at`, serial), so that we only need to
+    // check the first few of them for expiration.
+    std::map<std::pair<std::chrono::steady_clock::time_point, std::uint64_t>,
+             ServantDesc*>
+        expirations;
   };
 
   struct TaskRegistry {
-    std::atomic<std::uint64_t> next_task_id{};
+    // Task IDs are allocated as `next_task_id * shards + shard index`, so
+    // that the shard of a task can be told from its ID.
+    std::uint64_t next_task_id = 0;
     std::unordered_map<std::uint64_t, TaskDesc> tasks;
+
+    // Non-zombie tasks ordered by (`expires_at`, task ID).
+    std::set<std::pair<std::chrono::steady_clock::time_point, std::uint64_t>>
+        expirations;
+
+    // Task requestors may join, keyed by task digest. Only the first task of
+    // each digest is recorded here.
+    std::unordered_map<std::string, std::uint64_t> by_digest;
+  };
+
+  // Servants recently used by a given requestor. Assigning tasks to them allows
+  // the requestor to reuse its TCP connections (and avoid slow-start after
+  // idle), batch RPCs, etc.
+  struct RequestorAffinity {
+    struct RecentServant {
+      flare::RefPtr<ServantDesc> servant;
+      std::chrono::steady_clock::time_point last_used;
+    };
+
+    // Most recently used servants. This is kept small so a linear scan is
+    // fine.
+    std::vector<RecentServant> recent_servants;
+  };
+
+  struct AffinityRegistry {
+    // Keyed by requestor IP.
+    std::unordered_map<std::string, RequestorAffinity> requestors;
+
+    // Number of allocations made, and how many of them were made to a servant
+    // recently used by the same requestor (i.e., connection to the servant is
+    // likely to be reused.).
+    std::uint64_t allocations = 0;
+    std::uint64_t reused = 0;
+  };
+
+  // Allocations made to requestors in a given zone.
+  struct ZoneCounters {
+    std::uint64_t allocations = 0;
+
+    // Allocations made to servants in other zones. Ideally they're made only
+    // if servants in the requestor's zone are all busy.
+    std::uint64_t cross_zone_allocations = 0;
+  };
+
+  // Describes a caller blocked in `WaitForStartingNewTasks`.
+  struct Waiter {
+    const TaskPersonality* personality;
+    std::chrono::nanoseconds expires_in;
+    bool prefetching;
+    std::chrono::steady_clock::time_point since;
+
+    // Filled by whoever freed a servant and handed it to us.
+    std::optional<TaskAllocation> allocation;
+    // Set if all servants recognizing the requested environment have gone.
+    bool environment_gone = false;
+
+    flare::fiber::ConditionVariable cv;
+
+    // Set if this waiter stands for a unit of demand of a subscription. Such
+    // waiters are owned by `demand`, and allocation made for them is delivered
+    // to the subscription instead.
+    SubscribedDemand* demand = nullptr;
+    // Position of this waiter in `demand->waiters`. Valid only if `demand` is
+    // set.
+    std::list<Waiter>::iterator demand_pos;
+
+    // Set if cost of the task this unit of demand is for is known.
+    // `personality` points here then.
+    std::optional<TaskPersonality> own_personality;
+
+    // Position of this waiter in `RequestorWaiters::waiters`.
+    std::list<Waiter*>::iterator pos;
+  };
+
+  // Waiters from a given requestor, in FIFO order.
+  struct RequestorWaiters {
+    std::list<Waiter*> waiters;
+
+    // Position of us in `ClassWaiters::round_robin`.
+    std::list<RequestorWaiters*>::iterator pos;
+  };
+
+  // Waiters of a given environment and priority class. Requestors are served
+  // in a round-robin fashion (i.e. deficit round robin with unit cost per
+  // grant), so that a requestor with many waiters (e.g. a large CI build)
+  // cannot starve those with few.
+  struct ClassWaiters {
+    // Keyed by requestor IP.
+    std::unordered_map<std::string, RequestorWaiters> requestors;
+
+    // Requestors with at least one waiter. The first one is served next.
+    std::list<RequestorWaiters*> round_robin;
+
+    // Advanced by reciprocal of weight of this class each time a waiter of
+    // this class is served. The class with the smallest `pass` is served next
+    // (i.e. stride scheduling), so classes are served in proportion to their
+    // weights.
+    double pass = 0;
   };
 
+  static constexpr std::size_t kPriorityClasses = 3;
+
+  // Number of recent allocation decisions kept by each shard.
+  static constexpr std::size_t kRecentDecisionsPerShard = 128;
+
+  // Waiters of a given environment.
+  struct WaiterQueue {
+    // Indexed by `GetClassIndex`.
+    std::array<ClassWaiters, kPriorityClasses> classes;
+
+    // `pass` of the class served most recently. A class starts waiting with
+    // at least this `pass`, so it can't claim credit for the time it was not
+    // waiting.
+    double virtual_time = 0;
+  };
+
+  // Dispatcher state is sharded by compiler digest. Allocations for different
+  // environments are made in parallel, so long as they're hashed to different
+  // shards.
+  //
+  // A servant recognizing several environments is indexed in several shards.
+  // Its capacity is shared between them via `ServantDesc::lock`.
+  struct Shard {
+    std::size_t index;
+
+    // Protects everything below, unless stated otherwise.
+    flare::fiber::Mutex lock;
+
+    // Keyed by compiler digest. Servants not accepting tasks at all (i.e.
+    // `max_tasks` is 0) are not indexed.
+    std::unordered_map<std::string, EnvironmentIndex> environments;
+
+    // Tasks of environments in this shard.
+    TaskRegistry tasks;
+
+    // Callers waiting for servants, keyed by compiler digest.
+    std::unordered_map<std::string, WaiterQueue> waiters;
+
+    // All waiters in `waiters`, ordered by when they started waiting.
+    std::set<std::pair<std::chrono::steady_clock::time_point, Waiter*>>
+        waiting_since;
+
+    // When the oldest waiter (of all environments in this shard) started
+    // waiting, in ticks of `std::chrono::steady_clock`, or max if there's no
+    // waiter at all. This may be read without grabbing `lock`, for deciding
+    // which shard gets capacity freed first.
+    std::atomic<std::int64_t> oldest_waiter_since;
+
+    AffinityRegistry affinities;
+
+    // Keyed by requestor's zone.
+    std::unordered_map<std::string, ZoneCounters> zone_counters;
+
+    // Outcome of requests for environments in this shard, keyed by compiler
+    // digest. Digests are supplied by requestors, so only those recognized by
+    // some servant when first seen are counted on their own. The rest are
+    // counted in `unknown_environment_counters`.
+    //
+    // @sa: `UnsafeGetEnvironmentCounters`.
+    std::unordered_map<std::string, AllocationCounters> environment_counters;
+    AllocationCounters unknown_environment_counters;
+
+    // Outcome of requests, indexed by `GetClassIndex`.
+    std::array<AllocationCounters, kPriorityClasses> class_counters;
+
+    AllocationDecisionLog recent_decisions{kRecentDecisionsPerShard};
+
+    // Signaled when a task in `tasks.by_digest` is reported running or has
+    // gone.
+    flare::fiber::ConditionVariable task_running_cv;
+    // Number of requests served with a running task.
+    std::uint64_t joined_tasks = 0;
+
+    // Servants whose capacity may have increased since they were indexed in
+    // this shard (e.g., a task of theirs in another shard has been freed).
+    // They're re-indexed (and handed to our waiters) before we pick servants
+    // next time.
+    std::mutex dirty_lock;
+    std::vector<flare::RefPtr<ServantDesc>> dirty_servants;
+  };
+
+  struct Subscription;
+
+  // Standing demand of a subscription for an environment.
+  struct SubscribedDemand {
+    Subscription* subscription;
+    TaskPersonality personality;
+
+    // Each of them is enqueued in the shard of the environment. Protected by
+    // lock of that shard.
+    std::list<Waiter> waiters;
+  };
+
+  struct Subscription {
+    // Protected by `subscriptions_lock_`.
+    std::uint64_t last_sequence = 0;
+    std::chrono::nanoseconds expires_in;
+    std::unordered_map<std::string, SubscribedDemand> demands;
+
+    flare::fiber::Mutex lock;
+    flare::fiber::ConditionVariable cv;
+    // Allocations not taken yet. Protected by `lock`.
+    std::vector<SubscribedTaskAllocation> allocations;
+    // Protected by `lock`.
+    std::size_t pollers = 0;
+    std::chrono::steady_clock::time_point last_polled_at;
+  };
+
+  Shard* GetShardOf(const std::string& compiler_digest) const noexcept;
+  Shard* GetShardOfTask(std::uint64_t task_id) const noexcept;
+
   // Get capacity available to us (not used by other jobs on the node.).
+  //
+  // `servant_desc.lock` must be held by the caller.
   std::size_t GetCapacityAvailable(
       const ServantDesc& servant_desc) const noexcept;
 
-  void UnsafeFreeTasks(const std::vector<std::uint64_t>& task_ids);
+  // Tests if `servant_desc` has enough memory for a new task expected to use
+  // `memory` bytes at its peak. `learned` tells if `memory` was learned from
+  // earlier runs of similar tasks (rather than a default guess).
+  //
+  // `servant_desc.lock` must be held by the caller.
+  bool HasMemoryFor(const ServantDesc& servant_desc, std::size_t memory,
+                    bool learned) const noexcept;
+
+  // Get memory the task is expected to use at its peak.
+  std::size_t GetExpectedMemory(const TaskPersonality& task) const noexcept;
+
+  // Account a task that has just completed on `servant` / a new load sample
+  // reported by `servant`.
+  //
+  // `servant->lock` must be held by the caller.
+  void UnsafeRecordTaskCompletion(ServantDesc* servant,
+                                  std::chrono::nanoseconds ran_for);
+  void UnsafeRecordLoadReport(ServantDesc* servant);
+
+  // Pick a servant in `servants` and assign a new task to it. `std::nullopt`
+  // is returned if no servant is free for the moment.
+  std::optional<TaskAllocation> UnsafeTryAllocateTask(
+      Shard* shard, const EnvironmentIndex& servants,
+      const TaskPersonality& personality, std::chrono::nanoseconds expires_in,
+      bool prefetching);
+
+  // Assign a new task to `servant`. This fails if the servant has been fully
+  // used in the meantime (by allocations made in other shards).
+  std::optional<TaskAllocation> UnsafeTryAllocateTaskOn(
+      Shard* shard, ServantDesc* servant, const TaskPersonality& personality,
+      std::chrono::nanoseconds expires_in, bool prefetching);
+
+  // Free tasks, and hand capacity freed to waiters. No shard lock may be held
+  // by the caller.
+  void FreeTasks(const std::vector<std::uint64_t>& task_ids);
+
+  // Free a task in `shard`. Returns the servant it was assigned to, if it's
+  // found. The servant is only re-indexed in `shard`, it's up to the caller to
+  // call `MarkServantDirty` and `ServeWaitersOf` after releasing the lock.
+  flare::RefPtr<ServantDesc> UnsafeFreeTask(Shard* shard,
+                                            std::uint64_t task_id);
+
+  // Wait until task of the given digest is reported running by its servant, or
+  // `timeout` is reached. `std::nullopt` is returned if there's no such task,
+  // or it has gone or has not been reported in time.
+  std::optional<RunningTask> UnsafeWaitForRunningTaskOf(
+      Shard* shard, const std::string& task_digest,
+      std::chrono::steady_clock::time_point timeout,
+      std::unique_lock<flare::fiber::Mutex>* lock);
+
+  // Add waiter to / remove waiter from `shard->waiters`.
+  //
+  // Waiters are served by priority class first (in proportion to class
+  // weights), then by requestor, and in FIFO order at last.
+  void UnsafeEnqueueWaiter(Shard* shard, Waiter* waiter);
+  void UnsafeDequeueWaiter(Shard* shard, Waiter* waiter);
+
+  // Get the waiter in `queue` to serve next. Classes in `excluded` are not
+  // considered. `nullptr` is returned if there's none.
+  static Waiter* GetNextWaiter(
+      const WaiterQueue& queue,
+      const std::vector<const ClassWaiters*>& excluded = {});
+
+  // Hand capacity of `servant` (if there is any) to waiters of environments it
+  // recognizes. The waiter that has been waiting for the longest time is
+  // served first, subject to per-requestor fairness.
+  //
+  // This should be called each time capacity of a servant may have increased.
+  // No shard lock may be held by the caller. Shards are visited in order of
+  // their next waiter, so fairness between shards is only approximate.
+  void ServeWaitersOf(ServantDesc* servant);
+
+  // Same as `ServeWaitersOf`, but only waiters in `shard` are served.
+  void UnsafeServeWaitersOf(Shard* shard, ServantDesc* servant);
 
-  // Enumerates all servants eligible of handling the requesting task.
+  // Hand `allocation` made for `waiter` to it. `waiter` must have been
+  // dequeued, and may be destroyed by this method.
+  void UnsafeHandOver(Waiter* waiter, TaskAllocation allocation);
+
+  // Add `allocation` to those not taken yet by `subscription`.
+  void DeliverToSubscription(Subscription* subscription,
+                             const std::string& compiler_digest,
+                             TaskAllocation allocation,
+                             std::chrono::nanoseconds expires_in);
+
+  // Increase or decrease number of waiters of `demand` by `delta`. Demand
+  // increased is satisfied immediately if possible. @sa:
+  // `DemandDelta::expected_costs`.
   //
-  // Allocation lock must be held by the caller.
-  std::vector<ServantDesc*> UnsafeEnumerateEligibleServants(
-      const TaskPersonality& requesting_task);
+  // Lock of the shard of the environment must be held by the caller.
+  void UnsafeAdjustDemand(
+      Shard* shard, SubscribedDemand* demand, std::int64_t delta,
+      const std::vector<std::optional<TaskCost>>& expected_costs = {});
+
+  // Drop subscriptions that have not been polled for a while.
+  void SweepSubscriptions();
+
+  // Fail waiters waiting on environments no longer recognized by any servant.
+  // Standing demand of subscriptions is kept, in case such servants come back.
+  void UnsafeAbortOrphanWaiters(Shard* shard);
 
-  std::vector<ServantDesc*> UnsafeEnumerateFreeServants(
-      const std::vector<ServantDesc*>& eligible_servants);
+  // Ask shards `servant` is indexed in (other than `except`) to re-index it
+  // before picking servants next time.
+  void MarkServantDirty(ServantDesc* servant, const Shard* except);
+
+  // Re-index servants marked dirty. Waiters are served if their capacity
+  // increased.
+  void UnsafeDrainDirtyServants(Shard* shard);
+
+  // Index `servant` in all shards of environments it recognizes. This should
+  // be called each time servant's personality changes. Shards it was indexed
+  // in are updated as well.
+  //
+  // `servant->index_lock` must be held by the caller.
+  void UnsafeUpdateServantShards(ServantDesc* servant);
+
+  // Add servant to / remove servant from `shard->environments`. Each time
+  // servant's personality changes, the servant must be unindexed before the
+  // change and indexed again afterwards. For changes affecting only servant's
+  // utilization (e.g. running tasks), re-indexing it is sufficient.
+  //
+  // Lock of `shard` must be held by the caller.
+  void UnsafeIndexServant(Shard* shard, ServantDesc* servant);
+  void UnsafeUnindexServant(Shard* shard, ServantDesc* servant);
+  void UnsafeReindexServant(Shard* shard, ServantDesc* servant);
+
+  // Tests if `servant` has changed since it was indexed in `shard`.
+  static bool UnsafeIsStale(const Shard& shard, const ServantDesc& servant);
+
+  // Determine where should `servant` be placed in environment indices.
+  void UnsafeUpdateIndexPlacement(Shard* shard, ServantDesc* servant);
+
+  // Add free servant to / remove free servant from `servants`, as specified by
+  // `indexed`.
+  static void AddFreeServant(ServantDesc* servant,
+                             const IndexedServant& indexed,
+                             FreeServants* servants);
+  static void RemoveFreeServant(const IndexedServant& indexed,
+                                FreeServants* servants);
+
+  // Find index of servants eligible of handling the requesting task. `nullptr`
+  // is returned if no servant would ever be able to serve this request.
+  //
+  // Lock of `shard` must be held by the caller.
+  const EnvironmentIndex* UnsafeFindEligibleServants(
+      Shard* shard, const TaskPersonality& requesting_task);
 
   // Pick a servant for handling this request. The implementation may do some
-  // heuristics for optimizing workload distribution.
+  // heuristics for optimizing workload distribution. `nullptr` is returned if
+  // no servant is free for the moment.
   //
-  // Allocation lock must be held by the caller. This guarantees validity of
+  // Lock of `shard` must be held by the caller. This guarantees validity of
   // pointers in `servants`.
-  ServantDesc* UnsafePickServantFor(std::vector<ServantDesc*> servants,
-                                    const std::string& requestor);
+  ServantDesc* UnsafePickServantFor(Shard* shard,
+                                    const EnvironmentIndex& servants,
+                                    const TaskPersonality& requesting_task);
 
-  // Pick a dedicated (if available) servant for the given request. If no
-  // dedicated servant is idle enough for new request, this method may return
-  // null.
-  ServantDesc* UnsafeTryPickDedicatedServantFor(
-      const std::vector<ServantDesc*>& servants);
+  // Same as `UnsafePickServantFor`, but only servants in `candidates` (either
+  // `servants` itself or one of its zones) are considered.
+  ServantDesc* UnsafePickServantFrom(Shard* shard,
+                                     const EnvironmentIndex& servants,
+                                     const FreeServants& candidates,
+                                     const TaskPersonality& requesting_task);
 
-  // Pick a servant for the given request.
-  ServantDesc* UnsafeTryPickAvailableServantFor(
-      const std::vector<ServantDesc*>& servants);
+  // Pick the least utilized servant in `servants` that satisfies `pred`.
+  template <class F>
+  ServantDesc* UnsafeTryPickServantFor(Shard* shard,
+                                       const OrderedServants& servants,
+                                       F&& pred);
 
-  // Pick a servant that satisfies the given predicate.
+  // Pick the least utilized servant in `servants` that has recently been used
+  // by the requestor, and is still not too busy. `pred` is respected as well.
   template <class F>
-  ServantDesc* UnsafeTryPickServantFor(
-      const std::vector<ServantDesc*>& servants, F&& pred);
+  ServantDesc* UnsafeTryPickRecentServantFor(
+      Shard* shard, const EnvironmentIndex& servants,
+      const TaskPersonality& requesting_task, F&& pred);
+
+  // Get counters of environment `digest` in `shard`.
+  //
+  // Lock of `shard` must be held by the caller.
+  AllocationCounters* UnsafeGetEnvironmentCounters(Shard* shard,
+                                                   const std::string& digest);
+
+  // Account a request of `personality` made at `since`. `allocation` is the
+  // (first) task allocated for it, if there is one.
+  void UnsafeRecordDecision(Shard* shard, AllocationOutcome outcome,
+                            const TaskPersonality& personality,
+                            std::chrono::steady_clock::time_point since,
+                            const TaskAllocation* allocation);
+
+  // Remember that `servant` has been used by the requestor of `task`.
+  void UnsafeRecordAffinity(Shard* shard, ServantDesc* servant,
+                            const TaskPersonality& task);
+
+  // Forget about servants not used recently, or have gone.
+  void UnsafeSweepAffinities(Shard* shard);
 
   // Forget about tasks that are marked as "zombie" and no longer recognized by
   // the corresponding servant.
-  void UnsafeSweepZombiesOf(
-      const ServantDesc* servant,
-      const std::unordered_set<std::uint64_t>& running_tasks);
+  void SweepZombiesOf(ServantDesc* servant,
+                      const std::unordered_set<std::uint64_t>& running_tasks);
 
-  // Forget about tasks whose servant has gone (presumably due to keep-alive
+  // Forget about tasks of a servant that has gone (presumably due to keep-alive
   // miss).
-  void UnsafeSweepOrphans();
+  void SweepOrphansOf(ServantDesc* servant);
+
+  // Register a servant we've never seen.
+  //
+  // `servants_lock_` must be held by the caller.
+  flare::RefPtr<ServantDesc> UnsafeAddServant(
+      const ServantPersonality& personality,
+      std::chrono::nanoseconds expires_in);
+
+  // Remove `servant` from `servants_` and unindex it everywhere. Its tasks
+  // should be swept by the caller (@sa: `SweepOrphansOf`) afterwards.
+  //
+  // `servants_lock_` must be held by the caller.
+  void UnsafeRemoveServant(ServantDesc* servant);
 
   // Check for task / servant expiration.
   void OnExpirationTimer();
 
+  // Load snapshot written by our previous incarnation, if there is one.
+  void LoadSnapshot();
+
+  // Capture a snapshot and hand it to `SnapshotWriterProc`.
+  void OnSnapshotTimer();
+
+  // Write snapshots captured by `OnSnapshotTimer` to disk. It runs in a
+  // dedicated thread, so that blocking I/O won't stall fiber workers.
+  void SnapshotWriterProc();
+
+  // Write serialized snapshot to `FLAGS_dispatcher_snapshot_path`, unless a
+  // more recent one (of a greater `sequence`) has been written.
+  void WriteSnapshot(std::uint64_t sequence, const std::string& bytes);
+
+  // Capture servants and (non-zombie) tasks.
+  DispatcherSnapshot CaptureSnapshot();
+
+  // Restore servants and tasks captured in `snapshot`, except for those that
+  // have expired since it was taken. Restored servants are allocated to
+  // immediately, without waiting for their heartbeats.
+  void RestoreSnapshot(const DispatcherSnapshot& snapshot);
+
   // Dump internal state for debugging.
   Json::Value DumpInternals();
 
+  // Dump latency histograms, counters of allocation outcomes, assignment rates
+  // of servants, and recent allocation decisions.
+  Json::Value DumpMetrics();
+
  private:
+  FRIEND_TEST(TaskDispatcher, Affinity);
+  FRIEND_TEST(TaskDispatcher, LoadDecay);
+  FRIEND_TEST(TaskDispatcher, Zone);
+  FRIEND_TEST(TaskDispatcher, JoinRunningTask);
+  FRIEND_TEST(TaskDispatcher, Metrics);
+  FRIEND_TEST(TaskDispatcher, Snapshot);
   FRIEND_TEST(SchedulerServiceImpl, TokenWithIntersection);
   FRIEND_TEST(SchedulerServiceImpl, TokenWithoutIntersection);
   std::uint64_t expiration_timer_;
+  std::optional<std::uint64_t> snapshot_timer_;
 
-  // Note that the current implementation doesn't scale well. Each time a
-  // servant is released, all pending allocations are waken up and check all
-  // servant for eligibility, **with lock held**. This effectively serializes a
-  // large amount of CPU computation, without a successful allocation guarantee.
-  //
-  // For the moment this doesn't matter much as we don't expect there to be too
-  // many servants. If this turns out to be a bottleneck in the future, we can
-  // shard internal state by, e.g., environment available of each servant.
-  flare::fiber::Mutex allocation_lock_;
-  flare::fiber::ConditionVariable allocation_cv_;
+  // Snapshot captured but not written yet. Older ones not written in time are
+  // dropped. Protected by `snapshot_lock_`.
+  std::mutex snapshot_lock_;
+  std::condition_variable snapshot_cv_;
+  std::uint64_t next_snapshot_sequence_ = 1;
+  std::optional<std::pair<std::uint64_t, std::string>> pending_snapshot_;
+  bool snapshot_writer_leaving_ = false;
+  std::thread snapshot_writer_;
 
-  // Protected by `allocation_lock_`.
+  // Serializes writers of the snapshot file.
+  std::mutex snapshot_file_lock_;
+  std::uint64_t last_written_snapshot_ = 0;
+
+  // Each time a servant is released, it's handed directly to the next eligible
+  // waiter (if any), so only that waiter is woken up.
+  //
+  // Locks are always acquired in this order: `servants_lock_`,
+  // `ServantDesc::index_lock`, lock of a shard (at most one at a time),
+  // `ServantDesc::lock`, `Shard::dirty_lock`. Allocating, renewing and freeing
+  // tasks don't touch `servants_lock_`.
+  flare::fiber::Mutex servants_lock_;
   ServantRegistry servants_;
-  TaskRegistry tasks_;
+
+  // Sized by `FLAGS_allocation_shards`.
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  // Never held together with `servants_lock_`. If a shard lock is needed, it's
+  // acquired after this one. `Subscription::lock` is acquired after all other
+  // locks.
+  flare::fiber::Mutex subscriptions_lock_;
+  std::unordered_map<std::uint64_t, std::unique_ptr<Subscription>>
+      subscriptions_;
 
   RunningTaskBookkeeper running_task_bookkeeper_;
+  TaskCostStore task_costs_;
+
+  // Reported to without grabbing any lock.
+  LatencyHistogram grant_wait_latency_;
+  LatencyHistogram keep_alive_lag_;  // Time since the previous renewal.
+  LatencyHistogram grant_lifetime_;  // Of tasks freed (i.e., not expired).
 
   // Exposes some internals for debugging.
   flare::ExposedVarDynamic<Json::Value> internal_exposer_;
+  flare::ExposedVarDynamic<Json::Value> metrics_exposer_;
 
   // Parsed from `FLAGS_min_memory_for_dispatching_servant` when initializing.
   std::size_t min_memory_for_new_task_;
+
+  // Parsed from `FLAGS_servant_default_task_memory` when initializing.
+  std::size_t default_task_memory_;
 };
 
 }  // namespace yadcc::scheduler
@@ -0,0 +1,272 @@
+// Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+//
+// Licensed under the BSD 3-Clause License (the "License"); you may not use this
+// file except in compliance with the License. You may obtain a copy of the
+// License at
+//
+// https://opensource.org/licenses/BSD-3-Clause
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+#include "flare/base/logging.h"
+#include "flare/base/string.h"
+
+#include "yadcc/scheduler/task_dispatcher.h"
+
+using namespace std::literals;
+
+// Allocation latency against cluster size.
+//
+// Each servant recognizes a third of all environments, with about half of
+// their capacity in use by other tasks.
+
+namespace yadcc::scheduler {
+
+constexpr auto kEnvironments = 30;
+
+void RegisterServants(int servants, std::size_t running_tasks_each,
+                      std::vector<std::uint64_t>* tasks) {
+  for (int i = 0; i != servants; ++i) {
+    ServantPersonality servant;
+    // Servants registered for different cluster sizes must not collide.
+    servant.observed_location = servant.reported_location =
+        flare::Format("10.{}.{}.{}:8335", servants / 256, i / 256, i % 256);
+    for (int j = 0; j != kEnvironments / 3; ++j) {
+      servant.environments.emplace_back().set_compiler_digest(flare::Format(
+          "digest-{}-{}", servants, (i + j * 3) % kEnvironments));
+    }
+    servant.max_tasks = 16;
+    servant.current_load = 0;
+    servant.num_processors = 16;
+    servant.priority =
+        i % 2 ? SERVANT_PRIORITY_DEDICATED : SERVANT_PRIORITY_USER;
+    servant.version = 8;
+    servant.memory_available_in_bytes = 50ULL * 1024 * 1024 * 1024;
+    TaskDispatcher::Instance()->KeepServantAlive(servant, 30s);
+  }
+
+  // Keep the cluster partially loaded.
+  TaskPersonality task;
+  task.requestor_ip = "127.0.0.1";
+  task.min_version = 8;
+  for (int i = 0; i != servants * running_tasks_each; ++i) {
+    task.env_desc.set_compiler_digest(
+        flare::Format("digest-{}-{}", servants, i % kEnvironments));
+    auto allocation = TaskDispatcher::Instance()->WaitForStartingNewTask(
+        task, 30s, flare::ReadCoarseSteadyClock() + 1s, false);
+    FLARE_CHECK(allocation);
+    tasks->push_back(allocation->task_id);
+  }
+}
+
+void Benchmark_WaitForStartingNewTask(benchmark::State& state) {
+  auto servants = state.range(0);
+  std::vector<std::uint64_t> background_tasks;
+  RegisterServants(servants, 8, &background_tasks);
+
+  std::vector<TaskPersonality> tasks(kEnvironments);
+  for (int i = 0; i != kEnvironments; ++i) {
+    tasks[i].requestor_ip = "127.0.0.1";
+    tasks[i].min_version = 8;
+    tasks[i].env_desc.set_compiler_digest(
+        flare::Format("digest-{}-{}", servants, i));
+  }
+
+  int index = 0;
+  while (state.KeepRunning()) {
+    auto allocation = TaskDispatcher::Instance()->WaitForStartingNewTask(
+        tasks[index++ % kEnvironments], 30s,
+        flare::ReadCoarseSteadyClock() + 1s, false);
+    FLARE_CHECK(allocation);
+    TaskDispatcher::Instance()->FreeTask(allocation->task_id);
+  }
+
+  for (auto&& e : background_tasks) {
+    TaskDispatcher::Instance()->FreeTask(e);
+  }
+}
+
+BENCHMARK(Benchmark_WaitForStartingNewTask)
+    ->RangeMultiplier(4)
+    ->Range(16, 4096);
+
+// Allocation throughput against number of concurrent requestors, each
+// allocating (and freeing) tasks of all environments in turn, on a cluster of
+// 1000 servants.
+void Benchmark_WaitForStartingNewTaskConcurrently(benchmark::State& state) {
+  constexpr auto kServants = 1000;
+  // Registered once for all thread counts. Background tasks are never freed.
+  [[maybe_unused]] static const bool kRegistered = [] {
+    std::vector<std::uint64_t> background_tasks;
+    RegisterServants(kServants, 8, &background_tasks);
+    return true;
+  }();
+  static std::atomic<int> next_requestor{};
+  auto requestor = next_requestor.fetch_add(1, std::memory_order_relaxed);
+
+  std::vector<TaskPersonality> tasks(kEnvironments);
+  for (int i = 0; i != kEnvironments; ++i) {
+    tasks[i].requestor_ip =
+        flare::Format("127.{}.{}.1", requestor / 256, requestor % 256);
+    tasks[i].min_version = 8;
+    tasks[i].env_desc.set_compiler_digest(
+        flare::Format("digest-{}-{}", kServants, i));
+  }
+
+  int index = requestor;
+  while (state.KeepRunning()) {
+    auto allocation = TaskDispatcher::Instance()->WaitForStartingNewTask(
+        tasks[index++ % kEnvironments], 30s,
+        flare::ReadCoarseSteadyClock() + 1s, false);
+    FLARE_CHECK(allocation);
+    TaskDispatcher::Instance()->FreeTask(allocation->task_id);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(Benchmark_WaitForStartingNewTaskConcurrently)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
+
+// CI fan-out: Several CI jobs building the same commit start at about the same
+// time, each compiling the same translation units in the same order.
+//
+// Time is simulated in ticks, a tick being a heartbeat interval. Reported are
+// ratio of compilations joining one already running (as done by the
+// scheduler), and ratio of those that could have been found in a snapshot of
+// running tasks taken at the beginning of the tick (as previously done by the
+// delegates).
+void Benchmark_CiFanout(benchmark::State& state) {
+  constexpr auto kServants = 64;
+  constexpr auto kTranslationUnits = 200;
+  constexpr auto kCompileTicks = 5;
+  constexpr auto kStartupJitterTicks = 3;
+
+  auto shards = state.range(0);
+  auto env_digest = flare::Format("fanout-digest-{}", shards);
+  for (int i = 0; i != kServants; ++i) {
+    ServantPersonality servant;
+    servant.observed_location = servant.reported_location =
+        flare::Format("172.16.{}.{}:8335", shards, i);
+    servant.environments.emplace_back().set_compiler_digest(env_digest);
+    servant.max_tasks = 16;
+    servant.current_load = 0;
+    servant.num_processors = 16;
+    servant.priority = SERVANT_PRIORITY_DEDICATED;
+    servant.version = 8;
+    TaskDispatcher::Instance()->KeepServantAlive(servant, 30s);
+  }
+
+  struct Compilation {
+    std::uint64_t task_id;
+    std::string servant_location;
+    std::string task_digest;
+    int done_at;
+  };
+  struct Shard {
+    int start_at;
+    int busy_until = 0;
+    int next_tu = 0;
+  };
+
+  std::size_t requests = 0, joined = 0, snapshot_hits = 0;
+  std::uint64_t next_servant_task_id = 1;
+  int run = 0;
+  while (state.KeepRunning()) {
+    ++run;
+    std::vector<Shard> ci_jobs;
+    for (int i = 0; i != shards; ++i) {
+      ci_jobs.push_back(Shard{.start_at = i % kStartupJitterTicks});
+    }
+    std::unordered_map<std::uint64_t, Compilation> compilations;
+    std::unordered_map<std::string, std::vector<RunningTask>> reported;
+
+    for (int tick = 0, finished = 0; finished != shards; ++tick) {
+      std::unordered_set<std::string> snapshot;
+      for (auto iter = compilations.begin(); iter != compilations.end();) {
+        if (iter->second.done_at <= tick) {
+          TaskDispatcher::Instance()->FreeTask(iter->first);
+          auto&& running = reported[iter->second.servant_location];
+          running.erase(std::find_if(
+              running.begin(), running.end(), [&](const RunningTask& t) {
+                return t.task_grant_id() == iter->first;
+              }));
+          iter = compilations.erase(iter);
+        } else {
+          snapshot.insert(iter->second.task_digest);
+          ++iter;
+        }
+      }
+
+      // Jobs arrive in different order in each tick.
+      for (int i = 0; i != shards; ++i) {
+        auto&& job = ci_jobs[(i + tick) % shards];
+        if (tick < job.start_at || tick < job.busy_until ||
+            job.next_tu == kTranslationUnits) {
+          continue;
+        }
+        TaskPersonality task;
+        task.requestor_ip = flare::Format("10.1.0.{}", i);
+        task.min_version = 8;
+        task.env_desc.set_compiler_digest(env_digest);
+        task.task_digest = flare::Format("tu-{}-{}", run, job.next_tu);
+        ++requests;
+        snapshot_hits += snapshot.count(task.task_digest);
+
+        std::optional<RunningTask> existing;
+        auto allocations = TaskDispatcher::Instance()->WaitForStartingNewTasks(
+            task, 30s, flare::ReadCoarseSteadyClock() + 1s, 1, 0, &existing);
+        FLARE_CHECK(allocations);
+        if (existing) {
+          ++joined;
+          job.busy_until = compilations.at(existing->task_grant_id()).done_at;
+        } else {
+          FLARE_CHECK_EQ(allocations->size(), 1);
+          auto&& allocation = allocations->front();
+          job.busy_until = tick + kCompileTicks;
+          compilations[allocation.task_id] = {
+              .task_id = allocation.task_id,
+              .servant_location = allocation.servant_location,
+              .task_digest = task.task_digest,
+              .done_at = job.busy_until};
+
+          // Report it as running (this is what joiners would wait for).
+          auto&& running = reported[allocation.servant_location];
+          auto&& added = running.emplace_back();
+          added.set_servant_location(allocation.servant_location);
+          added.set_task_grant_id(allocation.task_id);
+          added.set_servant_task_id(next_servant_task_id++);
+          added.set_task_digest(task.task_digest);
+          TaskDispatcher::Instance()->NotifyServantRunningTasks(
+              allocation.servant_location, running);
+        }
+        finished += ++job.next_tu == kTranslationUnits;
+      }
+    }
+    for (auto&& [k, v] : compilations) {
+      TaskDispatcher::Instance()->FreeTask(k);
+    }
+  }
+  state.counters["join_ratio"] = static_cast<double>(joined) / requests;
+  state.counters["snapshot_hit_ratio"] =
+      static_cast<double>(snapshot_hits) / requests;
+}
+
+BENCHMARK(Benchmark_CiFanout)->RangeMultiplier(4)->Range(4, 64);
+
+}  // namespace yadcc::scheduler
@@ -0,0 +1,478 @@
+// Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+//
+// Licensed under the BSD 3-Clause License (the "License"); you may not use this
+// file except in compliance with the License. You may obtain a copy of the
+// License at
+//
+// https://opensource.org/licenses/BSD-3-Clause
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+// WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+// License for the specific language governing permissions and limitations under
+// the License.
+
+// Replays a task trace against `TaskDispatcher` on a simulated cluster, and
+// reports how well the tasks were scheduled. This allows changes to picking
+// policy or capacity formulas (as well as flags controlling them) to be
+// evaluated without deploying them.
+//
+// Time is simulated. Tasks run on simulated servants for their duration as
+// recorded in the trace, and servants heartbeat periodically with load and
+// memory usage derived from tasks running on them. Note that time-based
+// parameters of the dispatcher itself (e.g. `requestor_affinity_window`) still
+// follow wall clock.
+//
+// Tasks waiting for a servant are retried in order of their arrival each time
+// the cluster changes (instead of blocking in the dispatcher), so that the
+// simulation is deterministic.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "gflags/gflags.h"
+
+#include "flare/base/logging.h"
+#include "flare/base/string.h"
+#include "flare/init.h"
+
+#include "yadcc/scheduler/task_dispatcher.h"
+
+using namespace std::literals;
+
+DEFINE_string(trace, "",
+              "Task trace to replay. Each line describes a task: `<arrival "
+              "ms> <requestor> <environment> <duration ms> <peak memory in "
+              "bytes> [cost key]`. Lines starting with `#` are ignored. If not "
+              "specified, a synthetic one (a large CI build competing with "
+              "several developers) is used.");
+DEFINE_string(servants, "",
+              "Servants to simulate. Each line describes a group of identical "
+              "servants: `<count> <dedicated|user> <physical cores> <SMT ways> "
+              "<memory in GB> [max tasks]`. `max tasks` defaults to number of "
+              "processors. Lines starting with `#` are ignored. If not "
+              "specified, 16 dedicated servants with 16 cores (2-way SMT) and "
+              "64G memory each are simulated.");
+DEFINE_string(convert_log, "",
+              "If set, task traces logged by the scheduler (with `--v=1`) are "
+              "read from this file and printed in trace format, instead of "
+              "running the simulation.");
+DEFINE_double(smt_slowdown, 1.3,
+              "Tasks started on a servant whose physical cores are all busy "
+              "are assumed to run this many times longer.");
+DEFINE_int32(simulated_heartbeat_interval_ms, 1000,
+             "Interval between heartbeats of simulated servants.");
+
+namespace yadcc::scheduler {
+
+namespace {
+
+// Version of simulated servants and tasks.
+constexpr auto kVersion = 8;
+
+// Leases are never renewed in simulation, as they're counted in wall clock.
+constexpr auto kLease = 24h;
+
+struct TraceEntry {
+  std::chrono::milliseconds arrival;
+  std::string requestor;
+  std::string environment;
+  std::chrono::milliseconds duration;
+  std::size_t peak_memory;
+  std::string cost_key;
+};
+
+struct ServantSpec {
+  std::size_t count;
+  ServantPriority priority;
+  std::size_t physical_cores;
+  std::size_t smt_ways;
+  std::size_t memory;
+  std::size_t max_tasks;  // 0 if not specified.
+};
+
+struct SimulatedServant {
+  ServantPersonality personality;
+  std::size_t running_tasks = 0;
+  std::size_t memory_used = 0;
+};
+
+struct SimulatedTask {
+  std::uint64_t task_id;
+  std::size_t trace_index;
+  SimulatedServant* servant;
+  std::chrono::milliseconds started_at;
+};
+
+// Skips empty lines and comments.
+template <class F>
+void ForEachLineIn(const std::string& path, F&& f) {
+  std::ifstream input(path);
+  FLARE_CHECK(input, "Failed to open [{}].", path);
+  std::string line;
+  while (std::getline(input, line)) {
+    auto trimmed = flare::Trim(line);
+    if (trimmed.empty() || trimmed[0] == '#') {
+      continue;
+    }
+    f(std::string(trimmed));
+  }
+}
+
+std::vector<TraceEntry> ReadTrace(const std::string& path) {
+  std::vector<TraceEntry> trace;
+  ForEachLineIn(path, [&](const std::string& line) {
+    std::istringstream is(line);
+    std::int64_t arrival, duration;
+    auto&& entry = trace.emplace_back();
+    FLARE_CHECK(is >> arrival >> entry.requestor >> entry.environment >>
+                    duration >> entry.peak_memory,
+                "Malformed trace: {}", line);
+    is >> entry.cost_key;  // Optional.
+    entry.arrival = arrival * 1ms;
+    entry.duration = duration * 1ms;
+  });
+  std::stable_sort(trace.begin(), trace.end(), [](auto&& x, auto&& y) {
+    return x.arrival < y.arrival;
+  });
+  return trace;
+}
+
+// A CI job submitting a large build at once, and a few developers each
+// building a small change every now and then.
+std::vector<TraceEntry> SynthesizeTrace() {
+  constexpr auto kCiTasks = 4000;
+  constexpr auto kDevelopers = 8;
+  constexpr auto kBuildsPerDeveloper = 10;
+  constexpr auto kTasksPerBuild = 40;
+  std::mt19937 engine(0);
+  std::lognormal_distribution<> duration(std::log(3000), 0.8);
+  std::uniform_int_distribution<std::size_t> memory(200 << 20, 2000 << 20);
+  std::uniform_int_distribution<> think_time(10000, 60000);
+
+  std::vector<TraceEntry> trace;
+  auto add = [&](std::chrono::milliseconds arrival, const std::string& who) {
+    auto&& entry = trace.emplace_back();
+    entry.arrival = arrival;
+    entry.requestor = who;
+    entry.environment = "synthetic-env";
+    entry.duration = std::chrono::milliseconds(std::lround(duration(engine)));
+    entry.peak_memory = memory(engine);
+  };
+  for (int i = 0; i != kCiTasks; ++i) {
+    add(i * 5ms, "10.0.0.1");
+  }
+  for (int i = 0; i != kDevelopers; ++i) {
+    auto arrival = std::chrono::milliseconds(think_time(engine));
+    for (int j = 0; j != kBuildsPerDeveloper; ++j) {
+      for (int k = 0; k != kTasksPerBuild; ++k) {
+        add(arrival + k * 10ms, flare::Format("10.0.1.{}", i));
+      }
+      arrival += std::chrono::milliseconds(think_time(engine));
+    }
+  }
+  std::stable_sort(trace.begin(), trace.end(), [](auto&& x, auto&& y) {
+    return x.arrival < y.arrival;
+  });
+  return trace;
+}
+
+std::vector<ServantSpec> ReadServants(const std::string& path) {
+  std::vector<ServantSpec> specs;
+  ForEachLineIn(path, [&](const std::string& line) {
+    std::istringstream is(line);
+    std::string priority;
+    auto&& spec = specs.emplace_back();
+    FLARE_CHECK(is >> spec.count >> priority >> spec.physical_cores >>
+                    spec.smt_ways >> spec.memory,
+                "Malformed servant spec: {}", line);
+    FLARE_CHECK(priority == "dedicated" || priority == "user",
+                "Unknown servant priority [{}].", priority);
+    spec.priority = priority == "dedicated" ? SERVANT_PRIORITY_DEDICATED
+                                            : SERVANT_PRIORITY_USER;
+    spec.memory <<= 30;
+    spec.max_tasks = 0;
+    is >> spec.max_tasks;  // Optional.
+  });
+  return specs;
+}
+
+// Converts task traces logged by `TaskDispatcher` (@sa:
+// `NotifyServantCompletedTasks`).
+void ConvertLog(const std::string& path) {
+  constexpr auto kMarker = "Task trace: "sv;
+  std::vector<std::pair<std::int64_t, std::string>> tasks;  // (Start, rest).
+  ForEachLineIn(path, [&](const std::string& line) {
+    auto pos = line.find(kMarker);
+    if (pos == std::string::npos) {
+      return;
+    }
+    auto trace = std::string_view(line).substr(pos + kMarker.size());
+    std::unordered_map<std::string, std::string> fields;
+    for (auto&& e : flare::Split(trace, " ")) {
+      auto kv = flare::Split(e, "=");
+      if (kv.size() == 2) {
+        fields[std::string(kv[0])] = std::string(kv[1]);
+      }
+    }
+    auto started_at = flare::TryParse<std::int64_t>(fields["started_at_ms"]);
+    if (!started_at) {
+      FLARE_LOG_WARNING("Ignoring malformed task trace: {}", line);
+      return;
+    }
+    tasks.emplace_back(
+        *started_at, flare::Format("{} {} {} {} {}", fields["requestor"],
+                                   fields["env"], fields["ran_for_ms"],
+                                   fields["memory"], fields["cost_key"]));
+  });
+  std::stable_sort(tasks.begin(), tasks.end(),
+                   [](auto&& x, auto&& y) { return x.first < y.first; });
+  std::cout << "# Converted from " << path << ".\n";
+  for (auto&& [start, rest] : tasks) {
+    std::cout << start - tasks.front().first << " " << rest << "\n";
+  }
+}
+
+double GetPercentile(const std::vector<std::chrono::milliseconds>& sorted,
+                     double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[std::min<std::size_t>(sorted.size() * p, sorted.size() - 1)]
+      .count();
+}
+
+// Jain's fairness index. 1 if all values are equal.
+double GetFairness(const std::vector<double>& values) {
+  double sum = 0, square_sum = 0;
+  for (auto&& e : values) {
+    sum += e;
+    square_sum += e * e;
+  }
+  return square_sum ? sum * sum / values.size() / square_sum : 1;
+}
+
+void Simulate(const std::vector<TraceEntry>& trace,
+              const std::vector<ServantSpec>& specs) {
+  auto dispatcher = TaskDispatcher::Instance();
+
+  // All servants recognize all environments in the trace.
+  std::unordered_set<std::string> environments;
+  for (auto&& e : trace) {
+    environments.insert(e.environment);
+  }
+  std::vector<std::unique_ptr<SimulatedServant>> servants;
+  std::unordered_map<std::string, SimulatedServant*> servants_by_location;
+  std::size_t total_slots = 0;
+  for (auto&& spec : specs) {
+    for (std::size_t i = 0; i != spec.count; ++i) {
+      auto index = servants.size();
+      auto&& servant = servants.emplace_back(
+          std::make_unique<SimulatedServant>());
+      auto&& personality = servant->personality;
+      personality.version = kVersion;
+      personality.observed_location = personality.reported_location =
+          flare::Format("10.{}.{}.{}:8335", index / 65536, index / 256 % 256,
+                        index % 256);
+      for (auto&& e : environments) {
+        personality.environments.emplace_back().set_compiler_digest(e);
+      }
+      personality.num_physical_cores = spec.physical_cores;
+      personality.smt_ways = spec.smt_ways;
+      personality.num_processors = spec.physical_cores * spec.smt_ways;
+      personality.current_load = 0;
+      personality.total_memory_in_bytes = spec.memory;
+      personality.memory_available_in_bytes = spec.memory;
+      personality.max_tasks =
+          spec.max_tasks ? spec.max_tasks : personality.num_processors;
+      personality.priority = spec.priority;
+      personality.not_accepting_task_reason =
+          NOT_ACCEPTING_TASK_REASON_UNKNOWN;
+      servants_by_location[personality.observed_location] = servant.get();
+      total_slots += personality.max_tasks;
+    }
+  }
+
+  auto now = 0ms;
+  auto heartbeat = [&] {
+    for (auto&& e : servants) {
+      e->personality.current_load = e->personality.runnable_tasks =
+          e->running_tasks;
+      e->personality.memory_available_in_bytes =
+          e->personality.total_memory_in_bytes -
+          std::min(e->memory_used, e->personality.total_memory_in_bytes);
+      dispatcher->KeepServantAlive(e->personality, kLease);
+    }
+  };
+
+  std::size_t next_arrival = 0;
+  std::list<std::size_t> pending;  // Indices into `trace`, in arrival order.
+  std::multimap<std::chrono::milliseconds, SimulatedTask> running;
+  std::vector<std::chrono::milliseconds> waits;
+  std::unordered_map<std::string, std::vector<double>> slowdowns;
+  std::chrono::milliseconds busy_time{};
+  std::size_t unschedulable = 0;
+
+  auto dispatch = [&] {
+    std::unordered_set<std::string> exhausted;
+    for (auto iter = pending.begin(); iter != pending.end();) {
+      auto&& entry = trace[*iter];
+      if (exhausted.count(entry.environment)) {
+        ++iter;
+        continue;
+      }
+      TaskPersonality task;
+      task.requestor_ip = entry.requestor;
+      task.min_version = kVersion;
+      task.env_desc.set_compiler_digest(entry.environment);
+      task.expected_cost = dispatcher->GetExpectedTaskCost(entry.cost_key);
+      // Don't wait, we'll retry once the cluster changes.
+      auto allocation = dispatcher->WaitForStartingNewTask(
+          task, kLease, flare::ReadCoarseSteadyClock(), false);
+      if (!allocation) {
+        if (allocation.error() == WaitStatus::EnvironmentNotFound) {
+          ++unschedulable;
+          iter = pending.erase(iter);
+        } else {
+          exhausted.insert(entry.environment);
+          ++iter;
+        }
+        continue;
+      }
+
+      auto servant = servants_by_location.at(allocation->servant_location);
+      auto duration = entry.duration;
+      if (servant->running_tasks >=
+          servant->personality.num_physical_cores) {
+        duration = std::chrono::milliseconds(
+            std::lround(duration.count() * FLAGS_smt_slowdown));
+      }
+      ++servant->running_tasks;
+      servant->memory_used += entry.peak_memory;
+      running.emplace(now + duration,
+                      SimulatedTask{.task_id = allocation->task_id,
+                                    .trace_index = *iter,
+                                    .servant = servant,
+                                    .started_at = now});
+      waits.push_back(now - entry.arrival);
+      slowdowns[entry.requestor].push_back(
+          static_cast<double>((now - entry.arrival + duration).count()) /
+          std::max<std::int64_t>(duration.count(), 1));
+      iter = pending.erase(iter);
+    }
+  };
+
+  heartbeat();
+  auto next_heartbeat = now + FLAGS_simulated_heartbeat_interval_ms * 1ms;
+  auto first_arrival = trace.empty() ? 0ms : trace.front().arrival;
+  while (next_arrival != trace.size() || !running.empty() || !pending.empty()) {
+    now = next_heartbeat;
+    if (next_arrival != trace.size()) {
+      now = std::min(now, trace[next_arrival].arrival);
+    }
+    if (!running.empty()) {
+      now = std::min(now, running.begin()->first);
+    }
+
+    while (!running.empty() && running.begin()->first <= now) {
+      auto task = running.begin()->second;
+      running.erase(running.begin());
+      auto&& entry = trace[task.trace_index];
+      dispatcher->FreeTask(task.task_id);
+      --task.servant->running_tasks;
+      task.servant->memory_used -= entry.peak_memory;
+      busy_time += now - task.started_at;
+      if (!entry.cost_key.empty()) {
+        CompletedTask completed;
+        completed.set_task_cost_key(entry.cost_key);
+        completed.set_compile_time_ms((now - task.started_at) / 1ms);
+        completed.set_peak_memory_in_bytes(entry.peak_memory);
+        dispatcher->NotifyServantCompletedTasks({completed});
+      }
+    }
+    if (now == next_heartbeat) {
+      heartbeat();
+      next_heartbeat += FLAGS_simulated_heartbeat_interval_ms * 1ms;
+
+      // Nothing is going to change if nothing is running or arriving.
+      if (running.empty() && next_arrival == trace.size()) {
+        unschedulable += pending.size();
+        pending.clear();
+      }
+    }
+    while (next_arrival != trace.size() &&
+           trace[next_arrival].arrival <= now) {
+      pending.push_back(next_arrival++);
+    }
+    dispatch();
+  }
+
+  auto makespan = std::max(now - first_arrival, 1ms);
+  std::sort(waits.begin(), waits.end());
+  std::vector<double> mean_slowdowns;
+  for (auto&& [k, v] : slowdowns) {
+    double sum = 0;
+    for (auto&& e : v) {
+      sum += e;
+    }
+    mean_slowdowns.push_back(sum / v.size());
+  }
+
+  std::cout << flare::Format(
+      "Tasks: {} ({} unschedulable)\n"
+      "Servants: {} ({} slots)\n"
+      "Makespan: {} ms\n"
+      "Utilization: {:.2f}%\n"
+      "Grant wait (ms): p50 {}, p90 {}, p99 {}, max {}\n"
+      "Fairness (Jain's index of mean slowdown of {} requestors): {:.4f}\n",
+      trace.size(), unschedulable, servants.size(), total_slots,
+      makespan.count(),
+      100.0 * busy_time.count() / makespan.count() /
+          std::max<std::size_t>(total_slots, 1),
+      GetPercentile(waits, 0.5), GetPercentile(waits, 0.9),
+      GetPercentile(waits, 0.99), GetPercentile(waits, 1),
+      mean_slowdowns.size(), GetFairness(mean_slowdowns));
+}
+
+}  // namespace
+
+int SimulatorStart(int argc, char** argv) {
+  if (!FLAGS_convert_log.empty()) {
+    ConvertLog(FLAGS_convert_log);
+    return 0;
+  }
+
+  std::vector<ServantSpec> specs;
+  if (!FLAGS_servants.empty()) {
+    specs = ReadServants(FLAGS_servants);
+  } else {
+    specs.push_back(ServantSpec{.count = 16,
+                                .priority = SERVANT_PRIORITY_DEDICATED,
+                                .physical_cores = 16,
+                                .smt_ways = 2,
+                                .memory = 64ULL << 30,
+                                .max_tasks = 0});
+  }
+  Simulate(FLAGS_trace.empty() ? SynthesizeTrace() : ReadTrace(FLAGS_trace),
+           specs);
+  return 0;
+}
+
+}  // namespace yadcc::scheduler
+
+int main(int argc, char** argv) {
+  return flare::Start(argc, argv, yadcc::scheduler::SimulatorStart);
+}
@@ -15,30 +15,56 @@
 #include "yadcc/scheduler/task_dispatcher.h"
 
 #include <chrono>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
 #include <vector>
 
+#include "gflags/gflags.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
+#include "flare/fiber/fiber.h"
 #include "flare/testing/main.h"
 
 using namespace std::literals;
 
+DECLARE_double(requestor_affinity_max_utilization);
+DECLARE_int32(interactive_task_weight);
+DECLARE_int32(ci_task_weight);
+DECLARE_int32(servant_load_decay_seconds);
+DECLARE_int32(max_subscribed_demand);
+
 namespace yadcc::scheduler {
 
-TEST(TaskDispatcher, All) {
-  ServantPersonality servant;
+constexpr auto kServantMemory = 50ULL * 1024 * 1024 * 1024;
 
-  servant.observed_location = "127.0.0.1:1234";
-  servant.reported_location = "127.0.0.1:1234";
-  servant.environments.emplace_back().set_compiler_digest("digest");
-  servant.max_tasks = 10;
-  servant.current_load = 0;
-  servant.num_processors = 10;
-  servant.priority = SERVANT_PRIORITY_USER;  // Doesn't matter.
+// Registers a servant serving `digest`. Tests tweak the personality returned
+// and call `KeepServantAlive` again if they need something more specific.
+ServantPersonality AddServant(
+    const std::string& location, const std::string& digest,
+    std::size_t max_tasks, std::size_t num_processors, std::size_t load,
+    ServantPriority priority = SERVANT_PRIORITY_USER,
+    const std::string& zone = "",
+    std::size_t memory_available_in_bytes = kServantMemory) {
+  ServantPersonality servant;
+  servant.observed_location = location;
+  servant.reported_location = location;
+  servant.environments.emplace_back().set_compiler_digest(digest);
+  servant.max_tasks = max_tasks;
+  servant.num_processors = num_processors;
+  servant.current_load = load;
+  servant.priority = priority;
   servant.version = 8;
-  servant.memory_available_in_bytes = 50ULL * 1024 * 1024 * 1024;
+  servant.zone = zone;
+  servant.memory_available_in_bytes = memory_available_in_bytes;
   TaskDispatcher::Instance()->KeepServantAlive(servant, 10s);
+  return servant;
+}
+
+TEST(TaskDispatcher, All) {
+  auto servant = AddServant("127.0.0.1:1234", "digest", 10, 10, 0);
 
   // No environment available.
   {
@@ -150,18 +176,7 @@ TEST(TaskDispatcher, PreferDedicated) {
   task.env_desc.set_compiler_digest("digest");
   task.min_version = 8;
 
-  ServantPersonality servant;
-
-  servant.observed_location = "127.0.0.1:1234";
-  servant.reported_location = "127.0.0.1:1234";
-  servant.environments.emplace_back().set_compiler_digest("digest");
-  servant.max_tasks = 10;
-  servant.current_load = 0;
-  servant.num_processors = 10;
-  servant.priority = SERVANT_PRIORITY_USER;
-  servant.version = 8;
-  servant.memory_available_in_bytes = 50ULL * 1024 * 1024 * 1024;
-  TaskDispatcher::Instance()->KeepServantAlive(servant, 1s);
+  AddServant("127.0.0.1:1234", "digest", 10, 10, 0);
 
   auto allocation = TaskDispatcher::Instance()->WaitForStartingNewTask(
       task, 1s, flare::ReadCoarseSteadyClock() + 1s, false);
@@ -169,11 +184,9 @@ TEST(TaskDispatcher, PreferDedicated) {
   EXPECT_EQ("127.0.0.1:1234", allocation->servant_location);
   TaskDispatcher::Instance()->FreeTask(allocation->task_id);
 
-  servant.observed_location = "192.168.0.1:1234";
-  servant.reported_location = "192.168.0.1:1234";
-  servant.current_load = 2;  // Higher load.
-  servant.priority = SERVANT_PRIORITY_DEDICATED;
-  TaskDispatcher::Instance()->KeepServantAlive(servant, 1s);
+  // A dedicated one, with higher load.
+  AddServant("192.168.0.1:1234", "digest", 10, 10, 2,
+             SERVANT_PRIORITY_DEDICATED);
 
   allocation = TaskDispatcher::Instance()->WaitForStartingNewTask(
       task, 1s, flare::ReadCoarseSteadyClock() + 1s, false);
@@ -182,24 +195,982 @@ TEST(TaskDispatcher, PreferDedicated) {
   EXPECT_EQ("192.168.0.1:1234", allocation->servant_location);
   TaskDispatcher::Instance()->FreeTask(allocation->task_id);
 
-  std::this_thread::sleep_for(1500ms);  // For servants to expire.
+  TaskDispatcher::Instance()->RemoveServant("127.0.0.1:1234");
+  TaskDispatcher::Instance()->RemoveServant("192.168.0.1:1234");
 }
 
-ServantPersonality AddServant(const std::string location, std::size_t max_tasks,
-                              std::size_t num_processors, std::size_t load,
-                              std::size_t memory_available_in_bytes) {
-  ServantPersonality servant;
-  servant.observed_location = location;
-  servant.reported_location = location;
-  servant.environments.emplace_back().set_compiler_digest("Load Balance");
-  servant.max_tasks = max_tasks;
-  servant.num_processors = num_processors;
-  servant.current_load = load;
-  servant.priority = SERVANT_PRIORITY_USER;  // Doesn't matter.
-  servant.version = 8;
-  servant.memory_available_in_bytes = memory_available_in_bytes;
+TEST(TaskDispatcher, FillPhysicalCoresFirst) {
+  // SMT disabled.
+  auto servant = AddServant("192.168.7.1:1234", "smt-digest", 16, 16, 0,
+                            SERVANT_PRIORITY_DEDICATED);
+  servant.num_physical_cores = 16;
+  servant.smt_ways = 1;
   TaskDispatcher::Instance()->KeepServantAlive(servant, 10s);
-  return servant;
+
+  // 2-way SMT.
+  servant = AddServant("192.168.7.2:1234", "smt-digest", 16, 16, 0,
+                       SERVANT_PRIORITY_DEDICATED);
+  servant.num_physical_cores = 8;
+  servant.smt_ways = 2;
+  TaskDispatcher::Instance()->KeepServantAlive(servant, 10s);
+
+  TaskPersonality task;
+  task.requestor_ip = "127.0.0.1";
+  task.env_desc.set_compiler_digest("smt-digest");
+  task.min_version = 8;
+
+  // All physical cores are used before any hyperthread is.
+  auto allocations = TaskDispatcher::Instance()->WaitForStartingNewTasks(
+      task, 1s, flare::ReadCoarseSteadyClock() + 1s, 24, 0);
+  ASSERT_TRUE(allocations);
+  ASSERT_EQ(24, allocations->size());
+  std::map<std::string, int> assigned;
+  for (auto&& e : *allocations) {
+    ++assigned[e.servant_location];
+  }
+  EXPECT_EQ(16, assigned["192.168.7.1:1234"]);
+  EXPECT_EQ(8, assigned["192.168.7.2:1234"]);
+
+  for (auto&& e : *allocations) {
+    TaskDispatcher::Instance()->FreeTask(e.task_id);
+  }
+  TaskDispatcher::Instance()->RemoveServant("192.168.7.1:1234");
+  TaskDispatcher::Instance()->RemoveServant("192.168.7.2:1234");
+}
+
+TEST(TaskDispatcher, EnvironmentIndex) {
+  auto servant = AddServant("192.168.1.1:1234", "index-digest-1", 1, 10, 0);
+  servant.environments.emplace_back().set_compiler_digest("index-digest-2");
+  TaskDispatcher::Instance()->KeepServantAlive(servant, 10s);
+
+  TaskPersonality task;
+  task.requestor_ip = "127.0.0.1";
+  task.env_desc.set_compiler_digest("index-digest-2");
+  task.min_version = 9;
+
+  // No servant is recent enough.
+  auto allocation = TaskDispatcher::Instance()->WaitForStartingNewTask(
+      task, 1s, flare::ReadCoarseSteadyClock() + 1s, false);
+  ASSERT_FALSE(allocation);
+  EXPECT_EQ(WaitStatus::EnvironmentNotFound, allocation.error());
+
+  task.min_version = 8;
+  allocation = TaskDispatcher::Instance()->WaitForStartingNewTask(
+      task, 1s, flare::ReadCoarseSteadyClock() + 1s, false);
+  ASSERT_TRUE(allocation);
+  EXPECT_EQ("192.168.1.1:1234", allocation->servant_location);
+
+  // The servant is saturated, for both environments.
+  task.env_desc.set_compiler_digest("index-digest-1");
+  auto failed = TaskDispatcher::Instance()->WaitForStartingNewTask(
+      task, 1s, flare::ReadCoarseSteadyClock() + 100ms, false);
+  ASSERT_FALSE(failed);
+  EXPECT_EQ(WaitStatus::Timeout, failed.error());
+
+  // Once the servant raises its capacity, it's usable again.
+  servant.max_tasks = 2;
+  TaskDispatcher::Instance()->KeepServantAlive(servant, 10s);
+  auto another = TaskDispatcher::Instance()->WaitForStartingNewTask(
+      task, 1s, flare::ReadCoarseSteadyClock() + 1s, false);
+  ASSERT_TRUE(another);
+  EXPECT_EQ("192.168.1.1:1234", another->servant_location);
+
+  // Servants not accepting tasks are not eligible at all.
+  TaskDispatcher::Instance()->FreeTask(allocation->task_id);
+  TaskDispatcher::Instance()->FreeTask(another->task_id);
+  servant.max_tasks = 0;
+  TaskDispatcher::Instance()->KeepServantAlive(servant, 10s);
+  failed = TaskDispatcher::Instance()->WaitForStartingNewTask(
+      task, 1s, flare::ReadCoarseSteadyClock() + 1s, false);
+  ASSERT_FALSE(failed);
+  EXPECT_EQ(WaitStatus::EnvironmentNotFound, failed.error());
+
+  TaskDispatcher::Instance()->RemoveServant("192.168.1.1:1234");
+}
+
+TEST(TaskDispatcher, BatchAllocation) {
+  const std::vector<std::string> kServants = {
+      "192.168.2.1:1234", "192.168.2.2:1234", "192.168.2.3:1234"};
+  for (auto&& e : kServants) {
+    AddServant(e, "batch-digest", 2, 10, 0);
+  }
+
+  TaskPersonality task;
+  task.requestor_ip = "127.0.0.1";
+  task.env_desc.set_compiler_digest("batch-digest");
+  task.min_version = 8;
+
+  // Only 6 allocations can be made.
+  auto allocations = TaskDispatcher::Instance()->WaitForStartingNewTasks(
+      task, 1s, flare::ReadCoarseSteadyClock() + 1s, 2, 10);
+  ASSERT_TRUE(allocations);
+  ASSERT_EQ(6, allocations->size());
+
+  // Tasks stick to the same servant until it's too busy (affinity), and all
+  // servants are used eventually.
+  std::map<std::string, int> assigned;
+  for (int i = 0; i != 6; i += 2) {
+    EXPECT_EQ((*allocations)[i].servant_location,
+              (*allocations)[i + 1].servant_location);
+    ++assigned[(*allocations)[i].servant_location];
+  }
+  EXPECT_EQ(3, assigned.size());
+
+  // Nothing left.
+  auto failed = TaskDispatcher::Instance()->WaitForStartingNewTasks(
+      task, 1s, flare::ReadCoarseSteadyClock() + 100ms, 1, 1);
+  ASSERT_FALSE(failed);
+  EXPECT_EQ(WaitStatus::Timeout, failed.error());
+
+  for (auto&& e : *allocations) {
+    TaskDispatcher::Instance()->FreeTask(e.task_id);
+  }
+  for (auto&& e : kServants) {
+    TaskDispatcher::Instance()->RemoveServant(e);
+  }
+}
+
+TEST(TaskDispatcher, FairWaiterQueue) {
+  AddServant("192.168.3.1:1234", "fair-digest", 1, 10, 0);
+
+  auto make_task = [](const std::string& requestor) {
+    TaskPersonality task;
+    task.requestor_ip = requestor;
+    task.env_desc.set_compiler_digest("fair-digest");
+    task.min_version = 8;
+    return task;
+  };
+  auto occupier = TaskDispatcher::Instance()->WaitForStartingNewTask(
+      make_task("10.0.0.1"), 10s, flare::ReadCoarseSteadyClock() + 1s, false);
+  ASSERT_TRUE(occupier);
+
+  // Three waiters from `10.0.0.1`, followed by one from `10.0.0.2`.
+  std::mutex lock;
+  std::vector<std::pair<std::string, std::uint64_t>> granted;
+  std::vector<flare::Fiber> waiters;
+  for (auto&& e : {"10.0.0.1", "10.0.0.1", "10.0.0.1", "10.0.0.2"}) {
+    waiters.emplace_back([&, requestor = std::string(e)] {
+      auto result = TaskDispatcher::Instance()->WaitForStartingNewTask(
+          make_task(requestor), 10s, flare::ReadCoarseSteadyClock() + 5s,
+          false);
+      ASSERT_TRUE(result);
+      std::scoped_lock _(lock);
+      granted.emplace_back(requestor, result->task_id);
+    });
+    std::this_thread::sleep_for(100ms);  // Enqueued in order.
+  }
+
+  // Each time the servant is freed, exactly one waiter is granted. `10.0.0.2`
+  // shouldn't wait for all of `10.0.0.1`'s waiters.
+  auto last_task = occupier->task_id;
+  for (int i = 0; i != 4; ++i) {
+    TaskDispatcher::Instance()->FreeTask(last_task);
+    std::this_thread::sleep_for(100ms);
+    std::scoped_lock _(lock);
+    ASSERT_EQ(i + 1, granted.size());
+    last_task = granted.back().second;
+  }
+  TaskDispatcher::Instance()->FreeTask(last_task);
+  for (auto&& e : waiters) {
+    e.join();
+  }
+
+  EXPECT_EQ("10.0.0.1", granted[0].first);
+  EXPECT_EQ("10.0.0.2", granted[1].first);
+  EXPECT_EQ("10.0.0.1", granted[2].first);
+  EXPECT_EQ("10.0.0.1", granted[3].first);
+  TaskDispatcher::Instance()->RemoveServant("192.168.3.1:1234");
+}
+
+TEST(TaskDispatcher, PriorityClass) {
+  auto make_task = [](const std::string& requestor,
+                      TaskPriorityClass priority_class) {
+    TaskPersonality task;
+    task.requestor_ip = requestor;
+    task.env_desc.set_compiler_digest("priority-digest");
+    task.min_version = 8;
+    task.priority_class = priority_class;
+    return task;
+  };
+
+  // Last quarter of the dedicated servant is reserved for interactive tasks.
+  AddServant("192.168.3.2:1234", "priority-digest", 4, 10, 0,
+             SERVANT_PRIORITY_DEDICATED);
+
+  std::vector<std::uint64_t> tasks;
+  for (int i = 0; i != 3; ++i) {
+    auto result = TaskDispatcher::Instance()->WaitForStartingNewTask(
+        make_task("10.0.0.1", TASK_PRIORITY_CLASS_BATCH), 10s,
+        flare::ReadCoarseSteadyClock() + 1s, false);
+    ASSERT_TRUE(result);
+    tasks.push_back(result->task_id);
+  }
+  EXPECT_FALSE(TaskDispatcher::Instance()->WaitForStartingNewTask(
+      make_task("10.0.0.1", TASK_PRIORITY_CLASS_BATCH), 10s,
+      flare::ReadCoarseSteadyClock() + 100ms, false));
+  auto interactive = TaskDispatcher::Instance()->WaitForStartingNewTask(
+      make_task("10.0.0.2", TASK_PRIORITY_CLASS_INTERACTIVE), 10s,
+      flare::ReadCoarseSteadyClock() + 1s, false);
+  ASSERT_TRUE(interactive);
+  tasks.push_back(interactive->task_id);
+  for (auto&& e : tasks) {
+    TaskDispatcher::Instance()->FreeTask(e);
+  }
+  TaskDispatcher::Instance()->RemoveServant("192.168.3.2:1234");
+
+  // On a saturated servant, waiters are served in proportion to weights of
+  // their classes.
+  FLAGS_interactive_task_weight = 3;
+  FLAGS_ci_task_weight = 1;
+  AddServant("192.168.3.3:1234", "priority-digest", 1, 10, 0);
+  auto occupier = TaskDispatcher::Instance()->WaitForStartingNewTask(
+      make_task("10.0.0.1", TASK_PRIORITY_CLASS_CI), 10s,
+      flare::ReadCoarseSteadyClock() + 1s, false);
+  ASSERT_TRUE(occupier);
+
+  // CI waiters are enqueued before interactive ones.
+  std::mutex lock;
+  std::vector<std::pair<TaskPriorityClass, std::uint64_t>> granted;
+  std::vector<flare::Fiber> waiters;
+  for (auto&& e :
+       {TASK_PRIORITY_CLASS_CI, TASK_PRIORITY_CLASS_CI,
+        TASK_PRIORITY_CLASS_INTERACTIVE, TASK_PRIORITY_CLASS_INTERACTIVE,
+        TASK_PRIORITY_CLASS_INTERACTIVE, TASK_PRIORITY_CLASS_INTERACTIVE}) {
+    waiters.emplace_back([&, priority_class = e] {
+      auto result = TaskDispatcher::Instance()->WaitForStartingNewTask(
+          make_task(priority_class == TASK_PRIORITY_CLASS_CI ? "10.0.0.1"
+                                                             : "10.0.0.2",
+                    priority_class),
+          10s, flare::ReadCoarseSteadyClock() + 5s, false);
+      ASSERT_TRUE(result);
+      std::scoped_lock _(lock);
+      granted.emplace_back(priority_class, result->task_id);
+    });
+    std::this_thread::sleep_for(100ms);  // Enqueued in order.
+  }
+
+  auto last_task = occupier->task_id;
+  for (int i = 0; i != 6; ++i) {
+    TaskDispatcher::Instance()->FreeTask(last_task);
+    std::this_thread::sleep_for(100ms);
+    std::scoped_lock _(lock);
+    ASSERT_EQ(i + 1, granted.size());
+    last_task = granted.back().second;
+  }
+  TaskDispatcher::Instance()->FreeTask(last_task);
+  for (auto&& e : waiters) {
+    e.join();
+  }
+  FLAGS_interactive_task_weight = 8;
+  FLAGS_ci_task_weight = 2;
+
+  std::vector<TaskPriorityClass> expected = {
+      TASK_PRIORITY_CLASS_INTERACTIVE, TASK_PRIORITY_CLASS_CI,
+      TASK_PRIORITY_CLASS_INTERACTIVE, TASK_PRIORITY_CLASS_INTERACTIVE,
+      TASK_PRIORITY_CLASS_INTERACTIVE, TASK_PRIORITY_CLASS_CI};
+  for (int i = 0; i != 6; ++i) {
+    EXPECT_EQ(expected[i], granted[i].first);
+  }
+  TaskDispatcher::Instance()->RemoveServant("192.168.3.3:1234");
+}
+
+TEST(TaskDispatcher, Subscription) {
+  AddServant("192.168.3.4:1234", "subscribed-digest", 2, 10, 0);
+
+  auto make_delta = [](std::int64_t delta) {
+    DemandDelta result;
+    result.personality.requestor_ip = "10.0.0.1";
+    result.personality.env_desc.set_compiler_digest("subscribed-digest");
+    result.personality.min_version = 8;
+    result.delta = delta;
+    return result;
+  };
+  auto poll = [](std::chrono::nanoseconds timeout) {
+    auto result = TaskDispatcher::Instance()->WaitForSubscribedAllocations(
+        1, flare::ReadCoarseSteadyClock() + timeout);
+    EXPECT_TRUE(result);
+    std::vector<std::uint64_t> tasks;
+    for (auto&& e : *result) {
+      EXPECT_EQ("subscribed-digest", e.compiler_digest);
+      EXPECT_EQ("192.168.3.4:1234", e.allocation.servant_location);
+      tasks.push_back(e.allocation.task_id);
+    }
+    return tasks;
+  };
+
+  // Unknown subscriptions must be reset first.
+  EXPECT_FALSE(TaskDispatcher::Instance()->UpdateSubscription(
+      1, 1, false, {make_delta(1)}, 10s));
+  EXPECT_FALSE(TaskDispatcher::Instance()->WaitForSubscribedAllocations(
+      1, flare::ReadCoarseSteadyClock()));
+
+  // Demand is satisfied immediately as long as there's capacity.
+  ASSERT_TRUE(TaskDispatcher::Instance()->UpdateSubscription(
+      1, 1, true, {make_delta(3)}, 10s));
+  auto tasks = poll(1s);
+  ASSERT_EQ(2, tasks.size());
+
+  // Retried update is not applied twice.
+  ASSERT_TRUE(TaskDispatcher::Instance()->UpdateSubscription(
+      1, 1, false, {make_delta(3)}, 10s));
+
+  // The rest is delivered once a servant frees up.
+  std::vector<std::uint64_t> delivered;
+  auto poller = flare::Fiber([&] { delivered = poll(5s); });
+  std::this_thread::sleep_for(100ms);
+  auto freed_at = flare::ReadCoarseSteadyClock();
+  TaskDispatcher::Instance()->FreeTask(tasks[0]);
+  poller.join();
+  EXPECT_LT(flare::ReadCoarseSteadyClock() - freed_at, 1s);
+  ASSERT_EQ(1, delivered.size());
+  tasks[0] = delivered[0];
+
+  // Withdrawn demand is not served.
+  ASSERT_TRUE(TaskDispatcher::Instance()->UpdateSubscription(
+      1, 2, false, {make_delta(1)}, 10s));
+  ASSERT_TRUE(TaskDispatcher::Instance()->UpdateSubscription(
+      1, 3, false, {make_delta(-1)}, 10s));
+  TaskDispatcher::Instance()->FreeTask(tasks[0]);
+  EXPECT_TRUE(poll(100ms).empty());
+
+  // Reset sets demand to what's given.
+  ASSERT_TRUE(TaskDispatcher::Instance()->UpdateSubscription(
+      1, 4, true, {make_delta(1)}, 10s));
+  tasks[0] = poll(1s).at(0);
+
+  // Demand beyond the cap is dropped.
+  FLAGS_max_subscribed_demand = 1;
+  ASSERT_TRUE(TaskDispatcher::Instance()->UpdateSubscription(
+      1, 5, false, {make_delta(3)}, 10s));
+  TaskDispatcher::Instance()->FreeTask(tasks[0]);
+  tasks[0] = poll(1s).at(0);
+  TaskDispatcher::Instance()->FreeTask(tasks[1]);
+  EXPECT_TRUE(poll(100ms).empty());
+  FLAGS_max_subscribed_demand = 256;
+
+  TaskDispatcher::Instance()->FreeTask(tasks[0]);
+  ASSERT_TRUE(
+      TaskDispatcher::Instance()->UpdateSubscription(1, 6, true, {}, 10s));
+  TaskDispatcher::Instance()->RemoveServant("192.168.3.4:1234");
+}
+
+TEST(TaskDispatcher, Affinity) {
+  AddServant("192.168.4.1:1234", "affinity-digest", 4, 10, 0);
+  AddServant("192.168.4.2:1234", "affinity-digest", 4, 10, 0);
+
+  auto allocate = [](const std::string& requestor) {
+    TaskPersonality task;
+    task.requestor_ip = requestor;
+    task.env_desc.set_compiler_digest("affinity-digest");
+    task.min_version = 8;
+    auto result = TaskDispatcher::Instance()->WaitForStartingNewTask(
+        task, 1s, flare::ReadCoarseSteadyClock() + 1s, false);
+    EXPECT_TRUE(result);
+    return *result;
+  };
+  auto before = TaskDispatcher::Instance()->DumpInternals()["affinity"];
+
+  // Utilization is kept below 75% (3 out of 4).
+  std::vector<TaskAllocation> allocations;
+  for (int i = 0; i != 3; ++i) {
+    allocations.push_back(allocate("10.0.1.1"));
+  }
+  EXPECT_EQ(allocations[0].servant_location, allocations[1].servant_location);
+  EXPECT_EQ(allocations[0].servant_location, allocations[2].servant_location);
+
+  // Too busy now, the other (least utilized) servant is used.
+  allocations.push_back(allocate("10.0.1.1"));
+  EXPECT_NE(allocations[0].servant_location, allocations[3].servant_location);
+
+  // Other requestors don't have affinity with the servants.
+  allocations.push_back(allocate("10.0.1.2"));
+  EXPECT_EQ(allocations[3].servant_location, allocations[4].servant_location);
+
+  auto after = TaskDispatcher::Instance()->DumpInternals()["affinity"];
+  EXPECT_EQ(5, after["allocations"].asUInt64() -
+                   before["allocations"].asUInt64());
+  EXPECT_EQ(2, after["connection_reused"].asUInt64() -
+                   before["connection_reused"].asUInt64());
+
+  for (auto&& e : allocations) {
+    TaskDispatcher::Instance()->FreeTask(e.task_id);
+  }
+  TaskDispatcher::Instance()->RemoveServant("192.168.4.1:1234");
+  TaskDispatcher::Instance()->RemoveServant("192.168.4.2:1234");
+}
+
+TEST(TaskDispatcher, TaskCost) {
+  AddServant("192.168.5.1:1234", "cost-digest", 8, 8, 0,
+             SERVANT_PRIORITY_DEDICATED);
+  AddServant("192.168.5.2:1234", "cost-digest", 8, 8, 0);
+
+  std::vector<CompletedTask> completed(2);
+  completed[0].set_task_cost_key("long-task");
+  completed[0].set_compile_time_ms(60000);
+  completed[0].set_peak_memory_in_bytes(1024 * 1024 * 1024);
+  completed[1].set_task_cost_key("short-task");
+  completed[1].set_compile_time_ms(500);
+  completed[1].set_peak_memory_in_bytes(100 * 1024 * 1024);
+  TaskDispatcher::Instance()->NotifyServantCompletedTasks(completed);
+  EXPECT_FALSE(TaskDispatcher::Instance()->GetExpectedTaskCost("unknown"));
+  EXPECT_EQ(60s,
+            TaskDispatcher::Instance()->GetExpectedTaskCost("long-task")
+                ->compile_time);
+
+  auto allocate = [](const std::string& task_cost_key) {
+    TaskPersonality task;
+    task.requestor_ip = "10.0.2.1";
+    task.env_desc.set_compiler_digest("cost-digest");
+    task.min_version = 8;
+    task.expected_cost =
+        TaskDispatcher::Instance()->GetExpectedTaskCost(task_cost_key);
+    auto result = TaskDispatcher::Instance()->WaitForStartingNewTask(
+        task, 1s, flare::ReadCoarseSteadyClock() + 1s, false);
+    EXPECT_TRUE(result);
+    return *result;
+  };
+
+  std::vector<TaskAllocation> allocations;
+  // Tasks of unknown cost prefer dedicated servants, as always.
+  allocations.push_back(allocate("unknown"));
+  EXPECT_EQ("192.168.5.1:1234", allocations.back().servant_location);
+  // Short tasks are put on the volunteer, even if the requestor has just been
+  // using the dedicated one.
+  allocations.push_back(allocate("short-task"));
+  EXPECT_EQ("192.168.5.2:1234", allocations.back().servant_location);
+  // Long tasks are put on the dedicated servant, even if the requestor has
+  // just been using the volunteer.
+  allocations.push_back(allocate("long-task"));
+  EXPECT_EQ("192.168.5.1:1234", allocations.back().servant_location);
+  allocations.push_back(allocate("short-task"));
+  EXPECT_EQ("192.168.5.2:1234", allocations.back().servant_location);
+
+  for (auto&& e : allocations) {
+    TaskDispatcher::Instance()->FreeTask(e.task_id);
+  }
+  TaskDispatcher::Instance()->RemoveServant("192.168.5.1:1234");
+  TaskDispatcher::Instance()->RemoveServant("192.168.5.2:1234");
+}
+
+TEST(TaskDispatcher, MemoryBinPacking) {
+  auto saved_affinity = FLAGS_requestor_affinity_max_utilization;
+  FLAGS_requestor_affinity_max_utilization = 0;
+
+  constexpr auto kGiB = 1024ULL * 1024 * 1024;
+  auto small = AddServant("192.168.6.1:1234", "memory-digest", 10, 10, 0,
+                          SERVANT_PRIORITY_USER, "", 14 * kGiB);
+  small.total_memory_in_bytes = 16 * kGiB;
+  TaskDispatcher::Instance()->KeepServantAlive(small, 10s);
+  // More utilized.
+  auto large = AddServant("192.168.6.2:1234", "memory-digest", 10, 10, 5,
+                          SERVANT_PRIORITY_USER, "", 250 * kGiB);
+  large.total_memory_in_bytes = 256 * kGiB;
+  TaskDispatcher::Instance()->KeepServantAlive(large, 10s);
+
+  std::vector<CompletedTask> completed(2);
+  completed[0].set_task_cost_key("giant-tu");
+  completed[0].set_compile_time_ms(5000);
+  completed[0].set_peak_memory_in_bytes(4 * kGiB);
+  completed[1].set_task_cost_key("tiny-tu");
+  completed[1].set_compile_time_ms(5000);
+  completed[1].set_peak_memory_in_bytes(kGiB / 10);
+  TaskDispatcher::Instance()->NotifyServantCompletedTasks(completed);
+
+  auto allocate = [](const std::string& task_cost_key) {
+    TaskPersonality task;
+    task.requestor_ip = "10.0.3.1";
+    task.env_desc.set_compiler_digest("memory-digest");
+    task.min_version = 8;
+    task.expected_cost =
+        TaskDispatcher::Instance()->GetExpectedTaskCost(task_cost_key);
+    auto result = TaskDispatcher::Instance()->WaitForStartingNewTask(
+        task, 1s, flare::ReadCoarseSteadyClock() + 1s, false);
+    EXPECT_TRUE(result);
+    return *result;
+  };
+
+  // At least 10G (`servant_min_memory_for_accepting_new_task`) should be left
+  // on the servant after assigning the task.
+  std::vector<TaskAllocation> allocations;
+  allocations.push_back(allocate("giant-tu"));
+  EXPECT_EQ("192.168.6.1:1234", allocations.back().servant_location);
+  allocations.push_back(allocate("giant-tu"));
+  EXPECT_EQ("192.168.6.2:1234", allocations.back().servant_location);
+
+  // Even if the giant TU has not reached its peak by the time the servant
+  // reports its memory usage, we don't put another one on the small servant.
+  small.memory_available_in_bytes = 13 * kGiB;
+  TaskDispatcher::Instance()->KeepServantAlive(small, 10s);
+  allocations.push_back(allocate("giant-tu"));
+  EXPECT_EQ("192.168.6.2:1234", allocations.back().servant_location);
+
+  // Small one still fits in.
+  allocations.push_back(allocate("tiny-tu"));
+  EXPECT_EQ("192.168.6.1:1234", allocations.back().servant_location);
+
+  for (auto&& e : allocations) {
+    TaskDispatcher::Instance()->FreeTask(e.task_id);
+  }
+  FLAGS_requestor_affinity_max_utilization = saved_affinity;
+  TaskDispatcher::Instance()->RemoveServant("192.168.6.1:1234");
+  TaskDispatcher::Instance()->RemoveServant("192.168.6.2:1234");
+}
+
+TEST(TaskDispatcher, MemoryOfUnknownCost) {
+  constexpr auto kGiB = 1024ULL * 1024 * 1024;
+  auto servant =
+      AddServant("192.168.6.3:1234", "unknown-memory-digest", 10, 10, 0,
+                 SERVANT_PRIORITY_USER, "", 14 * kGiB);
+  servant.total_memory_in_bytes = 16 * kGiB;
+  TaskDispatcher::Instance()->KeepServantAlive(servant, 10s);
+
+  // Nothing is reserved for tasks whose cost we haven't learned, so they're
+  // limited by servant's capacity alone.
+  std::vector<TaskAllocation> allocations;
+  for (int i = 0; i != 10; ++i) {
+    TaskPersonality task;
+    task.requestor_ip = "10.0.3.2";
+    task.env_desc.set_compiler_digest("unknown-memory-digest");
+    task.min_version = 8;
+    auto result = TaskDispatcher::Instance()->WaitForStartingNewTask(
+        task, 1s, flare::ReadCoarseSteadyClock() + 10ms, false);
+    ASSERT_TRUE(result);
+    allocations.push_back(*result);
+  }
+
+  for (auto&& e : allocations) {
+    TaskDispatcher::Instance()->FreeTask(e.task_id);
+  }
+  TaskDispatcher::Instance()->RemoveServant("192.168.6.3:1234");
+}
+
+TEST(TaskDispatcher, Zone) {
+  // Discovered first, so it would have been preferred were zone not taken
+  // into consideration.
+  AddServant("192.168.7.1:1234", "zone-digest", 10, 10, 0,
+             SERVANT_PRIORITY_USER, "dc-b");
+  AddServant("192.168.7.2:1234", "zone-digest", 2, 10, 0,
+             SERVANT_PRIORITY_USER, "dc-a");
+
+  TaskPersonality task;
+  task.requestor_ip = "10.0.4.1";
+  task.env_desc.set_compiler_digest("zone-digest");
+  task.min_version = 8;
+  task.zone = "dc-a";
+
+  // Servant in the same zone is used until it's full.
+  auto allocations = TaskDispatcher::Instance()->WaitForStartingNewTasks(
+      task, 1s, flare::ReadCoarseSteadyClock() + 1s, 3, 0);
+  ASSERT_TRUE(allocations);
+  ASSERT_EQ(3, allocations->size());
+  EXPECT_EQ("192.168.7.2:1234", (*allocations)[0].servant_location);
+  EXPECT_EQ("192.168.7.2:1234", (*allocations)[1].servant_location);
+  EXPECT_EQ("192.168.7.1:1234", (*allocations)[2].servant_location);
+
+  auto internals = TaskDispatcher::Instance()->DumpInternals();
+  EXPECT_EQ(3, internals["zones"]["dc-a"]["allocations"].asUInt64());
+  EXPECT_EQ(1, internals["zones"]["dc-a"]["cross_zone_allocations"].asUInt64());
+
+  for (auto&& e : *allocations) {
+    TaskDispatcher::Instance()->FreeTask(e.task_id);
+  }
+  TaskDispatcher::Instance()->RemoveServant("192.168.7.1:1234");
+  TaskDispatcher::Instance()->RemoveServant("192.168.7.2:1234");
+}
+
+TEST(TaskDispatcher, JoinRunningTask) {
+  AddServant("192.168.8.1:1234", "join-digest", 10, 10, 0);
+
+  auto make_task = [](const std::string& digest) {
+    TaskPersonality task;
+    task.requestor_ip = "10.0.5.1";
+    task.env_desc.set_compiler_digest("join-digest");
+    task.min_version = 8;
+    task.task_digest = digest;
+    return task;
+  };
+
+  // The first one starts the task.
+  std::optional<RunningTask> existing;
+  auto first = TaskDispatcher::Instance()->WaitForStartingNewTasks(
+      make_task("tu-1"), 10s, flare::ReadCoarseSteadyClock() + 1s, 1, 0,
+      &existing);
+  ASSERT_TRUE(first);
+  ASSERT_EQ(1, first->size());
+  EXPECT_FALSE(existing);
+
+  // The second one waits for the task to be reported running, and joins it.
+  std::optional<RunningTask> joined;
+  flare::Fiber joiner([&] {
+    auto allocations = TaskDispatcher::Instance()->WaitForStartingNewTasks(
+        make_task("tu-1"), 10s, flare::ReadCoarseSteadyClock() + 5s, 1, 0,
+        &joined);
+    ASSERT_TRUE(allocations);
+    EXPECT_TRUE(allocations->empty());
+  });
+  std::this_thread::sleep_for(100ms);
+  RunningTask running;
+  running.set_servant_location("192.168.8.1:1234");
+  running.set_task_grant_id((*first)[0].task_id);
+  running.set_servant_task_id(77);
+  running.set_task_digest("tu-1");
+  EXPECT_TRUE(TaskDispatcher::Instance()
+                  ->NotifyServantRunningTasks("192.168.8.1:1234", {running})
+                  .empty());
+  joiner.join();
+  ASSERT_TRUE(joined);
+  EXPECT_EQ(77, joined->servant_task_id());
+  EXPECT_EQ("192.168.8.1:1234", joined->servant_location());
+  auto internals = TaskDispatcher::Instance()->DumpInternals();
+  EXPECT_EQ(1, internals["joined_tasks"].asUInt64());
+
+  // Lookups (neither immediate nor prefetch requests) join running tasks...
+  std::optional<RunningTask> looked_up;
+  auto lookup = TaskDispatcher::Instance()->WaitForStartingNewTasks(
+      make_task("tu-1"), 10s, flare::ReadCoarseSteadyClock() + 1s, 0, 0,
+      &looked_up);
+  ASSERT_TRUE(lookup);
+  EXPECT_TRUE(lookup->empty());
+  ASSERT_TRUE(looked_up);
+  EXPECT_EQ(77, looked_up->servant_task_id());
+
+  // ... and return immediately if there's none, without allocating anything.
+  looked_up.reset();
+  auto lookup_start = flare::ReadCoarseSteadyClock();
+  lookup = TaskDispatcher::Instance()->WaitForStartingNewTasks(
+      make_task("tu-3"), 10s, flare::ReadCoarseSteadyClock() + 1s, 0, 0,
+      &looked_up);
+  ASSERT_TRUE(lookup);
+  EXPECT_TRUE(lookup->empty());
+  EXPECT_FALSE(looked_up);
+  EXPECT_LT(flare::ReadCoarseSteadyClock() - lookup_start, 100ms);
+
+  // Prefetch-only requests are not made for a specific task, they never join.
+  auto prefetched = TaskDispatcher::Instance()->WaitForStartingNewTasks(
+      make_task("tu-1"), 10s, flare::ReadCoarseSteadyClock() + 1s, 0, 1,
+      &existing);
+  ASSERT_TRUE(prefetched);
+  ASSERT_EQ(1, prefetched->size());
+  EXPECT_FALSE(existing);
+
+  // Tasks of other digests are not affected.
+  auto other = TaskDispatcher::Instance()->WaitForStartingNewTasks(
+      make_task("tu-2"), 10s, flare::ReadCoarseSteadyClock() + 1s, 1, 0,
+      &existing);
+  ASSERT_TRUE(other);
+  ASSERT_EQ(1, other->size());
+  EXPECT_FALSE(existing);
+
+  // Once the task is done, a new one is started.
+  TaskDispatcher::Instance()->FreeTask((*first)[0].task_id);
+  auto start = flare::ReadCoarseSteadyClock();
+  auto again = TaskDispatcher::Instance()->WaitForStartingNewTasks(
+      make_task("tu-1"), 10s, flare::ReadCoarseSteadyClock() + 1s, 1, 0,
+      &existing);
+  ASSERT_TRUE(again);
+  ASSERT_EQ(1, again->size());
+  EXPECT_FALSE(existing);
+  EXPECT_LT(flare::ReadCoarseSteadyClock() - start, 100ms);
+
+  TaskDispatcher::Instance()->FreeTask((*prefetched)[0].task_id);
+  TaskDispatcher::Instance()->FreeTask((*other)[0].task_id);
+  TaskDispatcher::Instance()->FreeTask((*again)[0].task_id);
+  TaskDispatcher::Instance()->RemoveServant("192.168.8.1:1234");
+}
+
+TEST(TaskDispatcher, Expiration) {
+  auto servant = AddServant("192.168.5.1:1234", "expiration-digest", 3, 10, 0);
+
+  TaskPersonality task;
+  task.requestor_ip = "127.0.0.1";
+  task.env_desc.set_compiler_digest("expiration-digest");
+  task.min_version = 8;
+  auto allocations = TaskDispatcher::Instance()->WaitForStartingNewTasks(
+      task, 1s, flare::ReadCoarseSteadyClock() + 1s, 3, 0);
+  ASSERT_TRUE(allocations);
+  ASSERT_EQ(3, allocations->size());
+  auto&& renewed = (*allocations)[0];
+  auto&& expiring = (*allocations)[1];
+  auto&& freed = (*allocations)[2];
+
+  // Keep renewing the first task, and free the last one.
+  TaskDispatcher::Instance()->FreeTask(freed.task_id);
+  for (int i = 0; i != 4; ++i) {
+    std::this_thread::sleep_for(500ms);
+    EXPECT_TRUE(TaskDispatcher::Instance()->KeepTaskAlive(renewed.task_id, 1s));
+  }
+  // The second one has expired by now.
+  EXPECT_FALSE(TaskDispatcher::Instance()->KeepTaskAlive(expiring.task_id, 1s));
+
+  // Until the servant confirms that the zombie is not running, it still
+  // occupies the servant.
+  std::vector<RunningTask> running_tasks;
+  running_tasks.emplace_back().set_task_grant_id(renewed.task_id);
+  EXPECT_THAT(TaskDispatcher::Instance()->NotifyServantRunningTasks(
+                  "192.168.5.1:1234", std::move(running_tasks)),
+              ::testing::IsEmpty());
+
+  // Now the servant is only running the renewed one.
+  allocations = TaskDispatcher::Instance()->WaitForStartingNewTasks(
+      task, 1s, flare::ReadCoarseSteadyClock() + 1s, 3, 0);
+  ASSERT_TRUE(allocations);
+  EXPECT_EQ(2, allocations->size());
+
+  // The servant goes away, so do its tasks.
+  TaskDispatcher::Instance()->KeepServantAlive(servant, 0s);
+  std::this_thread::sleep_for(1500ms);
+  EXPECT_FALSE(TaskDispatcher::Instance()->KeepTaskAlive(renewed.task_id, 1s));
+  for (auto&& e : *allocations) {
+    EXPECT_FALSE(TaskDispatcher::Instance()->KeepTaskAlive(e.task_id, 1s));
+  }
+}
+
+TEST(TaskDispatcher, Lease) {
+  AddServant("192.168.10.1:1234", "lease-digest", 3, 10, 0);
+
+  TaskPersonality task;
+  task.requestor_ip = "127.0.0.1";
+  task.env_desc.set_compiler_digest("lease-digest");
+  task.min_version = 8;
+  auto leased = TaskDispatcher::Instance()->WaitForLeasingTasks(
+      task, 2s, flare::ReadCoarseSteadyClock() + 1s, 2);
+  ASSERT_TRUE(leased);
+  ASSERT_EQ(2, leased->size());
+  auto allocated = TaskDispatcher::Instance()->WaitForStartingNewTask(
+      task, 2s, flare::ReadCoarseSteadyClock() + 1s, false);
+  ASSERT_TRUE(allocated);
+
+  // Renewing a leased task with a shorter period does not shorten the lease.
+  for (auto&& e : *leased) {
+    EXPECT_TRUE(TaskDispatcher::Instance()->KeepTaskAlive(e.task_id, 100ms));
+  }
+  EXPECT_TRUE(
+      TaskDispatcher::Instance()->KeepTaskAlive(allocated->task_id, 100ms));
+  std::this_thread::sleep_for(1500ms);
+  EXPECT_TRUE(
+      TaskDispatcher::Instance()->KeepTaskAlive((*leased)[0].task_id, 5s));
+  EXPECT_FALSE(
+      TaskDispatcher::Instance()->KeepTaskAlive(allocated->task_id, 100ms));
+
+  // Once the lease ends, slots not renewed expire as usual.
+  std::this_thread::sleep_for(1500ms);
+  EXPECT_TRUE(
+      TaskDispatcher::Instance()->KeepTaskAlive((*leased)[0].task_id, 1s));
+  EXPECT_FALSE(
+      TaskDispatcher::Instance()->KeepTaskAlive((*leased)[1].task_id, 1s));
+  TaskDispatcher::Instance()->FreeTask((*leased)[0].task_id);
+  TaskDispatcher::Instance()->RemoveServant("192.168.10.1:1234");
+}
+
+TEST(TaskDispatcher, Metrics) {
+  AddServant("192.168.11.1:1234", "metrics-digest", 1, 10, 0);
+
+  TaskPersonality task;
+  task.requestor_ip = "127.0.0.2";
+  task.env_desc.set_compiler_digest("metrics-digest");
+  task.min_version = 8;
+  auto allocated = TaskDispatcher::Instance()->WaitForStartingNewTask(
+      task, 10s, flare::ReadCoarseSteadyClock() + 1s, false);
+  ASSERT_TRUE(allocated);
+  EXPECT_FALSE(TaskDispatcher::Instance()->WaitForStartingNewTask(
+      task, 10s, flare::ReadCoarseSteadyClock() + 100ms, false));
+  TaskDispatcher::Instance()->FreeTask(allocated->task_id);
+
+  // Digests no servant recognizes are not counted on their own.
+  TaskPersonality made_up = task;
+  made_up.env_desc.set_compiler_digest("made-up-metrics-digest");
+  EXPECT_FALSE(TaskDispatcher::Instance()->WaitForStartingNewTask(
+      made_up, 10s, flare::ReadCoarseSteadyClock() + 100ms, false));
+
+  auto metrics = TaskDispatcher::Instance()->DumpMetrics();
+  auto&& counters = metrics["environments"]["metrics-digest"];
+  EXPECT_EQ(1, counters["immediate"].asInt());
+  EXPECT_EQ(1, counters["timeout"].asInt());
+  EXPECT_FALSE(metrics["environments"].isMember("made-up-metrics-digest"));
+  EXPECT_GE(
+      metrics["unknown_environments"]["environment_not_found"].asInt(), 1);
+  EXPECT_EQ(1, metrics["servants"]["192.168.11.1:1234"]["assigned_tasks"]
+                   .asInt());
+  EXPECT_GE(metrics["grant_wait"]["count"].asInt(), 1);
+  EXPECT_GE(metrics["grant_lifetime"]["count"].asInt(), 1);
+
+  std::vector<std::string> outcomes;
+  for (auto&& e : metrics["recent_decisions"]) {
+    if (e["compiler_digest"].asString() == "metrics-digest") {
+      outcomes.push_back(e["outcome"].asString());
+    }
+  }
+  EXPECT_EQ((std::vector<std::string>{"immediate", "timeout"}), outcomes);
+  TaskDispatcher::Instance()->RemoveServant("192.168.11.1:1234");
+}
+
+TEST(TaskDispatcher, Snapshot) {
+  AddServant("192.168.9.1:1234", "snapshot-digest", 3, 10, 0,
+             SERVANT_PRIORITY_DEDICATED);
+
+  TaskPersonality task;
+  task.requestor_ip = "10.0.6.1";
+  task.env_desc.set_compiler_digest("snapshot-digest");
+  task.min_version = 8;
+  auto running = TaskDispatcher::Instance()->WaitForStartingNewTask(
+      task, 10s, flare::ReadCoarseSteadyClock() + 1s, false);
+  auto pending_task = task;
+  pending_task.priority_class = TASK_PRIORITY_CLASS_CI;
+  pending_task.expected_cost =
+      TaskCost{.compile_time = 3s, .peak_memory_in_bytes = 1 << 30};
+  auto pending = TaskDispatcher::Instance()->WaitForStartingNewTask(
+      pending_task, 10s, flare::ReadCoarseSteadyClock() + 1s, false);
+  ASSERT_TRUE(running);
+  ASSERT_TRUE(pending);
+  std::vector<RunningTask> running_tasks;
+  running_tasks.emplace_back().set_task_grant_id(running->task_id);
+  running_tasks.back().set_servant_task_id(1);
+  EXPECT_THAT(TaskDispatcher::Instance()->NotifyServantRunningTasks(
+                  "192.168.9.1:1234", running_tasks),
+              ::testing::IsEmpty());
+
+  auto captured = TaskDispatcher::Instance()->CaptureSnapshot();
+  EXPECT_GT(captured.next_task_id(), running->task_id);
+  EXPECT_GT(captured.next_task_id(), pending->task_id);
+
+  // Pick up our servant and tasks, as if they're the only ones.
+  DispatcherSnapshot snapshot;
+  snapshot.set_written_at_ms(captured.written_at_ms());
+  snapshot.set_next_task_id(captured.next_task_id());
+  for (auto&& e : captured.servants()) {
+    if (e.observed_location() == "192.168.9.1:1234") {
+      EXPECT_GT(e.expires_in_ms(), 5000);
+      EXPECT_EQ(3, e.max_tasks());
+      *snapshot.add_servants() = e;
+    }
+  }
+  for (auto&& e : captured.tasks()) {
+    if (e.servant_location() == "192.168.9.1:1234") {
+      EXPECT_EQ(e.task_id() == running->task_id, e.running());
+      *snapshot.add_tasks() = e;
+    }
+  }
+  ASSERT_EQ(1, snapshot.servants_size());
+  ASSERT_EQ(2, snapshot.tasks_size());
+
+  // This one would have expired by the time we restart.
+  auto&& expiring = *snapshot.add_servants();
+  expiring.set_observed_location("192.168.9.2:1234");
+  expiring.add_environments()->set_compiler_digest("snapshot-digest-2");
+  expiring.set_max_tasks(3);
+  expiring.set_version(8);
+  expiring.set_expires_in_ms(500);
+
+  // The servant goes away, so do its tasks, as if we've restarted.
+  TaskDispatcher::Instance()->RemoveServant("192.168.9.1:1234");
+  EXPECT_FALSE(
+      TaskDispatcher::Instance()->KeepTaskAlive(running->task_id, 10s));
+
+  // Now restore them.
+  TaskDispatcher::Instance()->RestoreSnapshot(snapshot);
+
+  // Grants survive the restart.
+  EXPECT_TRUE(TaskDispatcher::Instance()->KeepTaskAlive(running->task_id, 10s));
+  EXPECT_TRUE(TaskDispatcher::Instance()->KeepTaskAlive(pending->task_id, 10s));
+
+  // So do their priority class and expected cost.
+  bool pending_restored = false;
+  for (auto&& e : TaskDispatcher::Instance()->CaptureSnapshot().tasks()) {
+    if (e.task_id() == pending->task_id) {
+      EXPECT_EQ(TASK_PRIORITY_CLASS_CI, e.priority_class());
+      ASSERT_TRUE(e.has_expected_cost());
+      EXPECT_EQ(3000, e.expected_cost().compile_time_ms());
+      EXPECT_EQ(1 << 30, e.expected_cost().peak_memory_in_bytes());
+      pending_restored = true;
+    }
+  }
+  EXPECT_TRUE(pending_restored);
+
+  // The servant can be allocated to without waiting for its heartbeat. IDs
+  // allocated before restart are not reused.
+  auto allocated = TaskDispatcher::Instance()->WaitForStartingNewTask(
+      task, 10s, flare::ReadCoarseSteadyClock() + 1s, false);
+  ASSERT_TRUE(allocated);
+  EXPECT_GE(allocated->task_id, snapshot.next_task_id());
+  EXPECT_EQ("192.168.9.1:1234", allocated->servant_location);
+
+  // And it's full now.
+  auto start = flare::ReadCoarseSteadyClock();
+  EXPECT_FALSE(TaskDispatcher::Instance()->WaitForStartingNewTask(
+      task, 10s, flare::ReadCoarseSteadyClock() + 100ms, false));
+  EXPECT_GE(flare::ReadCoarseSteadyClock() - start, 90ms);
+
+  // The one expired is not restored.
+  task.env_desc.set_compiler_digest("snapshot-digest-2");
+  auto not_found = TaskDispatcher::Instance()->WaitForStartingNewTask(
+      task, 10s, flare::ReadCoarseSteadyClock() + 1s, false);
+  ASSERT_FALSE(not_found);
+  EXPECT_EQ(WaitStatus::EnvironmentNotFound, not_found.error());
+
+  // The task reported running has completed while we were down.
+  EXPECT_THAT(TaskDispatcher::Instance()->NotifyServantRunningTasks(
+                  "192.168.9.1:1234", {}),
+              ::testing::IsEmpty());
+  EXPECT_FALSE(
+      TaskDispatcher::Instance()->KeepTaskAlive(running->task_id, 10s));
+  EXPECT_TRUE(TaskDispatcher::Instance()->KeepTaskAlive(pending->task_id, 10s));
+
+  TaskDispatcher::Instance()->FreeTask(pending->task_id);
+  TaskDispatcher::Instance()->FreeTask(allocated->task_id);
+  TaskDispatcher::Instance()->RemoveServant("192.168.9.1:1234");
+}
+
+TEST(TaskDispatcher, LoadDecay) {
+  FLAGS_servant_load_decay_seconds = 1;
+
+  auto servant = AddServant("192.168.6.1:1234", "decay-digest", 10, 10, 0);
+
+  TaskPersonality task;
+  task.requestor_ip = "127.0.0.1";
+  task.env_desc.set_compiler_digest("decay-digest");
+  task.min_version = 8;
+  auto capacity_available = [] {
+    auto internals = TaskDispatcher::Instance()->DumpInternals();
+    for (auto&& e : internals["servants"]) {
+      if (e["location"].asString() == "192.168.6.1:1234") {
+        return e["capacity_available"].asInt64();
+      }
+    }
+    return Json::Int64(-1);
+  };
+
+  // Our tasks are running, and are reflected in the load.
+  auto allocations = TaskDispatcher::Instance()->WaitForStartingNewTasks(
+      task, 10s, flare::ReadCoarseSteadyClock() + 1s, 8, 0);
+  ASSERT_TRUE(allocations);
+  std::this_thread::sleep_for(2s);
+  servant.current_load = 8;
+  TaskDispatcher::Instance()->KeepServantAlive(servant, 10s);
+
+  // They completed before the servant reports its load again. The load they
+  // contributed to is not treated as foreign load.
+  for (auto&& e : *allocations) {
+    TaskDispatcher::Instance()->FreeTask(e.task_id);
+  }
+  EXPECT_EQ(10, capacity_available());
+
+  // The servant reports a lagged load, it's mostly compensated as well. (The
+  // tasks above ran for 2s, so they contributed ~86% of the load.)
+  TaskDispatcher::Instance()->KeepServantAlive(servant, 10s);
+  EXPECT_EQ(9, capacity_available());
+
+  // The load is truly foreign since the tasks have completed long ago.
+  std::this_thread::sleep_for(3s);
+  TaskDispatcher::Instance()->KeepServantAlive(servant, 10s);
+  EXPECT_EQ(2, capacity_available());
+
+  // Unless the servant tells us there's not that many runnable threads.
+  servant.runnable_tasks = 3;
+  TaskDispatcher::Instance()->KeepServantAlive(servant, 10s);
+  EXPECT_EQ(7, capacity_available());
+
+  FLAGS_servant_load_decay_seconds = 15;
+  TaskDispatcher::Instance()->RemoveServant("192.168.6.1:1234");
 }
 
 void ExpectServant(const std::string& requestor_ip,
@@ -214,8 +1185,11 @@ void ExpectServant(const std::string& requestor_ip,
 }
 
 TEST(TaskDispatcher, LoadBalanceCase) {
+  // We're testing picking the least utilized servant here.
+  FLAGS_requestor_affinity_max_utilization = 0;
+
   ServantPersonality servant_over_load =
-      AddServant("192.168.0.0:0000", 7, 16, 16, 50ULL * 1024 * 1024 * 1024);
+      AddServant("192.168.0.0:0000", "Load Balance", 7, 16, 16);
 
   // Expected result: servant_over_load over load, never pick it
   {
@@ -227,12 +1201,9 @@ TEST(TaskDispatcher, LoadBalanceCase) {
         task, 1s, flare::ReadCoarseSteadyClock() + 1s, false));
   }
 
-  auto servant1 =
-      AddServant("192.168.0.1:1111", 7, 16, 1, 50ULL * 1024 * 1024 * 1024);
-  auto servant2 =
-      AddServant("192.168.0.2:2222", 8, 16, 5, 50ULL * 1024 * 1024 * 1024);
-  auto servant3 =
-      AddServant("192.168.0.3:3333", 6, 16, 12, 50ULL * 1024 * 1024 * 1024);
+  auto servant1 = AddServant("192.168.0.1:1111", "Load Balance", 7, 16, 1);
+  auto servant2 = AddServant("192.168.0.2:2222", "Load Balance", 8, 16, 5);
+  auto servant3 = AddServant("192.168.0.3:3333", "Load Balance", 6, 16, 12);
 
   // Expected result: servant1: 0 / 7, servant2: 0 / 8, servant3: 0 / 4, pick
   // servant1